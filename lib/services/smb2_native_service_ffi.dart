@@ -27,18 +27,29 @@ class Smb2NativeService {
     };
   }
 
+  /// Requests to different servers never wait on each other. A [timeout] or
+  /// a cancelled [cancelToken] fails the request early.
   Future<List<SMBFileEntry>> listDirectory(
     SMBConnection connection,
-    String path,
-  ) async {
-    final jsonString = await _worker.requestList(
-      host: connection.host,
-      port: connection.port,
-      username: connection.username,
-      password: connection.password,
-      domain: connection.domain,
-      path: path,
-    );
+    String path, {
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  }) async {
+    final reactor = _reactor;
+    final jsonString = reactor != null
+        ? await reactor.list(connection, path, timeout, cancelToken)
+        : await _limit(
+            _workerFor(connection).requestList(
+              host: connection.host,
+              port: connection.port,
+              username: connection.username,
+              password: connection.password,
+              domain: connection.domain,
+              path: path,
+            ),
+            timeout,
+            cancelToken,
+          );
 
     final decoded = json.decode(jsonString);
     if (decoded is! List) {
@@ -63,16 +74,25 @@ class Smb2NativeService {
 
   Future<Smb2Stat> stat(
     SMBConnection connection,
-    String path,
-  ) async {
-    final result = await _worker.requestStat(
-      host: connection.host,
-      port: connection.port,
-      username: connection.username,
-      password: connection.password,
-      domain: connection.domain,
-      path: path,
-    );
+    String path, {
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  }) async {
+    final reactor = _reactor;
+    final result = reactor != null
+        ? await reactor.stat(connection, path, timeout, cancelToken)
+        : await _limit(
+            _workerFor(connection).requestStat(
+              host: connection.host,
+              port: connection.port,
+              username: connection.username,
+              password: connection.password,
+              domain: connection.domain,
+              path: path,
+            ),
+            timeout,
+            cancelToken,
+          );
     return Smb2Stat(
       type: result.type,
       size: result.size,
@@ -85,7 +105,18 @@ class Smb2NativeService {
     required int start,
     required int endExclusive,
     int chunkSize = 256 * 1024,
+    Smb2ChunkTransfer transfer = Smb2ChunkTransfer.external,
   }) {
+    final reactor = _reactor;
+    if (reactor != null && transfer == Smb2ChunkTransfer.external) {
+      return reactor.stream(
+        connection,
+        path,
+        start: start,
+        endExclusive: endExclusive,
+        chunkSize: chunkSize,
+      );
+    }
     return _Smb2StreamReader.stream(
       host: connection.host,
       port: connection.port,
@@ -96,10 +127,186 @@ class Smb2NativeService {
       start: start,
       endExclusive: endExclusive,
       chunkSize: chunkSize,
+      transfer: transfer,
+    );
+  }
+
+  /// Starts the native loopback range server and returns its port.
+  int startHttpServer(int port) => _native.startHttpServer(port);
+
+  void stopHttpServer() => _native.stopHttpServer();
+
+  /// Makes [connection] available to the native range server as
+  /// `conn=<name>`.
+  void registerHttpConnection(SMBConnection connection) {
+    _native.setHttpConnection(
+      name: connection.name.trim(),
+      host: connection.host,
+      port: connection.port,
+      username: connection.username,
+      password: connection.password,
+      domain: connection.domain,
     );
   }
 
-  final _Smb2Worker _worker = _Smb2Worker();
+  /// Keeps file blocks read over SMB in a persistent cache under
+  /// [directory], using at most [maxBytes] of disk. A cache left there by an
+  /// earlier run is reused.
+  void configureBlockCache({
+    required String directory,
+    required int maxBytes,
+  }) =>
+      _native.configureCache(directory, maxBytes);
+
+  void clearBlockCache() => _native.clearCache();
+
+  ({int hits, int misses, int usedBytes, int capacityBytes})
+      blockCacheStats() => _native.cacheStats();
+
+  /// Sizes the native read-ahead: sequential reads start [minWindow] bytes
+  /// ahead and double that up to [maxWindow]; 0 keeps the default.
+  void configureReadAhead({int minWindow = 0, int maxWindow = 0}) =>
+      _native.configureReadAhead(minWindow, maxWindow);
+
+  ({
+    int sequentialReads,
+    int stridedReads,
+    int randomReads,
+    int prefetchedBytes,
+    int usedBytes,
+  }) readAheadStats() => _native.readAheadStats();
+
+  ({int opens, int reusedOpens, int reads, int joinedReads})
+      sharedReadStats() => _native.sharedStats();
+
+  ({
+    int reconnects,
+    int failed,
+    int reclaimed,
+    int replayedReads,
+    int totalMs,
+    int maxMs,
+  }) reconnectStats() => _native.reconnectStats();
+
+  ({int grants, int breaks, int invalidatedBlocks, int statHits})
+      leaseStats() => _native.leaseStats();
+
+  /// Reads open files over up to [maxChannels] connections on servers with
+  /// SMB 3.x multichannel; 1 turns that off, 0 keeps the default.
+  void configureMultichannel({int maxChannels = 0}) =>
+      _native.configureMultichannel(maxChannels);
+
+  ({int bound, int failedBinds, int stripedReads, int lost})
+      multichannelStats() => _native.multichannelStats();
+
+  /// Issues a READ again on another connection once it took longer than the
+  /// [percentile] of its file's recent READs, and takes whichever lands
+  /// first; 0 turns that off (the default). Needs multichannel.
+  void configureHedging({int percentile = 0}) =>
+      _native.configureHedging(percentile);
+
+  ({int hedgedReads, int won, int wasted, int delayMs}) hedgeStats() =>
+      _native.hedgeStats();
+
+  /// Sets how many requests per server the native reactor runs at once.
+  void setHostConcurrency(int maxRequests) =>
+      _native.setHostConcurrency(maxRequests);
+
+  /// Without the reactor, each server gets its own worker isolate so that a
+  /// blocking call to an unreachable one cannot stall the others.
+  _Smb2Worker _workerFor(SMBConnection connection) => _workers.putIfAbsent(
+        '${connection.host.toLowerCase()}:${connection.port}',
+        _Smb2Worker.new,
+      );
+
+  /// The worker's blocking call cannot be interrupted; the result is dropped.
+  static Future<T> _limit<T>(
+    Future<T> request,
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  ) {
+    if (cancelToken == null && timeout == null) return request;
+    final completer = Completer<T>();
+    cancelToken?._listen(() {
+      if (!completer.isCompleted) {
+        completer.completeError(StateError('SMB request cancelled'));
+      }
+    });
+    request.then((value) {
+      if (!completer.isCompleted) completer.complete(value);
+    }, onError: (Object e, StackTrace st) {
+      if (!completer.isCompleted) completer.completeError(e, st);
+    });
+    return timeout == null
+        ? completer.future
+        : completer.future.timeout(
+            timeout,
+            onTimeout: () => throw StateError('SMB request timed out'),
+          );
+  }
+
+  final Map<String, _Smb2Worker> _workers = <String, _Smb2Worker>{};
+  late final _Smb2Native _native = _Smb2Native();
+
+  /// Null where the native library has no reactor; the worker isolates are
+  /// used instead.
+  late final _Smb2Reactor? _reactor = _Smb2Reactor.tryStart(_native);
+}
+
+/// How [Smb2NativeService.openReadStream] hands chunks from its reader
+/// isolate to the listener.
+enum Smb2ChunkTransfer {
+  /// Chunks are views of pooled native buffers; a `NativeFinalizer` returns
+  /// each buffer to the pool once the `Uint8List` is garbage collected.
+  external,
+
+  /// Chunks are copied once into a [TransferableTypedData].
+  transferable,
+}
+
+/// Cancels every request it is passed to, including ones started after
+/// [cancel].
+class Smb2CancelToken {
+  bool _cancelled = false;
+  int _handle = 0;
+  final List<void Function()> _listeners = <void Function()>[];
+
+  static final Finalizer<int> _finalizer = Finalizer<int>(
+    (handle) => Smb2NativeService.instance._native.freeCancelToken(handle),
+  );
+
+  bool get isCancelled => _cancelled;
+
+  void cancel() {
+    if (_cancelled) return;
+    _cancelled = true;
+    if (_handle != 0) {
+      Smb2NativeService.instance._native.cancelToken(_handle);
+    }
+    for (final listener in _listeners) {
+      listener();
+    }
+    _listeners.clear();
+  }
+
+  void _listen(void Function() listener) {
+    if (_cancelled) {
+      listener();
+    } else {
+      _listeners.add(listener);
+    }
+  }
+
+  /// The native token, created on first use by the reactor.
+  int _nativeHandle(_Smb2Native native) {
+    if (_handle == 0) {
+      _handle = native.newCancelToken();
+      if (_handle == 0) return 0;
+      _finalizer.attach(this, _handle);
+      if (_cancelled) native.cancelToken(_handle);
+    }
+    return _handle;
+  }
 }
 
 class Smb2Stat {
@@ -210,6 +417,193 @@ class _Smb2Worker {
   }
 }
 
+/// Runs requests on the native reactor thread, which serves all sessions
+/// without blocking an isolate per call. Completions arrive on one port as
+/// `[id, event, ...]` lists (see `np_smb2_async_event` in nipaplay_smb2.h).
+class _Smb2Reactor {
+  _Smb2Reactor._(this._native) {
+    _receivePort.listen(_onMessage);
+  }
+
+  static _Smb2Reactor? tryStart(_Smb2Native native) {
+    if (native.startReactor() != 0) return null;
+    return _Smb2Reactor._(native);
+  }
+
+  static const int _eventDone = 0;
+  static const int _eventChunk = 1;
+  static const int _eventOpened = 2;
+
+  /// Chunks a stream may post before the listener has taken any.
+  static const int _streamCredits = 4;
+
+  final _Smb2Native _native;
+  final ReceivePort _receivePort = ReceivePort();
+  final Map<int, void Function(List<Object?>)> _handlers =
+      <int, void Function(List<Object?>)>{};
+  int _nextId = 1;
+
+  int get _replyPort => _receivePort.sendPort.nativePort;
+
+  void _onMessage(dynamic message) {
+    if (message is! List || message.length < 2) return;
+    final id = message[0];
+    final event = message[1];
+    if (id is! int || event is! int) return;
+    final handler = _handlers[id];
+    if (handler != null) {
+      handler(message);
+    } else if (event == _eventChunk && message.length >= 3) {
+      // Posted before the reactor saw the stream's close.
+      _native.releaseBuffer(message[2] as int);
+    }
+  }
+
+  static StateError _error(List<Object?> message) {
+    final text = message.length > 2 ? message[2] : null;
+    return StateError(
+        text is String && text.isNotEmpty ? text : 'SMB2 error ${message[1]}');
+  }
+
+  Future<String> list(
+    SMBConnection connection,
+    String path,
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  ) {
+    final id = _nextId++;
+    final completer = Completer<String>();
+    _handlers[id] = (message) {
+      _handlers.remove(id);
+      if ((message[1] as int) < 0) {
+        completer.completeError(_error(message));
+      } else if (message.length > 2 && message[2] is String) {
+        completer.complete(message[2] as String);
+      } else {
+        completer.completeError(StateError('Invalid SMB2 list result'));
+      }
+    };
+    final rc = _native.asyncList(_replyPort, id, connection, path,
+        timeoutMs: timeout?.inMilliseconds ?? 0,
+        cancelToken: cancelToken?._nativeHandle(_native) ?? 0);
+    if (rc != 0) {
+      _handlers.remove(id);
+      return Future.error(StateError('SMB2 reactor is not running'));
+    }
+    return completer.future;
+  }
+
+  Future<({int type, int size})> stat(
+    SMBConnection connection,
+    String path,
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  ) {
+    final id = _nextId++;
+    final completer = Completer<({int type, int size})>();
+    _handlers[id] = (message) {
+      _handlers.remove(id);
+      if ((message[1] as int) < 0) {
+        completer.completeError(_error(message));
+      } else if (message.length > 3 &&
+          message[2] is int &&
+          message[3] is int) {
+        completer.complete((type: message[2] as int, size: message[3] as int));
+      } else {
+        completer.completeError(StateError('Invalid SMB2 stat result'));
+      }
+    };
+    final rc = _native.asyncStat(_replyPort, id, connection, path,
+        timeoutMs: timeout?.inMilliseconds ?? 0,
+        cancelToken: cancelToken?._nativeHandle(_native) ?? 0);
+    if (rc != 0) {
+      _handlers.remove(id);
+      return Future.error(StateError('SMB2 reactor is not running'));
+    }
+    return completer.future;
+  }
+
+  /// Chunks are pooled native buffers, returned to the pool by a
+  /// `NativeFinalizer` like [Smb2ChunkTransfer.external]. One credit is
+  /// granted back per chunk delivered, so a paused listener stops the reads.
+  Stream<Uint8List> stream(
+    SMBConnection connection,
+    String path, {
+    required int start,
+    required int endExclusive,
+    required int chunkSize,
+  }) {
+    if (endExclusive <= start) {
+      return const Stream<Uint8List>.empty();
+    }
+
+    final id = _nextId++;
+    final controller = StreamController<Uint8List>();
+    var handle = 0;
+    var withheld = 0;
+
+    void finish() {
+      _handlers.remove(id);
+      if (handle != 0) {
+        _native.asyncStreamClose(handle);
+        handle = 0;
+      }
+    }
+
+    void onMessage(List<Object?> message) {
+      final event = message[1] as int;
+      if (event == _eventChunk) {
+        final address = message[2] as int;
+        if (handle == 0) {
+          _native.releaseBuffer(address);
+          return;
+        }
+        controller.add(_native.wrapBuffer(address, message[3] as int));
+        if (controller.isPaused) {
+          withheld++;
+        } else {
+          _native.asyncStreamRequest(handle, 1);
+        }
+        return;
+      }
+      if (event == _eventOpened) return;
+      finish();
+      if (event < 0) {
+        controller.addError(_error(message));
+      }
+      controller.close();
+    }
+
+    controller.onListen = () {
+      _handlers[id] = onMessage;
+      handle = _native.asyncStreamOpen(
+        _replyPort,
+        id,
+        connection,
+        path,
+        start: start,
+        endExclusive: endExclusive,
+        chunkSize: chunkSize <= 0 ? 256 * 1024 : chunkSize,
+        credits: _streamCredits,
+      );
+      if (handle == 0) {
+        _handlers.remove(id);
+        controller.addError(StateError('SMB2 reactor is not running'));
+        controller.close();
+      }
+    };
+    controller.onResume = () {
+      if (handle != 0 && withheld > 0) {
+        _native.asyncStreamRequest(handle, withheld);
+        withheld = 0;
+      }
+    };
+    controller.onCancel = finish;
+
+    return controller.stream;
+  }
+}
+
 void _smb2WorkerMain(SendPort mainPort) {
   final ReceivePort workerPort = ReceivePort();
   mainPort.send(workerPort.sendPort);
@@ -272,6 +666,9 @@ void _smb2WorkerMain(SendPort mainPort) {
 }
 
 class _Smb2Native {
+  // np_smb2_open_flags
+  static const int _openPrefetchIndex = 1;
+
   _Smb2Native() : _dylib = _openDynamicLibrary() {
     _free = _dylib.lookupFunction<_np_smb2_free_c, _np_smb2_free_dart>(
       'np_smb2_free',
@@ -295,6 +692,129 @@ class _Smb2Native {
         .lookupFunction<_np_smb2_reader_close_c, _np_smb2_reader_close_dart>(
       'np_smb2_reader_close',
     );
+    _streamOpen =
+        _dylib.lookupFunction<_np_smb2_stream_open_c, _np_smb2_stream_open_dart>(
+      'np_smb2_stream_open',
+    );
+    _streamNext =
+        _dylib.lookupFunction<_np_smb2_stream_next_c, _np_smb2_stream_next_dart>(
+      'np_smb2_stream_next',
+    );
+    _streamClose = _dylib
+        .lookupFunction<_np_smb2_stream_close_c, _np_smb2_stream_close_dart>(
+      'np_smb2_stream_close',
+    );
+    _streamNextBuf =
+        _dylib.lookupFunction<_np_smb2_stream_next_c, _np_smb2_stream_next_dart>(
+      'np_smb2_stream_next_buf',
+    );
+    _bufReleasePtr = _dylib.lookup<NativeFunction<_np_smb2_buf_release_c>>(
+      'np_smb2_buf_release',
+    );
+    _bufRelease = _bufReleasePtr.asFunction<_np_smb2_buf_release_dart>();
+    _httpStart =
+        _dylib.lookupFunction<_np_smb2_http_start_c, _np_smb2_http_start_dart>(
+      'np_smb2_http_start',
+    );
+    _httpStop =
+        _dylib.lookupFunction<_np_smb2_http_stop_c, _np_smb2_http_stop_dart>(
+      'np_smb2_http_stop',
+    );
+    _httpSetConnection = _dylib.lookupFunction<_np_smb2_http_set_connection_c,
+        _np_smb2_http_set_connection_dart>(
+      'np_smb2_http_set_connection',
+    );
+    _reactorStart = _dylib
+        .lookupFunction<_np_smb2_reactor_start_c, _np_smb2_reactor_start_dart>(
+      'np_smb2_reactor_start',
+    );
+    _asyncList =
+        _dylib.lookupFunction<_np_smb2_async_path_c, _np_smb2_async_path_dart>(
+      'np_smb2_async_list',
+    );
+    _asyncStat =
+        _dylib.lookupFunction<_np_smb2_async_path_c, _np_smb2_async_path_dart>(
+      'np_smb2_async_stat',
+    );
+    _asyncStreamOpen = _dylib.lookupFunction<_np_smb2_async_stream_open_c,
+        _np_smb2_async_stream_open_dart>(
+      'np_smb2_async_stream_open',
+    );
+    _asyncStreamRequest = _dylib.lookupFunction<
+        _np_smb2_async_stream_request_c, _np_smb2_async_stream_request_dart>(
+      'np_smb2_async_stream_request',
+    );
+    _asyncStreamClose = _dylib.lookupFunction<_np_smb2_stream_close_c,
+        _np_smb2_stream_close_dart>(
+      'np_smb2_async_stream_close',
+    );
+    _cacheConfigure = _dylib.lookupFunction<_np_smb2_cache_configure_c,
+        _np_smb2_cache_configure_dart>(
+      'np_smb2_cache_configure',
+    );
+    _cacheClear = _dylib
+        .lookupFunction<_np_smb2_cache_clear_c, _np_smb2_cache_clear_dart>(
+      'np_smb2_cache_clear',
+    );
+    _cacheStats = _dylib
+        .lookupFunction<_np_smb2_cache_stats_c, _np_smb2_cache_stats_dart>(
+      'np_smb2_cache_stats',
+    );
+    _readAheadConfigure = _dylib.lookupFunction<
+        _np_smb2_readahead_configure_c, _np_smb2_readahead_configure_dart>(
+      'np_smb2_readahead_configure',
+    );
+    _readAheadStats = _dylib.lookupFunction<_np_smb2_readahead_stats_c,
+        _np_smb2_readahead_stats_dart>(
+      'np_smb2_readahead_stats',
+    );
+    _sharedStats = _dylib
+        .lookupFunction<_np_smb2_shared_stats_c, _np_smb2_shared_stats_dart>(
+      'np_smb2_shared_stats',
+    );
+    _reconnectStats = _dylib.lookupFunction<_np_smb2_reconnect_stats_c,
+        _np_smb2_reconnect_stats_dart>(
+      'np_smb2_reconnect_stats',
+    );
+    _leaseStats = _dylib
+        .lookupFunction<_np_smb2_lease_stats_c, _np_smb2_lease_stats_dart>(
+      'np_smb2_lease_stats',
+    );
+    _multichannelConfigure = _dylib.lookupFunction<
+        _np_smb2_multichannel_configure_c,
+        _np_smb2_multichannel_configure_dart>(
+      'np_smb2_multichannel_configure',
+    );
+    _multichannelStats = _dylib.lookupFunction<_np_smb2_multichannel_stats_c,
+        _np_smb2_multichannel_stats_dart>(
+      'np_smb2_multichannel_stats',
+    );
+    _hedgeConfigure = _dylib.lookupFunction<
+        _np_smb2_hedge_configure_c,
+        _np_smb2_hedge_configure_dart>(
+      'np_smb2_hedge_configure',
+    );
+    _hedgeStats = _dylib
+        .lookupFunction<_np_smb2_hedge_stats_c, _np_smb2_hedge_stats_dart>(
+      'np_smb2_hedge_stats',
+    );
+    _setHostConcurrency = _dylib.lookupFunction<
+        _np_smb2_reactor_set_host_concurrency_c,
+        _np_smb2_reactor_set_host_concurrency_dart>(
+      'np_smb2_reactor_set_host_concurrency',
+    );
+    _cancelTokenNew = _dylib.lookupFunction<_np_smb2_cancel_token_new_c,
+        _np_smb2_cancel_token_new_dart>(
+      'np_smb2_cancel_token_new',
+    );
+    _cancelTokenCancel = _dylib.lookupFunction<_np_smb2_cancel_token_cancel_c,
+        _np_smb2_cancel_token_cancel_dart>(
+      'np_smb2_cancel_token_cancel',
+    );
+    _cancelTokenFree = _dylib.lookupFunction<_np_smb2_cancel_token_free_c,
+        _np_smb2_cancel_token_free_dart>(
+      'np_smb2_cancel_token_free',
+    );
   }
 
   final DynamicLibrary _dylib;
@@ -305,6 +825,37 @@ class _Smb2Native {
   late final _np_smb2_reader_open_dart _readerOpen;
   late final _np_smb2_reader_pread_dart _readerPread;
   late final _np_smb2_reader_close_dart _readerClose;
+  late final _np_smb2_stream_open_dart _streamOpen;
+  late final _np_smb2_stream_next_dart _streamNext;
+  late final _np_smb2_stream_close_dart _streamClose;
+  late final _np_smb2_stream_next_dart _streamNextBuf;
+  late final Pointer<NativeFunction<_np_smb2_buf_release_c>> _bufReleasePtr;
+  late final _np_smb2_buf_release_dart _bufRelease;
+  late final _np_smb2_http_start_dart _httpStart;
+  late final _np_smb2_http_stop_dart _httpStop;
+  late final _np_smb2_http_set_connection_dart _httpSetConnection;
+  late final _np_smb2_reactor_start_dart _reactorStart;
+  late final _np_smb2_async_path_dart _asyncList;
+  late final _np_smb2_async_path_dart _asyncStat;
+  late final _np_smb2_async_stream_open_dart _asyncStreamOpen;
+  late final _np_smb2_async_stream_request_dart _asyncStreamRequest;
+  late final _np_smb2_stream_close_dart _asyncStreamClose;
+  late final _np_smb2_cache_configure_dart _cacheConfigure;
+  late final _np_smb2_cache_clear_dart _cacheClear;
+  late final _np_smb2_cache_stats_dart _cacheStats;
+  late final _np_smb2_readahead_configure_dart _readAheadConfigure;
+  late final _np_smb2_readahead_stats_dart _readAheadStats;
+  late final _np_smb2_shared_stats_dart _sharedStats;
+  late final _np_smb2_reconnect_stats_dart _reconnectStats;
+  late final _np_smb2_lease_stats_dart _leaseStats;
+  late final _np_smb2_multichannel_configure_dart _multichannelConfigure;
+  late final _np_smb2_multichannel_stats_dart _multichannelStats;
+  late final _np_smb2_hedge_configure_dart _hedgeConfigure;
+  late final _np_smb2_hedge_stats_dart _hedgeStats;
+  late final _np_smb2_reactor_set_host_concurrency_dart _setHostConcurrency;
+  late final _np_smb2_cancel_token_new_dart _cancelTokenNew;
+  late final _np_smb2_cancel_token_cancel_dart _cancelTokenCancel;
+  late final _np_smb2_cancel_token_free_dart _cancelTokenFree;
 
   String listEntriesJson({
     required String host,
@@ -403,6 +954,8 @@ class _Smb2Native {
     }
   }
 
+  /// With [prefetchIndex], the index of an MP4 or Matroska file is pulled
+  /// into the block cache in the background.
   ({int handle, int size}) openReader({
     required String host,
     required int port,
@@ -410,6 +963,7 @@ class _Smb2Native {
     required String password,
     required String domain,
     required String path,
+    bool prefetchIndex = false,
   }) {
     final errBuf = calloc<Uint8>(1024);
     final outSize = calloc<Uint64>();
@@ -431,6 +985,7 @@ class _Smb2Native {
                   passPtr,
                   domainPtr,
                   pathPtr,
+                  prefetchIndex ? _openPrefetchIndex : 0,
                   outSize,
                   errBuf,
                   1024,
@@ -478,37 +1033,474 @@ class _Smb2Native {
   void closeReader(int readerHandle) {
     _readerClose(readerHandle);
   }
-}
 
-DynamicLibrary _openDynamicLibrary() {
-  if (kIsWeb) {
-    throw UnsupportedError('libsmb2 is not supported on web.');
+  int openStream({
+    required String host,
+    required int port,
+    required String username,
+    required String password,
+    required String domain,
+    required String path,
+    required int start,
+    required int endExclusive,
+    required int chunkSize,
+    int queueDepth = 0,
+  }) {
+    final errBuf = calloc<Uint8>(1024);
+    try {
+      final handle = _withUtf8(
+        host,
+        (hostPtr) => _withUtf8(
+          username,
+          (userPtr) => _withUtf8(
+            password,
+            (passPtr) => _withUtf8(
+              domain,
+              (domainPtr) => _withUtf8(
+                path,
+                (pathPtr) => _streamOpen(
+                  hostPtr,
+                  port,
+                  userPtr,
+                  passPtr,
+                  domainPtr,
+                  pathPtr,
+                  start,
+                  endExclusive,
+                  chunkSize,
+                  queueDepth,
+                  nullptr,
+                  errBuf,
+                  1024,
+                ),
+              ),
+            ),
+          ),
+        ),
+      );
+      if (handle == 0) {
+        throw StateError(_readErr(errBuf));
+      }
+      return handle;
+    } finally {
+      calloc.free(errBuf);
+    }
   }
 
-  return switch (defaultTargetPlatform) {
-    TargetPlatform.macOS || TargetPlatform.iOS => DynamicLibrary.open(
-        'nipaplay_smb2.framework/nipaplay_smb2',
-      ),
-    TargetPlatform.android || TargetPlatform.linux => DynamicLibrary.open(
-        'libnipaplay_smb2.so',
-      ),
-    TargetPlatform.windows => DynamicLibrary.open(
-        'nipaplay_smb2.dll',
-      ),
-    _ => throw UnsupportedError(
-        'libsmb2 is not supported on $defaultTargetPlatform.',
-      ),
-  };
-}
+  /// Returns the next chunk (a view into native memory that is only valid
+  /// until the next call), or null at the end of the range.
+  Uint8List? nextChunk(int streamHandle) {
+    final errBuf = calloc<Uint8>(1024);
+    final outData = calloc<Pointer<Uint8>>();
+    try {
+      final rc = _streamNext(streamHandle, outData, errBuf, 1024);
+      if (rc < 0) {
+        throw StateError(_readErr(errBuf));
+      }
+      if (rc == 0) {
+        return null;
+      }
+      return outData.value.asTypedList(rc);
+    } finally {
+      calloc.free(outData);
+      calloc.free(errBuf);
+    }
+  }
 
-T _withUtf8<T>(String value, T Function(Pointer<Utf8>) fn) {
-  final ptr = value.toNativeUtf8();
-  try {
-    return fn(ptr);
-  } finally {
-    calloc.free(ptr);
+  /// Like [nextChunk], but the caller owns a reference to the returned
+  /// native buffer and must pass it to [wrapBuffer] or [releaseBuffer].
+  ({int address, int length})? nextBuffer(int streamHandle) {
+    final errBuf = calloc<Uint8>(1024);
+    final outBuf = calloc<Pointer<Uint8>>();
+    try {
+      final rc = _streamNextBuf(streamHandle, outBuf, errBuf, 1024);
+      if (rc < 0) {
+        throw StateError(_readErr(errBuf));
+      }
+      if (rc == 0) {
+        return null;
+      }
+      return (address: outBuf.value.address, length: rc);
+    } finally {
+      calloc.free(outBuf);
+      calloc.free(errBuf);
+    }
   }
-}
+
+  /// Wraps a buffer from [nextBuffer] without copying. The reference is
+  /// released when the returned list is garbage collected.
+  Uint8List wrapBuffer(int address, int length) {
+    final ptr = Pointer<Uint8>.fromAddress(address);
+    return ptr.asTypedList(
+      length,
+      finalizer: _bufReleasePtr.cast(),
+      token: ptr.cast(),
+    );
+  }
+
+  void releaseBuffer(int address) {
+    _bufRelease(Pointer<Void>.fromAddress(address));
+  }
+
+  void closeStream(int streamHandle) {
+    _streamClose(streamHandle);
+  }
+
+  int startHttpServer(int port) {
+    final errBuf = calloc<Uint8>(1024);
+    try {
+      final rc = _httpStart(port, errBuf, 1024);
+      if (rc <= 0) {
+        throw StateError(_readErr(errBuf));
+      }
+      return rc;
+    } finally {
+      calloc.free(errBuf);
+    }
+  }
+
+  void stopHttpServer() {
+    _httpStop();
+  }
+
+  void setHttpConnection({
+    required String name,
+    required String host,
+    required int port,
+    required String username,
+    required String password,
+    required String domain,
+  }) {
+    final rc = _withUtf8(
+      name,
+      (namePtr) => _withUtf8(
+        host,
+        (hostPtr) => _withUtf8(
+          username,
+          (userPtr) => _withUtf8(
+            password,
+            (passPtr) => _withUtf8(
+              domain,
+              (domainPtr) => _httpSetConnection(
+                namePtr,
+                hostPtr,
+                port,
+                userPtr,
+                passPtr,
+                domainPtr,
+              ),
+            ),
+          ),
+        ),
+      ),
+    );
+    if (rc != 0) {
+      throw StateError('Failed to register SMB connection "$name": $rc');
+    }
+  }
+
+  /// Starts the native reactor; returns <0 where it is not available.
+  int startReactor() => _reactorStart(NativeApi.postCObject.cast());
+
+  int asyncList(
+    int replyPort,
+    int id,
+    SMBConnection connection,
+    String path, {
+    int timeoutMs = 0,
+    int cancelToken = 0,
+  }) =>
+      _withConnection(
+        connection,
+        path,
+        (host, user, pass, domain, pathPtr) => _asyncList(replyPort, id, host,
+            connection.port, user, pass, domain, pathPtr, timeoutMs,
+            cancelToken),
+      );
+
+  int asyncStat(
+    int replyPort,
+    int id,
+    SMBConnection connection,
+    String path, {
+    int timeoutMs = 0,
+    int cancelToken = 0,
+  }) =>
+      _withConnection(
+        connection,
+        path,
+        (host, user, pass, domain, pathPtr) => _asyncStat(replyPort, id, host,
+            connection.port, user, pass, domain, pathPtr, timeoutMs,
+            cancelToken),
+      );
+
+  int asyncStreamOpen(
+    int replyPort,
+    int id,
+    SMBConnection connection,
+    String path, {
+    required int start,
+    required int endExclusive,
+    required int chunkSize,
+    required int credits,
+    int queueDepth = 0,
+    int timeoutMs = 0,
+    int cancelToken = 0,
+  }) =>
+      _withConnection(
+        connection,
+        path,
+        (host, user, pass, domain, pathPtr) => _asyncStreamOpen(
+          replyPort,
+          id,
+          host,
+          connection.port,
+          user,
+          pass,
+          domain,
+          pathPtr,
+          start,
+          endExclusive,
+          chunkSize,
+          queueDepth,
+          credits,
+          timeoutMs,
+          cancelToken,
+        ),
+      );
+
+  void asyncStreamRequest(int streamHandle, int chunks) {
+    _asyncStreamRequest(streamHandle, chunks);
+  }
+
+  void asyncStreamClose(int streamHandle) {
+    _asyncStreamClose(streamHandle);
+  }
+
+  void configureCache(String directory, int maxBytes) {
+    final errBuf = calloc<Uint8>(1024);
+    try {
+      final rc = _withUtf8(
+        directory,
+        (dirPtr) => _cacheConfigure(dirPtr, maxBytes, errBuf, 1024),
+      );
+      if (rc < 0) {
+        throw StateError(_readErr(errBuf));
+      }
+    } finally {
+      calloc.free(errBuf);
+    }
+  }
+
+  void clearCache() {
+    _cacheClear();
+  }
+
+  ({int hits, int misses, int usedBytes, int capacityBytes}) cacheStats() {
+    final out = calloc<Uint64>(4);
+    try {
+      _cacheStats(out, out + 1, out + 2, out + 3);
+      return (
+        hits: out[0],
+        misses: out[1],
+        usedBytes: out[2],
+        capacityBytes: out[3],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  void configureReadAhead(int minWindow, int maxWindow) {
+    _readAheadConfigure(minWindow, maxWindow);
+  }
+
+  ({
+    int sequentialReads,
+    int stridedReads,
+    int randomReads,
+    int prefetchedBytes,
+    int usedBytes,
+  }) readAheadStats() {
+    final out = calloc<Uint64>(5);
+    try {
+      _readAheadStats(out, out + 1, out + 2, out + 3, out + 4);
+      return (
+        sequentialReads: out[0],
+        stridedReads: out[1],
+        randomReads: out[2],
+        prefetchedBytes: out[3],
+        usedBytes: out[4],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  ({int opens, int reusedOpens, int reads, int joinedReads})
+      sharedStats() {
+    final out = calloc<Uint64>(4);
+    try {
+      _sharedStats(out, out + 1, out + 2, out + 3);
+      return (
+        opens: out[0],
+        reusedOpens: out[1],
+        reads: out[2],
+        joinedReads: out[3],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  ({
+    int reconnects,
+    int failed,
+    int reclaimed,
+    int replayedReads,
+    int totalMs,
+    int maxMs,
+  }) reconnectStats() {
+    final out = calloc<Uint64>(6);
+    try {
+      _reconnectStats(out, out + 1, out + 2, out + 3, out + 4, out + 5);
+      return (
+        reconnects: out[0],
+        failed: out[1],
+        reclaimed: out[2],
+        replayedReads: out[3],
+        totalMs: out[4],
+        maxMs: out[5],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  ({int grants, int breaks, int invalidatedBlocks, int statHits})
+      leaseStats() {
+    final out = calloc<Uint64>(4);
+    try {
+      _leaseStats(out, out + 1, out + 2, out + 3);
+      return (
+        grants: out[0],
+        breaks: out[1],
+        invalidatedBlocks: out[2],
+        statHits: out[3],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  void configureMultichannel(int maxChannels) {
+    _multichannelConfigure(maxChannels);
+  }
+
+  ({int bound, int failedBinds, int stripedReads, int lost})
+      multichannelStats() {
+    final out = calloc<Uint64>(4);
+    try {
+      _multichannelStats(out, out + 1, out + 2, out + 3);
+      return (
+        bound: out[0],
+        failedBinds: out[1],
+        stripedReads: out[2],
+        lost: out[3],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  void configureHedging(int percentile) {
+    _hedgeConfigure(percentile);
+  }
+
+  ({int hedgedReads, int won, int wasted, int delayMs}) hedgeStats() {
+    final out = calloc<Uint64>(4);
+    try {
+      _hedgeStats(out, out + 1, out + 2, out + 3);
+      return (
+        hedgedReads: out[0],
+        won: out[1],
+        wasted: out[2],
+        delayMs: out[3],
+      );
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  void setHostConcurrency(int maxRequests) {
+    _setHostConcurrency(maxRequests);
+  }
+
+  int newCancelToken() => _cancelTokenNew();
+
+  void cancelToken(int token) {
+    _cancelTokenCancel(token);
+  }
+
+  void freeCancelToken(int token) {
+    _cancelTokenFree(token);
+  }
+}
+
+T _withConnection<T>(
+  SMBConnection connection,
+  String path,
+  T Function(Pointer<Utf8> host, Pointer<Utf8> username,
+          Pointer<Utf8> password, Pointer<Utf8> domain, Pointer<Utf8> path)
+      fn,
+) {
+  return _withUtf8(
+    connection.host,
+    (hostPtr) => _withUtf8(
+      connection.username,
+      (userPtr) => _withUtf8(
+        connection.password,
+        (passPtr) => _withUtf8(
+          connection.domain,
+          (domainPtr) => _withUtf8(
+            path,
+            (pathPtr) => fn(hostPtr, userPtr, passPtr, domainPtr, pathPtr),
+          ),
+        ),
+      ),
+    ),
+  );
+}
+
+DynamicLibrary _openDynamicLibrary() {
+  if (kIsWeb) {
+    throw UnsupportedError('libsmb2 is not supported on web.');
+  }
+
+  return switch (defaultTargetPlatform) {
+    TargetPlatform.macOS || TargetPlatform.iOS => DynamicLibrary.open(
+        'nipaplay_smb2.framework/nipaplay_smb2',
+      ),
+    TargetPlatform.android || TargetPlatform.linux => DynamicLibrary.open(
+        'libnipaplay_smb2.so',
+      ),
+    TargetPlatform.windows => DynamicLibrary.open(
+        'nipaplay_smb2.dll',
+      ),
+    _ => throw UnsupportedError(
+        'libsmb2 is not supported on $defaultTargetPlatform.',
+      ),
+  };
+}
+
+T _withUtf8<T>(String value, T Function(Pointer<Utf8>) fn) {
+  final ptr = value.toNativeUtf8();
+  try {
+    return fn(ptr);
+  } finally {
+    calloc.free(ptr);
+  }
+}
 
 String _readErr(Pointer<Uint8> errBuf) {
   final bytes = errBuf.asTypedList(1024);
@@ -574,6 +1566,7 @@ typedef _np_smb2_reader_open_c = IntPtr Function(
   Pointer<Utf8>,
   Pointer<Utf8>,
   Pointer<Utf8>,
+  Int32,
   Pointer<Uint64>,
   Pointer<Uint8>,
   Int32,
@@ -585,6 +1578,7 @@ typedef _np_smb2_reader_open_dart = int Function(
   Pointer<Utf8>,
   Pointer<Utf8>,
   Pointer<Utf8>,
+  int,
   Pointer<Uint64>,
   Pointer<Uint8>,
   int,
@@ -610,6 +1604,283 @@ typedef _np_smb2_reader_pread_dart = int Function(
 typedef _np_smb2_reader_close_c = Void Function(IntPtr);
 typedef _np_smb2_reader_close_dart = void Function(int);
 
+typedef _np_smb2_stream_open_c = IntPtr Function(
+  Pointer<Utf8>,
+  Int32,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Uint64,
+  Uint64,
+  Uint32,
+  Int32,
+  Pointer<Uint64>,
+  Pointer<Uint8>,
+  Int32,
+);
+typedef _np_smb2_stream_open_dart = int Function(
+  Pointer<Utf8>,
+  int,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  int,
+  int,
+  int,
+  int,
+  Pointer<Uint64>,
+  Pointer<Uint8>,
+  int,
+);
+
+typedef _np_smb2_stream_next_c = Int32 Function(
+  IntPtr,
+  Pointer<Pointer<Uint8>>,
+  Pointer<Uint8>,
+  Int32,
+);
+typedef _np_smb2_stream_next_dart = int Function(
+  int,
+  Pointer<Pointer<Uint8>>,
+  Pointer<Uint8>,
+  int,
+);
+
+typedef _np_smb2_stream_close_c = Void Function(IntPtr);
+typedef _np_smb2_stream_close_dart = void Function(int);
+
+typedef _np_smb2_buf_release_c = Void Function(Pointer<Void>);
+typedef _np_smb2_buf_release_dart = void Function(Pointer<Void>);
+
+typedef _np_smb2_http_start_c = Int32 Function(Int32, Pointer<Uint8>, Int32);
+typedef _np_smb2_http_start_dart = int Function(int, Pointer<Uint8>, int);
+
+typedef _np_smb2_http_stop_c = Void Function();
+typedef _np_smb2_http_stop_dart = void Function();
+
+typedef _np_smb2_http_set_connection_c = Int32 Function(
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Int32,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+);
+typedef _np_smb2_http_set_connection_dart = int Function(
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  int,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+);
+
+typedef _np_smb2_reactor_start_c = Int32 Function(
+  Pointer<NativeFunction<Bool Function(Int64, Pointer<Void>)>>,
+);
+typedef _np_smb2_reactor_start_dart = int Function(
+  Pointer<NativeFunction<Bool Function(Int64, Pointer<Void>)>>,
+);
+
+typedef _np_smb2_async_path_c = Int32 Function(
+  Int64,
+  Int64,
+  Pointer<Utf8>,
+  Int32,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Int32,
+  IntPtr,
+);
+typedef _np_smb2_async_path_dart = int Function(
+  int,
+  int,
+  Pointer<Utf8>,
+  int,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  int,
+  int,
+);
+
+typedef _np_smb2_async_stream_open_c = IntPtr Function(
+  Int64,
+  Int64,
+  Pointer<Utf8>,
+  Int32,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Uint64,
+  Uint64,
+  Uint32,
+  Int32,
+  Int32,
+  Int32,
+  IntPtr,
+);
+typedef _np_smb2_async_stream_open_dart = int Function(
+  int,
+  int,
+  Pointer<Utf8>,
+  int,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  Pointer<Utf8>,
+  int,
+  int,
+  int,
+  int,
+  int,
+  int,
+  int,
+);
+
+typedef _np_smb2_async_stream_request_c = Void Function(IntPtr, Int32);
+typedef _np_smb2_async_stream_request_dart = void Function(int, int);
+
+typedef _np_smb2_cache_configure_c = Int32 Function(
+  Pointer<Utf8>,
+  Uint64,
+  Pointer<Uint8>,
+  Int32,
+);
+typedef _np_smb2_cache_configure_dart = int Function(
+  Pointer<Utf8>,
+  int,
+  Pointer<Uint8>,
+  int,
+);
+
+typedef _np_smb2_cache_clear_c = Void Function();
+typedef _np_smb2_cache_clear_dart = void Function();
+
+typedef _np_smb2_cache_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_cache_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_readahead_configure_c = Void Function(Uint32, Uint32);
+typedef _np_smb2_readahead_configure_dart = void Function(int, int);
+
+typedef _np_smb2_readahead_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_readahead_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_reconnect_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_reconnect_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_shared_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_shared_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_lease_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_lease_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_multichannel_configure_c = Void Function(Int32);
+typedef _np_smb2_multichannel_configure_dart = void Function(int);
+
+typedef _np_smb2_multichannel_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_multichannel_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_hedge_configure_c = Void Function(Int32);
+typedef _np_smb2_hedge_configure_dart = void Function(int);
+
+typedef _np_smb2_hedge_stats_c = Void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+typedef _np_smb2_hedge_stats_dart = void Function(
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+  Pointer<Uint64>,
+);
+
+typedef _np_smb2_reactor_set_host_concurrency_c = Void Function(Int32);
+typedef _np_smb2_reactor_set_host_concurrency_dart = void Function(int);
+
+typedef _np_smb2_cancel_token_new_c = IntPtr Function();
+typedef _np_smb2_cancel_token_new_dart = int Function();
+
+typedef _np_smb2_cancel_token_cancel_c = Void Function(IntPtr);
+typedef _np_smb2_cancel_token_cancel_dart = void Function(int);
+
+typedef _np_smb2_cancel_token_free_c = Void Function(IntPtr);
+typedef _np_smb2_cancel_token_free_dart = void Function(int);
+
 class _Smb2StreamReader {
   static Stream<Uint8List> stream({
     required String host,
@@ -621,66 +1892,116 @@ class _Smb2StreamReader {
     required int start,
     required int endExclusive,
     required int chunkSize,
+    required Smb2ChunkTransfer transfer,
   }) {
     final controller = StreamController<Uint8List>();
+    final native = Smb2NativeService.instance._native;
 
-    Isolate? isolate;
     ReceivePort? receivePort;
+    // Polled by the reader isolate between chunks; set on cancel so it can
+    // close the native stream (and its pooled session) instead of being
+    // killed mid-read.
+    Pointer<Int32>? cancelFlag;
+    var cancelled = false;
+
+    void finish() {
+      receivePort?.close();
+      if (cancelFlag != null) {
+        calloc.free(cancelFlag!);
+        cancelFlag = null;
+      }
+      if (!controller.isClosed) {
+        controller.close();
+      }
+    }
 
     Future<void> startIsolate() async {
       receivePort = ReceivePort();
-      isolate = await Isolate.spawn<_Smb2StreamArgs>(
-        _smb2StreamIsolateMain,
-        _Smb2StreamArgs(
-          sendPort: receivePort!.sendPort,
-          host: host,
-          port: port,
-          username: username,
-          password: password,
-          domain: domain,
-          path: path,
-          start: start,
-          endExclusive: endExclusive,
-          chunkSize: chunkSize,
-        ),
-        errorsAreFatal: true,
-      );
+      cancelFlag = calloc<Int32>();
 
       receivePort!.listen((message) {
-        if (message is Uint8List) {
-          controller.add(message);
+        if (message is _Smb2NativeChunk) {
+          if (cancelled) {
+            native.releaseBuffer(message.address);
+          } else {
+            controller.add(native.wrapBuffer(message.address, message.length));
+          }
+          return;
+        }
+        if (message is TransferableTypedData) {
+          if (!cancelled) {
+            controller.add(message.materialize().asUint8List());
+          }
           return;
         }
         if (message is Map && message['type'] == 'error') {
-          controller.addError(message['error'] ?? 'SMB2 stream error');
+          if (!cancelled) {
+            controller.addError(message['error'] ?? 'SMB2 stream error');
+          }
           controller.close();
-          isolate?.kill(priority: Isolate.immediate);
-          receivePort?.close();
           return;
         }
         if (message is Map && message['type'] == 'done') {
           controller.close();
-          isolate?.kill(priority: Isolate.immediate);
-          receivePort?.close();
           return;
         }
+        if (message == null) {
+          // Isolate exit; anything it sent has been delivered by now.
+          finish();
+        }
       });
+
+      try {
+        await Isolate.spawn<_Smb2StreamArgs>(
+          _smb2StreamIsolateMain,
+          _Smb2StreamArgs(
+            sendPort: receivePort!.sendPort,
+            cancelFlagAddress: cancelFlag!.address,
+            host: host,
+            port: port,
+            username: username,
+            password: password,
+            domain: domain,
+            path: path,
+            start: start,
+            endExclusive: endExclusive,
+            chunkSize: chunkSize,
+            transfer: transfer,
+          ),
+          errorsAreFatal: true,
+          onExit: receivePort!.sendPort,
+        );
+      } catch (e) {
+        if (!cancelled) {
+          controller.addError(e);
+        }
+        finish();
+      }
     }
 
     controller.onListen = () {
       startIsolate();
     };
-    controller.onCancel = () async {
-      isolate?.kill(priority: Isolate.immediate);
-      receivePort?.close();
+    controller.onCancel = () {
+      cancelled = true;
+      cancelFlag?.value = 1;
     };
 
     return controller.stream;
   }
 }
 
+/// A native buffer reference handed from the reader isolate to the listener.
+class _Smb2NativeChunk {
+  final int address;
+  final int length;
+
+  const _Smb2NativeChunk(this.address, this.length);
+}
+
 class _Smb2StreamArgs {
   final SendPort sendPort;
+  final int cancelFlagAddress;
   final String host;
   final int port;
   final String username;
@@ -690,9 +2011,11 @@ class _Smb2StreamArgs {
   final int start;
   final int endExclusive;
   final int chunkSize;
+  final Smb2ChunkTransfer transfer;
 
   const _Smb2StreamArgs({
     required this.sendPort,
+    required this.cancelFlagAddress,
     required this.host,
     required this.port,
     required this.username,
@@ -702,64 +2025,56 @@ class _Smb2StreamArgs {
     required this.start,
     required this.endExclusive,
     required this.chunkSize,
+    required this.transfer,
   });
 }
 
 void _smb2StreamIsolateMain(_Smb2StreamArgs args) {
   final native = _Smb2Native();
-  int readerHandle = 0;
-  Pointer<Uint8>? buffer;
+  final cancelFlag = Pointer<Int32>.fromAddress(args.cancelFlagAddress);
+  int streamHandle = 0;
   try {
-    final opened = native.openReader(
+    if (args.endExclusive <= args.start) {
+      args.sendPort.send({'type': 'done'});
+      return;
+    }
+
+    streamHandle = native.openStream(
       host: args.host,
       port: args.port,
       username: args.username,
       password: args.password,
       domain: args.domain,
       path: args.path,
+      start: args.start,
+      endExclusive: args.endExclusive,
+      chunkSize: args.chunkSize <= 0 ? 256 * 1024 : args.chunkSize,
     );
-    readerHandle = opened.handle;
-
-    final total = args.endExclusive - args.start;
-    if (total <= 0) {
-      args.sendPort.send({'type': 'done'});
-      native.closeReader(readerHandle);
-      return;
-    }
 
-    final maxChunk = args.chunkSize <= 0 ? 256 * 1024 : args.chunkSize;
-    buffer = malloc<Uint8>(maxChunk);
-
-    int offset = args.start;
-    while (offset < args.endExclusive) {
-      final remaining = args.endExclusive - offset;
-      final toRead = remaining < maxChunk ? remaining : maxChunk;
-      final read = native.pread(
-        readerHandle: readerHandle,
-        offset: offset,
-        buffer: buffer,
-        count: toRead,
-      );
-      if (read <= 0) {
-        break;
+    while (cancelFlag.value == 0) {
+      if (args.transfer == Smb2ChunkTransfer.external) {
+        final chunk = native.nextBuffer(streamHandle);
+        if (chunk == null) {
+          break;
+        }
+        args.sendPort.send(_Smb2NativeChunk(chunk.address, chunk.length));
+      } else {
+        final view = native.nextChunk(streamHandle);
+        if (view == null) {
+          break;
+        }
+        args.sendPort.send(TransferableTypedData.fromList([view]));
       }
-      final chunk = Uint8List.fromList(buffer.asTypedList(read));
-      args.sendPort.send(chunk);
-      offset += read;
     }
 
-    native.closeReader(readerHandle);
+    native.closeStream(streamHandle);
     args.sendPort.send({'type': 'done'});
   } catch (e) {
-    if (readerHandle != 0) {
+    if (streamHandle != 0) {
       try {
-        native.closeReader(readerHandle);
+        native.closeStream(streamHandle);
       } catch (_) {}
     }
     args.sendPort.send({'type': 'error', 'error': e.toString()});
-  } finally {
-    if (buffer != null) {
-      malloc.free(buffer);
-    }
   }
 }
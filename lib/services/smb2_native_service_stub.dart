@@ -11,15 +11,19 @@ class Smb2NativeService {
 
   Future<List<SMBFileEntry>> listDirectory(
     SMBConnection connection,
-    String path,
-  ) {
+    String path, {
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  }) {
     throw UnsupportedError('libsmb2 is not supported on this platform.');
   }
 
   Future<Smb2Stat> stat(
     SMBConnection connection,
-    String path,
-  ) {
+    String path, {
+    Duration? timeout,
+    Smb2CancelToken? cancelToken,
+  }) {
     throw UnsupportedError('libsmb2 is not supported on this platform.');
   }
 
@@ -29,9 +33,110 @@ class Smb2NativeService {
     required int start,
     required int endExclusive,
     int chunkSize = 256 * 1024,
+    Smb2ChunkTransfer transfer = Smb2ChunkTransfer.external,
+  }) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  int startHttpServer(int port) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void stopHttpServer() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void registerHttpConnection(SMBConnection connection) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void configureBlockCache({
+    required String directory,
+    required int maxBytes,
   }) {
     throw UnsupportedError('libsmb2 is not supported on this platform.');
   }
+
+  void clearBlockCache() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({int hits, int misses, int usedBytes, int capacityBytes})
+      blockCacheStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void configureReadAhead({int minWindow = 0, int maxWindow = 0}) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({
+    int sequentialReads,
+    int stridedReads,
+    int randomReads,
+    int prefetchedBytes,
+    int usedBytes,
+  }) readAheadStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({int opens, int reusedOpens, int reads, int joinedReads})
+      sharedReadStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({
+    int reconnects,
+    int failed,
+    int reclaimed,
+    int replayedReads,
+    int totalMs,
+    int maxMs,
+  }) reconnectStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({int grants, int breaks, int invalidatedBlocks, int statHits})
+      leaseStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void configureMultichannel({int maxChannels = 0}) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({int bound, int failedBinds, int stripedReads, int lost})
+      multichannelStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void configureHedging({int percentile = 0}) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  ({int hedgedReads, int won, int wasted, int delayMs}) hedgeStats() {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+
+  void setHostConcurrency(int maxRequests) {
+    throw UnsupportedError('libsmb2 is not supported on this platform.');
+  }
+}
+
+class Smb2CancelToken {
+  bool _cancelled = false;
+
+  bool get isCancelled => _cancelled;
+
+  void cancel() {
+    _cancelled = true;
+  }
+}
+
+/// How [Smb2NativeService.openReadStream] hands chunks to the listener.
+enum Smb2ChunkTransfer {
+  external,
+  transferable,
 }
 
 class Smb2Stat {
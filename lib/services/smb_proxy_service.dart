@@ -4,6 +4,7 @@ import 'dart:typed_data';
 
 import 'package:flutter/foundation.dart';
 import 'package:path/path.dart' as p;
+import 'package:path_provider/path_provider.dart';
 import 'package:shared_preferences/shared_preferences.dart';
 import 'package:shelf/shelf.dart';
 import 'package:shelf/shelf_io.dart' as shelf_io;
@@ -16,6 +17,7 @@ import 'package:nipaplay/services/smb2_native_service.dart';
 class SMBProxyService {
   static const String _portKey = 'smb_proxy_port';
   static const int _defaultPort = 33221;
+  static const int _blockCacheBytes = 1024 * 1024 * 1024;
 
   SMBProxyService._();
 
@@ -24,6 +26,9 @@ class SMBProxyService {
   HttpServer? _server;
   int _port = 0;
   bool _isRunning = false;
+  // Requests are served by the range server inside libnipaplay_smb2 rather
+  // than by the shelf handlers below.
+  bool _isNative = false;
 
   bool get isRunning => _isRunning;
   int get port => _port;
@@ -38,13 +43,6 @@ class SMBProxyService {
 
     await SMBService.instance.initialize();
 
-    final router = Router()
-      ..add('GET', '/smb/stream', _handleStream)
-      ..add('HEAD', '/smb/stream', _handleStreamHead)
-      ..get('/smb/health', (Request request) => Response.ok('ok'));
-
-    final handler = const Pipeline().addHandler(router.call);
-
     final prefs = await SharedPreferences.getInstance();
     final savedPort = prefs.getInt(_portKey);
 
@@ -60,6 +58,32 @@ class SMBProxyService {
     addPort(0);
 
     Object? lastError;
+    if (Smb2NativeService.instance.isSupported) {
+      await _configureBlockCache();
+      for (final candidatePort in portsToTry) {
+        try {
+          _port = Smb2NativeService.instance.startHttpServer(candidatePort);
+          _isRunning = true;
+          _isNative = true;
+          for (final connection in SMBService.instance.connections) {
+            Smb2NativeService.instance.registerHttpConnection(connection);
+          }
+          await prefs.setInt(_portKey, _port);
+          debugPrint('SMBProxyService started natively on 127.0.0.1:$_port');
+          return;
+        } catch (e) {
+          lastError = e;
+        }
+      }
+    }
+
+    final router = Router()
+      ..add('GET', '/smb/stream', _handleStream)
+      ..add('HEAD', '/smb/stream', _handleStreamHead)
+      ..get('/smb/health', (Request request) => Response.ok('ok'));
+
+    final handler = const Pipeline().addHandler(router.call);
+
     for (final candidatePort in portsToTry) {
       try {
         _server = await shelf_io.serve(
@@ -80,10 +104,31 @@ class SMBProxyService {
     debugPrint('SMBProxyService failed to start: $lastError');
   }
 
+  /// Lets the native readers serve re-watched and seeked-back regions from
+  /// disk instead of the network.
+  Future<void> _configureBlockCache() async {
+    try {
+      final cacheDir = Directory(
+        p.join((await getApplicationCacheDirectory()).path, 'smb2_blocks'),
+      );
+      await cacheDir.create(recursive: true);
+      Smb2NativeService.instance.configureBlockCache(
+        directory: cacheDir.path,
+        maxBytes: _blockCacheBytes,
+      );
+    } catch (e) {
+      debugPrint('SMBProxyService block cache disabled: $e');
+    }
+  }
+
   String buildStreamUrl(SMBConnection connection, String smbPath) {
     final normalizedConnection = SMBService.instance.getConnection(connection.name) ?? connection;
     final connName = normalizedConnection.name.trim();
     final normalizedPath = _normalizeSmbPath(smbPath);
+    if (_isNative) {
+      // Keeps the native registry in sync with edited credentials.
+      Smb2NativeService.instance.registerHttpConnection(normalizedConnection);
+    }
 
     final resolvedPort = _port > 0 ? _port : _defaultPort;
     return Uri(
@@ -0,0 +1,2 @@
+// Forwarder to compile libsmb2 sources for iOS.
+#include "../../../third_party/libsmb2/lib/aes_hw.c"
@@ -0,0 +1,3 @@
+// Relative import to be able to reuse the C sources.
+// See the comment in ../nipaplay_smb2.podspec for more information.
+#include "../../src/np_smb2_index.c"
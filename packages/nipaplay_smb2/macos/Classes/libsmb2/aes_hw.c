@@ -0,0 +1 @@
+#include "../../../third_party/libsmb2/lib/aes_hw.c"
@@ -0,0 +1 @@
+#include "../../../third_party/libsmb2/lib/uring.c"
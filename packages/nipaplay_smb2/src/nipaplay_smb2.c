@@ -1,4 +1,5 @@
 #include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -19,12 +20,110 @@
 #include <smb2/libsmb2-raw.h>
 
 typedef struct np_smb2_reader {
-  struct smb2_context *ctx;
-  struct smb2fh *fh;
+  // Shared with other readers and streams of the same file.
+  np_shared_file_t *file;
   uint64_t size;
+  bool failed;
+  np_cache_key_t key;
+  // Servicing the socket failed; the session must be discarded.
+  bool broken;
+
+  np_ra_t ra;
+  // READs issued ahead of a sequential or strided reader. `ahead_data` holds
+  // the unread rest of the current chunk, which starts at `ahead_pos`.
+  np_smb2_stream_t *ahead;
+  uint8_t *ahead_data;
+  uint32_t ahead_len;
+  uint64_t ahead_pos;
 } np_smb2_reader_t;
 
-static void np_set_err(char *err_buf, int err_len, const char *fmt, ...) {
+// Read-ahead of a sequential reader; the stream grows its window within this.
+#define NP_READER_AHEAD_DEPTH 8
+
+uint64_t np_now_ms(void) {
+#if defined(_WIN32) || defined(_WINDOWS)
+  return (uint64_t)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000u + (uint64_t)(ts.tv_nsec / 1000000);
+#endif
+}
+
+void np_sleep_ms(uint32_t ms) {
+#if defined(_WIN32) || defined(_WINDOWS)
+  Sleep(ms);
+#else
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+#endif
+}
+
+typedef struct np_thread_start_args {
+  np_thread_fn fn;
+  void *arg;
+} np_thread_start_args_t;
+
+#if defined(_WIN32) || defined(_WINDOWS)
+static DWORD WINAPI np_thread_main(LPVOID param) {
+#else
+static void *np_thread_main(void *param) {
+#endif
+  np_thread_start_args_t args = *(np_thread_start_args_t *)param;
+  free(param);
+  args.fn(args.arg);
+  return 0;
+}
+
+int np_thread_start(np_thread_t *out, np_thread_fn fn, void *arg) {
+  np_thread_start_args_t *args =
+      (np_thread_start_args_t *)malloc(sizeof(*args));
+  if (args == NULL) {
+    return -ENOMEM;
+  }
+  args->fn = fn;
+  args->arg = arg;
+
+#if defined(_WIN32) || defined(_WINDOWS)
+  HANDLE thread = CreateThread(NULL, 0, np_thread_main, args, 0, NULL);
+  if (thread == NULL) {
+    free(args);
+    return -EAGAIN;
+  }
+  if (out != NULL) {
+    *out = thread;
+  } else {
+    CloseHandle(thread);
+  }
+#else
+  pthread_t thread;
+  const int rc = pthread_create(&thread, NULL, np_thread_main, args);
+  if (rc != 0) {
+    free(args);
+    return -rc;
+  }
+  if (out != NULL) {
+    *out = thread;
+  } else {
+    pthread_detach(thread);
+  }
+#endif
+  return 0;
+}
+
+void np_thread_join(np_thread_t thread) {
+#if defined(_WIN32) || defined(_WINDOWS)
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+void np_set_err(char *err_buf, int err_len, const char *fmt, ...) {
   if (err_buf == NULL || err_len <= 0) {
     return;
   }
@@ -34,9 +133,9 @@ static void np_set_err(char *err_buf, int err_len, const char *fmt, ...) {
   va_end(ap);
 }
 
-static bool np_is_empty(const char *s) { return s == NULL || s[0] == '\0'; }
+bool np_is_empty(const char *s) { return s == NULL || s[0] == '\0'; }
 
-static char *np_strdup_or_empty(const char *s) {
+char *np_strdup_or_empty(const char *s) {
   if (s == NULL) {
     char *out = (char *)malloc(1);
     if (out) {
@@ -53,7 +152,7 @@ static char *np_strdup_or_empty(const char *s) {
   return out;
 }
 
-static char *np_normalize_path(const char *raw) {
+char *np_normalize_path(const char *raw) {
   if (raw == NULL || raw[0] == '\0') {
     return np_strdup_or_empty("/");
   }
@@ -85,8 +184,7 @@ static char *np_normalize_path(const char *raw) {
   return tmp;
 }
 
-static int np_build_server(const char *host, int port, char *out,
-                           size_t out_len) {
+int np_build_server(const char *host, int port, char *out, size_t out_len) {
   if (out == NULL || out_len == 0) {
     return -EINVAL;
   }
@@ -102,9 +200,9 @@ static int np_build_server(const char *host, int port, char *out,
   return snprintf(out, out_len, "%s:%d", host, port) < 0 ? -EINVAL : 0;
 }
 
-static int np_parse_share_and_path(const char *normalized_path, char *share_out,
-                                   size_t share_len, char *path_out,
-                                   size_t path_len) {
+int np_parse_share_and_path(const char *normalized_path, char *share_out,
+                            size_t share_len, char *path_out,
+                            size_t path_len) {
   if (normalized_path == NULL || normalized_path[0] == '\0') {
     return -EINVAL;
   }
@@ -216,8 +314,8 @@ static char *np_json_escape(const char *s) {
   return out;
 }
 
-static void np_apply_credentials(struct smb2_context *ctx, const char *username,
-                                 const char *password, const char *domain) {
+void np_apply_credentials(struct smb2_context *ctx, const char *username,
+                          const char *password, const char *domain) {
   if (ctx == NULL) {
     return;
   }
@@ -249,9 +347,76 @@ static void np_share_enum_cb(struct smb2_context *smb2, int status,
   state->done = 1;
 }
 
-static int np_run_until_done(struct smb2_context *ctx,
-                             struct np_share_enum_state *state) {
-  while (state->done == 0) {
+// Set by np_smb2_set_io_uring().
+static volatile int g_uring_enabled;
+
+FFI_PLUGIN_EXPORT void np_smb2_set_io_uring(int enabled) {
+  g_uring_enabled = enabled != 0;
+}
+
+#if defined(__linux__)
+// Each thread that services sessions gets its own io_uring once enabled,
+// created on first use and destroyed with the thread. Once the kernel
+// refuses one, everyone stays on poll().
+static pthread_once_t g_uring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_uring_key;
+static volatile int g_uring_unavailable;
+
+static void np_uring_destroy(void *ring) {
+  smb2_uring_destroy((struct smb2_uring *)ring);
+}
+
+static void np_uring_key_init(void) {
+  if (pthread_key_create(&g_uring_key, np_uring_destroy) != 0) {
+    g_uring_unavailable = 1;
+  }
+}
+
+static struct smb2_uring *np_thread_uring(void) {
+  if (!g_uring_enabled) {
+    return NULL;
+  }
+  pthread_once(&g_uring_once, np_uring_key_init);
+  if (g_uring_unavailable) {
+    return NULL;
+  }
+  struct smb2_uring *ring =
+      (struct smb2_uring *)pthread_getspecific(g_uring_key);
+  if (ring == NULL) {
+    ring = smb2_uring_create();
+    if (ring == NULL || pthread_setspecific(g_uring_key, ring) != 0) {
+      smb2_uring_destroy(ring);
+      g_uring_unavailable = 1;
+      return NULL;
+    }
+  }
+  return ring;
+}
+
+// Drop this thread's ring after it failed; the caller falls back to poll().
+static void np_thread_uring_failed(struct smb2_uring *ring) {
+  pthread_setspecific(g_uring_key, NULL);
+  smb2_uring_destroy(ring);
+  g_uring_unavailable = 1;
+}
+#endif
+
+int np_run_until_done(struct smb2_context *ctx, volatile int *done) {
+#if defined(__linux__)
+  struct smb2_uring *ring = np_thread_uring();
+  while (ring != NULL && *done == 0) {
+    int ret = 0;
+    const int rc = smb2_uring_service(ring, &ctx, &ret, 1, 1000);
+    if (rc < 0) {
+      np_thread_uring_failed(ring);
+      break;
+    }
+    if (ret < 0) {
+      return ret;
+    }
+  }
+#endif
+  while (*done == 0) {
     const t_socket fd = smb2_get_fd(ctx);
     const int events = smb2_which_events(ctx);
 
@@ -293,7 +458,7 @@ static int np_share_enum_sync(struct smb2_context *ctx,
     return rc;
   }
 
-  rc = np_run_until_done(ctx, &state);
+  rc = np_run_until_done(ctx, &state.done);
   if (rc != 0) {
     if (state.rep != NULL) {
       smb2_free_data(ctx, state.rep);
@@ -312,45 +477,8 @@ static int np_share_enum_sync(struct smb2_context *ctx,
   return 0;
 }
 
-static char *np_list_shares_json(const char *host, int port,
-                                 const char *username, const char *password,
-                                 const char *domain, char *err_buf,
-                                 int err_len) {
-  struct smb2_context *ctx = smb2_init_context();
-  if (ctx == NULL) {
-    np_set_err(err_buf, err_len, "smb2_init_context failed");
-    return NULL;
-  }
-
-  np_apply_credentials(ctx, username, password, domain);
-
-  char server[1024];
-  const int server_rc = np_build_server(host, port, server, sizeof(server));
-  if (server_rc != 0) {
-    np_set_err(err_buf, err_len, "Invalid server");
-    smb2_destroy_context(ctx);
-    return NULL;
-  }
-
-  const char *user_for_connect =
-      (!np_is_empty(username)) ? username : "guest";
-
-  int rc = smb2_connect_share(ctx, server, "IPC$", user_for_connect);
-  if (rc != 0) {
-    np_set_err(err_buf, err_len, "SMB connect IPC$ failed: %s",
-               smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
-    return NULL;
-  }
-
-  struct srvsvc_NetrShareEnum_rep *rep = NULL;
-  rc = np_share_enum_sync(ctx, &rep);
-  if (rc != 0 || rep == NULL) {
-    np_set_err(err_buf, err_len, "SMB share enum failed: %s", smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
-    return NULL;
-  }
-
+// JSON array of the visible disk shares in a NetrShareEnum reply.
+char *np_shares_json(const struct srvsvc_NetrShareEnum_rep *rep) {
   char *json = NULL;
   size_t len = 0;
   size_t cap = 0;
@@ -409,64 +537,12 @@ static char *np_list_shares_json(const char *host, int port,
   }
 
   np_json_append(&json, &len, &cap, "]");
-
-  smb2_free_data(ctx, rep);
-  smb2_destroy_context(ctx);
   return json;
 }
 
-static char *np_list_dir_json(const char *host, int port, const char *username,
-                              const char *password, const char *domain,
-                              const char *normalized_path, char *err_buf,
-                              int err_len) {
-  char share[512];
-  char inner_path[4096];
-  const int parse_rc = np_parse_share_and_path(normalized_path, share,
-                                               sizeof(share), inner_path,
-                                               sizeof(inner_path));
-  if (parse_rc != 0) {
-    np_set_err(err_buf, err_len, "Invalid SMB path: %s", normalized_path);
-    return NULL;
-  }
-
-  struct smb2_context *ctx = smb2_init_context();
-  if (ctx == NULL) {
-    np_set_err(err_buf, err_len, "smb2_init_context failed");
-    return NULL;
-  }
-  np_apply_credentials(ctx, username, password, domain);
-
-  char server[1024];
-  const int server_rc = np_build_server(host, port, server, sizeof(server));
-  if (server_rc != 0) {
-    np_set_err(err_buf, err_len, "Invalid server");
-    smb2_destroy_context(ctx);
-    return NULL;
-  }
-
-  const char *user_for_connect =
-      (!np_is_empty(username)) ? username : "guest";
-
-  int rc = smb2_connect_share(ctx, server, share, user_for_connect);
-  if (rc != 0) {
-    np_set_err(err_buf, err_len, "SMB connect share failed: %s",
-               smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
-    return NULL;
-  }
-
-  const char *libsmb2_path = inner_path;
-  if (libsmb2_path[0] == '/') {
-    libsmb2_path++;
-  }
-
-  struct smb2dir *dir = smb2_opendir(ctx, libsmb2_path);
-  if (dir == NULL) {
-    np_set_err(err_buf, err_len, "SMB opendir failed: %s", smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
-    return NULL;
-  }
-
+// JSON array of the entries left in `dir`, with paths under /share/inner_path.
+char *np_dir_json(struct smb2_context *ctx, struct smb2dir *dir,
+                  const char *share, const char *inner_path) {
   char *json = NULL;
   size_t len = 0;
   size_t cap = 0;
@@ -534,8 +610,71 @@ static char *np_list_dir_json(const char *host, int port, const char *username,
   }
 
   np_json_append(&json, &len, &cap, "]");
+  return json;
+}
+
+static char *np_list_shares_json(const char *host, int port,
+                                 const char *username, const char *password,
+                                 const char *domain, char *err_buf,
+                                 int err_len) {
+  np_smb2_session_t *session = np_pool_acquire(
+      host, port, username, password, domain, "IPC$", NULL, err_buf, err_len);
+  if (session == NULL) {
+    return NULL;
+  }
+  struct smb2_context *ctx = session->ctx;
+
+  struct srvsvc_NetrShareEnum_rep *rep = NULL;
+  int rc = np_share_enum_sync(ctx, &rep);
+  if (rc != 0 || rep == NULL) {
+    np_set_err(err_buf, err_len, "SMB share enum failed: %s", smb2_get_error(ctx));
+    np_pool_release(session, NP_RELEASE_SUSPECT);
+    return NULL;
+  }
+
+  char *json = np_shares_json(rep);
+
+  smb2_free_data(ctx, rep);
+  np_pool_release(session, NP_RELEASE_OK);
+  return json;
+}
+
+static char *np_list_dir_json(const char *host, int port, const char *username,
+                              const char *password, const char *domain,
+                              const char *normalized_path, char *err_buf,
+                              int err_len) {
+  char share[512];
+  char inner_path[4096];
+  const int parse_rc = np_parse_share_and_path(normalized_path, share,
+                                               sizeof(share), inner_path,
+                                               sizeof(inner_path));
+  if (parse_rc != 0) {
+    np_set_err(err_buf, err_len, "Invalid SMB path: %s", normalized_path);
+    return NULL;
+  }
+
+  np_smb2_session_t *session = np_pool_acquire(
+      host, port, username, password, domain, share, NULL, err_buf, err_len);
+  if (session == NULL) {
+    return NULL;
+  }
+  struct smb2_context *ctx = session->ctx;
+
+  const char *libsmb2_path = inner_path;
+  if (libsmb2_path[0] == '/') {
+    libsmb2_path++;
+  }
+
+  struct smb2dir *dir = smb2_opendir(ctx, libsmb2_path);
+  if (dir == NULL) {
+    np_set_err(err_buf, err_len, "SMB opendir failed: %s", smb2_get_error(ctx));
+    np_pool_release(session, NP_RELEASE_SUSPECT);
+    return NULL;
+  }
+
+  char *json = np_dir_json(ctx, dir, share, inner_path);
   smb2_closedir(ctx, dir);
-  smb2_destroy_context(ctx);
+  np_pool_release(session, NP_RELEASE_OK);
   return json;
 }
 
@@ -586,6 +725,13 @@ FFI_PLUGIN_EXPORT int np_smb2_stat(const char *host, int port,
     np_set_err(err_buf, err_len, "Cannot stat root path");
     return -EINVAL;
   }
+  // A file open with a read-caching lease cannot have changed meanwhile.
+  if (np_shared_lease_stat(host, port, username, password, domain, normalized,
+                           out_size)) {
+    free(normalized);
+    *out_type = SMB2_TYPE_FILE;
+    return 0;
+  }
 
   char share[512];
   char inner_path[4096];
@@ -597,32 +743,13 @@ FFI_PLUGIN_EXPORT int np_smb2_stat(const char *host, int port,
     return parse_rc;
   }
 
-  struct smb2_context *ctx = smb2_init_context();
-  if (ctx == NULL) {
-    np_set_err(err_buf, err_len, "smb2_init_context failed");
-    return -ENOMEM;
-  }
-
-  np_apply_credentials(ctx, username, password, domain);
-
-  char server[1024];
-  const int server_rc = np_build_server(host, port, server, sizeof(server));
-  if (server_rc != 0) {
-    np_set_err(err_buf, err_len, "Invalid server");
-    smb2_destroy_context(ctx);
-    return server_rc;
-  }
-
-  const char *user_for_connect =
-      (!np_is_empty(username)) ? username : "guest";
-
-  int rc = smb2_connect_share(ctx, server, share, user_for_connect);
-  if (rc != 0) {
-    np_set_err(err_buf, err_len, "SMB connect share failed: %s",
-               smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
+  int rc = 0;
+  np_smb2_session_t *session = np_pool_acquire(
+      host, port, username, password, domain, share, &rc, err_buf, err_len);
+  if (session == NULL) {
     return rc;
   }
+  struct smb2_context *ctx = session->ctx;
 
   struct smb2_stat_64 st;
   memset(&st, 0, sizeof(st));
@@ -633,34 +760,50 @@ FFI_PLUGIN_EXPORT int np_smb2_stat(const char *host, int port,
   rc = smb2_stat(ctx, libsmb2_path, &st);
   if (rc != 0) {
     np_set_err(err_buf, err_len, "SMB stat failed: %s", smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
+    np_pool_release(session, NP_RELEASE_SUSPECT);
     return rc;
   }
 
   *out_type = st.smb2_type;
   *out_size = st.smb2_size;
-  smb2_destroy_context(ctx);
+  np_pool_release(session, NP_RELEASE_OK);
   return 0;
 }
 
-FFI_PLUGIN_EXPORT intptr_t np_smb2_reader_open(
-    const char *host, int port, const char *username, const char *password,
-    const char *domain, const char *path, uint64_t *out_size, char *err_buf,
-    int err_len) {
-  if (out_size == NULL) {
-    np_set_err(err_buf, err_len, "Invalid out_size");
-    return (intptr_t)0;
+// How long the server should keep a durable handle after losing its
+// connection; servers cap it at their own limit.
+#define NP_DURABLE_TIMEOUT_MS 60000
+
+// A create guid or lease key only has to be unique among this client's.
+void np_new_id(uint8_t id[16]) {
+  static volatile int32_t counter;
+  uint64_t h[2] = {(uint64_t)time(NULL), np_now_ms()};
+  h[0] ^= (uint64_t)np_atomic_inc(&counter) << 32;
+  h[1] ^= (uint64_t)(uintptr_t)id;
+  for (int i = 0; i < 2; i++) {
+    // splitmix64 finalizer
+    uint64_t x = h[i] + 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    memcpy(id + i * 8, &x, 8);
   }
+}
 
+int np_open_file(const char *host, int port, const char *username,
+                 const char *password, const char *domain, const char *path,
+                 np_durable_t *durable, np_smb2_session_t **out_session,
+                 struct smb2fh **out_fh, uint64_t *out_size,
+                 np_cache_key_t *out_key, char *err_buf, int err_len) {
   char *normalized = np_normalize_path(path);
   if (normalized == NULL) {
     np_set_err(err_buf, err_len, "Out of memory");
-    return (intptr_t)0;
+    return -ENOMEM;
   }
   if (strcmp(normalized, "/") == 0) {
     free(normalized);
     np_set_err(err_buf, err_len, "Cannot open root path");
-    return (intptr_t)0;
+    return -EINVAL;
   }
 
   char share[512];
@@ -670,45 +813,49 @@ FFI_PLUGIN_EXPORT intptr_t np_smb2_reader_open(
   free(normalized);
   if (parse_rc != 0) {
     np_set_err(err_buf, err_len, "Invalid SMB path");
-    return (intptr_t)0;
-  }
-
-  struct smb2_context *ctx = smb2_init_context();
-  if (ctx == NULL) {
-    np_set_err(err_buf, err_len, "smb2_init_context failed");
-    return (intptr_t)0;
-  }
-  np_apply_credentials(ctx, username, password, domain);
-
-  char server[1024];
-  const int server_rc = np_build_server(host, port, server, sizeof(server));
-  if (server_rc != 0) {
-    np_set_err(err_buf, err_len, "Invalid server");
-    smb2_destroy_context(ctx);
-    return (intptr_t)0;
+    return parse_rc;
   }
 
-  const char *user_for_connect =
-      (!np_is_empty(username)) ? username : "guest";
-
-  int rc = smb2_connect_share(ctx, server, share, user_for_connect);
-  if (rc != 0) {
-    np_set_err(err_buf, err_len, "SMB connect share failed: %s",
-               smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
-    return (intptr_t)0;
+  int rc = 0;
+  np_smb2_session_t *session = np_pool_acquire(
+      host, port, username, password, domain, share, &rc, err_buf, err_len);
+  if (session == NULL) {
+    return rc;
   }
+  struct smb2_context *ctx = session->ctx;
 
   const char *libsmb2_path = inner_path;
   if (libsmb2_path[0] == '/') {
     libsmb2_path++;
   }
 
-  struct smb2fh *fh = smb2_open(ctx, libsmb2_path, O_RDONLY);
+  struct smb2fh *fh = NULL;
+  if (durable != NULL) {
+    if (durable->lease_want != 0) {
+      smb2_set_oplock_or_lease_break_callback(ctx, np_lease_break_cb);
+    }
+    // A reclaim fails if the server dropped the handle; open it anew then.
+    if (durable->durable) {
+      fh = smb2_reopen_durable(ctx, libsmb2_path, O_RDONLY, durable->guid,
+                               durable->file_id, durable->lease_want,
+                               durable->lease_key);
+    }
+    durable->reclaimed = fh != NULL;
+    if (fh == NULL) {
+      np_new_id(durable->guid);
+      fh = smb2_open_durable(ctx, libsmb2_path, O_RDONLY, durable->guid,
+                             NP_DURABLE_TIMEOUT_MS, durable->lease_want,
+                             durable->lease_key);
+    }
+  } else {
+    fh = smb2_open(ctx, libsmb2_path, O_RDONLY);
+  }
   if (fh == NULL) {
     np_set_err(err_buf, err_len, "SMB open failed: %s", smb2_get_error(ctx));
-    smb2_destroy_context(ctx);
-    return (intptr_t)0;
+    // The server's status if it refused the open, not a lost connection.
+    const int status = smb2_get_nterror(ctx);
+    np_pool_release(session, NP_RELEASE_SUSPECT);
+    return status != 0 ? -nterror_to_errno((uint32_t)status) : -EIO;
   }
 
   struct smb2_stat_64 st;
@@ -717,32 +864,228 @@ FFI_PLUGIN_EXPORT intptr_t np_smb2_reader_open(
   if (rc != 0) {
     np_set_err(err_buf, err_len, "SMB fstat failed: %s", smb2_get_error(ctx));
     smb2_close(ctx, fh);
-    smb2_destroy_context(ctx);
-    return (intptr_t)0;
+    np_pool_release(session, NP_RELEASE_SUSPECT);
+    return rc;
   }
   if (st.smb2_type == SMB2_TYPE_DIRECTORY) {
     np_set_err(err_buf, err_len, "Path is a directory");
     smb2_close(ctx, fh);
-    smb2_destroy_context(ctx);
+    np_pool_release(session, NP_RELEASE_OK);
+    return -EISDIR;
+  }
+
+  if (out_key != NULL) {
+    np_cache_key_init(out_key, host, port, share, inner_path, &st);
+  }
+  if (durable != NULL) {
+    durable->durable = smb2_fh_is_durable(fh) != 0;
+    durable->lease_state = smb2_fh_lease_state(fh);
+    memcpy(durable->file_id, smb2_get_file_id(fh), sizeof(durable->file_id));
+  }
+  *out_session = session;
+  *out_fh = fh;
+  *out_size = st.smb2_size;
+  return 0;
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_reader_open(
+    const char *host, int port, const char *username, const char *password,
+    const char *domain, const char *path, int flags, uint64_t *out_size,
+    char *err_buf, int err_len) {
+  if (out_size == NULL) {
+    np_set_err(err_buf, err_len, "Invalid out_size");
+    return (intptr_t)0;
+  }
+
+  np_shared_file_t *file = NULL;
+  if (np_shared_open(host, port, username, password, domain, path, &file,
+                     err_buf, err_len) != 0) {
     return (intptr_t)0;
   }
 
   np_smb2_reader_t *reader = (np_smb2_reader_t *)calloc(1, sizeof(*reader));
   if (reader == NULL) {
     np_set_err(err_buf, err_len, "Out of memory");
-    smb2_close(ctx, fh);
-    smb2_destroy_context(ctx);
+    np_shared_release(file, NP_RELEASE_OK);
     return (intptr_t)0;
   }
 
-  reader->ctx = ctx;
-  reader->fh = fh;
-  reader->size = st.smb2_size;
+  reader->file = file;
+  reader->size = np_shared_size(file);
+  reader->key = *np_shared_key(file);
+  np_ra_init(&reader->ra, 0);
+  if (flags & NP_SMB2_OPEN_PREFETCH_INDEX) {
+    np_index_prefetch_start(host, port, username, password, domain, path,
+                            &reader->key);
+  }
 
   *out_size = reader->size;
   return (intptr_t)reader;
 }
 
+// Copies from block `block` of the file onwards. A READ of the block already
+// in flight for another reader is joined; otherwise the whole block is
+// fetched when it can be cached, and just the requested `len` bytes when not.
+// Returns the bytes copied, 0 past the end of the data, or <0 on failure.
+static int np_reader_read_block(np_smb2_reader_t *reader, uint64_t block,
+                                uint32_t in_block, uint8_t *dst,
+                                uint32_t len, bool cached) {
+  const uint64_t offset = block * NP_CACHE_BLOCK_SIZE + in_block;
+  np_flight_t *flight = NULL;
+  int rc = np_shared_join(reader->file, block, &flight);
+  if (rc < 0) {
+    rc = cached ? np_shared_fetch(reader->file, block, true, &flight)
+                : np_shared_fetch_range(reader->file, offset, len, &flight);
+  }
+  if (rc < 0) {
+    return rc;
+  }
+  rc = np_shared_wait(reader->file, flight);
+  if (rc > 0) {
+    const uint32_t skip = (uint32_t)(offset - np_flight_offset(flight));
+    const uint32_t have = (uint32_t)rc > skip ? (uint32_t)rc - skip : 0;
+    if (len > have) {
+      len = have;
+    }
+    memcpy(dst, np_flight_data(flight) + skip, len);
+    rc = (int)len;
+  }
+  np_shared_put(reader->file, flight);
+  return rc;
+}
+
+// Serves the read block by block, from the cache where possible.
+static int np_reader_pread_blocks(np_smb2_reader_t *reader, uint64_t offset,
+                                  uint8_t *buf, uint32_t count) {
+  const bool cached = np_cache_enabled() && np_shared_cacheable(reader->file);
+  uint32_t done = 0;
+  while (done < count && offset < reader->size) {
+    const uint64_t block = offset / NP_CACHE_BLOCK_SIZE;
+    const uint32_t in_block = (uint32_t)(offset % NP_CACHE_BLOCK_SIZE);
+    int n = cached ? np_cache_read(&reader->key, block, in_block, buf + done,
+                                   count - done)
+                   : -ENOENT;
+    if (n < 0) {
+      n = np_reader_read_block(reader, block, in_block, buf + done,
+                               count - done, cached);
+      if (n < 0) {
+        return done > 0 ? (int)done : n;
+      }
+      if (n == 0) {
+        break;
+      }
+    }
+    done += (uint32_t)n;
+    offset += (uint64_t)n;
+  }
+  return (int)done;
+}
+
+static void np_reader_drop_ahead(np_smb2_reader_t *reader) {
+  np_smb2_stream_t *ahead = reader->ahead;
+  if (ahead == NULL || reader->broken) {
+    return;
+  }
+  np_stream_cancel(ahead);
+  np_stream_settle(ahead);
+  if (!np_stream_idle(ahead)) {
+    // READs still target its buffers; it is freed once the session is gone.
+    reader->broken = true;
+    return;
+  }
+  const enum np_release_mode mode = np_stream_detach(ahead);
+  if (mode == NP_RELEASE_DISCARD) {
+    reader->broken = true;
+  } else if (mode == NP_RELEASE_SUSPECT) {
+    reader->failed = true;
+  }
+  reader->ahead = NULL;
+  reader->ahead_len = 0;
+}
+
+// Hand the next chunk of the read-ahead stream to ahead_data, waiting unless
+// `wait` is false. Returns false (and drops the stream) at its end or on
+// failure.
+static bool np_reader_pull_ahead(np_smb2_reader_t *reader, bool wait) {
+  char err[256];
+  uint8_t *data = NULL;
+  const int n = wait ? np_stream_next(reader->ahead, &data, err, sizeof(err))
+                     : np_stream_poll(reader->ahead, &data, err, sizeof(err));
+  if (n == -EAGAIN) {
+    return true;
+  }
+  if (n <= 0) {
+    np_reader_drop_ahead(reader);
+    return false;
+  }
+  reader->ahead_data = data;
+  reader->ahead_len = (uint32_t)n;
+  return true;
+}
+
+// Copy what the read-ahead stream has for a read at its position.
+static uint32_t np_reader_take_ahead(np_smb2_reader_t *reader, uint8_t *buf,
+                                     uint32_t count) {
+  uint32_t done = 0;
+  while (done < count && reader->ahead != NULL) {
+    if (reader->ahead_len == 0) {
+      if (!np_reader_pull_ahead(reader, true)) {
+        break;
+      }
+      continue;
+    }
+    uint32_t n = count - done;
+    if (n > reader->ahead_len) {
+      n = reader->ahead_len;
+    }
+    memcpy(buf + done, reader->ahead_data, n);
+    reader->ahead_data += n;
+    reader->ahead_len -= n;
+    reader->ahead_pos += n;
+    done += n;
+  }
+  return done;
+}
+
+// Start READs where the access pattern says the next read will land: the
+// rest of the file for sequential reads, one more read a stride further on
+// for strided ones.
+static void np_reader_plan_ahead(np_smb2_reader_t *reader, uint32_t count) {
+  const np_ra_t *ra = &reader->ra;
+  if (reader->ahead != NULL || reader->broken || ra->window == 0) {
+    return;
+  }
+  uint64_t start;
+  uint64_t end;
+  uint32_t chunk;
+  int depth;
+  if (ra->pattern == NP_RA_SEQUENTIAL) {
+    start = ra->next;
+    end = 0;
+    chunk = 0;
+    depth = NP_READER_AHEAD_DEPTH;
+  } else if (ra->pattern == NP_RA_STRIDED) {
+    start = ra->last + ra->stride;
+    end = start + count;
+    chunk = count;
+    depth = 1;
+  } else {
+    return;
+  }
+  if (start >= reader->size) {
+    return;
+  }
+  reader->ahead =
+      np_stream_create_shared(reader->file, start, end, chunk, depth);
+  if (reader->ahead == NULL) {
+    return;
+  }
+  reader->ahead_pos = start;
+  reader->ahead_len = 0;
+  // Issues the READs; a chunk served from the cache may be ready at once.
+  np_reader_pull_ahead(reader, false);
+}
+
 FFI_PLUGIN_EXPORT int np_smb2_reader_pread(intptr_t reader_ptr,
                                           uint64_t offset, uint8_t *buf,
                                           uint32_t count, char *err_buf,
@@ -752,16 +1095,44 @@ FFI_PLUGIN_EXPORT int np_smb2_reader_pread(intptr_t reader_ptr,
     return -EINVAL;
   }
   np_smb2_reader_t *reader = (np_smb2_reader_t *)reader_ptr;
-  if (reader->ctx == NULL || reader->fh == NULL) {
+  if (reader->file == NULL) {
     np_set_err(err_buf, err_len, "Reader is closed");
     return -EINVAL;
   }
-  const int rc = smb2_pread(reader->ctx, reader->fh, buf, count, offset);
-  if (rc < 0) {
-    np_set_err(err_buf, err_len, "SMB read failed: %s",
-               smb2_get_error(reader->ctx));
+  if (reader->broken) {
+    np_set_err(err_buf, err_len, "SMB connection lost");
+    return -EIO;
   }
-  return rc;
+
+  uint32_t done = 0;
+  if (reader->ahead != NULL) {
+    if (offset == reader->ahead_pos) {
+      done = np_reader_take_ahead(reader, buf, count);
+    } else {
+      np_reader_drop_ahead(reader);
+    }
+  }
+  if (reader->broken) {
+    np_set_err(err_buf, err_len, "SMB connection lost");
+    return -EIO;
+  }
+
+  if (done < count && offset + done < reader->size) {
+    const int rc = np_reader_pread_blocks(reader, offset + done, buf + done,
+                                          count - done);
+    if (rc < 0 && done == 0) {
+      reader->failed = true;
+      np_shared_set_err(reader->file, err_buf, err_len, "SMB read failed");
+      return rc;
+    }
+    if (rc > 0) {
+      done += (uint32_t)rc;
+    }
+  }
+
+  np_ra_observe(&reader->ra, offset, done, 0);
+  np_reader_plan_ahead(reader, done);
+  return (int)done;
 }
 
 FFI_PLUGIN_EXPORT void np_smb2_reader_close(intptr_t reader_ptr) {
@@ -769,13 +1140,14 @@ FFI_PLUGIN_EXPORT void np_smb2_reader_close(intptr_t reader_ptr) {
     return;
   }
   np_smb2_reader_t *reader = (np_smb2_reader_t *)reader_ptr;
-  if (reader->ctx != NULL && reader->fh != NULL) {
-    smb2_close(reader->ctx, reader->fh);
-    reader->fh = NULL;
-  }
-  if (reader->ctx != NULL) {
-    smb2_destroy_context(reader->ctx);
-    reader->ctx = NULL;
-  }
+  np_reader_drop_ahead(reader);
+  if (reader->ahead != NULL) {
+    // The read-ahead only holds flights; the shared file settles them.
+    np_stream_detach(reader->ahead);
+  }
+  np_shared_release(reader->file,
+                    reader->broken ? NP_RELEASE_DISCARD
+                                   : (reader->failed ? NP_RELEASE_SUSPECT
+                                                     : NP_RELEASE_OK));
   free(reader);
 }
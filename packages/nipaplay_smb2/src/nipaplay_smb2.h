@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #if _WIN32
@@ -35,12 +36,21 @@ FFI_PLUGIN_EXPORT int np_smb2_stat(const char *host, int port,
                                   uint32_t *out_type, uint64_t *out_size,
                                   char *err_buf, int err_len);
 
-/// Open a file reader for streaming reads.
+/// Flags for np_smb2_reader_open().
+enum np_smb2_open_flags {
+  /// Locate the index of an MP4 (`moov`) or Matroska (Cues) file and pull it
+  /// into the block cache in the background, so the player's jump to it and
+  /// its first seeks are served locally. Needs np_smb2_cache_configure().
+  NP_SMB2_OPEN_PREFETCH_INDEX = 1,
+};
+
+/// Open a file reader for streaming reads. `flags` is a combination of
+/// np_smb2_open_flags.
 /// Returns a non-zero opaque handle on success; 0 on failure.
 FFI_PLUGIN_EXPORT intptr_t np_smb2_reader_open(
     const char *host, int port, const char *username, const char *password,
-    const char *domain, const char *path, uint64_t *out_size, char *err_buf,
-    int err_len);
+    const char *domain, const char *path, int flags, uint64_t *out_size,
+    char *err_buf, int err_len);
 
 /// Read bytes at `offset` into `buf`.
 /// Returns >=0 bytes read, or <0 on failure (negative errno-like).
@@ -51,6 +61,283 @@ FFI_PLUGIN_EXPORT int np_smb2_reader_pread(intptr_t reader, uint64_t offset,
 /// Close and free a reader handle.
 FFI_PLUGIN_EXPORT void np_smb2_reader_close(intptr_t reader);
 
+/// Open a pipelined sequential reader over `[start, end_exclusive)` of a file.
+///
+/// Up to `queue_depth` * `chunk_size` bytes are kept in flight, bounded by the
+/// credits the server granted. READs are whole 256 KiB blocks, shared with
+/// other readers and streams of the same file. `end_exclusive` of 0 (or past
+/// EOF) reads to the end of the file; `chunk_size`/`queue_depth` of 0 use the
+/// defaults (1 MiB, 8). Returns a non-zero opaque handle on success; 0 on
+/// failure.
+FFI_PLUGIN_EXPORT intptr_t np_smb2_stream_open(
+    const char *host, int port, const char *username, const char *password,
+    const char *domain, const char *path, uint64_t start,
+    uint64_t end_exclusive, uint32_t chunk_size, int queue_depth,
+    uint64_t *out_size, char *err_buf, int err_len);
+
+/// Wait for the next chunk in file order and point `*out_data` at it.
+/// The data stays valid until the next call or close.
+/// Returns >0 bytes, 0 at the end of the range, or <0 on failure.
+FFI_PLUGIN_EXPORT int np_smb2_stream_next(intptr_t stream, uint8_t **out_data,
+                                          char *err_buf, int err_len);
+
+/// Like np_smb2_stream_next(), but hands out a reference to the chunk's
+/// buffer: `*out_buf` stays valid after further calls and after close, until
+/// it is passed to np_smb2_buf_release().
+FFI_PLUGIN_EXPORT int np_smb2_stream_next_buf(intptr_t stream,
+                                              uint8_t **out_buf,
+                                              char *err_buf, int err_len);
+
+/// Close and free a stream handle.
+FFI_PLUGIN_EXPORT void np_smb2_stream_close(intptr_t stream);
+
+/// Get a pooled, refcounted buffer of at least `size` bytes (one reference).
+/// Returns NULL on allocation failure.
+FFI_PLUGIN_EXPORT uint8_t *np_smb2_buf_acquire(uint32_t size);
+
+/// Add a reference to a buffer from np_smb2_buf_acquire() or
+/// np_smb2_stream_next_buf().
+FFI_PLUGIN_EXPORT void np_smb2_buf_retain(void *buf);
+
+/// Drop a reference; the last one returns the buffer to the pool. The
+/// signature matches a Dart `NativeFinalizer` callback.
+FFI_PLUGIN_EXPORT void np_smb2_buf_release(void *buf);
+
+/// Free all idle pooled buffers.
+FFI_PLUGIN_EXPORT void np_smb2_buf_trim(void);
+
+/// Keep file blocks read from SMB in a persistent cache under `dir`, using at
+/// most `max_bytes` of disk. Readers, streams and the range server then serve
+/// second and later reads of a region locally. A cache left in `dir` by an
+/// earlier run is reused; an empty `dir` or a budget below one block (256 KiB)
+/// turns caching off. Returns 0 on success, <0 on failure (caching stays off).
+FFI_PLUGIN_EXPORT int np_smb2_cache_configure(const char *dir,
+                                              uint64_t max_bytes,
+                                              char *err_buf, int err_len);
+
+/// Drop every cached block.
+FFI_PLUGIN_EXPORT void np_smb2_cache_clear(void);
+
+/// Blocks served from the cache and blocks fetched into it since it was
+/// configured, plus bytes cached out of the budget. Any pointer may be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_cache_stats(uint64_t *out_hits,
+                                           uint64_t *out_misses,
+                                           uint64_t *out_used_bytes,
+                                           uint64_t *out_capacity_bytes);
+
+/// Size the read-ahead windows. Each reader and stream classifies its reads
+/// as sequential, strided or random: sequential access starts with
+/// `min_window` bytes requested ahead and doubles it on every further
+/// sequential read up to `max_window`; strided access prefetches the next
+/// read; random access reads nothing ahead. 0 restores the defaults (128 KiB
+/// and 16 MiB). Request sizes also follow the window, up to the server's
+/// maximum read size.
+FFI_PLUGIN_EXPORT void np_smb2_readahead_configure(uint32_t min_window,
+                                                   uint32_t max_window);
+
+/// Reads classified by pattern, plus bytes requested ahead and how many of
+/// them were consumed before their handle closed. Any pointer may be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_readahead_stats(uint64_t *out_sequential,
+                                               uint64_t *out_strided,
+                                               uint64_t *out_random,
+                                               uint64_t *out_prefetched_bytes,
+                                               uint64_t *out_used_bytes);
+
+/// Readers and streams of the same file share one open handle, and blocks
+/// they need at the same time are read once. Reports handles opened, opens
+/// that joined a handle already open, READs issued and block requests that
+/// joined a READ already in flight. Any pointer may be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_shared_stats(uint64_t *out_opens,
+                                            uint64_t *out_reused_opens,
+                                            uint64_t *out_reads,
+                                            uint64_t *out_joined_reads);
+
+/// When the connection under an open file is lost, the file is reopened on a
+/// new session (reclaiming its SMB 3.x durable handle if the server kept it)
+/// and the READs in flight are issued again. Reports reconnects, those that
+/// failed, those that reclaimed a durable handle, READs issued again, and the
+/// total and longest time spent reconnecting in milliseconds. Any pointer may
+/// be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_reconnect_stats(uint64_t *out_reconnects,
+                                               uint64_t *out_failed,
+                                               uint64_t *out_reclaimed,
+                                               uint64_t *out_replayed_reads,
+                                               uint64_t *out_total_ms,
+                                               uint64_t *out_max_ms);
+
+/// Open files ask for a read and handle caching lease. While it holds, their
+/// cached blocks and size are used without asking the server, and a stat of
+/// the path is answered from the open file; a break of read caching drops
+/// the file's blocks from the cache. Reports leases granted, breaks, blocks
+/// dropped and stats answered. Any pointer may be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_lease_stats(uint64_t *out_grants,
+                                           uint64_t *out_breaks,
+                                           uint64_t *out_invalidated_blocks,
+                                           uint64_t *out_stat_hits);
+
+/// Read open files over up to `max_channels` connections, bound to the same
+/// session with SMB 3.x multichannel on servers that support it, preferring
+/// the addresses they advertise on fast interfaces. READs go to the
+/// connection with the fewest in flight, and those of a connection that
+/// fails are issued again on the others. 1 turns it off; values <= 0 restore
+/// the default (2), the most is 4. Applies to files opened afterwards.
+FFI_PLUGIN_EXPORT void np_smb2_multichannel_configure(int max_channels);
+
+/// Channels bound, binds that failed, READs issued on a channel rather than
+/// the session's own connection, and channels lost. Any pointer may be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_multichannel_stats(uint64_t *out_bound,
+                                                  uint64_t *out_failed_binds,
+                                                  uint64_t *out_striped_reads,
+                                                  uint64_t *out_lost);
+
+/// Hedge the READs of open files read over more than one connection: a READ
+/// still outstanding after the `percentile` of the latest READ latencies of
+/// its file is issued again on another connection, and whichever lands
+/// first is used. <= 0 turns it off (the default); values are kept within
+/// 50..99.
+FFI_PLUGIN_EXPORT void np_smb2_hedge_configure(int percentile);
+
+/// READs hedged, hedges that landed first, hedges cancelled because the
+/// READ landed first, and the delay before hedging last used (ms). Any
+/// pointer may be NULL.
+FFI_PLUGIN_EXPORT void np_smb2_hedge_stats(uint64_t *out_hedged_reads,
+                                           uint64_t *out_won,
+                                           uint64_t *out_wasted,
+                                           uint64_t *out_delay_ms);
+
+/// Start the loopback HTTP/1.1 range server on 127.0.0.1:`port` (0 picks a
+/// free port). It serves `GET`/`HEAD /smb/stream?conn=<name>&path=<path>` for
+/// connections registered with np_smb2_http_set_connection(), plus
+/// `/smb/health`. A `GET` from the start of a file also starts the index
+/// prefetch of NP_SMB2_OPEN_PREFETCH_INDEX. Returns the bound port (>0), or
+/// <0 on failure.
+FFI_PLUGIN_EXPORT int np_smb2_http_start(int port, char *err_buf, int err_len);
+
+/// Stop accepting connections. Responses in progress run to completion.
+FFI_PLUGIN_EXPORT void np_smb2_http_stop(void);
+
+/// Register or update the SMB connection served as `conn=<name>`.
+/// Returns 0 on success, <0 on failure (negative errno-like).
+FFI_PLUGIN_EXPORT int np_smb2_http_set_connection(const char *name,
+                                                  const char *host, int port,
+                                                  const char *username,
+                                                  const char *password,
+                                                  const char *domain);
+
+/// Forget the SMB connection registered as `name`.
+FFI_PLUGIN_EXPORT void np_smb2_http_remove_connection(const char *name);
+
+/// Lease a pooled, authenticated session with `share` tree-connected, e.g. to
+/// keep a connection warm. Returns a non-zero opaque handle on success; 0 on
+/// failure.
+FFI_PLUGIN_EXPORT intptr_t np_smb2_pool_acquire(const char *host, int port,
+                                                const char *username,
+                                                const char *password,
+                                                const char *domain,
+                                                const char *share,
+                                                char *err_buf, int err_len);
+
+/// Return a leased session to the pool. Non-zero `discard` closes it instead.
+FFI_PLUGIN_EXPORT void np_smb2_pool_release(intptr_t session, int discard);
+
+/// Close pooled sessions that stay idle longer than `idle_timeout_ms`.
+/// Values <= 0 restore the default (60s).
+FFI_PLUGIN_EXPORT void np_smb2_pool_set_idle_timeout(int idle_timeout_ms);
+
+/// Close all idle pooled sessions. Sessions currently leased are unaffected.
+FFI_PLUGIN_EXPORT void np_smb2_pool_clear(void);
+
+/// Non-zero `enabled` makes blocking calls wait for replies on a per-thread
+/// io_uring instead of poll(), where the kernel supports it (Linux only).
+/// Off by default: it makes fewer syscalls with many sessions per thread,
+/// but measured slower than poll() for a single session.
+FFI_PLUGIN_EXPORT void np_smb2_set_io_uring(int enabled);
+
+/// What the second element of a posted completion means; negative values
+/// are errors (negative errno-like) and the third element is the message.
+enum np_smb2_async_event {
+  /// The final result: `[id, 0, ...result]`.
+  NP_SMB2_ASYNC_DONE = 0,
+  /// A stream chunk: `[id, 1, buffer address, length]`. The buffer holds a
+  /// reference owned by the receiver; drop it with np_smb2_buf_release().
+  NP_SMB2_ASYNC_CHUNK = 1,
+  /// A stream is open: `[id, 2, file size]`.
+  NP_SMB2_ASYNC_OPENED = 2,
+};
+
+/// Start the reactor thread that runs the np_smb2_async_* operations on all
+/// sessions at once. `post_cobject` is Dart's `NativeApi.postCObject`;
+/// completions are posted to the port given with each request as
+/// `[request_id, event, ...]` lists (see np_smb2_async_event). Returns 0 on
+/// success (also if already running), or <0 if the platform has no reactor;
+/// use the blocking calls from a worker isolate then.
+///
+/// Requests queue per server (host and port): only a few of them connect or
+/// wait on the same server at once, and a slow server never delays another.
+/// Every request takes an optional `timeout_ms` (<= 0: none), after which it
+/// fails with -ETIMEDOUT, and an optional cancel token (0: none), which fails
+/// it with -ECANCELED.
+FFI_PLUGIN_EXPORT int np_smb2_reactor_start(
+    bool (*post_cobject)(int64_t port, void *message));
+
+/// Set how many requests per server may be in flight at once; streams count
+/// until they are open. Values <= 0 restore the default (4).
+FFI_PLUGIN_EXPORT void np_smb2_reactor_set_host_concurrency(int max_requests);
+
+/// Create a cancel token to pass to any number of np_smb2_async_* requests.
+/// Returns 0 on allocation failure or where the reactor is unavailable.
+FFI_PLUGIN_EXPORT intptr_t np_smb2_cancel_token_new(void);
+
+/// Fail the token's requests, current and future, with -ECANCELED.
+FFI_PLUGIN_EXPORT void np_smb2_cancel_token_cancel(intptr_t token);
+
+/// Drop the caller's reference. Requests using the token are unaffected.
+FFI_PLUGIN_EXPORT void np_smb2_cancel_token_free(intptr_t token);
+
+/// Like np_smb2_list_entries_json(), posting `[id, 0, json]` or an error.
+/// Returns 0 once queued; <0 (nothing is posted) if the reactor is not
+/// running.
+FFI_PLUGIN_EXPORT int np_smb2_async_list(int64_t reply_port,
+                                         int64_t request_id, const char *host,
+                                         int port, const char *username,
+                                         const char *password,
+                                         const char *domain, const char *path,
+                                         int timeout_ms,
+                                         intptr_t cancel_token);
+
+/// Like np_smb2_stat(), posting `[id, 0, type, size]` or an error.
+FFI_PLUGIN_EXPORT int np_smb2_async_stat(int64_t reply_port,
+                                         int64_t request_id, const char *host,
+                                         int port, const char *username,
+                                         const char *password,
+                                         const char *domain, const char *path,
+                                         int timeout_ms,
+                                         intptr_t cancel_token);
+
+/// Like np_smb2_stream_open(), but chunks are posted as they arrive, after an
+/// `OPENED` message and followed by `[id, 0]` or an error. Each chunk uses
+/// one of the stream's credits, starting with `credits`; more are granted
+/// with np_smb2_async_stream_request(). `timeout_ms` bounds opening the
+/// stream; cancelling ends it like an error. Returns a handle that stays
+/// valid until np_smb2_async_stream_close(), or 0 if the reactor is not
+/// running.
+FFI_PLUGIN_EXPORT intptr_t np_smb2_async_stream_open(
+    int64_t reply_port, int64_t request_id, const char *host, int port,
+    const char *username, const char *password, const char *domain,
+    const char *path, uint64_t start, uint64_t end_exclusive,
+    uint32_t chunk_size, int queue_depth, int credits, int timeout_ms,
+    intptr_t cancel_token);
+
+/// Allow `chunks` more chunks to be posted.
+FFI_PLUGIN_EXPORT void np_smb2_async_stream_request(intptr_t stream,
+                                                    int chunks);
+
+/// Stop the stream and invalidate the handle. Chunks posted before the
+/// reactor saw the close may still arrive and must be released; nothing is
+/// posted after that. Outstanding READs and the CLOSE finish in the
+/// background.
+FFI_PLUGIN_EXPORT void np_smb2_async_stream_close(intptr_t stream);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
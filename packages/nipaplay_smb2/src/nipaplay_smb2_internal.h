@@ -0,0 +1,492 @@
+#pragma once
+
+// Helpers shared between the nipaplay_smb2 translation units. Nothing in here
+// is part of the FFI surface; see nipaplay_smb2.h for the exported API.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) || defined(_WINDOWS)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+struct smb2_context;
+struct smb2dir;
+struct smb2fh;
+struct smb2_stat_64;
+struct srvsvc_NetrShareEnum_rep;
+struct smb2_oplock_or_lease_break_reply;
+struct np_smb2_session;
+
+// ---------------------------------------------------------------------------
+// Locking
+// ---------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WINDOWS)
+typedef SRWLOCK np_mutex_t;
+#define NP_MUTEX_INIT SRWLOCK_INIT
+static inline void np_mutex_lock(np_mutex_t *m) { AcquireSRWLockExclusive(m); }
+static inline void np_mutex_unlock(np_mutex_t *m) {
+  ReleaseSRWLockExclusive(m);
+}
+#else
+typedef pthread_mutex_t np_mutex_t;
+#define NP_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+static inline void np_mutex_lock(np_mutex_t *m) { pthread_mutex_lock(m); }
+static inline void np_mutex_unlock(np_mutex_t *m) { pthread_mutex_unlock(m); }
+#endif
+
+#if defined(_WIN32) || defined(_WINDOWS)
+typedef CONDITION_VARIABLE np_cond_t;
+#define NP_COND_INIT CONDITION_VARIABLE_INIT
+static inline void np_cond_wait(np_cond_t *c, np_mutex_t *m) {
+  SleepConditionVariableSRW(c, m, INFINITE, 0);
+}
+static inline void np_cond_broadcast(np_cond_t *c) {
+  WakeAllConditionVariable(c);
+}
+#else
+typedef pthread_cond_t np_cond_t;
+#define NP_COND_INIT PTHREAD_COND_INITIALIZER
+static inline void np_cond_wait(np_cond_t *c, np_mutex_t *m) {
+  pthread_cond_wait(c, m);
+}
+static inline void np_cond_broadcast(np_cond_t *c) {
+  pthread_cond_broadcast(c);
+}
+#endif
+
+#if defined(_WIN32) || defined(_WINDOWS)
+static inline int32_t np_atomic_inc(volatile int32_t *v) {
+  return (int32_t)InterlockedIncrement((volatile LONG *)v);
+}
+static inline int32_t np_atomic_dec(volatile int32_t *v) {
+  return (int32_t)InterlockedDecrement((volatile LONG *)v);
+}
+#else
+static inline int32_t np_atomic_inc(volatile int32_t *v) {
+  return __atomic_add_fetch(v, 1, __ATOMIC_ACQ_REL);
+}
+static inline int32_t np_atomic_dec(volatile int32_t *v) {
+  return __atomic_sub_fetch(v, 1, __ATOMIC_ACQ_REL);
+}
+#endif
+
+/// Monotonic clock in milliseconds.
+uint64_t np_now_ms(void);
+void np_sleep_ms(uint32_t ms);
+
+// ---------------------------------------------------------------------------
+// Threads
+// ---------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WINDOWS)
+typedef HANDLE np_thread_t;
+#else
+typedef pthread_t np_thread_t;
+#endif
+
+typedef void (*np_thread_fn)(void *arg);
+
+/// Run `fn(arg)` on a new thread. With `out` == NULL the thread is detached.
+/// Returns 0 on success, <0 on failure.
+int np_thread_start(np_thread_t *out, np_thread_fn fn, void *arg);
+void np_thread_join(np_thread_t thread);
+
+// ---------------------------------------------------------------------------
+// Block cache (np_smb2_cache.c)
+// ---------------------------------------------------------------------------
+
+// Files are cached in aligned blocks of this size; only whole blocks (or the
+// last block of a file) are stored.
+#define NP_CACHE_BLOCK_SIZE (256 * 1024)
+
+/// Identifies one version of a file: server, share, path, file id, mtime and
+/// size.
+typedef struct np_cache_key {
+  uint64_t hi;
+  uint64_t lo;
+} np_cache_key_t;
+
+void np_cache_key_init(np_cache_key_t *key, const char *host, int port,
+                       const char *share, const char *inner_path,
+                       const struct smb2_stat_64 *st);
+
+/// Copy up to `len` bytes from `offset` within a cached block. Returns the
+/// bytes copied, or -ENOENT if the block is not cached (or the cache is off).
+int np_cache_read(const np_cache_key_t *key, uint64_t block, uint32_t offset,
+                  uint8_t *dst, uint32_t len);
+
+/// Cache a block fetched from the server, evicting the least recently used.
+void np_cache_store(const np_cache_key_t *key, uint64_t block,
+                    const uint8_t *data, uint32_t len);
+
+/// Drop the cached blocks `first` to `first + count - 1` of a file, e.g. once
+/// it may have changed. Returns the number of blocks dropped.
+uint32_t np_cache_invalidate(const np_cache_key_t *key, uint64_t first,
+                             uint64_t count);
+
+bool np_cache_enabled(void);
+
+// ---------------------------------------------------------------------------
+// Read-ahead (np_smb2_readahead.c)
+// ---------------------------------------------------------------------------
+
+enum np_ra_pattern {
+  NP_RA_RANDOM = 0,
+  NP_RA_SEQUENTIAL,
+  // Equal jumps forward, e.g. sampling frames across a file.
+  NP_RA_STRIDED,
+};
+
+/// Per-handle access history.
+typedef struct np_ra {
+  // Start and end of the previous read.
+  uint64_t last;
+  uint64_t next;
+  // Distance between the starts of the previous two reads; 0 if unknown.
+  uint64_t stride;
+  int pattern;
+  // Bytes to keep requested ahead of the reader; 0 for none.
+  uint64_t window;
+} np_ra_t;
+
+/// Start a history where a read at `start` counts as sequential, with the
+/// minimum window.
+void np_ra_init(np_ra_t *ra, uint64_t start);
+
+/// Classify a read of `len` bytes at `offset` and resize the window: it
+/// starts at the minimum and doubles with every sequential read up to
+/// `limit` (and the configured maximum), covers one read for strided access
+/// and drops to 0 otherwise. Returns the pattern.
+int np_ra_observe(np_ra_t *ra, uint64_t offset, uint32_t len, uint64_t limit);
+
+/// Record bytes requested ahead and how many of them were consumed.
+void np_ra_account(uint64_t prefetched, uint64_t used);
+
+// ---------------------------------------------------------------------------
+// Common helpers (nipaplay_smb2.c)
+// ---------------------------------------------------------------------------
+
+void np_set_err(char *err_buf, int err_len, const char *fmt, ...);
+bool np_is_empty(const char *s);
+char *np_strdup_or_empty(const char *s);
+char *np_normalize_path(const char *raw);
+int np_build_server(const char *host, int port, char *out, size_t out_len);
+int np_parse_share_and_path(const char *normalized_path, char *share_out,
+                            size_t share_len, char *path_out,
+                            size_t path_len);
+void np_apply_credentials(struct smb2_context *ctx, const char *username,
+                          const char *password, const char *domain);
+
+/// Durable handle of a file opened by np_open_file(). On SMB 3.x the server
+/// keeps such a handle open for a while after the connection is lost, and a
+/// new session can reclaim it by `guid` and `file_id`.
+typedef struct np_durable {
+  uint8_t guid[16];
+  uint8_t file_id[16];
+  // The server granted a durable handle. When set on input, the handle is
+  // reclaimed rather than opened anew, if the server still has it.
+  bool durable;
+  // Out: the handle was reclaimed.
+  bool reclaimed;
+  // The lease state (SMB2_LEASE_*_CACHING) to ask for under `lease_key`, or
+  // 0 for none. Breaks go to np_lease_break_cb().
+  uint32_t lease_want;
+  uint8_t lease_key[16];
+  // Out: the lease state granted, 0 if the server grants no leases.
+  uint32_t lease_state;
+} np_durable_t;
+
+/// Fill `id` with 16 bytes unique among this client's create guids and lease
+/// keys.
+void np_new_id(uint8_t id[16]);
+
+/// Lease a pooled session for the share in `path` and open the file read-only.
+/// Returns 0 on success, <0 on failure (negative errno-like). On success the
+/// caller owns `*out_fh` and the lease in `*out_session`; `out_key`, if not
+/// NULL, receives the file's block cache key. With `durable` the handle is
+/// asked to be durable, see np_durable_t.
+int np_open_file(const char *host, int port, const char *username,
+                 const char *password, const char *domain, const char *path,
+                 np_durable_t *durable, struct np_smb2_session **out_session,
+                 struct smb2fh **out_fh, uint64_t *out_size,
+                 np_cache_key_t *out_key, char *err_buf, int err_len);
+
+/// Entry lists in the format returned by np_smb2_list_entries_json().
+/// Both return a malloc-allocated string, or NULL when out of memory.
+char *np_shares_json(const struct srvsvc_NetrShareEnum_rep *rep);
+char *np_dir_json(struct smb2_context *ctx, struct smb2dir *dir,
+                  const char *share, const char *inner_path);
+
+/// Service `ctx` until `*done` becomes non-zero.
+/// Returns 0 on success, <0 if polling or servicing the socket failed.
+int np_run_until_done(struct smb2_context *ctx, volatile int *done);
+
+// ---------------------------------------------------------------------------
+// Session pool (np_smb2_pool.c)
+// ---------------------------------------------------------------------------
+
+#define NP_SESSION_MAX_TREES 16
+
+typedef struct np_smb2_tree {
+  char share[256];
+  uint32_t tree_id;
+} np_smb2_tree_t;
+
+/// A pooled, authenticated SMB session. While leased, `ctx` belongs to the
+/// caller exclusively and has the tree for the requested share selected.
+typedef struct np_smb2_session {
+  struct np_smb2_session *next;
+  struct smb2_context *ctx;
+
+  char *host;
+  int port;
+  char *username;
+  char *password;
+  char *domain;
+
+  np_smb2_tree_t trees[NP_SESSION_MAX_TREES];
+  int ntrees;
+
+  bool in_use;
+  bool suspect;
+  uint64_t last_used_ms;
+} np_smb2_session_t;
+
+enum np_release_mode {
+  // The session is healthy and can be handed out again as-is.
+  NP_RELEASE_OK = 0,
+  // An operation failed; verify the session with an echo before reusing it.
+  NP_RELEASE_SUSPECT = 1,
+  // The session is unusable; destroy it.
+  NP_RELEASE_DISCARD = 2,
+};
+
+/// Lease a session for host/port/user/domain with `share` tree-connected and
+/// selected. `share` may be "IPC$". Returns NULL, with the error in `*out_rc`
+/// (if not NULL), and fills `err_buf` on error.
+np_smb2_session_t *np_pool_acquire(const char *host, int port,
+                                   const char *username, const char *password,
+                                   const char *domain, const char *share,
+                                   int *out_rc, char *err_buf, int err_len);
+
+/// Return a leased session to the pool.
+void np_pool_release(np_smb2_session_t *session, enum np_release_mode mode);
+
+/// Host names and share names are case-insensitive in SMB.
+bool np_strcaseeq(const char *a, const char *b);
+/// The port sessions are keyed by: 445 unless `port` is a valid other one.
+int np_normalize_port(int port);
+
+// The steps of np_pool_acquire(), for callers that drive the I/O themselves
+// (np_smb2_reactor.c) instead of blocking in np_run_until_done().
+
+/// Lease an idle session for the key without any I/O, preferring one that
+/// already has `share` tree-connected. `*out_check` is set when the session
+/// must be verified with an ECHO first. Returns NULL if none is idle.
+np_smb2_session_t *np_pool_take_idle(const char *host, int port,
+                                     const char *username,
+                                     const char *password, const char *domain,
+                                     const char *share, bool *out_check);
+
+/// Allocate a leased, not yet connected session. Once connected, hand it to
+/// np_pool_insert(); on failure np_pool_release(..., NP_RELEASE_DISCARD).
+np_smb2_session_t *np_session_new(const char *host, int port,
+                                  const char *username, const char *password,
+                                  const char *domain, char *err_buf,
+                                  int err_len);
+void np_pool_insert(np_smb2_session_t *session);
+
+/// Select the tree for `share`. Returns -ENOENT if it is not connected yet and
+/// -EIO if the session is unusable.
+int np_session_select_tree(np_smb2_session_t *s, const char *share);
+
+/// Queue a TREE_CONNECT for `share`; `cb` gets the NT status. On success call
+/// np_session_add_tree() to remember (and keep selected) the new tree.
+int np_session_tree_connect_async(np_smb2_session_t *s, const char *share,
+                                  void (*cb)(struct smb2_context *smb2,
+                                             int status, void *command_data,
+                                             void *cb_data),
+                                  void *cb_data);
+void np_session_add_tree(np_smb2_session_t *s, const char *share);
+
+// ---------------------------------------------------------------------------
+// Shared open files (np_smb2_shared.c)
+// ---------------------------------------------------------------------------
+
+/// One open handle per file and credentials, shared by every reader of it.
+/// Concurrent requests for the same block join one READ (a "flight").
+typedef struct np_shared_file np_shared_file_t;
+typedef struct np_flight np_flight_t;
+
+/// Take a reference to the open file at `path`, opening it if no live handle
+/// exists. Returns 0 on success, <0 on failure (negative errno-like).
+int np_shared_open(const char *host, int port, const char *username,
+                   const char *password, const char *domain, const char *path,
+                   np_shared_file_t **out, char *err_buf, int err_len);
+
+/// Drop a reference; `mode` reports how the caller's reads went. The last one
+/// closes the file and releases the session.
+void np_shared_release(np_shared_file_t *file, enum np_release_mode mode);
+
+uint64_t np_shared_size(const np_shared_file_t *file);
+const np_cache_key_t *np_shared_key(const np_shared_file_t *file);
+
+/// Whether the file's blocks may be served from and stored into the block
+/// cache: until its read-caching lease is broken, or for good if the server
+/// granted none. Picks up lease breaks waiting on the session first.
+bool np_shared_cacheable(np_shared_file_t *file);
+
+/// Answer a stat of `path` from a file open with a read-caching lease that
+/// still holds. Returns false if there is none.
+bool np_shared_lease_stat(const char *host, int port, const char *username,
+                          const char *password, const char *domain,
+                          const char *path, uint64_t *out_size);
+
+/// libsmb2 oplock or lease break callback of sessions with leased files.
+/// Runs on whichever thread services the session.
+void np_lease_break_cb(struct smb2_context *smb2, int status,
+                       struct smb2_oplock_or_lease_break_reply *rep,
+                       uint8_t *new_oplock_level, uint32_t *new_lease_state);
+
+/// Take a reference to the flight for `block`, issuing its READ if none is in
+/// flight. Short of credits, waits for them with `wait`, or returns -EAGAIN.
+int np_shared_fetch(np_shared_file_t *file, uint64_t block, bool wait,
+                    np_flight_t **out);
+
+/// Like np_shared_fetch(), but only joins a flight already there. Returns
+/// -ENOENT if there is none.
+int np_shared_join(np_shared_file_t *file, uint64_t block,
+                   np_flight_t **out);
+
+/// Issue a READ of `[offset, offset + len)` that nobody joins, waiting for
+/// credits. Used where a whole block would waste bandwidth.
+int np_shared_fetch_range(np_shared_file_t *file, uint64_t offset,
+                          uint32_t len, np_flight_t **out);
+
+/// The bytes read once the flight landed, <0 if its READ failed, or -EAGAIN.
+int np_shared_poll(np_shared_file_t *file, np_flight_t *flight);
+
+/// Like np_shared_poll(), but services the session (or waits for the holder
+/// that does) until the flight lands. Never returns -EAGAIN.
+int np_shared_wait(np_shared_file_t *file, np_flight_t *flight);
+
+/// The flight's data, which starts at np_flight_offset() in the file; valid
+/// once landed, until np_shared_put().
+const uint8_t *np_flight_data(const np_flight_t *flight);
+uint64_t np_flight_offset(const np_flight_t *flight);
+
+/// Drop a reference to a flight; the last one cancels its READ if needed.
+void np_shared_put(np_shared_file_t *file, np_flight_t *flight);
+
+/// Batch the READs issued in between into as few writes as possible.
+void np_shared_cork(np_shared_file_t *file);
+void np_shared_uncork(np_shared_file_t *file);
+
+/// Format "`what`: <last session error>" into `err_buf`.
+void np_shared_set_err(np_shared_file_t *file, char *err_buf, int err_len,
+                       const char *what);
+
+// ---------------------------------------------------------------------------
+// Pipelined reads (np_smb2_stream.c)
+// ---------------------------------------------------------------------------
+
+typedef struct np_smb2_stream np_smb2_stream_t;
+
+/// Start pipelined reads of `[start, end_exclusive)` on an open file. Takes
+/// ownership of `session` and `fh` even on failure (returns NULL). With a
+/// `cache_key`, reads go through the block cache.
+np_smb2_stream_t *np_stream_attach(np_smb2_session_t *session,
+                                   struct smb2fh *fh, uint64_t size,
+                                   uint64_t start, uint64_t end_exclusive,
+                                   uint32_t chunk_size, int queue_depth,
+                                   const np_cache_key_t *cache_key,
+                                   char *err_buf, int err_len);
+
+/// Like np_stream_attach(), reading through a shared open file: its READs are
+/// whole blocks joined with those of other readers. Takes ownership of the
+/// reference to `file` even on failure (returns NULL).
+np_smb2_stream_t *np_stream_attach_shared(np_shared_file_t *file,
+                                          uint64_t start,
+                                          uint64_t end_exclusive,
+                                          uint32_t chunk_size, int queue_depth,
+                                          char *err_buf, int err_len);
+
+/// See np_smb2_stream_next().
+int np_stream_next(np_smb2_stream_t *stream, uint8_t **out_data,
+                   char *err_buf, int err_len);
+
+/// Drain outstanding READs, close the file and release the session (or the
+/// reference to a shared file).
+void np_stream_close(np_smb2_stream_t *stream);
+
+// Non-blocking variants for callers that service the context themselves.
+
+/// Like np_stream_attach() without issuing READs yet, and the caller keeps
+/// `session` and `fh` if it fails (returns NULL on allocation failure).
+np_smb2_stream_t *np_stream_create(np_smb2_session_t *session,
+                                   struct smb2fh *fh, uint64_t size,
+                                   uint64_t start, uint64_t end_exclusive,
+                                   uint32_t chunk_size, int queue_depth,
+                                   const np_cache_key_t *cache_key);
+
+/// Like np_stream_create() for a shared open file. The stream borrows the
+/// reference; free it with np_stream_detach().
+np_smb2_stream_t *np_stream_create_shared(np_shared_file_t *file,
+                                          uint64_t start,
+                                          uint64_t end_exclusive,
+                                          uint32_t chunk_size,
+                                          int queue_depth);
+
+/// Like np_stream_next(), but returns -EAGAIN instead of waiting when the
+/// next chunk has not arrived yet.
+int np_stream_poll(np_smb2_stream_t *stream, uint8_t **out_data,
+                   char *err_buf, int err_len);
+
+/// True once no READ is outstanding, i.e. np_stream_detach() is safe.
+bool np_stream_idle(const np_smb2_stream_t *stream);
+
+/// Wait for outstanding READs. Stops early if servicing the socket fails, in
+/// which case the stream stays busy until the session is discarded.
+void np_stream_settle(np_smb2_stream_t *stream);
+
+/// Cancel the outstanding READs; their buffers are not written any more. A
+/// READ whose reply is being decrypted still has to be settled.
+void np_stream_cancel(np_smb2_stream_t *stream);
+
+/// Mark the session unusable, e.g. after servicing its socket failed.
+void np_stream_set_broken(np_smb2_stream_t *stream);
+
+/// Free the stream but leave the file and session to the caller. Returns how
+/// the session should be released.
+enum np_release_mode np_stream_detach(np_smb2_stream_t *stream);
+
+// ---------------------------------------------------------------------------
+// Container index prefetch (np_smb2_index.c)
+// ---------------------------------------------------------------------------
+
+/// Locate the index of the MP4 or Matroska file at `path` and pull it into
+/// the block cache on a background thread with a session of its own. `key`
+/// identifies the file (see np_open_file()); a file already being prefetched
+/// is skipped, as is everything while the cache is off. Returns 0 if started
+/// or skipped, <0 on failure.
+int np_index_prefetch_start(const char *host, int port, const char *username,
+                            const char *password, const char *domain,
+                            const char *path, const np_cache_key_t *key);
+
+// ---------------------------------------------------------------------------
+// Refcounted buffers (np_smb2_buf.c)
+// ---------------------------------------------------------------------------
+
+/// Allocate a buffer of at least `size` bytes with one reference, reusing a
+/// pooled one when possible. Returns NULL on allocation failure.
+uint8_t *np_buf_acquire(uint32_t size);
+void np_buf_retain(uint8_t *data);
+/// Drop a reference; the last one returns the buffer to the pool.
+void np_buf_release(uint8_t *data);
+/// True if someone other than the caller holds a reference.
+bool np_buf_is_shared(const uint8_t *data);
@@ -0,0 +1,138 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Size classes are powers of two from 64 KiB (one SMB2 credit) to 8 MiB (the
+// largest READ servers negotiate); bigger requests bypass the pool.
+#define NP_BUF_MIN_SHIFT 16
+#define NP_BUF_NUM_CLASSES 8
+// Free buffers kept per class and in total.
+#define NP_BUF_MAX_FREE_PER_CLASS 16
+#define NP_BUF_MAX_FREE_BYTES (64u * 1024 * 1024)
+
+// Lives directly in front of the data, padded to a cache line so the
+// refcount never shares one with payload bytes.
+typedef union np_buf_hdr {
+  struct {
+    union np_buf_hdr *next;
+    uint32_t capacity;
+    int32_t cls;
+    volatile int32_t refs;
+  } h;
+  uint8_t pad[64];
+} np_buf_hdr_t;
+
+static np_mutex_t g_buf_lock = NP_MUTEX_INIT;
+static np_buf_hdr_t *g_buf_free[NP_BUF_NUM_CLASSES];
+static int g_buf_free_count[NP_BUF_NUM_CLASSES];
+static size_t g_buf_free_bytes = 0;
+
+static np_buf_hdr_t *np_buf_hdr(const uint8_t *data) {
+  return (np_buf_hdr_t *)(data - sizeof(np_buf_hdr_t));
+}
+
+static int np_buf_class(uint32_t size) {
+  for (int cls = 0; cls < NP_BUF_NUM_CLASSES; cls++) {
+    if (size <= (1u << (NP_BUF_MIN_SHIFT + cls))) {
+      return cls;
+    }
+  }
+  return -1;
+}
+
+uint8_t *np_buf_acquire(uint32_t size) {
+  const int cls = np_buf_class(size);
+  np_buf_hdr_t *hdr = NULL;
+
+  if (cls >= 0) {
+    np_mutex_lock(&g_buf_lock);
+    hdr = g_buf_free[cls];
+    if (hdr != NULL) {
+      g_buf_free[cls] = hdr->h.next;
+      g_buf_free_count[cls]--;
+      g_buf_free_bytes -= hdr->h.capacity;
+    }
+    np_mutex_unlock(&g_buf_lock);
+  }
+
+  if (hdr == NULL) {
+    const uint32_t capacity =
+        cls >= 0 ? (1u << (NP_BUF_MIN_SHIFT + cls)) : size;
+    hdr = (np_buf_hdr_t *)malloc(sizeof(np_buf_hdr_t) + capacity);
+    if (hdr == NULL) {
+      return NULL;
+    }
+    hdr->h.capacity = capacity;
+    hdr->h.cls = cls;
+  }
+
+  hdr->h.next = NULL;
+  hdr->h.refs = 1;
+  return (uint8_t *)(hdr + 1);
+}
+
+void np_buf_retain(uint8_t *data) { np_atomic_inc(&np_buf_hdr(data)->h.refs); }
+
+void np_buf_release(uint8_t *data) {
+  if (data == NULL) {
+    return;
+  }
+  np_buf_hdr_t *hdr = np_buf_hdr(data);
+  if (np_atomic_dec(&hdr->h.refs) != 0) {
+    return;
+  }
+
+  const int cls = hdr->h.cls;
+  if (cls >= 0) {
+    np_mutex_lock(&g_buf_lock);
+    if (g_buf_free_count[cls] < NP_BUF_MAX_FREE_PER_CLASS &&
+        g_buf_free_bytes + hdr->h.capacity <= NP_BUF_MAX_FREE_BYTES) {
+      hdr->h.next = g_buf_free[cls];
+      g_buf_free[cls] = hdr;
+      g_buf_free_count[cls]++;
+      g_buf_free_bytes += hdr->h.capacity;
+      hdr = NULL;
+    }
+    np_mutex_unlock(&g_buf_lock);
+  }
+  free(hdr);
+}
+
+bool np_buf_is_shared(const uint8_t *data) {
+  return np_buf_hdr(data)->h.refs > 1;
+}
+
+FFI_PLUGIN_EXPORT uint8_t *np_smb2_buf_acquire(uint32_t size) {
+  return np_buf_acquire(size);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_buf_retain(void *data) {
+  if (data != NULL) {
+    np_buf_retain((uint8_t *)data);
+  }
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_buf_release(void *data) {
+  np_buf_release((uint8_t *)data);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_buf_trim(void) {
+  np_buf_hdr_t *lists[NP_BUF_NUM_CLASSES];
+
+  np_mutex_lock(&g_buf_lock);
+  memcpy(lists, g_buf_free, sizeof(lists));
+  memset(g_buf_free, 0, sizeof(g_buf_free));
+  memset(g_buf_free_count, 0, sizeof(g_buf_free_count));
+  g_buf_free_bytes = 0;
+  np_mutex_unlock(&g_buf_lock);
+
+  for (int cls = 0; cls < NP_BUF_NUM_CLASSES; cls++) {
+    while (lists[cls] != NULL) {
+      np_buf_hdr_t *next = lists[cls]->h.next;
+      free(lists[cls]);
+      lists[cls] = next;
+    }
+  }
+}
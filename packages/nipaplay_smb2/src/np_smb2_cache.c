@@ -0,0 +1,674 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(_WIN32) || defined(_WINDOWS)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+// The cache is a slab file of NP_CACHE_BLOCK_SIZE slots plus an index file
+// with one fixed-size record per slot. A slot's record is cleared before its
+// data is rewritten and written back once the data is in place, but nothing
+// orders those writes on disk, so a crash can leave a record whose data never
+// landed. Each record therefore carries a checksum of its block, and a block
+// loaded from disk is checked against it the first time it is read.
+
+#define NP_CACHE_DATA_FILE "nipaplay_smb2_cache.bin"
+#define NP_CACHE_INDEX_FILE "nipaplay_smb2_cache.idx"
+#define NP_CACHE_MAGIC "NPSMBC02"
+// Records read per pread() when loading the index.
+#define NP_CACHE_LOAD_BATCH 1024
+
+typedef struct np_cache_header {
+  char magic[8];
+  uint32_t block_size;
+  uint32_t record_size;
+  uint64_t reserved[2];
+} np_cache_header_t;
+
+// On-disk index entry. `sum` covers the block data and `check` the other
+// fields; a `check` of 0 marks a free slot.
+typedef struct np_cache_record {
+  uint64_t hi;
+  uint64_t lo;
+  uint64_t block;
+  uint64_t sum;
+  uint32_t length;
+  uint32_t check;
+} np_cache_record_t;
+
+typedef struct np_cache_slot {
+  uint64_t hi;
+  uint64_t lo;
+  uint64_t block;
+  uint64_t sum;
+  uint32_t length;
+  // Next slot in the same hash bucket, or -1.
+  int32_t next;
+  // Block reads and writes in flight; eviction passes pinned slots over.
+  uint32_t pins;
+  bool used;
+  // Second chance for the clock hand.
+  bool referenced;
+  // The data has been checked against `sum`, or was written this session.
+  bool verified;
+} np_cache_slot_t;
+
+// Index records are written under the lock, block data is read and written
+// outside it with the slot pinned. g_cache_cond wakes a close waiting for
+// that unlocked I/O to drain.
+static np_mutex_t g_cache_lock = NP_MUTEX_INIT;
+static np_cond_t g_cache_cond = NP_COND_INIT;
+static struct {
+  bool enabled;
+  // Pinned block I/O in flight; the files and slots outlive it.
+  uint32_t pending;
+  int data_fd;
+  int index_fd;
+  uint32_t nslots;
+  np_cache_slot_t *slots;
+  int32_t *buckets;
+  uint32_t nbuckets;
+  uint32_t hand;
+  uint64_t used_bytes;
+  uint64_t hits;
+  uint64_t misses;
+} g_cache = {.data_fd = -1, .index_fd = -1};
+
+// ---------------------------------------------------------------------------
+// Files
+// ---------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WINDOWS)
+static int np_file_open(const char *path) {
+  return _open(path, _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+
+static void np_file_close(int fd) { _close(fd); }
+
+static int np_file_truncate(int fd, uint64_t size) {
+  return _chsize_s(fd, (__int64)size) == 0 ? 0 : -EIO;
+}
+
+static int64_t np_file_size(int fd) {
+  const __int64 size = _filelengthi64(fd);
+  return size < 0 ? -EIO : (int64_t)size;
+}
+
+// Block I/O runs outside g_cache_lock, so both go through an OVERLAPPED
+// offset rather than seek + read.
+static int np_file_pread(int fd, void *buf, size_t len, uint64_t off) {
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)off;
+  ov.OffsetHigh = (DWORD)(off >> 32);
+  DWORD n = 0;
+  if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, (DWORD)len, &n, &ov)) {
+    return -EIO;
+  }
+  return n == (DWORD)len ? 0 : -EIO;
+}
+
+static int np_file_pwrite(int fd, const void *buf, size_t len, uint64_t off) {
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)off;
+  ov.OffsetHigh = (DWORD)(off >> 32);
+  DWORD n = 0;
+  if (!WriteFile((HANDLE)_get_osfhandle(fd), buf, (DWORD)len, &n, &ov)) {
+    return -EIO;
+  }
+  return n == (DWORD)len ? 0 : -EIO;
+}
+#else
+static int np_file_open(const char *path) {
+  return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+static void np_file_close(int fd) { close(fd); }
+
+static int np_file_truncate(int fd, uint64_t size) {
+  return ftruncate(fd, (off_t)size) == 0 ? 0 : -errno;
+}
+
+static int64_t np_file_size(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 ? (int64_t)st.st_size : -errno;
+}
+
+static int np_file_pread(int fd, void *buf, size_t len, uint64_t off) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len > 0) {
+    const ssize_t n = pread(fd, p, len, (off_t)off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n < 0 ? -errno : -EIO;
+    }
+    p += n;
+    len -= (size_t)n;
+    off += (uint64_t)n;
+  }
+  return 0;
+}
+
+static int np_file_pwrite(int fd, const void *buf, size_t len, uint64_t off) {
+  const uint8_t *p = (const uint8_t *)buf;
+  while (len > 0) {
+    const ssize_t n = pwrite(fd, p, len, (off_t)off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n < 0 ? -errno : -EIO;
+    }
+    p += n;
+    len -= (size_t)n;
+    off += (uint64_t)n;
+  }
+  return 0;
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Keys and index
+// ---------------------------------------------------------------------------
+
+#define NP_FNV_PRIME 0x100000001b3ULL
+
+static uint64_t np_fnv_bytes(uint64_t h, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * NP_FNV_PRIME;
+  }
+  return h;
+}
+
+static uint64_t np_fnv_lower(uint64_t h, const char *s) {
+  for (; *s != '\0'; s++) {
+    uint8_t c = (uint8_t)*s;
+    if (c >= 'A' && c <= 'Z') {
+      c = (uint8_t)(c - 'A' + 'a');
+    }
+    h = (h ^ c) * NP_FNV_PRIME;
+  }
+  return (h ^ 0xff) * NP_FNV_PRIME;
+}
+
+static uint64_t np_fnv_u64(uint64_t h, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    h = (h ^ (uint8_t)(v >> (i * 8))) * NP_FNV_PRIME;
+  }
+  return h;
+}
+
+void np_cache_key_init(np_cache_key_t *key, const char *host, int port,
+                       const char *share, const char *inner_path,
+                       const struct smb2_stat_64 *st) {
+  const char *path = inner_path[0] == '/' ? inner_path + 1 : inner_path;
+  // Two differently seeded FNV-1a hashes make a 128-bit key.
+  uint64_t h[2] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+  for (int i = 0; i < 2; i++) {
+    h[i] = np_fnv_lower(h[i], host);
+    h[i] = np_fnv_u64(h[i], (uint64_t)np_normalize_port(port));
+    h[i] = np_fnv_lower(h[i], share);
+    h[i] = np_fnv_bytes(h[i], path, strlen(path) + 1);
+    h[i] = np_fnv_u64(h[i], st->smb2_ino);
+    h[i] = np_fnv_u64(h[i], st->smb2_mtime);
+    h[i] = np_fnv_u64(h[i], st->smb2_mtime_nsec);
+    h[i] = np_fnv_u64(h[i], st->smb2_size);
+  }
+  key->hi = h[0];
+  key->lo = h[1];
+}
+
+static uint32_t np_cache_bucket(uint64_t hi, uint64_t lo, uint64_t block) {
+  uint64_t x = hi ^ (lo * 0x9e3779b97f4a7c15ULL) ^
+               (block * 0xc2b2ae3d27d4eb4fULL);
+  x ^= x >> 29;
+  return (uint32_t)x & (g_cache.nbuckets - 1);
+}
+
+static uint32_t np_record_check(const np_cache_record_t *r) {
+  const uint64_t h = np_fnv_bytes(0xcbf29ce484222325ULL, r,
+                                  offsetof(np_cache_record_t, check));
+  return (uint32_t)(h ^ (h >> 32)) | 1u;
+}
+
+static uint64_t np_block_sum(const uint8_t *data, uint32_t len) {
+  return np_fnv_bytes(0xcbf29ce484222325ULL, data, len);
+}
+
+static uint64_t np_record_offset(uint32_t slot) {
+  return sizeof(np_cache_header_t) + (uint64_t)slot * sizeof(np_cache_record_t);
+}
+
+static int np_cache_write_record(uint32_t slot, const np_cache_slot_t *s) {
+  np_cache_record_t r;
+  memset(&r, 0, sizeof(r));
+  if (s != NULL) {
+    r.hi = s->hi;
+    r.lo = s->lo;
+    r.block = s->block;
+    r.sum = s->sum;
+    r.length = s->length;
+    r.check = np_record_check(&r);
+  }
+  return np_file_pwrite(g_cache.index_fd, &r, sizeof(r),
+                        np_record_offset(slot));
+}
+
+static int32_t np_cache_find(uint64_t hi, uint64_t lo, uint64_t block) {
+  int32_t i = g_cache.buckets[np_cache_bucket(hi, lo, block)];
+  while (i >= 0) {
+    const np_cache_slot_t *s = &g_cache.slots[i];
+    if (s->hi == hi && s->lo == lo && s->block == block) {
+      return i;
+    }
+    i = s->next;
+  }
+  return -1;
+}
+
+static void np_cache_link(uint32_t slot) {
+  np_cache_slot_t *s = &g_cache.slots[slot];
+  const uint32_t b = np_cache_bucket(s->hi, s->lo, s->block);
+  s->next = g_cache.buckets[b];
+  g_cache.buckets[b] = (int32_t)slot;
+  s->used = true;
+  g_cache.used_bytes += s->length;
+}
+
+static void np_cache_unlink(uint32_t slot) {
+  np_cache_slot_t *s = &g_cache.slots[slot];
+  if (!s->used) {
+    return;
+  }
+  int32_t *pp = &g_cache.buckets[np_cache_bucket(s->hi, s->lo, s->block)];
+  while (*pp >= 0) {
+    if (*pp == (int32_t)slot) {
+      *pp = s->next;
+      break;
+    }
+    pp = &g_cache.slots[*pp].next;
+  }
+  g_cache.used_bytes -= s->length;
+  s->used = false;
+  s->referenced = false;
+  s->verified = false;
+  s->next = -1;
+}
+
+// Clock (second chance) eviction. Returns -1 if every slot is pinned. The
+// hand starts at slot 0, so a fresh cache fills the data file front to back
+// rather than writing far past its end.
+static int32_t np_cache_victim(void) {
+  for (uint32_t n = 0; n < 2 * g_cache.nslots; n++) {
+    const uint32_t i = g_cache.hand;
+    g_cache.hand = (g_cache.hand + 1) % g_cache.nslots;
+    np_cache_slot_t *s = &g_cache.slots[i];
+    if (s->pins > 0) {
+      continue;
+    }
+    if (!s->used || !s->referenced) {
+      return (int32_t)i;
+    }
+    s->referenced = false;
+  }
+  return -1;
+}
+
+static void np_cache_close_locked(void) {
+  g_cache.enabled = false;
+  while (g_cache.pending > 0) {
+    np_cond_wait(&g_cache_cond, &g_cache_lock);
+  }
+  if (g_cache.data_fd >= 0) {
+    np_file_close(g_cache.data_fd);
+  }
+  if (g_cache.index_fd >= 0) {
+    np_file_close(g_cache.index_fd);
+  }
+  free(g_cache.slots);
+  free(g_cache.buckets);
+  g_cache.enabled = false;
+  g_cache.data_fd = -1;
+  g_cache.index_fd = -1;
+  g_cache.slots = NULL;
+  g_cache.buckets = NULL;
+  g_cache.nslots = 0;
+  g_cache.nbuckets = 0;
+  g_cache.hand = 0;
+  g_cache.used_bytes = 0;
+}
+
+// Reads the records of the slots that still exist; anything unreadable or
+// from another format starts the cache over.
+static int np_cache_load_locked(void) {
+  np_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  const bool valid =
+      np_file_pread(g_cache.index_fd, &header, sizeof(header), 0) == 0 &&
+      memcmp(header.magic, NP_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+      header.block_size == NP_CACHE_BLOCK_SIZE &&
+      header.record_size == sizeof(np_cache_record_t);
+  const uint64_t index_size = np_record_offset(g_cache.nslots);
+  if (!valid) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NP_CACHE_MAGIC, sizeof(header.magic));
+    header.block_size = NP_CACHE_BLOCK_SIZE;
+    header.record_size = sizeof(np_cache_record_t);
+    int rc = np_file_truncate(g_cache.index_fd, 0);
+    if (rc == 0) {
+      rc = np_file_pwrite(g_cache.index_fd, &header, sizeof(header), 0);
+    }
+    if (rc == 0) {
+      rc = np_file_truncate(g_cache.index_fd, index_size);
+    }
+    return rc;
+  }
+
+  int rc = np_file_truncate(g_cache.index_fd, index_size);
+  if (rc != 0) {
+    return rc;
+  }
+  np_cache_record_t batch[NP_CACHE_LOAD_BATCH];
+  for (uint32_t first = 0; first < g_cache.nslots;
+       first += NP_CACHE_LOAD_BATCH) {
+    uint32_t n = g_cache.nslots - first;
+    if (n > NP_CACHE_LOAD_BATCH) {
+      n = NP_CACHE_LOAD_BATCH;
+    }
+    rc = np_file_pread(g_cache.index_fd, batch, n * sizeof(batch[0]),
+                       np_record_offset(first));
+    if (rc != 0) {
+      return rc;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      const np_cache_record_t *r = &batch[i];
+      if (r->check == 0 || r->check != np_record_check(r) ||
+          r->length == 0 || r->length > NP_CACHE_BLOCK_SIZE ||
+          np_cache_find(r->hi, r->lo, r->block) >= 0) {
+        continue;
+      }
+      np_cache_slot_t *s = &g_cache.slots[first + i];
+      s->hi = r->hi;
+      s->lo = r->lo;
+      s->block = r->block;
+      s->sum = r->sum;
+      s->length = r->length;
+      np_cache_link(first + i);
+    }
+  }
+  return 0;
+}
+
+static int np_cache_open_locked(const char *dir, uint64_t max_bytes) {
+  uint64_t nslots = max_bytes / NP_CACHE_BLOCK_SIZE;
+  if (nslots > (1u << 24)) {
+    nslots = 1u << 24;
+  }
+  uint32_t nbuckets = 16;
+  while (nbuckets < nslots) {
+    nbuckets <<= 1;
+  }
+
+  g_cache.nslots = (uint32_t)nslots;
+  g_cache.nbuckets = nbuckets;
+  g_cache.slots = (np_cache_slot_t *)calloc(nslots, sizeof(np_cache_slot_t));
+  g_cache.buckets = (int32_t *)malloc(nbuckets * sizeof(int32_t));
+  if (g_cache.slots == NULL || g_cache.buckets == NULL) {
+    return -ENOMEM;
+  }
+  for (uint32_t i = 0; i < nbuckets; i++) {
+    g_cache.buckets[i] = -1;
+  }
+  for (uint32_t i = 0; i < g_cache.nslots; i++) {
+    g_cache.slots[i].next = -1;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, NP_CACHE_DATA_FILE);
+  g_cache.data_fd = np_file_open(path);
+  snprintf(path, sizeof(path), "%s/%s", dir, NP_CACHE_INDEX_FILE);
+  g_cache.index_fd = np_file_open(path);
+  if (g_cache.data_fd < 0 || g_cache.index_fd < 0) {
+    return -errno;
+  }
+  // Only ever shrink the data file, dropping the slots past the new budget.
+  // Growing it to the budget up front would zero-fill it on file systems
+  // without sparse files, such as FAT and exFAT.
+  const int64_t size = np_file_size(g_cache.data_fd);
+  if (size < 0) {
+    return (int)size;
+  }
+  const uint64_t budget = nslots * NP_CACHE_BLOCK_SIZE;
+  int rc = (uint64_t)size > budget ? np_file_truncate(g_cache.data_fd, budget)
+                                   : 0;
+  if (rc == 0) {
+    rc = np_cache_load_locked();
+  }
+  return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Lookups
+// ---------------------------------------------------------------------------
+
+// Drops a slot whose data could not be read back or failed its checksum.
+static void np_cache_drop_locked(uint32_t slot) {
+  if (g_cache.slots[slot].used) {
+    np_cache_write_record(slot, NULL);
+    np_cache_unlink(slot);
+  }
+}
+
+static void np_cache_unpin_locked(np_cache_slot_t *s) {
+  s->pins--;
+  if (--g_cache.pending == 0 && !g_cache.enabled) {
+    np_cond_broadcast(&g_cache_cond);
+  }
+}
+
+// Reads a whole block that was loaded from disk and checks it against its
+// record before copying out the part asked for.
+static int np_cache_read_verified(int fd, uint32_t slot, uint32_t length,
+                                  uint64_t sum, uint32_t offset, uint8_t *dst,
+                                  uint32_t n) {
+  uint8_t *buf = (uint8_t *)malloc(length);
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  int rc = np_file_pread(fd, buf, length, (uint64_t)slot * NP_CACHE_BLOCK_SIZE);
+  if (rc == 0 && np_block_sum(buf, length) != sum) {
+    rc = -EIO;
+  }
+  if (rc == 0) {
+    memcpy(dst, buf + offset, n);
+  }
+  free(buf);
+  return rc;
+}
+
+int np_cache_read(const np_cache_key_t *key, uint64_t block, uint32_t offset,
+                  uint8_t *dst, uint32_t len) {
+  np_mutex_lock(&g_cache_lock);
+  const int32_t i =
+      g_cache.enabled ? np_cache_find(key->hi, key->lo, block) : -1;
+  if (i < 0 || offset >= g_cache.slots[i].length) {
+    np_mutex_unlock(&g_cache_lock);
+    return -ENOENT;
+  }
+  np_cache_slot_t *s = &g_cache.slots[i];
+  const uint32_t n = s->length - offset < len ? s->length - offset : len;
+  const bool verified = s->verified;
+  const uint32_t length = s->length;
+  const uint64_t sum = s->sum;
+  const int fd = g_cache.data_fd;
+  s->pins++;
+  g_cache.pending++;
+  np_mutex_unlock(&g_cache_lock);
+
+  int rc = verified ? np_file_pread(fd, dst, n,
+                                    (uint64_t)i * NP_CACHE_BLOCK_SIZE + offset)
+                    : np_cache_read_verified(fd, (uint32_t)i, length, sum,
+                                             offset, dst, n);
+
+  np_mutex_lock(&g_cache_lock);
+  np_cache_unpin_locked(s);
+  if (rc == 0) {
+    s->referenced = true;
+    s->verified = s->used;
+    g_cache.hits++;
+    rc = (int)n;
+  } else if (rc == -ENOMEM) {
+    rc = -ENOENT;
+  } else {
+    np_cache_drop_locked((uint32_t)i);
+    rc = -ENOENT;
+  }
+  np_mutex_unlock(&g_cache_lock);
+  return rc;
+}
+
+void np_cache_store(const np_cache_key_t *key, uint64_t block,
+                    const uint8_t *data, uint32_t len) {
+  if (len == 0 || len > NP_CACHE_BLOCK_SIZE) {
+    return;
+  }
+  np_mutex_lock(&g_cache_lock);
+  if (!g_cache.enabled || np_cache_find(key->hi, key->lo, block) >= 0) {
+    np_mutex_unlock(&g_cache_lock);
+    return;
+  }
+  g_cache.misses++;
+  const int32_t i = np_cache_victim();
+  if (i < 0) {
+    np_mutex_unlock(&g_cache_lock);
+    return;
+  }
+  np_cache_slot_t *s = &g_cache.slots[i];
+  np_cache_unlink((uint32_t)i);
+  if (np_cache_write_record((uint32_t)i, NULL) != 0) {
+    np_mutex_unlock(&g_cache_lock);
+    return;
+  }
+  const int fd = g_cache.data_fd;
+  s->pins++;
+  g_cache.pending++;
+  np_mutex_unlock(&g_cache_lock);
+
+  const int rc =
+      np_file_pwrite(fd, data, len, (uint64_t)i * NP_CACHE_BLOCK_SIZE);
+  const uint64_t sum = np_block_sum(data, len);
+
+  np_mutex_lock(&g_cache_lock);
+  np_cache_unpin_locked(s);
+  // Another store of the same block may have finished first.
+  if (rc == 0 && g_cache.enabled &&
+      np_cache_find(key->hi, key->lo, block) < 0) {
+    s->hi = key->hi;
+    s->lo = key->lo;
+    s->block = block;
+    s->sum = sum;
+    s->length = len;
+    if (np_cache_write_record((uint32_t)i, s) == 0) {
+      np_cache_link((uint32_t)i);
+      s->verified = true;
+    }
+  }
+  np_mutex_unlock(&g_cache_lock);
+}
+
+uint32_t np_cache_invalidate(const np_cache_key_t *key, uint64_t first,
+                             uint64_t count) {
+  uint32_t dropped = 0;
+  np_mutex_lock(&g_cache_lock);
+  for (uint64_t block = first; g_cache.enabled && block - first < count;
+       block++) {
+    const int32_t i = np_cache_find(key->hi, key->lo, block);
+    if (i >= 0) {
+      np_cache_write_record((uint32_t)i, NULL);
+      np_cache_unlink((uint32_t)i);
+      dropped++;
+    }
+  }
+  np_mutex_unlock(&g_cache_lock);
+  return dropped;
+}
+
+bool np_cache_enabled(void) {
+  np_mutex_lock(&g_cache_lock);
+  const bool enabled = g_cache.enabled;
+  np_mutex_unlock(&g_cache_lock);
+  return enabled;
+}
+
+// ---------------------------------------------------------------------------
+// FFI
+// ---------------------------------------------------------------------------
+
+FFI_PLUGIN_EXPORT int np_smb2_cache_configure(const char *dir,
+                                              uint64_t max_bytes,
+                                              char *err_buf, int err_len) {
+  np_mutex_lock(&g_cache_lock);
+  np_cache_close_locked();
+  g_cache.hits = 0;
+  g_cache.misses = 0;
+  if (np_is_empty(dir) || max_bytes < NP_CACHE_BLOCK_SIZE) {
+    np_mutex_unlock(&g_cache_lock);
+    return 0;
+  }
+  const int rc = np_cache_open_locked(dir, max_bytes);
+  if (rc != 0) {
+    np_set_err(err_buf, err_len, "Cannot open block cache in %s: %s", dir,
+               strerror(-rc));
+    np_cache_close_locked();
+  } else {
+    g_cache.enabled = true;
+  }
+  np_mutex_unlock(&g_cache_lock);
+  return rc;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_cache_clear(void) {
+  np_mutex_lock(&g_cache_lock);
+  for (uint32_t i = 0; g_cache.enabled && i < g_cache.nslots; i++) {
+    if (g_cache.slots[i].used) {
+      np_cache_write_record(i, NULL);
+      np_cache_unlink(i);
+    }
+  }
+  np_mutex_unlock(&g_cache_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_cache_stats(uint64_t *out_hits,
+                                           uint64_t *out_misses,
+                                           uint64_t *out_used_bytes,
+                                           uint64_t *out_capacity_bytes) {
+  np_mutex_lock(&g_cache_lock);
+  if (out_hits != NULL) {
+    *out_hits = g_cache.hits;
+  }
+  if (out_misses != NULL) {
+    *out_misses = g_cache.misses;
+  }
+  if (out_used_bytes != NULL) {
+    *out_used_bytes = g_cache.used_bytes;
+  }
+  if (out_capacity_bytes != NULL) {
+    *out_capacity_bytes = (uint64_t)g_cache.nslots * NP_CACHE_BLOCK_SIZE;
+  }
+  np_mutex_unlock(&g_cache_lock);
+}
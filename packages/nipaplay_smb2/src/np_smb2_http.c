@@ -0,0 +1,812 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#if defined(_WIN32) || defined(_WINDOWS)
+#include "compat.h"
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+#if defined(_WIN32) || defined(_WINDOWS)
+#define np_closesocket closesocket
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
+typedef int t_socket;
+#define INVALID_SOCKET (-1)
+#define np_closesocket close
+#endif
+
+#if defined(MSG_NOSIGNAL)
+#define NP_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define NP_SEND_FLAGS 0
+#endif
+
+// Request line plus headers; players send well under 1 KiB.
+#define NP_HTTP_MAX_REQUEST 8192
+// Keep-alive connections with no new request for this long are closed.
+#define NP_HTTP_IDLE_TIMEOUT_MS 30000
+#define NP_HTTP_ACCEPT_POLL_MS 500
+// Largest read-ahead for response bodies; streams ramp up to it as the
+// player keeps reading (see np_stream_attach()).
+#define NP_HTTP_CHUNK (1024 * 1024)
+#define NP_HTTP_QUEUE_DEPTH 8
+
+typedef struct np_http_conn_entry {
+  struct np_http_conn_entry *next;
+  char *name;
+  char *host;
+  int port;
+  char *username;
+  char *password;
+  char *domain;
+} np_http_conn_entry_t;
+
+static np_mutex_t g_http_lock = NP_MUTEX_INIT;
+static np_http_conn_entry_t *g_http_conns = NULL;
+static t_socket g_http_listen = INVALID_SOCKET;
+static np_thread_t g_http_thread;
+static volatile int g_http_running = 0;
+static int g_http_port = 0;
+
+// ---------------------------------------------------------------------------
+// Connection registry
+// ---------------------------------------------------------------------------
+
+static void np_http_conn_free(np_http_conn_entry_t *e) {
+  if (e == NULL) {
+    return;
+  }
+  free(e->name);
+  free(e->host);
+  free(e->username);
+  free(e->password);
+  free(e->domain);
+  free(e);
+}
+
+// Copy of a registry entry that stays valid without holding the lock.
+typedef struct np_http_target {
+  char host[256];
+  int port;
+  char username[256];
+  char password[256];
+  char domain[256];
+} np_http_target_t;
+
+static bool np_http_lookup(const char *name, np_http_target_t *out) {
+  bool found = false;
+  np_mutex_lock(&g_http_lock);
+  for (np_http_conn_entry_t *e = g_http_conns; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      snprintf(out->host, sizeof(out->host), "%s", e->host);
+      out->port = e->port;
+      snprintf(out->username, sizeof(out->username), "%s", e->username);
+      snprintf(out->password, sizeof(out->password), "%s", e->password);
+      snprintf(out->domain, sizeof(out->domain), "%s", e->domain);
+      found = true;
+      break;
+    }
+  }
+  np_mutex_unlock(&g_http_lock);
+  return found;
+}
+
+// ---------------------------------------------------------------------------
+// Socket helpers
+// ---------------------------------------------------------------------------
+
+// Write all of `iov`, advancing through partial writes.
+static int np_http_writev_all(t_socket sock, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+#if defined(_WIN32) || defined(_WINDOWS)
+    const int n = writev(sock, iov, iovcnt);
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+    const ssize_t n = sendmsg(sock, &msg, NP_SEND_FLAGS);
+#endif
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    size_t left = (size_t)n;
+    while (iovcnt > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+static int np_http_send_all(t_socket sock, const void *buf, size_t len) {
+  struct iovec iov;
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+  return np_http_writev_all(sock, &iov, 1);
+}
+
+// Read until a complete header block ("\r\n\r\n") is buffered. Bytes past the
+// header (a pipelined request) stay in `buf` for the next call.
+// Returns the header length, 0 if the peer closed or idled out, <0 on error.
+static int np_http_read_request(t_socket sock, char *buf, size_t *buf_len) {
+  for (;;) {
+    buf[*buf_len] = '\0';
+    char *end = strstr(buf, "\r\n\r\n");
+    if (end != NULL) {
+      return (int)(end - buf) + 4;
+    }
+    if (*buf_len >= NP_HTTP_MAX_REQUEST) {
+      return -1;
+    }
+
+    struct pollfd pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    const int prc = poll(&pfd, 1, NP_HTTP_IDLE_TIMEOUT_MS);
+    if (prc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (prc <= 0) {
+      return prc;
+    }
+
+    const int n = (int)recv(sock, buf + *buf_len,
+                            (int)(NP_HTTP_MAX_REQUEST - *buf_len), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n;
+    }
+    *buf_len += (size_t)n;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Request parsing
+// ---------------------------------------------------------------------------
+
+typedef struct np_http_request {
+  char method[8];
+  char target[4096];
+  bool keep_alive;
+  bool has_range;
+  char range[128];
+} np_http_request_t;
+
+static bool np_http_header_is(const char *line, const char *name) {
+  const size_t n = strlen(name);
+  return strncasecmp(line, name, n) == 0 && line[n] == ':';
+}
+
+static const char *np_http_header_value(const char *line) {
+  const char *v = strchr(line, ':') + 1;
+  while (*v == ' ' || *v == '\t') {
+    v++;
+  }
+  return v;
+}
+
+static int np_http_parse_request(char *head, np_http_request_t *req) {
+  memset(req, 0, sizeof(*req));
+
+  char *line_end = strstr(head, "\r\n");
+  *line_end = '\0';
+  char version[16];
+  if (sscanf(head, "%7s %4095s %15s", req->method, req->target, version) !=
+      3) {
+    return -1;
+  }
+  req->keep_alive = strcmp(version, "HTTP/1.1") == 0;
+
+  char *line = line_end + 2;
+  while (*line != '\0' && strncmp(line, "\r\n", 2) != 0) {
+    line_end = strstr(line, "\r\n");
+    if (line_end == NULL) {
+      break;
+    }
+    *line_end = '\0';
+
+    if (np_http_header_is(line, "Range")) {
+      snprintf(req->range, sizeof(req->range), "%s",
+               np_http_header_value(line));
+      req->has_range = true;
+    } else if (np_http_header_is(line, "Connection")) {
+      const char *v = np_http_header_value(line);
+      if (strncasecmp(v, "close", 5) == 0) {
+        req->keep_alive = false;
+      } else if (strncasecmp(v, "keep-alive", 10) == 0) {
+        req->keep_alive = true;
+      }
+    }
+    line = line_end + 2;
+  }
+  return 0;
+}
+
+static int np_http_hex(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c = (char)tolower((unsigned char)c);
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Percent-decode `in[0, len)` into `out`, treating '+' as a space.
+static void np_http_url_decode(const char *in, size_t len, char *out,
+                               size_t out_len) {
+  size_t j = 0;
+  for (size_t i = 0; i < len && j + 1 < out_len; i++) {
+    if (in[i] == '%' && i + 2 < len && np_http_hex(in[i + 1]) >= 0 &&
+        np_http_hex(in[i + 2]) >= 0) {
+      out[j++] = (char)(np_http_hex(in[i + 1]) * 16 + np_http_hex(in[i + 2]));
+      i += 2;
+    } else if (in[i] == '+') {
+      out[j++] = ' ';
+    } else {
+      out[j++] = in[i];
+    }
+  }
+  out[j] = '\0';
+}
+
+static bool np_http_query_param(const char *query, const char *name,
+                                char *out, size_t out_len) {
+  const size_t name_len = strlen(name);
+  const char *p = query;
+  while (p != NULL && *p != '\0') {
+    const char *amp = strchr(p, '&');
+    const size_t len = amp ? (size_t)(amp - p) : strlen(p);
+    if (len > name_len && strncmp(p, name, name_len) == 0 &&
+        p[name_len] == '=') {
+      np_http_url_decode(p + name_len + 1, len - name_len - 1, out, out_len);
+      return true;
+    }
+    p = amp ? amp + 1 : NULL;
+  }
+  return false;
+}
+
+static void np_http_trim(char *s) {
+  size_t n = strlen(s);
+  while (n > 0 && isspace((unsigned char)s[n - 1])) {
+    s[--n] = '\0';
+  }
+  size_t i = 0;
+  while (isspace((unsigned char)s[i])) {
+    i++;
+  }
+  if (i > 0) {
+    memmove(s, s + i, n - i + 1);
+  }
+}
+
+// Mirrors the single-range handling of the Dart proxy: only the first range
+// of a list is served; suffix ranges ("-N") are supported.
+static bool np_http_parse_range(const char *header, uint64_t total,
+                                uint64_t *start, uint64_t *end_exclusive) {
+  if (total == 0 || strncmp(header, "bytes=", 6) != 0) {
+    return false;
+  }
+  const char *spec = header + 6;
+  while (*spec == ' ') {
+    spec++;
+  }
+
+  const char *dash = strchr(spec, '-');
+  if (dash == NULL) {
+    return false;
+  }
+  const char *stop = strchr(dash, ',');
+  const char *end_str = dash + 1;
+  const size_t end_len = stop ? (size_t)(stop - end_str) : strlen(end_str);
+
+  bool has_start = false;
+  uint64_t first = 0;
+  for (const char *p = spec; p < dash; p++) {
+    if (!isdigit((unsigned char)*p)) {
+      return false;
+    }
+    first = first * 10 + (uint64_t)(*p - '0');
+    has_start = true;
+  }
+  bool has_end = false;
+  uint64_t last = 0;
+  for (size_t i = 0; i < end_len; i++) {
+    if (end_str[i] == ' ') {
+      break;
+    }
+    if (!isdigit((unsigned char)end_str[i])) {
+      return false;
+    }
+    last = last * 10 + (uint64_t)(end_str[i] - '0');
+    has_end = true;
+  }
+
+  if (!has_start) {
+    if (!has_end || last == 0) {
+      return false;
+    }
+    *start = last >= total ? 0 : total - last;
+    *end_exclusive = total;
+    return true;
+  }
+  if (first >= total) {
+    return false;
+  }
+  if (has_end) {
+    if (last < first) {
+      return false;
+    }
+    if (last >= total) {
+      last = total - 1;
+    }
+  } else {
+    last = total - 1;
+  }
+  *start = first;
+  *end_exclusive = last + 1;
+  return true;
+}
+
+static const char *np_http_content_type(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  if (dot == NULL || (slash != NULL && dot < slash)) {
+    return "application/octet-stream";
+  }
+  static const struct {
+    const char *ext;
+    const char *type;
+  } types[] = {
+      {".mp4", "video/mp4"},         {".m4v", "video/mp4"},
+      {".mkv", "video/x-matroska"},  {".mov", "video/quicktime"},
+      {".avi", "video/x-msvideo"},   {".flv", "video/x-flv"},
+      {".ts", "video/mpeg"},         {".mpeg", "video/mpeg"},
+      {".mpg", "video/mpeg"},        {".webm", "video/webm"},
+  };
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    if (strcasecmp(dot, types[i].ext) == 0) {
+      return types[i].type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+// ---------------------------------------------------------------------------
+// Responses
+// ---------------------------------------------------------------------------
+
+static int np_http_send_simple(t_socket sock, int status, const char *reason,
+                               const char *extra_headers, const char *body,
+                               bool head_only, bool keep_alive) {
+  char header[1024];
+  const size_t body_len = body ? strlen(body) : 0;
+  const int n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 %d %s\r\n"
+                         "Content-Type: text/plain; charset=utf-8\r\n"
+                         "Content-Length: %zu\r\n"
+                         "%s"
+                         "Connection: %s\r\n"
+                         "\r\n",
+                         status, reason, body_len,
+                         extra_headers ? extra_headers : "",
+                         keep_alive ? "keep-alive" : "close");
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = (size_t)n;
+  iov[1].iov_base = (void *)body;
+  iov[1].iov_len = head_only ? 0 : body_len;
+  return np_http_writev_all(sock, iov, iov[1].iov_len > 0 ? 2 : 1);
+}
+
+// Serve /smb/stream. Returns true if the connection can be kept alive.
+static bool np_http_serve_stream(t_socket sock, const np_http_request_t *req,
+                                 const char *query) {
+  const bool head_only = strcmp(req->method, "HEAD") == 0;
+  bool keep_alive = req->keep_alive;
+
+  char conn[256] = {0};
+  char path[4096] = {0};
+  np_http_query_param(query, "conn", conn, sizeof(conn));
+  np_http_query_param(query, "path", path, sizeof(path));
+  np_http_trim(conn);
+  np_http_trim(path);
+  if (conn[0] == '\0' || path[0] == '\0') {
+    return np_http_send_simple(sock, 400, "Bad Request", NULL,
+                               "Missing conn or path", head_only,
+                               keep_alive) == 0 &&
+           keep_alive;
+  }
+
+  np_http_target_t target;
+  if (!np_http_lookup(conn, &target)) {
+    return np_http_send_simple(sock, 404, "Not Found", NULL,
+                               "SMB connection not found", head_only,
+                               keep_alive) == 0 &&
+           keep_alive;
+  }
+
+  // Same normalisation as the Dart proxy: no trailing slash on files.
+  size_t path_len = strlen(path);
+  while (path_len > 1 && (path[path_len - 1] == '/' ||
+                          path[path_len - 1] == '\\')) {
+    path[--path_len] = '\0';
+  }
+
+  char err[512] = {0};
+  // Players open several connections to the same file (probe, index, body);
+  // they share one handle and any block they read concurrently.
+  np_shared_file_t *file = NULL;
+  const int orc =
+      np_shared_open(target.host, target.port, target.username,
+                     target.password, target.domain, path, &file, err,
+                     (int)sizeof(err));
+  if (orc == -EISDIR) {
+    return np_http_send_simple(sock, 400, "Bad Request", NULL,
+                               "Path is a directory", head_only,
+                               keep_alive) == 0 &&
+           keep_alive;
+  }
+  if (orc != 0) {
+    char body[600];
+    snprintf(body, sizeof(body), "SMB stream error: %s", err);
+    return np_http_send_simple(sock, 500, "Internal Server Error", NULL, body,
+                               head_only, keep_alive) == 0 &&
+           keep_alive;
+  }
+
+  const uint64_t total = np_shared_size(file);
+  uint64_t start = 0;
+  uint64_t end_exclusive = total;
+  char range_header[128] = {0};
+  if (req->has_range) {
+    if (!np_http_parse_range(req->range, total, &start, &end_exclusive)) {
+      np_shared_release(file, NP_RELEASE_OK);
+      char extra[96];
+      snprintf(extra, sizeof(extra), "Content-Range: bytes */%llu\r\n",
+               (unsigned long long)total);
+      return np_http_send_simple(sock, 416, "Range Not Satisfiable", extra,
+                                 NULL, head_only, keep_alive) == 0 &&
+             keep_alive;
+    }
+    snprintf(range_header, sizeof(range_header),
+             "Content-Range: bytes %llu-%llu/%llu\r\n",
+             (unsigned long long)start, (unsigned long long)(end_exclusive - 1),
+             (unsigned long long)total);
+  }
+
+  // Playback starts here; fetch the index the player will jump to next
+  // while this response streams the head.
+  if (!head_only && start == 0) {
+    np_index_prefetch_start(target.host, target.port, target.username,
+                            target.password, target.domain, path,
+                            np_shared_key(file));
+  }
+
+  const uint64_t length = end_exclusive - start;
+  char header[1024];
+  const int header_len = snprintf(
+      header, sizeof(header),
+      "HTTP/1.1 %s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %llu\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "%s"
+      "Cache-Control: no-cache\r\n"
+      "Connection: %s\r\n"
+      "\r\n",
+      req->has_range ? "206 Partial Content" : "200 OK",
+      np_http_content_type(path), (unsigned long long)length, range_header,
+      keep_alive ? "keep-alive" : "close");
+
+  if (head_only || length == 0) {
+    np_shared_release(file, NP_RELEASE_OK);
+    return np_http_send_all(sock, header, (size_t)header_len) == 0 &&
+           keep_alive;
+  }
+
+  np_smb2_stream_t *stream =
+      np_stream_attach_shared(file, start, end_exclusive, NP_HTTP_CHUNK,
+                              NP_HTTP_QUEUE_DEPTH, err, (int)sizeof(err));
+  if (stream == NULL) {
+    char body[600];
+    snprintf(body, sizeof(body), "SMB stream error: %s", err);
+    return np_http_send_simple(sock, 500, "Internal Server Error", NULL, body,
+                               false, keep_alive) == 0 &&
+           keep_alive;
+  }
+
+  // The first chunk goes out together with the header in one writev, so a
+  // failing first READ can still be reported as a 500.
+  uint8_t *data = NULL;
+  int n = np_stream_next(stream, &data, err, (int)sizeof(err));
+  if (n <= 0) {
+    np_stream_close(stream);
+    char body[600];
+    snprintf(body, sizeof(body), "SMB stream error: %s",
+             n == 0 ? "unexpected end of file" : err);
+    return np_http_send_simple(sock, 500, "Internal Server Error", NULL, body,
+                               false, keep_alive) == 0 &&
+           keep_alive;
+  }
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = (size_t)header_len;
+  iov[1].iov_base = data;
+  iov[1].iov_len = (size_t)n;
+  int wrc = np_http_writev_all(sock, iov, 2);
+
+  uint64_t sent = (uint64_t)n;
+  while (wrc == 0 && sent < length) {
+    n = np_stream_next(stream, &data, err, (int)sizeof(err));
+    if (n <= 0) {
+      // Headers are already out; all we can do is cut the response short.
+      break;
+    }
+    wrc = np_http_send_all(sock, data, (size_t)n);
+    sent += (uint64_t)n;
+  }
+
+  np_stream_close(stream);
+  return wrc == 0 && sent == length && keep_alive;
+}
+
+static bool np_http_dispatch(t_socket sock, char *head) {
+  np_http_request_t req;
+  if (np_http_parse_request(head, &req) != 0) {
+    np_http_send_simple(sock, 400, "Bad Request", NULL, "Bad request", false,
+                        false);
+    return false;
+  }
+
+  const bool is_get = strcmp(req.method, "GET") == 0;
+  const bool is_head = strcmp(req.method, "HEAD") == 0;
+
+  char *query = strchr(req.target, '?');
+  if (query != NULL) {
+    *query++ = '\0';
+  } else {
+    query = req.target + strlen(req.target);
+  }
+
+  if ((is_get || is_head) && strcmp(req.target, "/smb/stream") == 0) {
+    return np_http_serve_stream(sock, &req, query);
+  }
+  if (is_get && strcmp(req.target, "/smb/health") == 0) {
+    return np_http_send_simple(sock, 200, "OK", NULL, "ok", false,
+                               req.keep_alive) == 0 &&
+           req.keep_alive;
+  }
+  return np_http_send_simple(sock, 404, "Not Found", NULL, "Route not found",
+                             is_head, req.keep_alive) == 0 &&
+         req.keep_alive;
+}
+
+static void np_http_client_main(void *arg) {
+  const t_socket sock = (t_socket)(intptr_t)arg;
+  char *buf = (char *)malloc(NP_HTTP_MAX_REQUEST + 1);
+  size_t buf_len = 0;
+
+  bool keep_alive = buf != NULL;
+  while (keep_alive && g_http_running) {
+    const int head_len = np_http_read_request(sock, buf, &buf_len);
+    if (head_len <= 0) {
+      break;
+    }
+
+    char saved = buf[head_len];
+    buf[head_len] = '\0';
+    keep_alive = np_http_dispatch(sock, buf);
+    buf[head_len] = saved;
+
+    // GET/HEAD carry no body; anything left over is the next request.
+    memmove(buf, buf + head_len, buf_len - (size_t)head_len);
+    buf_len -= (size_t)head_len;
+  }
+
+  free(buf);
+  np_closesocket(sock);
+}
+
+static void np_http_accept_main(void *arg) {
+  (void)arg;
+  while (g_http_running) {
+    struct pollfd pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = g_http_listen;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, NP_HTTP_ACCEPT_POLL_MS) <= 0) {
+      continue;
+    }
+
+    const t_socket client = accept(g_http_listen, NULL, NULL);
+    if (client == INVALID_SOCKET) {
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char *)&one,
+               sizeof(one));
+#if defined(SO_NOSIGPIPE)
+    setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    if (np_thread_start(NULL, np_http_client_main,
+                        (void *)(intptr_t)client) != 0) {
+      np_closesocket(client);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// FFI
+// ---------------------------------------------------------------------------
+
+FFI_PLUGIN_EXPORT int np_smb2_http_start(int port, char *err_buf,
+                                         int err_len) {
+  np_mutex_lock(&g_http_lock);
+  if (g_http_running) {
+    const int running_port = g_http_port;
+    np_mutex_unlock(&g_http_lock);
+    return running_port;
+  }
+
+#if defined(_WIN32) || defined(_WINDOWS)
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+  const t_socket sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock == INVALID_SOCKET) {
+    np_mutex_unlock(&g_http_lock);
+    np_set_err(err_buf, err_len, "socket() failed");
+    return -EIO;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons((uint16_t)(port > 0 && port <= 65535 ? port : 0));
+
+  socklen_t addr_len = sizeof(addr);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(sock, 16) != 0 ||
+      getsockname(sock, (struct sockaddr *)&addr, &addr_len) != 0) {
+    np_closesocket(sock);
+    np_mutex_unlock(&g_http_lock);
+    np_set_err(err_buf, err_len, "Cannot listen on 127.0.0.1:%d", port);
+    return -EADDRINUSE;
+  }
+
+  g_http_listen = sock;
+  g_http_port = ntohs(addr.sin_port);
+  g_http_running = 1;
+  if (np_thread_start(&g_http_thread, np_http_accept_main, NULL) != 0) {
+    g_http_running = 0;
+    g_http_listen = INVALID_SOCKET;
+    np_closesocket(sock);
+    np_mutex_unlock(&g_http_lock);
+    np_set_err(err_buf, err_len, "Cannot start HTTP thread");
+    return -EAGAIN;
+  }
+
+  const int bound_port = g_http_port;
+  np_mutex_unlock(&g_http_lock);
+  return bound_port;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_http_stop(void) {
+  np_mutex_lock(&g_http_lock);
+  if (!g_http_running) {
+    np_mutex_unlock(&g_http_lock);
+    return;
+  }
+  g_http_running = 0;
+  np_mutex_unlock(&g_http_lock);
+
+  // Client threads notice the flag after their current response.
+  np_thread_join(g_http_thread);
+
+  np_mutex_lock(&g_http_lock);
+  np_closesocket(g_http_listen);
+  g_http_listen = INVALID_SOCKET;
+  g_http_port = 0;
+  np_mutex_unlock(&g_http_lock);
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_http_set_connection(const char *name,
+                                                  const char *host, int port,
+                                                  const char *username,
+                                                  const char *password,
+                                                  const char *domain) {
+  if (np_is_empty(name) || np_is_empty(host)) {
+    return -EINVAL;
+  }
+
+  np_http_conn_entry_t *e =
+      (np_http_conn_entry_t *)calloc(1, sizeof(*e));
+  if (e == NULL) {
+    return -ENOMEM;
+  }
+  e->name = np_strdup_or_empty(name);
+  e->host = np_strdup_or_empty(host);
+  e->port = port;
+  e->username = np_strdup_or_empty(username);
+  e->password = np_strdup_or_empty(password);
+  e->domain = np_strdup_or_empty(domain);
+  if (e->name == NULL || e->host == NULL || e->username == NULL ||
+      e->password == NULL || e->domain == NULL) {
+    np_http_conn_free(e);
+    return -ENOMEM;
+  }
+
+  np_http_conn_entry_t *old = NULL;
+  np_mutex_lock(&g_http_lock);
+  for (np_http_conn_entry_t **pp = &g_http_conns; *pp != NULL;
+       pp = &(*pp)->next) {
+    if (strcmp((*pp)->name, name) == 0) {
+      old = *pp;
+      *pp = old->next;
+      break;
+    }
+  }
+  e->next = g_http_conns;
+  g_http_conns = e;
+  np_mutex_unlock(&g_http_lock);
+
+  np_http_conn_free(old);
+  return 0;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_http_remove_connection(const char *name) {
+  if (name == NULL) {
+    return;
+  }
+  np_http_conn_entry_t *old = NULL;
+  np_mutex_lock(&g_http_lock);
+  for (np_http_conn_entry_t **pp = &g_http_conns; *pp != NULL;
+       pp = &(*pp)->next) {
+    if (strcmp((*pp)->name, name) == 0) {
+      old = *pp;
+      *pp = old->next;
+      break;
+    }
+  }
+  np_mutex_unlock(&g_http_lock);
+  np_http_conn_free(old);
+}
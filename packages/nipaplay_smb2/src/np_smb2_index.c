@@ -0,0 +1,453 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+// Players open MP4 and Matroska files with a read of the head, a jump to the
+// index (the `moov` box, or the Cues element) and a jump back. A prefetch job
+// finds the index from the file's top-level structure and pulls it into the
+// block cache on a session of its own, so those jumps and the first seeks are
+// served locally instead of waiting behind the head.
+
+// Jobs running at once; requests beyond that are dropped.
+#define NP_INDEX_MAX_JOBS 4
+// Index elements larger than this are prefetched only up to it.
+#define NP_INDEX_MAX_BYTES (64 * 1024 * 1024)
+// Top-level MP4 boxes walked before giving up (fragmented files have many).
+#define NP_INDEX_MAX_BOXES 64
+#define NP_INDEX_MAX_RANGES 4
+#define NP_INDEX_CHUNK (1024 * 1024)
+#define NP_INDEX_DEPTH 8
+
+#define NP_EBML_ID_HEADER 0x1A45DFA3u
+#define NP_EBML_ID_SEGMENT 0x18538067u
+#define NP_EBML_ID_SEEKHEAD 0x114D9B74u
+#define NP_EBML_ID_SEEK 0x4DBBu
+#define NP_EBML_ID_SEEKID 0x53ABu
+#define NP_EBML_ID_SEEKPOSITION 0x53ACu
+#define NP_EBML_ID_CUES 0x1C53BB6Bu
+#define NP_EBML_ID_CLUSTER 0x1F43B675u
+
+typedef struct np_index_range {
+  uint64_t start;
+  uint64_t end;
+} np_index_range_t;
+
+typedef struct np_index_job {
+  char *host;
+  int port;
+  char *username;
+  char *password;
+  char *domain;
+  char *path;
+  np_cache_key_t key;
+
+  np_smb2_session_t *session;
+  struct smb2fh *fh;
+  uint64_t size;
+  // Staging for blocks read while parsing; they are cached as well.
+  uint8_t *block;
+
+  np_index_range_t ranges[NP_INDEX_MAX_RANGES];
+  int nranges;
+} np_index_job_t;
+
+static np_mutex_t g_index_lock = NP_MUTEX_INIT;
+static np_cache_key_t g_index_running[NP_INDEX_MAX_JOBS];
+static bool g_index_slot_used[NP_INDEX_MAX_JOBS];
+
+static uint32_t np_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t np_be64(const uint8_t *p) {
+  return ((uint64_t)np_be32(p) << 32) | np_be32(p + 4);
+}
+
+// Read through the block cache, fetching missing blocks whole. Returns the
+// bytes read, short only at the end of the file, or <0 on failure.
+static int np_index_read(np_index_job_t *job, uint64_t offset, uint8_t *dst,
+                         uint32_t len) {
+  uint32_t done = 0;
+  while (done < len && offset < job->size) {
+    const uint64_t block = offset / NP_CACHE_BLOCK_SIZE;
+    const uint32_t in_block = (uint32_t)(offset % NP_CACHE_BLOCK_SIZE);
+    int n = np_cache_read(&job->key, block, in_block, dst + done, len - done);
+    if (n < 0) {
+      const uint64_t start = block * NP_CACHE_BLOCK_SIZE;
+      const uint32_t want = job->size - start < NP_CACHE_BLOCK_SIZE
+                                ? (uint32_t)(job->size - start)
+                                : NP_CACHE_BLOCK_SIZE;
+      uint32_t got = 0;
+      while (got < want) {
+        const int rc = smb2_pread(job->session->ctx, job->fh, job->block + got,
+                                  want - got, start + got);
+        if (rc < 0) {
+          return rc;
+        }
+        if (rc == 0) {
+          break;
+        }
+        got += (uint32_t)rc;
+      }
+      if (got == want) {
+        np_cache_store(&job->key, block, job->block, got);
+      }
+      if (got <= in_block) {
+        break;
+      }
+      n = (int)(got - in_block);
+      if ((uint32_t)n > len - done) {
+        n = (int)(len - done);
+      }
+      memcpy(dst + done, job->block + in_block, (size_t)n);
+    }
+    done += (uint32_t)n;
+    offset += (uint64_t)n;
+  }
+  return (int)done;
+}
+
+static void np_index_add(np_index_job_t *job, uint64_t start, uint64_t len) {
+  if (job->nranges >= NP_INDEX_MAX_RANGES || start >= job->size) {
+    return;
+  }
+  if (len > NP_INDEX_MAX_BYTES) {
+    len = NP_INDEX_MAX_BYTES;
+  }
+  uint64_t end = start + len;
+  if (end > job->size || end < start) {
+    end = job->size;
+  }
+  job->ranges[job->nranges].start = start;
+  job->ranges[job->nranges].end = end;
+  job->nranges++;
+}
+
+// ISO-BMFF: walk the top-level boxes for `moov`, and find a trailing `mfra`
+// through the `mfro` box that ends fragmented files.
+static void np_index_parse_mp4(np_index_job_t *job) {
+  uint8_t hdr[16];
+  uint64_t offset = 0;
+  for (int i = 0; i < NP_INDEX_MAX_BOXES && offset + 8 <= job->size; i++) {
+    if (np_index_read(job, offset, hdr, sizeof(hdr)) < 8) {
+      return;
+    }
+    uint64_t box = np_be32(hdr);
+    if (box == 1) {
+      if (offset + 16 > job->size) {
+        return;
+      }
+      box = np_be64(hdr + 8);
+    } else if (box == 0) {
+      box = job->size - offset;
+    }
+    if (box < 8) {
+      return;
+    }
+    if (memcmp(hdr + 4, "moov", 4) == 0) {
+      np_index_add(job, offset, box);
+      break;
+    }
+    offset += box;
+  }
+
+  if (job->size >= 16 &&
+      np_index_read(job, job->size - 16, hdr, sizeof(hdr)) == 16 &&
+      np_be32(hdr) == 16 && memcmp(hdr + 4, "mfro", 4) == 0) {
+    const uint64_t mfra = np_be32(hdr + 12);
+    if (mfra >= 16 && mfra <= job->size) {
+      np_index_add(job, job->size - mfra, mfra);
+    }
+  }
+}
+
+// EBML variable-length integer at `p`; `is_id` keeps the length marker, as
+// element IDs do. Returns its length in bytes, or 0 if malformed.
+static int np_ebml_vint(const uint8_t *p, const uint8_t *end, bool is_id,
+                        uint64_t *out) {
+  if (p >= end || p[0] == 0) {
+    return 0;
+  }
+  int len = 1;
+  while (len <= 8 && !(p[0] & (0x80 >> (len - 1)))) {
+    len++;
+  }
+  if (len > 8 || (is_id && len > 4) || p + len > end) {
+    return 0;
+  }
+  uint64_t v = is_id ? p[0] : (uint64_t)(p[0] & (0xFF >> len));
+  bool all_ones = v == (uint64_t)(0xFF >> len);
+  for (int i = 1; i < len; i++) {
+    v = (v << 8) | p[i];
+    all_ones = all_ones && p[i] == 0xFF;
+  }
+  // An all-ones size means "unknown".
+  *out = (!is_id && all_ones) ? UINT64_MAX : v;
+  return len;
+}
+
+// Element header at `p`: ID and data size. Returns the header length, or 0.
+static int np_ebml_header(const uint8_t *p, const uint8_t *end, uint64_t *id,
+                          uint64_t *size) {
+  const int a = np_ebml_vint(p, end, true, id);
+  if (a == 0) {
+    return 0;
+  }
+  const int b = np_ebml_vint(p + a, end, false, size);
+  return b == 0 ? 0 : a + b;
+}
+
+// Matroska: the SeekHead at the start of the Segment gives the position of
+// the Cues; the Cues element's own header gives its size.
+static void np_index_parse_mkv(np_index_job_t *job, const uint8_t *head,
+                               uint32_t head_len) {
+  const uint8_t *end = head + head_len;
+  const uint8_t *p = head;
+  uint64_t id;
+  uint64_t size;
+  int n = np_ebml_header(p, end, &id, &size);
+  if (n == 0 || id != NP_EBML_ID_HEADER || size > (uint64_t)(end - p - n)) {
+    return;
+  }
+  p += n + size;
+  n = np_ebml_header(p, end, &id, &size);
+  if (n == 0 || id != NP_EBML_ID_SEGMENT) {
+    return;
+  }
+  p += n;
+  const uint64_t segment = (uint64_t)(p - head);
+
+  uint64_t cues = UINT64_MAX;
+  while (p < end && cues == UINT64_MAX) {
+    n = np_ebml_header(p, end, &id, &size);
+    if (n == 0 || id == NP_EBML_ID_CLUSTER || size == UINT64_MAX ||
+        size > (uint64_t)(end - p - n)) {
+      break;
+    }
+    if (id == NP_EBML_ID_SEEKHEAD) {
+      const uint8_t *s = p + n;
+      const uint8_t *s_end = s + size;
+      while (s < s_end) {
+        uint64_t seek_size;
+        const int sn = np_ebml_header(s, s_end, &id, &seek_size);
+        if (sn == 0 || seek_size > (uint64_t)(s_end - s - sn)) {
+          break;
+        }
+        if (id == NP_EBML_ID_SEEK) {
+          const uint8_t *e = s + sn;
+          const uint8_t *e_end = e + seek_size;
+          uint64_t target = 0;
+          uint64_t position = UINT64_MAX;
+          while (e < e_end) {
+            uint64_t field;
+            const int en = np_ebml_header(e, e_end, &id, &field);
+            if (en == 0 || field > 8 || field > (uint64_t)(e_end - e - en)) {
+              break;
+            }
+            uint64_t v = 0;
+            for (uint64_t i = 0; i < field; i++) {
+              v = (v << 8) | e[en + i];
+            }
+            if (id == NP_EBML_ID_SEEKID) {
+              target = v;
+            } else if (id == NP_EBML_ID_SEEKPOSITION) {
+              position = v;
+            }
+            e += en + field;
+          }
+          if (target == NP_EBML_ID_CUES && position != UINT64_MAX) {
+            cues = segment + position;
+          }
+        }
+        s += sn + seek_size;
+      }
+    } else if (id == NP_EBML_ID_CUES) {
+      cues = (uint64_t)(p - head);
+    }
+    p += n + size;
+  }
+  if (cues == UINT64_MAX || cues >= job->size) {
+    return;
+  }
+
+  uint8_t hdr[16];
+  const int got = np_index_read(job, cues, hdr, sizeof(hdr));
+  if (got <= 0) {
+    return;
+  }
+  n = np_ebml_header(hdr, hdr + got, &id, &size);
+  if (n == 0 || id != NP_EBML_ID_CUES) {
+    return;
+  }
+  np_index_add(job, cues, size == UINT64_MAX ? job->size - cues : n + size);
+}
+
+static void np_index_close_cb(struct smb2_context *smb2, int status,
+                              void *command_data, void *cb_data) {
+  (void)smb2;
+  (void)status;
+  (void)command_data;
+  (void)cb_data;
+}
+
+// Pull the ranges into the cache, all in flight at once: waiting for one
+// stream's chunk services the replies of the others too.
+static void np_index_fetch(np_index_job_t *job) {
+  np_smb2_stream_t *streams[NP_INDEX_MAX_RANGES] = {0};
+  for (int i = 0; i < job->nranges; i++) {
+    // Whole blocks, so every READ can be stored.
+    const uint64_t start =
+        job->ranges[i].start / NP_CACHE_BLOCK_SIZE * NP_CACHE_BLOCK_SIZE;
+    const uint64_t end = (job->ranges[i].end + NP_CACHE_BLOCK_SIZE - 1) /
+                         NP_CACHE_BLOCK_SIZE * NP_CACHE_BLOCK_SIZE;
+    streams[i] = np_stream_create(job->session, job->fh, job->size, start,
+                                  end, NP_INDEX_CHUNK, NP_INDEX_DEPTH,
+                                  &job->key);
+  }
+
+  char err[256];
+  bool broken = false;
+  int active = job->nranges;
+  while (active > 0 && !broken) {
+    active = 0;
+    for (int i = 0; i < job->nranges && !broken; i++) {
+      if (streams[i] == NULL) {
+        continue;
+      }
+      uint8_t *data;
+      if (np_stream_next(streams[i], &data, err, sizeof(err)) > 0) {
+        active++;
+        continue;
+      }
+      np_stream_cancel(streams[i]);
+      np_stream_settle(streams[i]);
+      if (!np_stream_idle(streams[i])) {
+        broken = true;
+      } else {
+        broken = np_stream_detach(streams[i]) == NP_RELEASE_DISCARD;
+        streams[i] = NULL;
+      }
+    }
+  }
+
+  if (broken) {
+    // Destroying the context fails the READs still aimed at the streams'
+    // buffers before they are freed; the queued CLOSE frees the handle.
+    smb2_close_async(job->session->ctx, job->fh, np_index_close_cb, NULL);
+    job->fh = NULL;
+    np_pool_release(job->session, NP_RELEASE_DISCARD);
+    job->session = NULL;
+  }
+  for (int i = 0; i < job->nranges; i++) {
+    if (streams[i] != NULL) {
+      np_stream_detach(streams[i]);
+    }
+  }
+}
+
+static bool np_index_claim(const np_cache_key_t *key) {
+  np_mutex_lock(&g_index_lock);
+  int free_slot = -1;
+  for (int i = 0; i < NP_INDEX_MAX_JOBS; i++) {
+    if (!g_index_slot_used[i]) {
+      free_slot = free_slot < 0 ? i : free_slot;
+    } else if (g_index_running[i].hi == key->hi &&
+               g_index_running[i].lo == key->lo) {
+      free_slot = -1;
+      break;
+    }
+  }
+  if (free_slot >= 0) {
+    g_index_slot_used[free_slot] = true;
+    g_index_running[free_slot] = *key;
+  }
+  np_mutex_unlock(&g_index_lock);
+  return free_slot >= 0;
+}
+
+static void np_index_unclaim(const np_cache_key_t *key) {
+  np_mutex_lock(&g_index_lock);
+  for (int i = 0; i < NP_INDEX_MAX_JOBS; i++) {
+    if (g_index_slot_used[i] && g_index_running[i].hi == key->hi &&
+        g_index_running[i].lo == key->lo) {
+      g_index_slot_used[i] = false;
+      break;
+    }
+  }
+  np_mutex_unlock(&g_index_lock);
+}
+
+static void np_index_job_free(np_index_job_t *job) {
+  free(job->host);
+  free(job->username);
+  free(job->password);
+  free(job->domain);
+  free(job->path);
+  free(job->block);
+  free(job);
+}
+
+static void np_index_main(void *arg) {
+  np_index_job_t *job = (np_index_job_t *)arg;
+  const np_cache_key_t claimed = job->key;
+  char err[256];
+  job->block = (uint8_t *)malloc(NP_CACHE_BLOCK_SIZE);
+  if (job->block != NULL &&
+      np_open_file(job->host, job->port, job->username, job->password,
+                   job->domain, job->path, NULL, &job->session, &job->fh,
+                   &job->size, &job->key, err, (int)sizeof(err)) == 0) {
+    uint8_t *head = (uint8_t *)malloc(NP_CACHE_BLOCK_SIZE);
+    const int head_len =
+        head != NULL ? np_index_read(job, 0, head, NP_CACHE_BLOCK_SIZE) : -1;
+    if (head_len >= 8 && memcmp(head + 4, "ftyp", 4) == 0) {
+      np_index_parse_mp4(job);
+    } else if (head_len >= 4 && np_be32(head) == NP_EBML_ID_HEADER) {
+      np_index_parse_mkv(job, head, (uint32_t)head_len);
+    }
+    free(head);
+    if (job->nranges > 0) {
+      np_index_fetch(job);
+    }
+    if (job->session != NULL) {
+      smb2_close(job->session->ctx, job->fh);
+      np_pool_release(job->session, NP_RELEASE_OK);
+    }
+  }
+  np_index_unclaim(&claimed);
+  np_index_job_free(job);
+}
+
+int np_index_prefetch_start(const char *host, int port, const char *username,
+                            const char *password, const char *domain,
+                            const char *path, const np_cache_key_t *key) {
+  if (!np_cache_enabled() || !np_index_claim(key)) {
+    return 0;
+  }
+  np_index_job_t *job = (np_index_job_t *)calloc(1, sizeof(*job));
+  if (job != NULL) {
+    job->host = np_strdup_or_empty(host);
+    job->port = port;
+    job->username = np_strdup_or_empty(username);
+    job->password = np_strdup_or_empty(password);
+    job->domain = np_strdup_or_empty(domain);
+    job->path = np_strdup_or_empty(path);
+    job->key = *key;
+  }
+  if (job == NULL || job->host == NULL || job->username == NULL ||
+      job->password == NULL || job->domain == NULL || job->path == NULL ||
+      np_thread_start(NULL, np_index_main, job) != 0) {
+    if (job != NULL) {
+      np_index_job_free(job);
+    }
+    np_index_unclaim(key);
+    return -ENOMEM;
+  }
+  return 0;
+}
@@ -0,0 +1,500 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+#include <smb2/libsmb2-raw.h>
+
+// Sessions idle for longer than this are closed.
+#define NP_POOL_DEFAULT_IDLE_TIMEOUT_MS 60000
+// Sessions idle for longer than this are verified with an ECHO before reuse.
+#define NP_POOL_HEALTH_CHECK_AFTER_MS 15000
+// Upper bound for the ECHO round trip used as a health check.
+#define NP_POOL_ECHO_TIMEOUT_S 5
+// Idle sessions kept across all servers; the least recently used go first.
+#define NP_POOL_MAX_IDLE 8
+
+static np_mutex_t g_pool_lock = NP_MUTEX_INIT;
+static np_smb2_session_t *g_pool = NULL;
+static uint64_t g_idle_timeout_ms = NP_POOL_DEFAULT_IDLE_TIMEOUT_MS;
+
+static bool np_streq(const char *a, const char *b) {
+  return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+bool np_strcaseeq(const char *a, const char *b) {
+  a = a ? a : "";
+  b = b ? b : "";
+  while (*a && *b) {
+    char ca = *a++;
+    char cb = *b++;
+    if (ca >= 'A' && ca <= 'Z') {
+      ca = (char)(ca - 'A' + 'a');
+    }
+    if (cb >= 'A' && cb <= 'Z') {
+      cb = (char)(cb - 'A' + 'a');
+    }
+    if (ca != cb) {
+      return false;
+    }
+  }
+  return *a == *b;
+}
+
+int np_normalize_port(int port) {
+  return (port <= 0 || port > 65535) ? 445 : port;
+}
+
+static const char *np_effective_user(const char *username) {
+  return np_is_empty(username) ? "guest" : username;
+}
+
+static bool np_session_matches(const np_smb2_session_t *s, const char *host,
+                               int port, const char *username,
+                               const char *password, const char *domain) {
+  return s->port == port && np_strcaseeq(s->host, host) &&
+         np_streq(s->username, username) && np_streq(s->domain, domain) &&
+         np_streq(s->password, password);
+}
+
+static int np_session_find_tree(const np_smb2_session_t *s, const char *share) {
+  for (int i = 0; i < s->ntrees; i++) {
+    if (np_strcaseeq(s->trees[i].share, share)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void np_session_destroy(np_smb2_session_t *s) {
+  if (s == NULL) {
+    return;
+  }
+  if (s->ctx != NULL) {
+    smb2_destroy_context(s->ctx);
+  }
+  free(s->host);
+  free(s->username);
+  free(s->password);
+  free(s->domain);
+  free(s);
+}
+
+void np_session_add_tree(np_smb2_session_t *s, const char *share) {
+  uint32_t tree_id = 0;
+  if (s->ntrees >= NP_SESSION_MAX_TREES) {
+    return;
+  }
+  if (smb2_get_tree_id_for_pdu(s->ctx, NULL, &tree_id) != 0) {
+    return;
+  }
+  np_smb2_tree_t *tree = &s->trees[s->ntrees++];
+  snprintf(tree->share, sizeof(tree->share), "%s", share);
+  tree->tree_id = tree_id;
+}
+
+// Unlinks every idle session that expired (or exceeds the idle cap) and
+// returns them as a list. Must be called with g_pool_lock held; the caller
+// destroys the returned sessions after dropping the lock.
+static np_smb2_session_t *np_pool_collect_expired_locked(uint64_t now) {
+  np_smb2_session_t *expired = NULL;
+  np_smb2_session_t **pp = &g_pool;
+  int idle = 0;
+
+  while (*pp != NULL) {
+    np_smb2_session_t *s = *pp;
+    if (!s->in_use && now - s->last_used_ms > g_idle_timeout_ms) {
+      *pp = s->next;
+      s->next = expired;
+      expired = s;
+      continue;
+    }
+    if (!s->in_use) {
+      idle++;
+    }
+    pp = &s->next;
+  }
+
+  while (idle > NP_POOL_MAX_IDLE) {
+    np_smb2_session_t **oldest = NULL;
+    for (pp = &g_pool; *pp != NULL; pp = &(*pp)->next) {
+      if ((*pp)->in_use) {
+        continue;
+      }
+      if (oldest == NULL || (*pp)->last_used_ms < (*oldest)->last_used_ms) {
+        oldest = pp;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+    np_smb2_session_t *s = *oldest;
+    *oldest = s->next;
+    s->next = expired;
+    expired = s;
+    idle--;
+  }
+  return expired;
+}
+
+static void np_destroy_list(np_smb2_session_t *list) {
+  while (list != NULL) {
+    np_smb2_session_t *next = list->next;
+    np_session_destroy(list);
+    list = next;
+  }
+}
+
+static void np_pool_unlink_locked(np_smb2_session_t *session) {
+  for (np_smb2_session_t **pp = &g_pool; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == session) {
+      *pp = session->next;
+      session->next = NULL;
+      return;
+    }
+  }
+}
+
+// Picks an idle session for the key, preferring one that already has the
+// share tree-connected, and marks it in use.
+static np_smb2_session_t *np_pool_take_idle_locked(const char *host, int port,
+                                                   const char *username,
+                                                   const char *password,
+                                                   const char *domain,
+                                                   const char *share) {
+  np_smb2_session_t *fallback = NULL;
+  for (np_smb2_session_t *s = g_pool; s != NULL; s = s->next) {
+    if (s->in_use ||
+        !np_session_matches(s, host, port, username, password, domain)) {
+      continue;
+    }
+    if (np_session_find_tree(s, share) >= 0) {
+      s->in_use = true;
+      return s;
+    }
+    if (fallback == NULL && s->ntrees < NP_SESSION_MAX_TREES) {
+      fallback = s;
+    }
+  }
+  if (fallback != NULL) {
+    fallback->in_use = true;
+  }
+  return fallback;
+}
+
+static bool np_session_echo_ok(np_smb2_session_t *s) {
+  smb2_set_timeout(s->ctx, NP_POOL_ECHO_TIMEOUT_S);
+  const int rc = smb2_echo(s->ctx);
+  smb2_set_timeout(s->ctx, 0);
+  return rc == 0;
+}
+
+struct np_tree_connect_state {
+  volatile int done;
+  int status;
+};
+
+static void np_tree_connect_cb(struct smb2_context *smb2, int status,
+                               void *command_data, void *cb_data) {
+  (void)smb2;
+  (void)command_data;
+  struct np_tree_connect_state *state = (struct np_tree_connect_state *)cb_data;
+  state->status = status;
+  state->done = 1;
+}
+
+int np_session_tree_connect_async(np_smb2_session_t *s, const char *share,
+                                  smb2_command_cb cb, void *cb_data) {
+  char server[1024];
+  if (np_build_server(s->host, s->port, server, sizeof(server)) != 0) {
+    return -EINVAL;
+  }
+  char unc[1024];
+  const int len = snprintf(unc, sizeof(unc), "\\\\%s\\%s", server, share);
+  if (len < 0 || (size_t)len >= sizeof(unc)) {
+    return -ENAMETOOLONG;
+  }
+  struct smb2_utf16 *utf16_unc = smb2_utf8_to_utf16(unc);
+  if (utf16_unc == NULL) {
+    return -ENOMEM;
+  }
+
+  struct smb2_tree_connect_request req;
+  memset(&req, 0, sizeof(req));
+  req.flags = 0;
+  req.path_length = (uint16_t)(2 * utf16_unc->len);
+  req.path = utf16_unc->val;
+
+  struct smb2_pdu *pdu = smb2_cmd_tree_connect_async(s->ctx, &req, cb, cb_data);
+  free(utf16_unc);
+  if (pdu == NULL) {
+    return -ENOMEM;
+  }
+  smb2_queue_pdu(s->ctx, pdu);
+  return 0;
+}
+
+// Issues a TREE_CONNECT for `share` on an already authenticated session.
+// Returns 0 on success; on failure the session itself is still usable unless
+// the socket failed (reported as -EIO).
+static int np_session_tree_connect(np_smb2_session_t *s, const char *share,
+                                   char *err_buf, int err_len) {
+  struct np_tree_connect_state state;
+  memset(&state, 0, sizeof(state));
+
+  const int rc =
+      np_session_tree_connect_async(s, share, np_tree_connect_cb, &state);
+  if (rc != 0) {
+    np_set_err(err_buf, err_len, "SMB tree connect %s failed: %s", share,
+               rc == -ENAMETOOLONG ? "name too long" : smb2_get_error(s->ctx));
+    return rc;
+  }
+
+  if (np_run_until_done(s->ctx, &state.done) != 0) {
+    np_set_err(err_buf, err_len, "SMB tree connect failed: %s",
+               smb2_get_error(s->ctx));
+    return -EIO;
+  }
+  if (state.status != SMB2_STATUS_SUCCESS) {
+    np_set_err(err_buf, err_len, "SMB tree connect %s failed: %s", share,
+               nterror_to_str(state.status));
+    return -nterror_to_errno(state.status);
+  }
+
+  np_session_add_tree(s, share);
+  return 0;
+}
+
+np_smb2_session_t *np_session_new(const char *host, int port,
+                                  const char *username, const char *password,
+                                  const char *domain, char *err_buf,
+                                  int err_len) {
+  np_smb2_session_t *s = (np_smb2_session_t *)calloc(1, sizeof(*s));
+  if (s == NULL) {
+    np_set_err(err_buf, err_len, "Out of memory");
+    return NULL;
+  }
+  s->port = np_normalize_port(port);
+  s->host = np_strdup_or_empty(host);
+  s->username = np_strdup_or_empty(username);
+  s->password = np_strdup_or_empty(password);
+  s->domain = np_strdup_or_empty(domain);
+  if (s->host == NULL || s->username == NULL || s->password == NULL ||
+      s->domain == NULL) {
+    np_set_err(err_buf, err_len, "Out of memory");
+    np_session_destroy(s);
+    return NULL;
+  }
+
+  s->ctx = smb2_init_context();
+  if (s->ctx == NULL) {
+    np_set_err(err_buf, err_len, "smb2_init_context failed");
+    np_session_destroy(s);
+    return NULL;
+  }
+  np_apply_credentials(s->ctx, username, password, domain);
+  s->in_use = true;
+  return s;
+}
+
+static np_smb2_session_t *np_session_connect(const char *host, int port,
+                                             const char *username,
+                                             const char *password,
+                                             const char *domain,
+                                             const char *share, int *out_rc,
+                                             char *err_buf, int err_len) {
+  char server[1024];
+  *out_rc = np_build_server(host, port, server, sizeof(server));
+  if (*out_rc != 0) {
+    np_set_err(err_buf, err_len, "Invalid server");
+    return NULL;
+  }
+
+  np_smb2_session_t *s = np_session_new(host, port, username, password, domain,
+                                        err_buf, err_len);
+  if (s == NULL) {
+    *out_rc = -ENOMEM;
+    return NULL;
+  }
+
+  *out_rc =
+      smb2_connect_share(s->ctx, server, share, np_effective_user(username));
+  if (*out_rc != 0) {
+    np_set_err(err_buf, err_len, "SMB connect %s failed: %s", share,
+               smb2_get_error(s->ctx));
+    np_session_destroy(s);
+    return NULL;
+  }
+
+  np_session_add_tree(s, share);
+  return s;
+}
+
+np_smb2_session_t *np_pool_take_idle(const char *host, int port,
+                                     const char *username,
+                                     const char *password, const char *domain,
+                                     const char *share, bool *out_check) {
+  port = np_normalize_port(port);
+  username = username ? username : "";
+  password = password ? password : "";
+  domain = domain ? domain : "";
+
+  const uint64_t now = np_now_ms();
+  np_mutex_lock(&g_pool_lock);
+  np_smb2_session_t *expired = np_pool_collect_expired_locked(now);
+  np_smb2_session_t *s =
+      np_pool_take_idle_locked(host, port, username, password, domain, share);
+  np_mutex_unlock(&g_pool_lock);
+  np_destroy_list(expired);
+
+  if (s != NULL) {
+    *out_check =
+        s->suspect || now - s->last_used_ms > NP_POOL_HEALTH_CHECK_AFTER_MS;
+  }
+  return s;
+}
+
+int np_session_select_tree(np_smb2_session_t *s, const char *share) {
+  const int idx = np_session_find_tree(s, share);
+  if (idx < 0) {
+    return -ENOENT;
+  }
+  if (smb2_select_tree_id(s->ctx, s->trees[idx].tree_id) != 0) {
+    return -EIO;
+  }
+  return 0;
+}
+
+void np_pool_insert(np_smb2_session_t *session) {
+  np_mutex_lock(&g_pool_lock);
+  session->next = g_pool;
+  g_pool = session;
+  np_mutex_unlock(&g_pool_lock);
+}
+
+np_smb2_session_t *np_pool_acquire(const char *host, int port,
+                                   const char *username, const char *password,
+                                   const char *domain, const char *share,
+                                   int *out_rc, char *err_buf, int err_len) {
+  int unused_rc;
+  if (out_rc == NULL) {
+    out_rc = &unused_rc;
+  }
+  if (np_is_empty(host) || np_is_empty(share)) {
+    np_set_err(err_buf, err_len, "Invalid server or share");
+    *out_rc = -EINVAL;
+    return NULL;
+  }
+
+  for (;;) {
+    bool check = false;
+    np_smb2_session_t *s = np_pool_take_idle(host, port, username, password,
+                                             domain, share, &check);
+    if (s == NULL) {
+      break;
+    }
+
+    if (check && !np_session_echo_ok(s)) {
+      np_pool_release(s, NP_RELEASE_DISCARD);
+      continue;
+    }
+    s->suspect = false;
+
+    int rc = np_session_select_tree(s, share);
+    if (rc == -ENOENT) {
+      rc = np_session_tree_connect(s, share, err_buf, err_len);
+      if (rc == -EIO) {
+        np_pool_release(s, NP_RELEASE_DISCARD);
+        continue;
+      }
+      if (rc != 0) {
+        np_pool_release(s, NP_RELEASE_OK);
+        *out_rc = rc;
+        return NULL;
+      }
+      return s;
+    }
+    if (rc != 0) {
+      np_pool_release(s, NP_RELEASE_DISCARD);
+      continue;
+    }
+    return s;
+  }
+
+  np_smb2_session_t *s = np_session_connect(
+      host, port, username, password, domain, share, out_rc, err_buf, err_len);
+  if (s == NULL) {
+    return NULL;
+  }
+  np_pool_insert(s);
+  return s;
+}
+
+void np_pool_release(np_smb2_session_t *session, enum np_release_mode mode) {
+  if (session == NULL) {
+    return;
+  }
+
+  np_mutex_lock(&g_pool_lock);
+  if (mode == NP_RELEASE_DISCARD) {
+    np_pool_unlink_locked(session);
+  } else {
+    session->in_use = false;
+    session->suspect = session->suspect || mode == NP_RELEASE_SUSPECT;
+    session->last_used_ms = np_now_ms();
+  }
+  np_smb2_session_t *expired = np_pool_collect_expired_locked(np_now_ms());
+  np_mutex_unlock(&g_pool_lock);
+
+  if (mode == NP_RELEASE_DISCARD) {
+    np_session_destroy(session);
+  }
+  np_destroy_list(expired);
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_pool_acquire(const char *host, int port,
+                                                const char *username,
+                                                const char *password,
+                                                const char *domain,
+                                                const char *share,
+                                                char *err_buf, int err_len) {
+  return (intptr_t)np_pool_acquire(host, port, username, password, domain,
+                                   share, NULL, err_buf, err_len);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_pool_release(intptr_t session, int discard) {
+  np_pool_release((np_smb2_session_t *)session,
+                  discard ? NP_RELEASE_DISCARD : NP_RELEASE_OK);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_pool_set_idle_timeout(int idle_timeout_ms) {
+  np_mutex_lock(&g_pool_lock);
+  g_idle_timeout_ms = idle_timeout_ms > 0 ? (uint64_t)idle_timeout_ms
+                                          : NP_POOL_DEFAULT_IDLE_TIMEOUT_MS;
+  np_mutex_unlock(&g_pool_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_pool_clear(void) {
+  np_smb2_session_t *idle = NULL;
+
+  np_mutex_lock(&g_pool_lock);
+  np_smb2_session_t **pp = &g_pool;
+  while (*pp != NULL) {
+    np_smb2_session_t *s = *pp;
+    if (s->in_use) {
+      pp = &s->next;
+      continue;
+    }
+    *pp = s->next;
+    s->next = idle;
+    idle = s;
+  }
+  np_mutex_unlock(&g_pool_lock);
+
+  np_destroy_list(idle);
+}
@@ -0,0 +1,1725 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+#include <smb2/libsmb2-raw.h>
+
+#if !defined(_WIN32) && !defined(_WINDOWS)
+
+#include <poll.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// Timeouts of queued requests (ECHO health checks) are checked this often.
+#define NP_REACTOR_TICK_MS 1000
+// Same bound as the pool's synchronous health check.
+#define NP_REACTOR_ECHO_TIMEOUT_S 5
+#define NP_REACTOR_MAX_EVENTS 64
+// Requests per host that may be connecting or waiting on the server at once;
+// the rest queue per host, so a slow server only delays its own requests.
+#define NP_REACTOR_HOST_CONCURRENCY 4
+// How long a cancelled request may keep its session to let an outstanding
+// reply land before the session is torn down instead.
+#define NP_REACTOR_CANCEL_GRACE_MS 10000
+
+// The subset of Dart_CObject (dart_native_api.h) that completions use. Dart
+// hands us NativeApi.postCObject, so the SDK headers are not needed; the
+// message is copied before the call returns.
+enum {
+  NP_COBJECT_INT64 = 3,  // Dart_CObject_kInt64
+  NP_COBJECT_STRING = 5, // Dart_CObject_kString
+  NP_COBJECT_ARRAY = 6,  // Dart_CObject_kArray
+};
+
+typedef struct np_cobject {
+  int type;
+  union {
+    int64_t as_int64;
+    const char *as_string;
+    struct {
+      intptr_t length;
+      struct np_cobject **values;
+    } as_array;
+  } value;
+} np_cobject_t;
+
+typedef bool (*np_post_cobject_fn)(int64_t port, void *message);
+
+enum np_job_kind {
+  NP_JOB_LIST_SHARES,
+  NP_JOB_LIST_DIR,
+  NP_JOB_STAT,
+  NP_JOB_STREAM,
+};
+
+// States from NP_JOB_STREAMING on no longer hold a host slot.
+enum np_job_state {
+  // Waiting for a slot of the host's concurrency limit.
+  NP_JOB_QUEUED,
+  // Take an idle session or start connecting a new one.
+  NP_JOB_ACQUIRE,
+  NP_JOB_CONNECTING,
+  NP_JOB_ECHO,
+  // Select the share's tree, connecting it if the session has none yet.
+  NP_JOB_TREE,
+  NP_JOB_TREE_CONNECT,
+  // The session is ready; issue the operation.
+  NP_JOB_ISSUE,
+  NP_JOB_WAIT,
+  NP_JOB_FSTAT,
+  NP_JOB_STREAMING,
+  // Let outstanding READs land, then close the file.
+  NP_JOB_DRAIN,
+  NP_JOB_CLOSE,
+  // The session is released; streams stay until Dart closes them.
+  NP_JOB_DONE,
+};
+
+typedef struct np_job np_job_t;
+
+// Shared by the requests that should be cancelled together. Guarded by
+// g_reactor_lock.
+typedef struct np_cancel_token {
+  int refs;
+  bool cancelled;
+} np_cancel_token_t;
+
+// Admission of one server's requests (reactor thread only).
+typedef struct np_host {
+  struct np_host *next;
+  char *host;
+  int port;
+  int active;
+  np_job_t *queue;
+  np_job_t **queue_tail;
+} np_host_t;
+
+// A socket of a leased context registered with the poller.
+typedef struct np_watch {
+  struct np_watch *next;
+  np_job_t *job;
+  int fd;
+  int events;
+  bool dead;
+} np_watch_t;
+
+struct np_job {
+  struct np_job *next;
+  int kind;
+  int state;
+
+  int64_t reply_port;
+  int64_t request_id;
+
+  char *host;
+  int port;
+  char *username;
+  char *password;
+  char *domain;
+  char share[512];
+  char inner_path[4096];
+
+  np_smb2_session_t *session;
+  np_watch_t *watches;
+  // When to start connecting to the next resolved address (happy eyeballs).
+  uint64_t retry_at_ms;
+
+  // Completion of the request in flight.
+  bool done;
+  int status;
+  void *data;
+
+  // Servicing the socket failed; the session must be discarded.
+  bool broken;
+  // An operation failed; verify the session before it is reused.
+  bool failed;
+  // The final result or error has been posted.
+  bool replied;
+
+  struct smb2_stat_64 st;
+  struct smb2fh *fh;
+  np_smb2_stream_t *stream;
+  uint64_t start;
+  uint64_t end_exclusive;
+  uint32_t chunk_size;
+  int queue_depth;
+  // Chunks Dart is willing to take; each posted chunk uses one.
+  int credits;
+  // Dart closed the stream handle; nothing more is posted.
+  bool closed;
+
+  // Reactor thread only: the job is linked into g_reactor.jobs.
+  bool linked;
+  // The host the job is queued at or holds a slot of.
+  np_host_t *slot_host;
+  bool has_slot;
+  // Next in the host's queue, or in g_reactor.runnable once admitted.
+  np_job_t *queue_next;
+  // Fail with -ETIMEDOUT at this time (0: never). Set from the request's
+  // timeout and cleared once a stream is open.
+  uint64_t deadline_ms;
+  // The token was cancelled; `cancel_handled` once that has been acted on.
+  bool cancelled;
+  bool cancel_handled;
+  np_cancel_token_t *token;
+
+  // Guarded by g_reactor_lock: news from Dart for the reactor thread.
+  np_job_t *inbox_next;
+  bool in_inbox;
+  int credit_grant;
+  bool close_requested;
+
+  char err[256];
+};
+
+typedef struct np_ready {
+  np_watch_t *watch;
+  int revents;
+} np_ready_t;
+
+typedef struct np_reactor {
+  bool running;
+  np_job_t *inbox;
+  np_job_t **inbox_tail;
+  // A token was cancelled or the host limit raised since the inbox was last
+  // taken.
+  bool rescan;
+  int host_limit;
+
+  // Everything below belongs to the reactor thread.
+  np_job_t *jobs;
+  np_host_t *hosts;
+  // Admitted from a host queue; run before the next wait.
+  np_job_t *runnable;
+  int active_limit;
+  np_watch_t *graveyard;
+  np_watch_t wake;
+  uint64_t next_tick_ms;
+  np_ready_t ready[NP_REACTOR_MAX_EVENTS];
+#if defined(__linux__)
+  int epfd;
+  int wake_fd;
+#else
+  int wake_pipe[2];
+  np_watch_t **watches;
+  struct pollfd *pfds;
+  int nwatches;
+  int cap;
+#endif
+} np_reactor_t;
+
+static np_mutex_t g_reactor_lock = NP_MUTEX_INIT;
+static np_reactor_t g_reactor = {.host_limit = NP_REACTOR_HOST_CONCURRENCY};
+static np_post_cobject_fn g_post;
+
+// ---------------------------------------------------------------------------
+// Poller: epoll on Linux/Android, poll() elsewhere
+// ---------------------------------------------------------------------------
+
+#if defined(__linux__)
+static uint32_t np_epoll_events(int events) {
+  return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+static int np_poll_events(uint32_t events) {
+  return ((events & EPOLLIN) ? POLLIN : 0) |
+         ((events & EPOLLOUT) ? POLLOUT : 0) |
+         ((events & EPOLLERR) ? POLLERR : 0) |
+         ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+static int np_poller_init(np_reactor_t *r) {
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd < 0) {
+    return -errno;
+  }
+  r->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (r->wake_fd < 0) {
+    const int rc = -errno;
+    close(r->epfd);
+    return rc;
+  }
+  return 0;
+}
+
+static void np_poller_destroy(np_reactor_t *r) {
+  close(r->wake_fd);
+  close(r->epfd);
+}
+
+static int np_wake_fd(np_reactor_t *r) { return r->wake_fd; }
+
+static int np_poller_add(np_reactor_t *r, np_watch_t *w) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = np_epoll_events(w->events);
+  ev.data.ptr = w;
+  return epoll_ctl(r->epfd, EPOLL_CTL_ADD, w->fd, &ev) == 0 ? 0 : -errno;
+}
+
+static void np_poller_mod(np_reactor_t *r, np_watch_t *w) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = np_epoll_events(w->events);
+  ev.data.ptr = w;
+  epoll_ctl(r->epfd, EPOLL_CTL_MOD, w->fd, &ev);
+}
+
+static void np_poller_del(np_reactor_t *r, np_watch_t *w) {
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+static int np_poller_wait(np_reactor_t *r, int timeout_ms) {
+  struct epoll_event events[NP_REACTOR_MAX_EVENTS];
+  const int n = epoll_wait(r->epfd, events, NP_REACTOR_MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; i++) {
+    r->ready[i].watch = (np_watch_t *)events[i].data.ptr;
+    r->ready[i].revents = np_poll_events(events[i].events);
+  }
+  return n < 0 ? 0 : n;
+}
+
+static void np_reactor_wake(np_reactor_t *r) {
+  const uint64_t one = 1;
+  (void)!write(r->wake_fd, &one, sizeof(one));
+}
+
+static void np_reactor_drain_wake(np_reactor_t *r) {
+  uint64_t value;
+  (void)!read(r->wake_fd, &value, sizeof(value));
+}
+#else
+static int np_poller_init(np_reactor_t *r) {
+  if (pipe(r->wake_pipe) != 0) {
+    return -errno;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(r->wake_pipe[i], F_SETFL, fcntl(r->wake_pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(r->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  return 0;
+}
+
+static void np_poller_destroy(np_reactor_t *r) {
+  close(r->wake_pipe[0]);
+  close(r->wake_pipe[1]);
+  free(r->watches);
+  free(r->pfds);
+  r->watches = NULL;
+  r->pfds = NULL;
+  r->nwatches = 0;
+  r->cap = 0;
+}
+
+static int np_wake_fd(np_reactor_t *r) { return r->wake_pipe[0]; }
+
+static int np_poller_add(np_reactor_t *r, np_watch_t *w) {
+  if (r->nwatches == r->cap) {
+    const int cap = r->cap > 0 ? r->cap * 2 : 16;
+    np_watch_t **watches =
+        (np_watch_t **)realloc(r->watches, (size_t)cap * sizeof(*watches));
+    if (watches == NULL) {
+      return -ENOMEM;
+    }
+    r->watches = watches;
+    struct pollfd *pfds =
+        (struct pollfd *)realloc(r->pfds, (size_t)cap * sizeof(*pfds));
+    if (pfds == NULL) {
+      return -ENOMEM;
+    }
+    r->pfds = pfds;
+    r->cap = cap;
+  }
+  r->watches[r->nwatches++] = w;
+  return 0;
+}
+
+static void np_poller_mod(np_reactor_t *r, np_watch_t *w) {
+  (void)r;
+  (void)w;
+}
+
+static void np_poller_del(np_reactor_t *r, np_watch_t *w) {
+  for (int i = 0; i < r->nwatches; i++) {
+    if (r->watches[i] == w) {
+      r->watches[i] = r->watches[--r->nwatches];
+      return;
+    }
+  }
+}
+
+static int np_poller_wait(np_reactor_t *r, int timeout_ms) {
+  for (int i = 0; i < r->nwatches; i++) {
+    r->pfds[i].fd = r->watches[i]->fd;
+    r->pfds[i].events = (short)r->watches[i]->events;
+    r->pfds[i].revents = 0;
+  }
+  if (poll(r->pfds, (nfds_t)r->nwatches, timeout_ms) <= 0) {
+    return 0;
+  }
+  int n = 0;
+  for (int i = 0; i < r->nwatches && n < NP_REACTOR_MAX_EVENTS; i++) {
+    if (r->pfds[i].revents != 0) {
+      r->ready[n].watch = r->watches[i];
+      r->ready[n].revents = r->pfds[i].revents;
+      n++;
+    }
+  }
+  return n;
+}
+
+static void np_reactor_wake(np_reactor_t *r) {
+  const char c = 0;
+  (void)!write(r->wake_pipe[1], &c, 1);
+}
+
+static void np_reactor_drain_wake(np_reactor_t *r) {
+  char buf[64];
+  while (read(r->wake_pipe[0], buf, sizeof(buf)) > 0) {
+  }
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Sockets of leased contexts
+// ---------------------------------------------------------------------------
+
+static np_watch_t *np_watch_find(np_job_t *job, int fd) {
+  for (np_watch_t *w = job->watches; w != NULL; w = w->next) {
+    if (w->fd == fd) {
+      return w;
+    }
+  }
+  return NULL;
+}
+
+static void np_watch_add(np_job_t *job, int fd, int events) {
+  np_watch_t *w = (np_watch_t *)calloc(1, sizeof(*w));
+  if (w == NULL) {
+    job->broken = true;
+    return;
+  }
+  w->job = job;
+  w->fd = fd;
+  w->events = events;
+  if (np_poller_add(&g_reactor, w) != 0) {
+    free(w);
+    job->broken = true;
+    return;
+  }
+  w->next = job->watches;
+  job->watches = w;
+}
+
+// Ready events of this round may still point at the watch, so it is only
+// freed once the round is over.
+static void np_watch_remove(np_job_t *job, np_watch_t *w) {
+  for (np_watch_t **pp = &job->watches; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == w) {
+      *pp = w->next;
+      break;
+    }
+  }
+  np_poller_del(&g_reactor, w);
+  w->dead = true;
+  w->next = g_reactor.graveyard;
+  g_reactor.graveyard = w;
+}
+
+static void np_watch_set_events(np_watch_t *w, int events) {
+  if (w->events != events) {
+    w->events = events;
+    np_poller_mod(&g_reactor, w);
+  }
+}
+
+static void np_job_fd_cb(struct smb2_context *smb2, int fd, int cmd) {
+  np_job_t *job = (np_job_t *)smb2_get_opaque(smb2);
+  if (job == NULL) {
+    return;
+  }
+  np_watch_t *w = np_watch_find(job, fd);
+  if (cmd == SMB2_ADD_FD) {
+    // A new connection attempt; it reports in with POLLOUT.
+    if (w == NULL) {
+      np_watch_add(job, fd, POLLOUT);
+    }
+  } else if (w != NULL) {
+    np_watch_remove(job, w);
+  }
+}
+
+static void np_job_events_cb(struct smb2_context *smb2, int fd, int events) {
+  np_job_t *job = (np_job_t *)smb2_get_opaque(smb2);
+  np_watch_t *w = job != NULL ? np_watch_find(job, fd) : NULL;
+  if (w != NULL) {
+    np_watch_set_events(w, events);
+  }
+}
+
+// The leased context reports its sockets to the reactor until released.
+static void np_job_watch(np_job_t *job) {
+  struct smb2_context *ctx = job->session->ctx;
+  smb2_set_opaque(ctx, job);
+  smb2_fd_event_callbacks(ctx, np_job_fd_cb, np_job_events_cb);
+  const int fd = smb2_get_fd(ctx);
+  if (fd >= 0) {
+    np_watch_add(job, fd, smb2_which_events(ctx));
+  }
+}
+
+static void np_job_unwatch(np_job_t *job) {
+  struct smb2_context *ctx = job->session->ctx;
+  while (job->watches != NULL) {
+    np_watch_remove(job, job->watches);
+  }
+  smb2_fd_event_callbacks(ctx, NULL, NULL);
+  smb2_set_opaque(ctx, NULL);
+}
+
+// libsmb2 skips the events callback when its cached value is stale (e.g. from
+// an earlier lease), so re-check the interest set after touching the context.
+static void np_job_sync(np_job_t *job) {
+  if (job->session == NULL) {
+    return;
+  }
+  struct smb2_context *ctx = job->session->ctx;
+  const int fd = smb2_get_fd(ctx);
+  if (fd < 0) {
+    return;
+  }
+  np_watch_t *w = np_watch_find(job, fd);
+  if (w == NULL) {
+    np_watch_add(job, fd, smb2_which_events(ctx));
+  } else {
+    np_watch_set_events(w, smb2_which_events(ctx));
+  }
+}
+
+static void np_job_release(np_job_t *job, enum np_release_mode mode) {
+  if (job->session == NULL) {
+    return;
+  }
+  np_job_unwatch(job);
+  np_pool_release(job->session, mode);
+  job->session = NULL;
+  job->retry_at_ms = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Completions
+// ---------------------------------------------------------------------------
+
+// Posts [request_id, status, values..., str] to the job's reply port.
+static bool np_job_post(np_job_t *job, int64_t status, const int64_t *values,
+                        int count, const char *str) {
+  np_cobject_t items[6];
+  np_cobject_t *ptrs[6];
+  int n = 0;
+
+  items[n].type = NP_COBJECT_INT64;
+  items[n++].value.as_int64 = job->request_id;
+  items[n].type = NP_COBJECT_INT64;
+  items[n++].value.as_int64 = status;
+  for (int i = 0; i < count && n < 5; i++) {
+    items[n].type = NP_COBJECT_INT64;
+    items[n++].value.as_int64 = values[i];
+  }
+  if (str != NULL) {
+    items[n].type = NP_COBJECT_STRING;
+    items[n++].value.as_string = str;
+  }
+  for (int i = 0; i < n; i++) {
+    ptrs[i] = &items[i];
+  }
+
+  np_cobject_t message;
+  message.type = NP_COBJECT_ARRAY;
+  message.value.as_array.length = n;
+  message.value.as_array.values = ptrs;
+  return g_post(job->reply_port, &message);
+}
+
+static void np_job_reply(np_job_t *job, const int64_t *values, int count,
+                         const char *str) {
+  if (!job->replied && !job->closed) {
+    np_job_post(job, NP_SMB2_ASYNC_DONE, values, count, str);
+  }
+  job->replied = true;
+}
+
+static void np_job_error(np_job_t *job, int rc, const char *fmt, ...) {
+  if (!job->replied && !job->closed) {
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    np_job_post(job, rc < 0 ? rc : -EIO, NULL, 0, msg);
+  }
+  job->replied = true;
+}
+
+static void np_job_cb(struct smb2_context *smb2, int status,
+                      void *command_data, void *cb_data) {
+  (void)smb2;
+  np_job_t *job = (np_job_t *)cb_data;
+  job->status = status;
+  job->data = command_data;
+  job->done = true;
+}
+
+static const char *np_job_smb_path(const np_job_t *job) {
+  return job->inner_path[0] == '/' ? job->inner_path + 1 : job->inner_path;
+}
+
+// Dart closed the stream, or the request was failed early (cancelled or
+// timed out): nothing more is posted, the job only winds down.
+static bool np_job_abandoned(const np_job_t *job) {
+  return job->closed || job->replied;
+}
+
+// ---------------------------------------------------------------------------
+// Jobs
+// ---------------------------------------------------------------------------
+
+// Destroys the session along with whatever is in flight on it.
+static void np_job_discard(np_job_t *job) {
+  // Destroying the context fails the outstanding READs before the stream
+  // and its buffers go away, and a queued CLOSE is the only way to have the
+  // file handle freed.
+  if (job->fh != NULL) {
+    smb2_close_async(job->session->ctx, job->fh, np_job_cb, job);
+  }
+  np_job_release(job, NP_RELEASE_DISCARD);
+  if (job->stream != NULL) {
+    np_stream_detach(job->stream);
+    job->stream = NULL;
+  }
+  job->fh = NULL;
+}
+
+static void np_job_broken(np_job_t *job) {
+  job->broken = false;
+  if (job->session == NULL) {
+    return;
+  }
+  // Like np_pool_acquire(), a stale idle session is replaced transparently.
+  const bool retry =
+      job->state == NP_JOB_ECHO || job->state == NP_JOB_TREE_CONNECT;
+  if (job->state == NP_JOB_CONNECTING) {
+    np_job_error(job, -EIO, "SMB connect %s failed: %s", job->share,
+                 smb2_get_error(job->session->ctx));
+  } else if (!retry) {
+    np_job_error(job, -EIO, "SMB connection failed: %s",
+                 smb2_get_error(job->session->ctx));
+  }
+  np_job_discard(job);
+  job->state = retry ? NP_JOB_ACQUIRE : NP_JOB_DONE;
+}
+
+static void np_job_finish(np_job_t *job, enum np_release_mode mode) {
+  np_job_release(job, mode);
+  job->state = NP_JOB_DONE;
+}
+
+static bool np_job_acquire(np_job_t *job) {
+  bool check = false;
+  np_smb2_session_t *s =
+      np_pool_take_idle(job->host, job->port, job->username, job->password,
+                        job->domain, job->share, &check);
+  if (s != NULL) {
+    job->session = s;
+    np_job_watch(job);
+    if (!check) {
+      job->state = NP_JOB_TREE;
+      return true;
+    }
+    job->done = false;
+    smb2_set_timeout(s->ctx, NP_REACTOR_ECHO_TIMEOUT_S);
+    if (smb2_echo_async(s->ctx, np_job_cb, job) != 0) {
+      np_job_release(job, NP_RELEASE_DISCARD);
+      return true;
+    }
+    job->state = NP_JOB_ECHO;
+    return true;
+  }
+
+  char server[1024];
+  if (np_build_server(job->host, job->port, server, sizeof(server)) != 0) {
+    np_job_error(job, -EINVAL, "Invalid server");
+    job->state = NP_JOB_DONE;
+    return false;
+  }
+  s = np_session_new(job->host, job->port, job->username, job->password,
+                     job->domain, job->err, sizeof(job->err));
+  if (s == NULL) {
+    np_job_error(job, -ENOMEM, "%s", job->err);
+    job->state = NP_JOB_DONE;
+    return false;
+  }
+  job->session = s;
+  np_job_watch(job);
+  job->done = false;
+  job->state = NP_JOB_CONNECTING;
+  const char *user = np_is_empty(job->username) ? "guest" : job->username;
+  if (smb2_connect_share_async(s->ctx, server, job->share, user, np_job_cb,
+                               job) != 0) {
+    np_job_error(job, -EIO, "SMB connect %s failed: %s", job->share,
+                 smb2_get_error(s->ctx));
+    np_job_finish(job, NP_RELEASE_DISCARD);
+  }
+  return true;
+}
+
+static bool np_job_issue(np_job_t *job) {
+  struct smb2_context *ctx = job->session->ctx;
+  int rc = 0;
+
+  if (np_job_abandoned(job)) {
+    np_job_finish(job, NP_RELEASE_OK);
+    return false;
+  }
+  job->done = false;
+  switch (job->kind) {
+  case NP_JOB_LIST_SHARES:
+    rc = smb2_share_enum_async(ctx, SHARE_INFO_1, np_job_cb, job);
+    break;
+  case NP_JOB_LIST_DIR:
+    rc = smb2_opendir_async(ctx, np_job_smb_path(job), np_job_cb, job);
+    break;
+  case NP_JOB_STAT:
+    rc = smb2_stat_async(ctx, np_job_smb_path(job), &job->st, np_job_cb, job);
+    break;
+  case NP_JOB_STREAM:
+    rc = smb2_open_async(ctx, np_job_smb_path(job), O_RDONLY, np_job_cb, job);
+    break;
+  }
+  if (rc < 0) {
+    np_job_error(job, rc, "SMB request failed: %s", smb2_get_error(ctx));
+    np_job_finish(job, NP_RELEASE_SUSPECT);
+    return false;
+  }
+  job->state = NP_JOB_WAIT;
+  return false;
+}
+
+static void np_job_complete(np_job_t *job) {
+  struct smb2_context *ctx = job->session->ctx;
+
+  switch (job->kind) {
+  case NP_JOB_LIST_SHARES: {
+    struct srvsvc_NetrShareEnum_rep *rep =
+        (struct srvsvc_NetrShareEnum_rep *)job->data;
+    if (job->status != 0 || rep == NULL) {
+      if (rep != NULL) {
+        smb2_free_data(ctx, rep);
+      }
+      np_job_error(job, -EIO, "SMB share enum failed: %s",
+                   smb2_get_error(ctx));
+      np_job_finish(job, NP_RELEASE_SUSPECT);
+      return;
+    }
+    char *json = np_shares_json(rep);
+    smb2_free_data(ctx, rep);
+    if (json == NULL) {
+      np_job_error(job, -ENOMEM, "Out of memory");
+    } else {
+      np_job_reply(job, NULL, 0, json);
+    }
+    free(json);
+    np_job_finish(job, NP_RELEASE_OK);
+    return;
+  }
+  case NP_JOB_LIST_DIR: {
+    struct smb2dir *dir = (struct smb2dir *)job->data;
+    if (job->status < 0 || dir == NULL) {
+      np_job_error(job, job->status, "SMB opendir failed: %s",
+                   smb2_get_error(ctx));
+      np_job_finish(job, NP_RELEASE_SUSPECT);
+      return;
+    }
+    char *json = np_dir_json(ctx, dir, job->share, job->inner_path);
+    smb2_closedir(ctx, dir);
+    if (json == NULL) {
+      np_job_error(job, -ENOMEM, "Out of memory");
+    } else {
+      np_job_reply(job, NULL, 0, json);
+    }
+    free(json);
+    np_job_finish(job, NP_RELEASE_OK);
+    return;
+  }
+  case NP_JOB_STAT:
+    if (job->status < 0) {
+      np_job_error(job, job->status, "SMB stat failed: %s",
+                   smb2_get_error(ctx));
+      np_job_finish(job, NP_RELEASE_SUSPECT);
+      return;
+    }
+    {
+      const int64_t values[2] = {(int64_t)job->st.smb2_type,
+                                 (int64_t)job->st.smb2_size};
+      np_job_reply(job, values, 2, NULL);
+    }
+    np_job_finish(job, NP_RELEASE_OK);
+    return;
+  case NP_JOB_STREAM:
+    if (job->status < 0 || job->data == NULL) {
+      np_job_error(job, job->status, "SMB open failed: %s",
+                   smb2_get_error(ctx));
+      np_job_finish(job, NP_RELEASE_SUSPECT);
+      return;
+    }
+    job->fh = (struct smb2fh *)job->data;
+    if (np_job_abandoned(job)) {
+      job->state = NP_JOB_DRAIN;
+      return;
+    }
+    job->done = false;
+    if (smb2_fstat_async(ctx, job->fh, &job->st, np_job_cb, job) < 0) {
+      np_job_error(job, -EIO, "SMB fstat failed: %s", smb2_get_error(ctx));
+      job->failed = true;
+      job->state = NP_JOB_DRAIN;
+      return;
+    }
+    job->state = NP_JOB_FSTAT;
+    return;
+  }
+}
+
+static void np_job_open_stream(np_job_t *job) {
+  struct smb2_context *ctx = job->session->ctx;
+  job->state = NP_JOB_DRAIN;
+  if (job->status != 0) {
+    np_job_error(job, job->status, "SMB fstat failed: %s",
+                 smb2_get_error(ctx));
+    job->failed = true;
+    return;
+  }
+  if (job->st.smb2_type == SMB2_TYPE_DIRECTORY) {
+    np_job_error(job, -EISDIR, "Path is a directory");
+    return;
+  }
+  if (np_job_abandoned(job)) {
+    return;
+  }
+  np_cache_key_t key;
+  np_cache_key_init(&key, job->host, job->port, job->share, job->inner_path,
+                    &job->st);
+  job->stream = np_stream_create(job->session, job->fh, job->st.smb2_size,
+                                 job->start, job->end_exclusive,
+                                 job->chunk_size, job->queue_depth, &key);
+  if (job->stream == NULL) {
+    np_job_error(job, -ENOMEM, "Out of memory");
+    return;
+  }
+  const int64_t size = (int64_t)job->st.smb2_size;
+  np_job_post(job, NP_SMB2_ASYNC_OPENED, &size, 1, NULL);
+  job->state = NP_JOB_STREAMING;
+  // The timeout covers opening; reading is paced by Dart's credits.
+  job->deadline_ms = 0;
+}
+
+// Hand out chunks while Dart has credits left.
+static void np_job_pump(np_job_t *job) {
+  if (job->closed) {
+    job->state = NP_JOB_DRAIN;
+    return;
+  }
+  while (job->credits > 0) {
+    uint8_t *data = NULL;
+    const int rc =
+        np_stream_poll(job->stream, &data, job->err, sizeof(job->err));
+    if (rc == -EAGAIN) {
+      return;
+    }
+    if (rc > 0) {
+      // The reference travels with the message; Dart's finalizer drops it.
+      np_buf_retain(data);
+      const int64_t values[2] = {(int64_t)(intptr_t)data, rc};
+      if (!np_job_post(job, NP_SMB2_ASYNC_CHUNK, values, 2, NULL)) {
+        np_buf_release(data);
+      }
+      job->credits--;
+      continue;
+    }
+    if (rc == 0) {
+      np_job_reply(job, NULL, 0, NULL);
+    } else {
+      np_job_error(job, rc, "%s", job->err);
+    }
+    job->state = NP_JOB_DRAIN;
+    return;
+  }
+}
+
+static bool np_job_drain(np_job_t *job) {
+  if (job->stream != NULL) {
+    // Stop READs nobody will consume; only a reply already being decrypted
+    // has to land.
+    np_stream_cancel(job->stream);
+    if (!np_stream_idle(job->stream)) {
+      return false;
+    }
+    if (np_stream_detach(job->stream) != NP_RELEASE_OK) {
+      job->failed = true;
+    }
+    job->stream = NULL;
+  }
+  const enum np_release_mode mode =
+      job->failed ? NP_RELEASE_SUSPECT : NP_RELEASE_OK;
+  if (job->fh == NULL) {
+    np_job_finish(job, mode);
+    return false;
+  }
+  job->done = false;
+  if (smb2_close_async(job->session->ctx, job->fh, np_job_cb, job) < 0) {
+    job->fh = NULL;
+    np_job_finish(job, NP_RELEASE_SUSPECT);
+    return false;
+  }
+  job->fh = NULL;
+  job->state = NP_JOB_CLOSE;
+  return false;
+}
+
+// Advances the job by one state. Returns true if the next state can run
+// right away.
+static bool np_job_step(np_job_t *job) {
+  switch (job->state) {
+  case NP_JOB_QUEUED:
+    return false;
+
+  case NP_JOB_ACQUIRE:
+    return np_job_acquire(job);
+
+  case NP_JOB_CONNECTING:
+    if (!job->done) {
+      return false;
+    }
+    job->retry_at_ms = 0;
+    if (job->status != 0) {
+      np_job_error(job, -EIO, "SMB connect %s failed: %s", job->share,
+                   smb2_get_error(job->session->ctx));
+      np_job_finish(job, NP_RELEASE_DISCARD);
+      return false;
+    }
+    np_session_add_tree(job->session, job->share);
+    np_pool_insert(job->session);
+    job->state = NP_JOB_ISSUE;
+    return true;
+
+  case NP_JOB_ECHO:
+    if (!job->done) {
+      return false;
+    }
+    smb2_set_timeout(job->session->ctx, 0);
+    if (job->status != 0) {
+      np_job_release(job, NP_RELEASE_DISCARD);
+      job->state = NP_JOB_ACQUIRE;
+      return true;
+    }
+    job->session->suspect = false;
+    job->state = NP_JOB_TREE;
+    return true;
+
+  case NP_JOB_TREE: {
+    const int rc = np_session_select_tree(job->session, job->share);
+    if (rc == 0) {
+      job->state = NP_JOB_ISSUE;
+      return true;
+    }
+    if (rc != -ENOENT) {
+      np_job_release(job, NP_RELEASE_DISCARD);
+      job->state = NP_JOB_ACQUIRE;
+      return true;
+    }
+    job->done = false;
+    if (np_session_tree_connect_async(job->session, job->share, np_job_cb,
+                                      job) != 0) {
+      np_job_error(job, -ENOMEM, "SMB tree connect failed: %s",
+                   smb2_get_error(job->session->ctx));
+      np_job_finish(job, NP_RELEASE_OK);
+      return false;
+    }
+    job->state = NP_JOB_TREE_CONNECT;
+    return false;
+  }
+
+  case NP_JOB_TREE_CONNECT:
+    if (!job->done) {
+      return false;
+    }
+    if (job->status != SMB2_STATUS_SUCCESS) {
+      np_job_error(job, -nterror_to_errno(job->status),
+                   "SMB tree connect %s failed: %s", job->share,
+                   nterror_to_str(job->status));
+      np_job_finish(job, NP_RELEASE_OK);
+      return false;
+    }
+    np_session_add_tree(job->session, job->share);
+    job->state = NP_JOB_ISSUE;
+    return true;
+
+  case NP_JOB_ISSUE:
+    return np_job_issue(job);
+
+  case NP_JOB_WAIT:
+    if (!job->done) {
+      return false;
+    }
+    np_job_complete(job);
+    return job->state != NP_JOB_DONE;
+
+  case NP_JOB_FSTAT:
+    if (!job->done) {
+      return false;
+    }
+    np_job_open_stream(job);
+    return true;
+
+  case NP_JOB_STREAMING:
+    np_job_pump(job);
+    return job->state != NP_JOB_STREAMING;
+
+  case NP_JOB_DRAIN:
+    return np_job_drain(job);
+
+  case NP_JOB_CLOSE:
+    if (!job->done) {
+      return false;
+    }
+    np_job_finish(job, job->failed ? NP_RELEASE_SUSPECT : NP_RELEASE_OK);
+    return false;
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+// Per-host admission
+// ---------------------------------------------------------------------------
+
+static np_host_t *np_host_get(np_reactor_t *r, const np_job_t *job) {
+  const int port = np_normalize_port(job->port);
+  for (np_host_t *h = r->hosts; h != NULL; h = h->next) {
+    if (h->port == port && np_strcaseeq(h->host, job->host)) {
+      return h;
+    }
+  }
+  np_host_t *h = (np_host_t *)calloc(1, sizeof(*h));
+  if (h == NULL) {
+    return NULL;
+  }
+  h->host = np_strdup_or_empty(job->host);
+  if (h->host == NULL) {
+    free(h);
+    return NULL;
+  }
+  h->port = port;
+  h->queue_tail = &h->queue;
+  h->next = r->hosts;
+  r->hosts = h;
+  return h;
+}
+
+// Moves queued jobs into free slots; they run before the reactor waits.
+static void np_host_admit(np_reactor_t *r, np_host_t *h) {
+  while (h->queue != NULL && h->active < r->active_limit) {
+    np_job_t *job = h->queue;
+    h->queue = job->queue_next;
+    if (h->queue == NULL) {
+      h->queue_tail = &h->queue;
+    }
+    h->active++;
+    job->has_slot = true;
+    job->state = NP_JOB_ACQUIRE;
+    job->queue_next = r->runnable;
+    r->runnable = job;
+  }
+}
+
+// Queues a new job at its host. Without memory for the host entry it just
+// runs unthrottled.
+static void np_host_enqueue(np_reactor_t *r, np_job_t *job) {
+  np_host_t *h = np_host_get(r, job);
+  if (h == NULL) {
+    return;
+  }
+  job->slot_host = h;
+  job->state = NP_JOB_QUEUED;
+  job->queue_next = NULL;
+  *h->queue_tail = job;
+  h->queue_tail = &job->queue_next;
+  np_host_admit(r, h);
+}
+
+static void np_host_dequeue(np_job_t *job) {
+  np_host_t *h = job->slot_host;
+  for (np_job_t **pp = &h->queue; *pp != NULL; pp = &(*pp)->queue_next) {
+    if (*pp == job) {
+      *pp = job->queue_next;
+      if (*pp == NULL) {
+        h->queue_tail = pp;
+      }
+      break;
+    }
+  }
+  job->queue_next = NULL;
+  job->slot_host = NULL;
+}
+
+static void np_host_leave(np_reactor_t *r, np_job_t *job) {
+  np_host_t *h = job->slot_host;
+  job->has_slot = false;
+  job->slot_host = NULL;
+  h->active--;
+  np_host_admit(r, h);
+}
+
+// ---------------------------------------------------------------------------
+// Deadlines and cancellation
+// ---------------------------------------------------------------------------
+
+// Fails the job ahead of its completion. A hard abort (deadline) destroys
+// whatever is in flight; a soft one (cancel) lets an outstanding reply land
+// so the session stays usable, for up to NP_REACTOR_CANCEL_GRACE_MS.
+static void np_job_abort(np_job_t *job, int rc, const char *why, bool hard) {
+  np_job_error(job, rc, "%s", why);
+  switch (job->state) {
+  case NP_JOB_QUEUED:
+    np_host_dequeue(job);
+    job->state = NP_JOB_DONE;
+    return;
+  case NP_JOB_ACQUIRE:
+  case NP_JOB_DONE:
+    job->state = NP_JOB_DONE;
+    return;
+  case NP_JOB_STREAMING:
+    job->state = NP_JOB_DRAIN;
+    return;
+  default:
+    break;
+  }
+  if (!hard && job->state != NP_JOB_CONNECTING) {
+    job->deadline_ms = np_now_ms() + NP_REACTOR_CANCEL_GRACE_MS;
+    return;
+  }
+  np_job_discard(job);
+  job->state = NP_JOB_DONE;
+}
+
+static void np_job_run(np_job_t *job) {
+  if (job->cancelled && !job->cancel_handled) {
+    job->cancel_handled = true;
+    np_job_abort(job, -ECANCELED, "SMB request cancelled", false);
+  }
+  bool again = true;
+  while (again) {
+    if (job->broken) {
+      np_job_broken(job);
+    }
+    again = job->state != NP_JOB_DONE && np_job_step(job);
+    again = again || (job->broken && job->state != NP_JOB_DONE);
+  }
+  np_job_sync(job);
+  if (job->has_slot && job->state >= NP_JOB_STREAMING) {
+    np_host_leave(&g_reactor, job);
+  }
+}
+
+static void np_job_expire(np_job_t *job, uint64_t now) {
+  if (job->deadline_ms == 0 || now < job->deadline_ms ||
+      job->state == NP_JOB_DONE) {
+    return;
+  }
+  job->deadline_ms = 0;
+  np_job_abort(job, -ETIMEDOUT, "SMB request timed out", true);
+  np_job_run(job);
+}
+
+static void np_job_free(np_job_t *job) {
+  if (job->token != NULL) {
+    np_mutex_lock(&g_reactor_lock);
+    const bool last = --job->token->refs == 0;
+    np_mutex_unlock(&g_reactor_lock);
+    if (last) {
+      free(job->token);
+    }
+  }
+  free(job->host);
+  free(job->username);
+  free(job->password);
+  free(job->domain);
+  free(job);
+}
+
+// ---------------------------------------------------------------------------
+// Reactor thread
+// ---------------------------------------------------------------------------
+
+// Happy eyeballs: while connecting, libsmb2 wants to be told when to try the
+// next resolved address in parallel.
+static void np_job_schedule_connect(np_job_t *job, uint64_t now) {
+  if (job->state != NP_JOB_CONNECTING || job->session == NULL) {
+    return;
+  }
+  if (job->retry_at_ms != 0 && now >= job->retry_at_ms) {
+    job->retry_at_ms = 0;
+    if (smb2_service_fd(job->session->ctx, -1, 0) < 0) {
+      job->broken = true;
+    }
+    np_job_run(job);
+    if (job->state != NP_JOB_CONNECTING) {
+      return;
+    }
+  }
+  if (job->retry_at_ms == 0) {
+    size_t count = 0;
+    int timeout = -1;
+    smb2_get_fds(job->session->ctx, &count, &timeout);
+    if (timeout >= 0) {
+      job->retry_at_ms = now + (uint64_t)timeout;
+    }
+  }
+}
+
+static void np_job_check_token_locked(np_job_t *job) {
+  if (job->token != NULL && job->token->cancelled) {
+    job->cancelled = true;
+  }
+}
+
+static void np_reactor_take_inbox(np_reactor_t *r) {
+  np_mutex_lock(&g_reactor_lock);
+  np_job_t *inbox = r->inbox;
+  r->inbox = NULL;
+  r->inbox_tail = &r->inbox;
+  const bool rescan = r->rescan;
+  r->rescan = false;
+  const bool wider = r->host_limit > r->active_limit;
+  r->active_limit = r->host_limit;
+  for (np_job_t *job = inbox; job != NULL; job = job->inbox_next) {
+    job->in_inbox = false;
+    job->credits += job->credit_grant;
+    job->credit_grant = 0;
+    job->closed = job->closed || job->close_requested;
+    np_job_check_token_locked(job);
+  }
+  if (rescan) {
+    for (np_job_t *job = r->jobs; job != NULL; job = job->next) {
+      np_job_check_token_locked(job);
+    }
+  }
+  np_mutex_unlock(&g_reactor_lock);
+
+  if (wider) {
+    for (np_host_t *h = r->hosts; h != NULL; h = h->next) {
+      np_host_admit(r, h);
+    }
+  }
+  while (inbox != NULL) {
+    np_job_t *job = inbox;
+    inbox = job->inbox_next;
+    job->inbox_next = NULL;
+    if (!job->linked) {
+      job->linked = true;
+      job->next = r->jobs;
+      r->jobs = job;
+      if (job->state == NP_JOB_ACQUIRE && !job->cancelled) {
+        np_host_enqueue(r, job);
+      }
+    }
+    np_job_run(job);
+  }
+  if (rescan) {
+    for (np_job_t *job = r->jobs; job != NULL; job = job->next) {
+      if (job->cancelled && !job->cancel_handled) {
+        np_job_run(job);
+      }
+    }
+  }
+}
+
+static void np_reactor_run_admitted(np_reactor_t *r) {
+  while (r->runnable != NULL) {
+    np_job_t *job = r->runnable;
+    r->runnable = job->queue_next;
+    job->queue_next = NULL;
+    np_job_run(job);
+  }
+}
+
+static void np_reactor_reap(np_reactor_t *r) {
+  np_job_t **pp = &r->jobs;
+  while (*pp != NULL) {
+    np_job_t *job = *pp;
+    if (job->state == NP_JOB_DONE &&
+        (job->kind != NP_JOB_STREAM || job->closed)) {
+      *pp = job->next;
+      np_job_free(job);
+      continue;
+    }
+    pp = &job->next;
+  }
+  for (np_host_t **hp = &r->hosts; *hp != NULL;) {
+    np_host_t *h = *hp;
+    if (h->active == 0 && h->queue == NULL) {
+      *hp = h->next;
+      free(h->host);
+      free(h);
+      continue;
+    }
+    hp = &h->next;
+  }
+  while (r->graveyard != NULL) {
+    np_watch_t *w = r->graveyard;
+    r->graveyard = w->next;
+    free(w);
+  }
+}
+
+static int np_reactor_timeout(np_reactor_t *r, uint64_t now) {
+  uint64_t deadline = r->next_tick_ms;
+  for (np_job_t *job = r->jobs; job != NULL; job = job->next) {
+    if (job->retry_at_ms != 0 && job->retry_at_ms < deadline) {
+      deadline = job->retry_at_ms;
+    }
+    if (job->deadline_ms != 0 && job->deadline_ms < deadline) {
+      deadline = job->deadline_ms;
+    }
+  }
+  return deadline > now ? (int)(deadline - now) : 0;
+}
+
+static void np_reactor_main(void *arg) {
+  np_reactor_t *r = (np_reactor_t *)arg;
+  r->next_tick_ms = np_now_ms() + NP_REACTOR_TICK_MS;
+
+  for (;;) {
+    const int n = np_poller_wait(r, np_reactor_timeout(r, np_now_ms()));
+    for (int i = 0; i < n; i++) {
+      np_watch_t *w = r->ready[i].watch;
+      if (w == &r->wake) {
+        np_reactor_drain_wake(r);
+        continue;
+      }
+      if (w->dead || w->job->session == NULL) {
+        continue;
+      }
+      np_job_t *job = w->job;
+      if (smb2_service_fd(job->session->ctx, w->fd, r->ready[i].revents) < 0) {
+        job->broken = true;
+      }
+      np_job_run(job);
+    }
+
+    np_reactor_take_inbox(r);
+
+    const uint64_t now = np_now_ms();
+    const bool tick = now >= r->next_tick_ms;
+    if (tick) {
+      r->next_tick_ms = now + NP_REACTOR_TICK_MS;
+    }
+    for (np_job_t *job = r->jobs; job != NULL; job = job->next) {
+      np_job_expire(job, now);
+      np_job_schedule_connect(job, now);
+      if (!tick || job->session == NULL || job->state == NP_JOB_CONNECTING) {
+        continue;
+      }
+      // No events: only expires timed out requests.
+      const int fd = smb2_get_fd(job->session->ctx);
+      if (fd >= 0 && smb2_service_fd(job->session->ctx, fd, 0) < 0) {
+        job->broken = true;
+      }
+      np_job_run(job);
+    }
+
+    np_reactor_run_admitted(r);
+    np_reactor_reap(r);
+  }
+}
+
+// Wake the reactor unless news is already waiting for it. Called with
+// g_reactor_lock, before adding the news.
+static void np_reactor_kick_locked(np_reactor_t *r) {
+  if (r->running && r->inbox == NULL && !r->rescan) {
+    np_reactor_wake(r);
+  }
+}
+
+// Queue news about `job` for the reactor thread. Called with g_reactor_lock.
+static void np_reactor_notify_locked(np_reactor_t *r, np_job_t *job) {
+  if (job->in_inbox) {
+    return;
+  }
+  np_reactor_kick_locked(r);
+  job->in_inbox = true;
+  *r->inbox_tail = job;
+  r->inbox_tail = &job->inbox_next;
+}
+
+// ---------------------------------------------------------------------------
+// FFI
+// ---------------------------------------------------------------------------
+
+static np_job_t *np_job_new(int kind, int64_t reply_port, int64_t request_id,
+                            const char *host, int port, const char *username,
+                            const char *password, const char *domain) {
+  np_job_t *job = (np_job_t *)calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return NULL;
+  }
+  job->kind = kind;
+  job->state = NP_JOB_ACQUIRE;
+  job->reply_port = reply_port;
+  job->request_id = request_id;
+  job->port = port;
+  job->host = np_strdup_or_empty(host);
+  job->username = np_strdup_or_empty(username);
+  job->password = np_strdup_or_empty(password);
+  job->domain = np_strdup_or_empty(domain);
+  if (job->host == NULL || job->username == NULL || job->password == NULL ||
+      job->domain == NULL) {
+    np_job_free(job);
+    return NULL;
+  }
+  return job;
+}
+
+// Splits `path` into share and inner path. On failure the error is posted and
+// the job is left DONE, so it still goes through the reactor (which keeps a
+// stream handle valid until it is closed).
+static void np_job_set_path(np_job_t *job, const char *path) {
+  char *normalized = np_normalize_path(path);
+  if (normalized == NULL) {
+    np_job_error(job, -ENOMEM, "Out of memory");
+    job->state = NP_JOB_DONE;
+    return;
+  }
+  if (strcmp(normalized, "/") == 0) {
+    free(normalized);
+    if (job->kind == NP_JOB_LIST_DIR) {
+      job->kind = NP_JOB_LIST_SHARES;
+      snprintf(job->share, sizeof(job->share), "IPC$");
+      return;
+    }
+    np_job_error(job, -EINVAL, "%s",
+                 job->kind == NP_JOB_STAT ? "Cannot stat root path"
+                                          : "Cannot open root path");
+    job->state = NP_JOB_DONE;
+    return;
+  }
+  const int rc = np_parse_share_and_path(normalized, job->share,
+                                         sizeof(job->share), job->inner_path,
+                                         sizeof(job->inner_path));
+  if (rc != 0) {
+    np_job_error(job, rc, "Invalid SMB path: %s", normalized);
+    job->state = NP_JOB_DONE;
+  }
+  free(normalized);
+}
+
+static void np_job_set_limits(np_job_t *job, int timeout_ms,
+                              intptr_t cancel_token) {
+  if (timeout_ms > 0) {
+    job->deadline_ms = np_now_ms() + (uint64_t)timeout_ms;
+  }
+  if (cancel_token != 0) {
+    job->token = (np_cancel_token_t *)cancel_token;
+    np_mutex_lock(&g_reactor_lock);
+    job->token->refs++;
+    np_mutex_unlock(&g_reactor_lock);
+  }
+}
+
+static int np_job_submit(np_job_t *job) {
+  np_mutex_lock(&g_reactor_lock);
+  if (!g_reactor.running) {
+    np_mutex_unlock(&g_reactor_lock);
+    np_job_free(job);
+    return -ENOSYS;
+  }
+  np_reactor_notify_locked(&g_reactor, job);
+  np_mutex_unlock(&g_reactor_lock);
+  return 0;
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_reactor_start(
+    bool (*post_cobject)(int64_t port, void *message)) {
+  if (post_cobject == NULL) {
+    return -EINVAL;
+  }
+  int rc = 0;
+  np_mutex_lock(&g_reactor_lock);
+  g_post = post_cobject;
+  if (!g_reactor.running) {
+    np_reactor_t *r = &g_reactor;
+    r->inbox = NULL;
+    r->inbox_tail = &r->inbox;
+    rc = np_poller_init(r);
+    if (rc == 0) {
+      r->wake.fd = np_wake_fd(r);
+      r->wake.events = POLLIN;
+      rc = np_poller_add(r, &r->wake);
+    }
+    if (rc == 0) {
+      rc = np_thread_start(NULL, np_reactor_main, r);
+    }
+    if (rc == 0) {
+      r->running = true;
+    } else {
+      np_poller_destroy(r);
+    }
+  }
+  np_mutex_unlock(&g_reactor_lock);
+  return rc;
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_async_list(int64_t reply_port,
+                                         int64_t request_id, const char *host,
+                                         int port, const char *username,
+                                         const char *password,
+                                         const char *domain, const char *path,
+                                         int timeout_ms,
+                                         intptr_t cancel_token) {
+  np_job_t *job = np_job_new(NP_JOB_LIST_DIR, reply_port, request_id, host,
+                             port, username, password, domain);
+  if (job == NULL) {
+    return -ENOMEM;
+  }
+  np_job_set_limits(job, timeout_ms, cancel_token);
+  np_job_set_path(job, path);
+  return np_job_submit(job);
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_async_stat(int64_t reply_port,
+                                         int64_t request_id, const char *host,
+                                         int port, const char *username,
+                                         const char *password,
+                                         const char *domain, const char *path,
+                                         int timeout_ms,
+                                         intptr_t cancel_token) {
+  np_job_t *job = np_job_new(NP_JOB_STAT, reply_port, request_id, host, port,
+                             username, password, domain);
+  if (job == NULL) {
+    return -ENOMEM;
+  }
+  np_job_set_limits(job, timeout_ms, cancel_token);
+  np_job_set_path(job, path);
+  // Answered right away from a file open with a read-caching lease.
+  uint64_t size = 0;
+  if (job->state != NP_JOB_DONE &&
+      np_shared_lease_stat(host, port, username, password, domain, path,
+                           &size)) {
+    const int64_t values[2] = {SMB2_TYPE_FILE, (int64_t)size};
+    np_job_reply(job, values, 2, NULL);
+    job->state = NP_JOB_DONE;
+  }
+  return np_job_submit(job);
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_async_stream_open(
+    int64_t reply_port, int64_t request_id, const char *host, int port,
+    const char *username, const char *password, const char *domain,
+    const char *path, uint64_t start, uint64_t end_exclusive,
+    uint32_t chunk_size, int queue_depth, int credits, int timeout_ms,
+    intptr_t cancel_token) {
+  np_job_t *job = np_job_new(NP_JOB_STREAM, reply_port, request_id, host, port,
+                             username, password, domain);
+  if (job == NULL) {
+    return (intptr_t)0;
+  }
+  job->start = start;
+  job->end_exclusive = end_exclusive;
+  job->chunk_size = chunk_size;
+  job->queue_depth = queue_depth;
+  job->credits = credits > 0 ? credits : 1;
+  np_job_set_limits(job, timeout_ms, cancel_token);
+  np_job_set_path(job, path);
+  return np_job_submit(job) == 0 ? (intptr_t)job : (intptr_t)0;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_async_stream_request(intptr_t stream,
+                                                    int chunks) {
+  if (stream == 0 || chunks <= 0) {
+    return;
+  }
+  np_job_t *job = (np_job_t *)stream;
+  np_mutex_lock(&g_reactor_lock);
+  job->credit_grant += chunks;
+  np_reactor_notify_locked(&g_reactor, job);
+  np_mutex_unlock(&g_reactor_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_async_stream_close(intptr_t stream) {
+  if (stream == 0) {
+    return;
+  }
+  np_job_t *job = (np_job_t *)stream;
+  np_mutex_lock(&g_reactor_lock);
+  job->close_requested = true;
+  np_reactor_notify_locked(&g_reactor, job);
+  np_mutex_unlock(&g_reactor_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_reactor_set_host_concurrency(int max_requests) {
+  np_mutex_lock(&g_reactor_lock);
+  g_reactor.host_limit =
+      max_requests > 0 ? max_requests : NP_REACTOR_HOST_CONCURRENCY;
+  if (g_reactor.host_limit > g_reactor.active_limit) {
+    np_reactor_kick_locked(&g_reactor);
+    g_reactor.rescan = true;
+  }
+  np_mutex_unlock(&g_reactor_lock);
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_cancel_token_new(void) {
+  np_cancel_token_t *token = (np_cancel_token_t *)calloc(1, sizeof(*token));
+  if (token == NULL) {
+    return (intptr_t)0;
+  }
+  token->refs = 1;
+  return (intptr_t)token;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_cancel_token_cancel(intptr_t token) {
+  if (token == 0) {
+    return;
+  }
+  np_cancel_token_t *t = (np_cancel_token_t *)token;
+  np_mutex_lock(&g_reactor_lock);
+  if (!t->cancelled) {
+    t->cancelled = true;
+    np_reactor_kick_locked(&g_reactor);
+    g_reactor.rescan = true;
+  }
+  np_mutex_unlock(&g_reactor_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_cancel_token_free(intptr_t token) {
+  if (token == 0) {
+    return;
+  }
+  np_cancel_token_t *t = (np_cancel_token_t *)token;
+  np_mutex_lock(&g_reactor_lock);
+  const bool last = --t->refs == 0;
+  np_mutex_unlock(&g_reactor_lock);
+  if (last) {
+    free(t);
+  }
+}
+
+#else
+
+// No reactor on Windows yet; callers keep using the blocking API from worker
+// isolates there.
+
+FFI_PLUGIN_EXPORT int np_smb2_reactor_start(
+    bool (*post_cobject)(int64_t port, void *message)) {
+  (void)post_cobject;
+  return -ENOSYS;
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_async_list(int64_t reply_port,
+                                         int64_t request_id, const char *host,
+                                         int port, const char *username,
+                                         const char *password,
+                                         const char *domain, const char *path,
+                                         int timeout_ms,
+                                         intptr_t cancel_token) {
+  (void)reply_port;
+  (void)request_id;
+  (void)host;
+  (void)port;
+  (void)username;
+  (void)password;
+  (void)domain;
+  (void)path;
+  (void)timeout_ms;
+  (void)cancel_token;
+  return -ENOSYS;
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_async_stat(int64_t reply_port,
+                                         int64_t request_id, const char *host,
+                                         int port, const char *username,
+                                         const char *password,
+                                         const char *domain, const char *path,
+                                         int timeout_ms,
+                                         intptr_t cancel_token) {
+  (void)reply_port;
+  (void)request_id;
+  (void)host;
+  (void)port;
+  (void)username;
+  (void)password;
+  (void)domain;
+  (void)path;
+  (void)timeout_ms;
+  (void)cancel_token;
+  return -ENOSYS;
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_async_stream_open(
+    int64_t reply_port, int64_t request_id, const char *host, int port,
+    const char *username, const char *password, const char *domain,
+    const char *path, uint64_t start, uint64_t end_exclusive,
+    uint32_t chunk_size, int queue_depth, int credits, int timeout_ms,
+    intptr_t cancel_token) {
+  (void)reply_port;
+  (void)request_id;
+  (void)host;
+  (void)port;
+  (void)username;
+  (void)password;
+  (void)domain;
+  (void)path;
+  (void)start;
+  (void)end_exclusive;
+  (void)chunk_size;
+  (void)queue_depth;
+  (void)credits;
+  (void)timeout_ms;
+  (void)cancel_token;
+  return (intptr_t)0;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_async_stream_request(intptr_t stream,
+                                                    int chunks) {
+  (void)stream;
+  (void)chunks;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_async_stream_close(intptr_t stream) {
+  (void)stream;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_reactor_set_host_concurrency(int max_requests) {
+  (void)max_requests;
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_cancel_token_new(void) {
+  return (intptr_t)0;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_cancel_token_cancel(intptr_t token) {
+  (void)token;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_cancel_token_free(intptr_t token) {
+  (void)token;
+}
+
+#endif
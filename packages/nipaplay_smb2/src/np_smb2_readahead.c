@@ -0,0 +1,102 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+// Windows used when np_smb2_readahead_configure() is given 0.
+#define NP_RA_DEFAULT_MIN (128 * 1024)
+#define NP_RA_DEFAULT_MAX (16 * 1024 * 1024)
+
+static np_mutex_t g_ra_lock = NP_MUTEX_INIT;
+static uint64_t g_ra_min = NP_RA_DEFAULT_MIN;
+static uint64_t g_ra_max = NP_RA_DEFAULT_MAX;
+static uint64_t g_ra_reads[3];
+static uint64_t g_ra_prefetched;
+static uint64_t g_ra_used;
+
+void np_ra_init(np_ra_t *ra, uint64_t start) {
+  ra->last = start;
+  ra->next = start;
+  ra->stride = 0;
+  ra->pattern = NP_RA_RANDOM;
+  np_mutex_lock(&g_ra_lock);
+  ra->window = g_ra_min;
+  np_mutex_unlock(&g_ra_lock);
+}
+
+int np_ra_observe(np_ra_t *ra, uint64_t offset, uint32_t len, uint64_t limit) {
+  np_mutex_lock(&g_ra_lock);
+  const uint64_t min = g_ra_min;
+  uint64_t max = g_ra_max;
+
+  int pattern;
+  if (offset == ra->next) {
+    pattern = NP_RA_SEQUENTIAL;
+  } else if (offset > ra->last && offset - ra->last == ra->stride) {
+    pattern = NP_RA_STRIDED;
+  } else {
+    pattern = NP_RA_RANDOM;
+  }
+  g_ra_reads[pattern]++;
+  np_mutex_unlock(&g_ra_lock);
+
+  if (limit > 0 && max > limit) {
+    max = limit;
+  }
+  if (pattern == NP_RA_SEQUENTIAL) {
+    ra->window = ra->window < min ? min : ra->window * 2;
+  } else if (pattern == NP_RA_STRIDED) {
+    ra->window = len;
+  } else {
+    ra->window = 0;
+  }
+  if (ra->window > max) {
+    ra->window = max;
+  }
+
+  ra->stride = offset > ra->last ? offset - ra->last : 0;
+  ra->last = offset;
+  ra->next = offset + len;
+  ra->pattern = pattern;
+  return pattern;
+}
+
+void np_ra_account(uint64_t prefetched, uint64_t used) {
+  np_mutex_lock(&g_ra_lock);
+  g_ra_prefetched += prefetched;
+  g_ra_used += used;
+  np_mutex_unlock(&g_ra_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_readahead_configure(uint32_t min_window,
+                                                   uint32_t max_window) {
+  np_mutex_lock(&g_ra_lock);
+  g_ra_min = min_window > 0 ? min_window : NP_RA_DEFAULT_MIN;
+  g_ra_max = max_window > 0 ? max_window : NP_RA_DEFAULT_MAX;
+  if (g_ra_max < g_ra_min) {
+    g_ra_max = g_ra_min;
+  }
+  np_mutex_unlock(&g_ra_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_readahead_stats(uint64_t *out_sequential,
+                                               uint64_t *out_strided,
+                                               uint64_t *out_random,
+                                               uint64_t *out_prefetched_bytes,
+                                               uint64_t *out_used_bytes) {
+  np_mutex_lock(&g_ra_lock);
+  if (out_sequential != NULL) {
+    *out_sequential = g_ra_reads[NP_RA_SEQUENTIAL];
+  }
+  if (out_strided != NULL) {
+    *out_strided = g_ra_reads[NP_RA_STRIDED];
+  }
+  if (out_random != NULL) {
+    *out_random = g_ra_reads[NP_RA_RANDOM];
+  }
+  if (out_prefetched_bytes != NULL) {
+    *out_prefetched_bytes = g_ra_prefetched;
+  }
+  if (out_used_bytes != NULL) {
+    *out_used_bytes = g_ra_used;
+  }
+  np_mutex_unlock(&g_ra_lock);
+}
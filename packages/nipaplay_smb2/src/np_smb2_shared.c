@@ -0,0 +1,1727 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#if defined(_WIN32) || defined(_WINDOWS)
+#include "compat.h"
+#else
+#include <poll.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+#include <smb2/libsmb2-raw.h>
+
+// Longest poll() of the thread servicing a shared session. READs queued by
+// other threads meanwhile are written by libsmb2 right away; this only bounds
+// the wait of one that did not fit into the socket buffer.
+#define NP_SHARED_POLL_MS 50
+// SMB2 charges one credit per 64 KiB of READ payload.
+#define NP_SHARED_CREDIT_UNIT 65536
+// Attempts to reopen a file whose connection was lost, the first one right
+// away and each next one after twice the previous backoff.
+#define NP_SHARED_RECONNECT_TRIES 4
+#define NP_SHARED_RECONNECT_BACKOFF_MS 250
+// Reconnects in a row without a READ landing in between before giving up on
+// a server that accepts connections but keeps dropping them.
+#define NP_SHARED_RECONNECT_LIMIT 3
+// Lease asked for on every shared file: read caching makes its cached blocks
+// and size authoritative until the server breaks it; handle caching lets the
+// server keep the handle across the opens of other clients.
+#define NP_SHARED_LEASE (SMB2_LEASE_READ_CACHING | SMB2_LEASE_HANDLE_CACHING)
+// Connections a shared file reads over by default and at most, its session's
+// own included. Servers without SMB 3.x multichannel get only that one.
+#define NP_SHARED_CHANNELS 2
+#define NP_SHARED_MAX_CHANNELS 4
+// Bounds each step of binding a channel, so that an address the server
+// advertises but this client cannot reach delays the open only briefly.
+#define NP_SHARED_BIND_TIMEOUT_S 2
+// Advertised addresses considered for channels.
+#define NP_SHARED_MAX_ADDRS 8
+// READ latencies of a file that hedging goes by, how many it takes before
+// READs are hedged, and bounds on the percentile and the delay.
+#define NP_HEDGE_SAMPLES 64
+#define NP_HEDGE_MIN_SAMPLES 16
+#define NP_HEDGE_MIN_PERCENTILE 50
+#define NP_HEDGE_MAX_PERCENTILE 99
+#define NP_HEDGE_MIN_MS 10
+
+// A further connection bound to the session of a shared file (SMB 3.x
+// multichannel), with the file's handle on it.
+typedef struct np_channel {
+  struct smb2_context *ctx;
+  struct smb2fh *fh;
+  int inflight;
+  // The connection failed and its context is being destroyed; np_flight_cb
+  // ignores the READs that fails.
+  bool lost;
+} np_channel_t;
+
+// One READ. A whole block is shared by everyone who asked for it while it was
+// in flight or held; a range READ belongs to the reader that issued it.
+struct np_flight {
+  struct np_flight *next;
+  struct np_shared_file *file;
+  uint64_t offset;
+  bool whole;
+  uint8_t *buf;
+  uint32_t want;
+  uint32_t got;
+  int status;
+  bool done;
+  // Handed to the block cache by the first holder to see it land.
+  bool stored;
+  // Nobody holds it any more, but its READ could not be cancelled; the
+  // callback frees it.
+  bool orphan;
+  // Its READ was lost with the connection and waits for credits on the new
+  // one.
+  bool parked;
+  // The channel its READ is on; NULL for the session's own connection.
+  np_channel_t *channel;
+  // When its READ was issued, for the latencies hedging goes by.
+  uint64_t issued_ms;
+  // The rest of its READ issued again on another connection, after it took
+  // longer than most.
+  struct np_hedge *hedge;
+  // The hedge landed first and filled in the data; its own READ was
+  // cancelled, but has not completed yet.
+  bool superseded;
+  int refs;
+};
+
+// The second READ of a hedged flight, into a buffer of its own.
+typedef struct np_hedge {
+  struct np_shared_file *file;
+  // NULL once the flight does not need it any more; the callback frees it.
+  np_flight_t *flight;
+  np_channel_t *channel;
+  uint8_t *buf;
+  // Where it starts in the flight, and in the file.
+  uint32_t base;
+  uint64_t offset;
+  uint32_t want;
+  uint32_t got;
+} np_hedge_t;
+
+// The lease of a file, found by key when the server breaks it.
+typedef struct np_lease {
+  struct np_lease *next;
+  uint8_t key[16];
+  // As granted, then as broken to.
+  uint32_t state;
+  // Read caching was broken: the file may have changed since it was opened.
+  bool read_lost;
+  // The file's blocks in the cache, once it is open.
+  bool keyed;
+  np_cache_key_t cache_key;
+  uint64_t blocks;
+} np_lease_t;
+
+struct np_shared_file {
+  struct np_shared_file *next;
+  char *host;
+  int port;
+  char *username;
+  char *password;
+  char *domain;
+  char *path;
+  int refs;
+  // np_open_file() is in progress; openers of the same file wait for it
+  // rather than opening it again, and share its error if it fails.
+  bool opening;
+  int open_rc;
+  char open_err[256];
+
+  np_smb2_session_t *session;
+  struct smb2fh *fh;
+  uint64_t size;
+  np_cache_key_t key;
+  np_durable_t durable;
+  np_lease_t lease;
+
+  // A holder is servicing the context with g_shared_lock released.
+  bool pumping;
+  // That holder is running libsmb2 on the file's connections, READ callbacks
+  // included, still with g_shared_lock released: nobody else may touch the
+  // file until this is cleared.
+  bool servicing;
+  // The connection was lost and the session is being replaced; neither may
+  // be touched until this is cleared.
+  bool reconnecting;
+  int reconnects;
+  // The connection was lost and could not be restored; the session must be
+  // discarded.
+  bool broken;
+  // A READ failed; verify the session before it is reused.
+  bool failed;
+  np_flight_t *flights;
+  int inflight;
+  // Bound to the session; READs go to whichever connection has the fewest
+  // in flight.
+  np_channel_t *channels[NP_SHARED_MAX_CHANNELS - 1];
+  int nchannels;
+  // Latencies of the latest READs (ms), the oldest overwritten first.
+  uint32_t latencies[NP_HEDGE_SAMPLES];
+  int nlatencies;
+  int latency_next;
+  // Hedging counted by the callbacks, added to the totals under
+  // g_shared_lock.
+  uint64_t hedges;
+  uint64_t hedge_wins;
+  uint64_t hedges_wasted;
+};
+
+// Guards the registry, the totals and everything in the files, including
+// their contexts. libsmb2 is called on a file's contexts either with it held
+// or by the holder servicing the file, which releases it meanwhile so that
+// one file's replies do not hold up the others; READ callbacks run the same
+// way, so they touch nothing outside their file. Holders wait on
+// g_shared_cond while another one services the socket.
+static np_mutex_t g_shared_lock = NP_MUTEX_INIT;
+static np_cond_t g_shared_cond = NP_COND_INIT;
+static np_shared_file_t *g_shared_files = NULL;
+static uint64_t g_shared_opens;
+static uint64_t g_shared_reuses;
+static uint64_t g_shared_reads;
+static uint64_t g_shared_joins;
+static uint64_t g_reconnects;
+static uint64_t g_reconnect_failures;
+static uint64_t g_reconnect_reclaims;
+static uint64_t g_reconnect_replays;
+static uint64_t g_reconnect_total_ms;
+static uint64_t g_reconnect_max_ms;
+static int g_channels_max = NP_SHARED_CHANNELS;
+static uint64_t g_channels_bound;
+static uint64_t g_channel_bind_failures;
+static uint64_t g_channel_reads;
+static uint64_t g_channels_lost;
+static int g_hedge_percentile;
+static uint64_t g_hedges;
+static uint64_t g_hedge_wins;
+static uint64_t g_hedges_wasted;
+static uint64_t g_hedge_delay_ms;
+
+// Guards the leases. Breaks arrive on whichever thread services a session,
+// np_open_file() included, so this does not depend on g_shared_lock; it is
+// taken after it and never held while taking another lock.
+static np_mutex_t g_lease_lock = NP_MUTEX_INIT;
+static np_lease_t *g_leases = NULL;
+static uint64_t g_lease_grants;
+static uint64_t g_lease_breaks;
+static uint64_t g_lease_invalidated;
+static uint64_t g_lease_stat_hits;
+
+// ---------------------------------------------------------------------------
+// Leases
+// ---------------------------------------------------------------------------
+
+static void np_lease_link(np_lease_t *lease) {
+  np_new_id(lease->key);
+  np_mutex_lock(&g_lease_lock);
+  lease->next = g_leases;
+  g_leases = lease;
+  np_mutex_unlock(&g_lease_lock);
+}
+
+static void np_lease_unlink(np_lease_t *lease) {
+  np_mutex_lock(&g_lease_lock);
+  for (np_lease_t **p = &g_leases; *p != NULL; p = &(*p)->next) {
+    if (*p == lease) {
+      *p = lease->next;
+      break;
+    }
+  }
+  np_mutex_unlock(&g_lease_lock);
+}
+
+// The state the lease is in; `*out_read_lost` tells whether read caching was
+// broken since the file was opened.
+static uint32_t np_lease_state(const np_lease_t *lease, bool *out_read_lost) {
+  np_mutex_lock(&g_lease_lock);
+  const uint32_t state = lease->state;
+  *out_read_lost = lease->read_lost;
+  np_mutex_unlock(&g_lease_lock);
+  return state;
+}
+
+static void np_lease_invalidate(const np_cache_key_t *key, uint64_t first,
+                                uint64_t count) {
+  const uint32_t dropped = np_cache_invalidate(key, first, count);
+  np_mutex_lock(&g_lease_lock);
+  g_lease_invalidated += dropped;
+  np_mutex_unlock(&g_lease_lock);
+}
+
+// Record the lease granted by np_open_file() and where the file is cached. A
+// break may already have come in meanwhile.
+static void np_lease_opened(np_shared_file_t *file) {
+  np_lease_t *lease = &file->lease;
+  np_mutex_lock(&g_lease_lock);
+  if (!lease->read_lost) {
+    lease->state = file->durable.lease_state;
+  }
+  if (file->durable.lease_state != 0) {
+    g_lease_grants++;
+  }
+  lease->keyed = true;
+  lease->cache_key = file->key;
+  lease->blocks = (file->size + NP_CACHE_BLOCK_SIZE - 1) / NP_CACHE_BLOCK_SIZE;
+  const bool read_lost = lease->read_lost;
+  np_mutex_unlock(&g_lease_lock);
+  if (read_lost) {
+    np_lease_invalidate(&file->key, 0, lease->blocks);
+  }
+}
+
+void np_lease_break_cb(struct smb2_context *smb2, int status,
+                       struct smb2_oplock_or_lease_break_reply *rep,
+                       uint8_t *new_oplock_level, uint32_t *new_lease_state) {
+  (void)smb2;
+  (void)new_oplock_level;
+  (void)new_lease_state;
+  if (status != 0 || rep->break_type != SMB2_BREAK_TYPE_LEASE_NOTIFICATION) {
+    return;
+  }
+  const uint32_t from = rep->lock.lease.current_lease_state;
+  const uint32_t to = rep->lock.lease.new_lease_state;
+  np_cache_key_t key;
+  uint64_t blocks = 0;
+  np_mutex_lock(&g_lease_lock);
+  for (np_lease_t *l = g_leases; l != NULL; l = l->next) {
+    if (memcmp(l->key, rep->lock.lease.lease_key, sizeof(l->key)) != 0) {
+      continue;
+    }
+    g_lease_breaks++;
+    l->state = to;
+    if ((from & SMB2_LEASE_READ_CACHING) && !(to & SMB2_LEASE_READ_CACHING) &&
+        !l->read_lost) {
+      l->read_lost = true;
+      if (l->keyed) {
+        key = l->cache_key;
+        blocks = l->blocks;
+      }
+    }
+    break;
+  }
+  np_mutex_unlock(&g_lease_lock);
+  // The acknowledgement libsmb2 sends takes the state broken to.
+  if (blocks > 0) {
+    np_lease_invalidate(&key, 0, blocks);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Registry
+// ---------------------------------------------------------------------------
+
+static bool np_shared_streq(const char *a, const char *b) {
+  return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+static bool np_shared_matches(const np_shared_file_t *f, const char *host,
+                              int port, const char *username,
+                              const char *password, const char *domain,
+                              const char *path) {
+  bool read_lost;
+  np_lease_state(&f->lease, &read_lost);
+  // A file changed under its readers is not handed to new ones.
+  return !f->broken && !read_lost && f->port == port &&
+         np_strcaseeq(f->host, host) &&
+         np_shared_streq(f->username, username) &&
+         np_shared_streq(f->password, password) &&
+         np_shared_streq(f->domain, domain) && strcmp(f->path, path) == 0;
+}
+
+static void np_shared_free(np_shared_file_t *file) {
+  np_lease_unlink(&file->lease);
+  free(file->host);
+  free(file->username);
+  free(file->password);
+  free(file->domain);
+  free(file->path);
+  free(file);
+}
+
+static void np_shared_unlink(np_shared_file_t *file) {
+  for (np_shared_file_t **p = &g_shared_files; *p != NULL; p = &(*p)->next) {
+    if (*p == file) {
+      *p = file->next;
+      return;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Channels
+// ---------------------------------------------------------------------------
+
+// The server name libsmb2 connects to for `info`, or false for an address
+// that is no use to a client: an IPv6 link-local one means nothing off the
+// server's link, and the server's scope id nothing here.
+static bool np_channel_server(const struct smb2_network_interface_info *info,
+                              int port, char *out, size_t out_len) {
+  const uint8_t *a = info->address;
+  if (info->family == SMB2_NETWORK_INTERFACE_INET) {
+    snprintf(out, out_len, "%u.%u.%u.%u:%d", a[0], a[1], a[2], a[3], port);
+    return true;
+  }
+  if (a[0] == 0xfe && (a[1] & 0xc0) == 0x80) {
+    return false;
+  }
+  snprintf(out, out_len, "[%x:%x:%x:%x:%x:%x:%x:%x]:%d", a[0] << 8 | a[1],
+           a[2] << 8 | a[3], a[4] << 8 | a[5], a[6] << 8 | a[7],
+           a[8] << 8 | a[9], a[10] << 8 | a[11], a[12] << 8 | a[13],
+           a[14] << 8 | a[15], port);
+  return true;
+}
+
+// Whether to rather connect to `a` than to `b`: an interface with receive
+// side scaling spreads connections over its cores, then the faster link.
+static bool np_channel_better(const struct smb2_network_interface_info *a,
+                              const struct smb2_network_interface_info *b) {
+  const bool rss_a = (a->capability & SMB2_NETWORK_INTERFACE_CAP_RSS) != 0;
+  const bool rss_b = (b->capability & SMB2_NETWORK_INTERFACE_CAP_RSS) != 0;
+  if (rss_a != rss_b) {
+    return rss_a;
+  }
+  return a->link_speed > b->link_speed;
+}
+
+static void np_channel_destroy(np_channel_t *ch) {
+  smb2_free_fh(ch->ctx, ch->fh);
+  smb2_destroy_context(ch->ctx);
+  free(ch);
+}
+
+// Bind a channel over `server` to `session` and put `fh` on it. Returns NULL
+// with the error in `*out_rc` if that fails; -EOPNOTSUPP if the server does
+// not do multichannel.
+static np_channel_t *np_channel_bind(struct smb2_context *session,
+                                     struct smb2fh *fh, const char *server,
+                                     int *out_rc) {
+  np_channel_t *ch = (np_channel_t *)calloc(1, sizeof(*ch));
+  struct smb2_context *ctx = smb2_init_context();
+  if (ch == NULL || ctx == NULL) {
+    free(ch);
+    if (ctx != NULL) {
+      smb2_destroy_context(ctx);
+    }
+    *out_rc = -ENOMEM;
+    return NULL;
+  }
+  smb2_set_timeout(ctx, NP_SHARED_BIND_TIMEOUT_S);
+  int rc = smb2_connect_channel(ctx, session, server);
+  if (rc == 0) {
+    smb2_file_id file_id;
+    memcpy(file_id, smb2_get_file_id(fh), sizeof(file_id));
+    ch->fh = smb2_fh_from_file_id(ctx, &file_id);
+    if (ch->fh == NULL) {
+      rc = -ENOMEM;
+    }
+  }
+  if (rc != 0) {
+    smb2_destroy_context(ctx);
+    free(ch);
+    *out_rc = rc;
+    return NULL;
+  }
+  // Like on the session's own connection, READs wait as long as it takes.
+  smb2_set_timeout(ctx, 0);
+  // The server may break the lease on any channel.
+  smb2_set_oplock_or_lease_break_callback(ctx, np_lease_break_cb);
+  ch->ctx = ctx;
+  return ch;
+}
+
+// Bind up to `want` - 1 channels to `session` for `file`, open as `fh`, over
+// the addresses the server advertises in order of preference, falling back
+// to the host it was reached at. Called with g_shared_lock released while
+// nobody else touches the session: while the file is opening or
+// reconnecting. Returns how many were bound into `out`; `*out_failed` counts
+// binds that failed.
+static int np_channels_bind(const np_shared_file_t *file,
+                            np_smb2_session_t *session, struct smb2fh *fh,
+                            int want, np_channel_t **out, int *out_failed) {
+  struct smb2_context *ctx = session->ctx;
+  *out_failed = 0;
+  char host[1024];
+  if (want <= 1 || smb2_get_dialect(ctx) < SMB2_VERSION_0300 ||
+      np_build_server(file->host, file->port, host, sizeof(host)) != 0) {
+    return 0;
+  }
+
+  struct smb2_network_interface_info *list = NULL;
+  const struct smb2_network_interface_info *addrs[NP_SHARED_MAX_ADDRS];
+  int naddrs = 0;
+  if (smb2_query_network_interfaces(ctx, &list) == 0) {
+    for (const struct smb2_network_interface_info *info = list;
+         info != NULL && naddrs < NP_SHARED_MAX_ADDRS; info = info->next) {
+      int i = naddrs++;
+      while (i > 0 && np_channel_better(info, addrs[i - 1])) {
+        addrs[i] = addrs[i - 1];
+        i--;
+      }
+      addrs[i] = info;
+    }
+  }
+
+  int n = 0;
+  for (int i = 0; i < want - 1; i++) {
+    char server[128];
+    np_channel_t *ch = NULL;
+    int rc = 0;
+    if (naddrs > 0 && np_channel_server(addrs[i % naddrs], file->port,
+                                        server, sizeof(server))) {
+      ch = np_channel_bind(ctx, fh, server, &rc);
+      if (ch == NULL && rc != -EOPNOTSUPP) {
+        (*out_failed)++;
+      }
+    }
+    if (ch == NULL && rc != -EOPNOTSUPP) {
+      ch = np_channel_bind(ctx, fh, host, &rc);
+      if (ch == NULL && rc != -EOPNOTSUPP) {
+        (*out_failed)++;
+      }
+    }
+    if (rc == -EOPNOTSUPP) {
+      break;
+    }
+    if (ch != NULL) {
+      out[n++] = ch;
+    }
+  }
+  smb2_free_data(ctx, list);
+  return n;
+}
+
+// Pick the connection for a READ needing `needed` credits: of those with the
+// credits, or with nothing in flight so that a starved credit window still
+// makes progress, the one with the fewest READs in flight. `*out` is NULL
+// for the session's own. Returns false if none can take it now.
+static bool np_channel_pick_locked(np_shared_file_t *file, int needed,
+                                   np_channel_t **out) {
+  int own = file->inflight;
+  for (int i = 0; i < file->nchannels; i++) {
+    own -= file->channels[i]->inflight;
+  }
+  bool found = false;
+  int best = 0;
+  if (own == 0 || smb2_get_available_credits(file->session->ctx) >= needed) {
+    found = true;
+    best = own;
+    *out = NULL;
+  }
+  for (int i = 0; i < file->nchannels; i++) {
+    np_channel_t *ch = file->channels[i];
+    if ((found && ch->inflight >= best) ||
+        (ch->inflight > 0 && smb2_get_available_credits(ch->ctx) < needed)) {
+      continue;
+    }
+    found = true;
+    best = ch->inflight;
+    *out = ch;
+  }
+  return found;
+}
+
+// ---------------------------------------------------------------------------
+// Flights
+// ---------------------------------------------------------------------------
+
+static void np_flight_unlink(np_flight_t *flight) {
+  np_shared_file_t *file = flight->file;
+  for (np_flight_t **p = &file->flights; *p != NULL; p = &(*p)->next) {
+    if (*p == flight) {
+      *p = flight->next;
+      break;
+    }
+  }
+  np_buf_release(flight->buf);
+  free(flight);
+}
+
+// Note how long a READ of `file` took to land.
+static void np_latency_sample_locked(np_shared_file_t *file,
+                                     uint64_t issued_ms) {
+  const uint64_t ms = np_now_ms() - issued_ms;
+  file->latencies[file->latency_next] =
+      ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+  file->latency_next = (file->latency_next + 1) % NP_HEDGE_SAMPLES;
+  if (file->nlatencies < NP_HEDGE_SAMPLES) {
+    file->nlatencies++;
+  }
+}
+
+// How long a READ of `file` may take before it is hedged: the configured
+// percentile of its latest latencies. 0 if it is not to be hedged, with
+// hedging off, no other connection to hedge on, or too few READs to go by.
+static uint32_t np_hedge_delay_locked(const np_shared_file_t *file) {
+  if (g_hedge_percentile == 0 || file->nchannels == 0 ||
+      file->nlatencies < NP_HEDGE_MIN_SAMPLES) {
+    return 0;
+  }
+  uint32_t sorted[NP_HEDGE_SAMPLES];
+  const int n = file->nlatencies;
+  for (int i = 0; i < n; i++) {
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > file->latencies[i]; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = file->latencies[i];
+  }
+  const uint32_t ms = sorted[n * g_hedge_percentile / 100];
+  g_hedge_delay_ms = ms < NP_HEDGE_MIN_MS ? NP_HEDGE_MIN_MS : ms;
+  return (uint32_t)g_hedge_delay_ms;
+}
+
+// The connection a READ on `ch` of `file` (NULL for the session's own) is
+// on.
+static struct smb2_context *np_channel_ctx(const np_shared_file_t *file,
+                                           const np_channel_t *ch) {
+  return ch != NULL ? ch->ctx : file->session->ctx;
+}
+
+static void np_hedge_free(np_hedge_t *h) {
+  np_buf_release(h->buf);
+  free(h);
+}
+
+// The READ of `flight` landed, failed or is not wanted any more: cancel its
+// hedge. The hedge's callback frees it, now or once its reply is in.
+static void np_hedge_drop_locked(np_flight_t *flight) {
+  np_hedge_t *h = flight->hedge;
+  flight->hedge = NULL;
+  h->flight = NULL;
+  h->file->hedges_wasted++;
+  // Failing to write the CANCEL is found by whoever services it next.
+  smb2_cancel_async(np_channel_ctx(h->file, h->channel), h);
+}
+
+static void np_flight_cb(struct smb2_context *smb2, int status,
+                         void *command_data, void *cb_data) {
+  (void)command_data;
+  np_flight_t *flight = (np_flight_t *)cb_data;
+  np_shared_file_t *file = flight->file;
+
+  np_channel_t *ch = flight->channel;
+
+  // A lost context fails its READs; they are issued again on another one.
+  if (file->reconnecting || (ch != NULL && ch->lost)) {
+    return;
+  }
+  // Its hedge landed first and filled it in; this is the READ cancelled, or
+  // a reply that was already arriving.
+  if (flight->superseded) {
+    flight->superseded = false;
+    flight->status = (int)flight->got;
+    flight->done = true;
+    file->inflight--;
+    if (ch != NULL) {
+      ch->inflight--;
+    }
+    if (flight->orphan) {
+      np_flight_unlink(flight);
+    }
+    return;
+  }
+  if (status > 0) {
+    file->reconnects = 0;
+    flight->got += (uint32_t)status;
+    // Short of credits libsmb2 shrinks a READ; fetch the rest.
+    if (flight->got < flight->want && flight->refs > 0 &&
+        smb2_pread_async(smb2, ch != NULL ? ch->fh : file->fh,
+                         flight->buf + flight->got,
+                         flight->want - flight->got,
+                         flight->offset + flight->got,
+                         np_flight_cb, flight) == 0) {
+      return;
+    }
+  }
+  flight->status = status < 0 ? status : (int)flight->got;
+  flight->done = true;
+  file->inflight--;
+  if (ch != NULL) {
+    ch->inflight--;
+  }
+  if (status >= 0) {
+    np_latency_sample_locked(file, flight->issued_ms);
+  }
+  if (flight->hedge != NULL) {
+    np_hedge_drop_locked(flight);
+  }
+  // A READ cancelled by its last holder did not fail.
+  if (status < 0 && flight->refs > 0) {
+    file->failed = true;
+  }
+  if (flight->orphan) {
+    np_flight_unlink(flight);
+  }
+}
+
+static void np_hedge_cb(struct smb2_context *smb2, int status,
+                        void *command_data, void *cb_data) {
+  (void)command_data;
+  np_hedge_t *h = (np_hedge_t *)cb_data;
+  np_shared_file_t *file = h->file;
+  np_channel_t *ch = h->channel;
+  np_flight_t *flight = h->flight;
+
+  // A lost context fails its READs; the flight's own READ goes on.
+  if (file->reconnecting || (ch != NULL && ch->lost)) {
+    if (!file->reconnecting) {
+      file->inflight--;
+    }
+    if (flight != NULL) {
+      flight->hedge = NULL;
+    }
+    np_hedge_free(h);
+    return;
+  }
+  if (status > 0) {
+    h->got += (uint32_t)status;
+    if (h->got < h->want && flight != NULL &&
+        smb2_pread_async(smb2, ch != NULL ? ch->fh : file->fh,
+                         h->buf + h->got, h->want - h->got,
+                         h->offset + h->got, np_hedge_cb, h) == 0) {
+      return;
+    }
+  }
+  file->inflight--;
+  if (ch != NULL) {
+    ch->inflight--;
+  }
+  if (flight != NULL) {
+    flight->hedge = NULL;
+  }
+  if (flight != NULL && status >= 0 && h->got == h->want) {
+    memcpy(flight->buf + h->base, h->buf, h->want);
+    flight->got = flight->want;
+    file->hedge_wins++;
+    np_latency_sample_locked(file, flight->issued_ms);
+    if (flight->parked) {
+      // Its own READ was lost with its connection and is not issued again.
+      flight->parked = false;
+      flight->status = (int)flight->got;
+      flight->done = true;
+    } else {
+      // Its own READ completes it once cancelled. Failing to write the
+      // CANCEL is found by whoever services that connection next.
+      flight->superseded = true;
+      smb2_cancel_async(np_channel_ctx(file, flight->channel), flight);
+    }
+  }
+  np_hedge_free(h);
+}
+
+// Issue the rest of the READ of `flight` again on the connection other than
+// its own with the fewest READs in flight. Nothing happens if none has the
+// credits for it now.
+static void np_hedge_issue_locked(np_flight_t *flight) {
+  np_shared_file_t *file = flight->file;
+  const uint32_t left = flight->want - flight->got;
+  const int needed = (int)((left - 1) / NP_SHARED_CREDIT_UNIT + 1);
+  int own = file->inflight;
+  for (int i = 0; i < file->nchannels; i++) {
+    own -= file->channels[i]->inflight;
+  }
+  bool found = false;
+  int best = 0;
+  np_channel_t *ch = NULL;
+  if (flight->channel != NULL &&
+      smb2_get_available_credits(file->session->ctx) >= needed) {
+    found = true;
+    best = own;
+  }
+  for (int i = 0; i < file->nchannels; i++) {
+    np_channel_t *c = file->channels[i];
+    if (c == flight->channel || (found && c->inflight >= best) ||
+        smb2_get_available_credits(c->ctx) < needed) {
+      continue;
+    }
+    found = true;
+    best = c->inflight;
+    ch = c;
+  }
+  if (!found) {
+    return;
+  }
+
+  np_hedge_t *h = (np_hedge_t *)calloc(1, sizeof(*h));
+  uint8_t *buf = np_buf_acquire(left);
+  if (h == NULL || buf == NULL) {
+    free(h);
+    np_buf_release(buf);
+    return;
+  }
+  h->file = file;
+  h->flight = flight;
+  h->channel = ch;
+  h->buf = buf;
+  h->base = flight->got;
+  h->offset = flight->offset + flight->got;
+  h->want = left;
+  if (smb2_pread_async(np_channel_ctx(file, ch),
+                       ch != NULL ? ch->fh : file->fh, h->buf, h->want,
+                       h->offset, np_hedge_cb, h) < 0) {
+    np_hedge_free(h);
+    return;
+  }
+  flight->hedge = h;
+  file->inflight++;
+  if (ch != NULL) {
+    ch->inflight++;
+  }
+  file->hedges++;
+}
+
+// The READ of a flight took longer than most of its file's: hedge it, unless
+// it landed, is already hedged or nobody wants it any more.
+static void np_flight_deadline_cb(struct smb2_context *smb2, void *cb_data) {
+  (void)smb2;
+  np_flight_t *flight = (np_flight_t *)cb_data;
+  np_shared_file_t *file = flight->file;
+  if (file->reconnecting || flight->done || flight->parked ||
+      flight->orphan || flight->superseded || flight->hedge != NULL ||
+      flight->refs == 0 ||
+      (flight->channel != NULL && flight->channel->lost)) {
+    return;
+  }
+  np_hedge_issue_locked(flight);
+}
+
+// Issue the READ of `flight` from where it got to, on `ch` (NULL for the
+// session's own connection).
+static int np_flight_issue_locked(np_flight_t *flight, np_channel_t *ch) {
+  np_shared_file_t *file = flight->file;
+  struct smb2_context *ctx = np_channel_ctx(file, ch);
+  const int rc = smb2_pread_async(
+      ctx, ch != NULL ? ch->fh : file->fh, flight->buf + flight->got,
+      flight->want - flight->got, flight->offset + flight->got, np_flight_cb,
+      flight);
+  if (rc < 0) {
+    return rc;
+  }
+  flight->channel = ch;
+  flight->issued_ms = np_now_ms();
+  file->inflight++;
+  if (ch != NULL) {
+    ch->inflight++;
+    g_channel_reads++;
+  }
+  const uint32_t delay = np_hedge_delay_locked(file);
+  if (delay > 0) {
+    smb2_set_deadline_async(ctx, flight, delay, np_flight_deadline_cb);
+  }
+  return 0;
+}
+
+// Stop reading over channel `i` of `file`, whose connection failed, and
+// park its READs to be issued again on the other connections. Called by the
+// holder servicing the session.
+static void np_channel_drop_locked(np_shared_file_t *file, int i) {
+  np_channel_t *ch = file->channels[i];
+  ch->lost = true;
+  smb2_free_fh(ch->ctx, ch->fh);
+  smb2_destroy_context(ch->ctx);
+  for (np_flight_t **p = &file->flights; *p != NULL;) {
+    np_flight_t *f = *p;
+    if (f->channel != ch) {
+      p = &f->next;
+      continue;
+    }
+    f->channel = NULL;
+    if (f->done) {
+      p = &f->next;
+    } else if (f->orphan) {
+      *p = f->next;
+      np_buf_release(f->buf);
+      free(f);
+      file->inflight--;
+    } else if (f->superseded) {
+      // Its hedge already filled it in.
+      f->superseded = false;
+      f->status = (int)f->got;
+      f->done = true;
+      file->inflight--;
+      p = &f->next;
+    } else {
+      f->parked = true;
+      file->inflight--;
+      p = &f->next;
+    }
+  }
+  free(ch);
+  file->nchannels--;
+  memmove(&file->channels[i], &file->channels[i + 1],
+          (size_t)(file->nchannels - i) * sizeof(file->channels[0]));
+}
+
+// Drop every channel of `file`, whose session is going away.
+static void np_channels_drop_locked(np_shared_file_t *file) {
+  while (file->nchannels > 0) {
+    np_channel_drop_locked(file, file->nchannels - 1);
+  }
+}
+
+// Wait until nobody is replacing the session of `file` or running its
+// callbacks. Everything that touches the session, the file handle or the
+// flights calls this first.
+static void np_shared_settle_locked(np_shared_file_t *file) {
+  while (file->reconnecting || file->servicing) {
+    np_cond_wait(&g_shared_cond, &g_shared_lock);
+  }
+}
+
+// Add the hedging counted by the callbacks of `file` to the totals.
+static void np_hedge_count_locked(np_shared_file_t *file) {
+  g_hedges += file->hedges;
+  g_hedge_wins += file->hedge_wins;
+  g_hedges_wasted += file->hedges_wasted;
+  file->hedges = 0;
+  file->hedge_wins = 0;
+  file->hedges_wasted = 0;
+}
+
+// Issue the READs of parked flights as far as credits allow, oldest first so
+// that a stream gets its next block before those further ahead.
+static void np_shared_unpark_locked(np_shared_file_t *file) {
+  np_flight_t *parked[64];
+  int n = 0;
+  for (np_flight_t *f = file->flights; f != NULL && n < 64; f = f->next) {
+    if (f->parked) {
+      parked[n++] = f;
+    }
+  }
+  while (n-- > 0) {
+    np_flight_t *f = parked[n];
+    const uint32_t left = f->want - f->got;
+    const int needed = (int)((left - 1) / NP_SHARED_CREDIT_UNIT + 1);
+    np_channel_t *ch;
+    if (!np_channel_pick_locked(file, needed, &ch)) {
+      return;
+    }
+    if (np_flight_issue_locked(f, ch) < 0) {
+      f->status = -EIO;
+      f->done = true;
+      file->failed = true;
+    } else {
+      g_reconnect_replays++;
+    }
+    f->parked = false;
+  }
+}
+
+// Open `file` again after its connection was lost and park the READs that
+// were in flight, to be issued again at the offsets they had got to. Called
+// and returns with g_shared_lock held, by the holder servicing the socket;
+// `reconnecting` keeps everyone else off the session meanwhile. Sets `broken`
+// if the file cannot be reopened, or was changed in between.
+static void np_shared_reconnect_locked(np_shared_file_t *file) {
+  const uint64_t start = np_now_ms();
+  g_reconnects++;
+  file->reconnecting = true;
+  // The channels go with the session they were bound to.
+  np_channels_drop_locked(file);
+  // The old context fails the READs it had; np_flight_cb ignores that.
+  smb2_free_fh(file->session->ctx, file->fh);
+  np_pool_release(file->session, NP_RELEASE_DISCARD);
+  file->session = NULL;
+  file->fh = NULL;
+  file->inflight = 0;
+  for (np_flight_t **p = &file->flights; *p != NULL;) {
+    np_flight_t *f = *p;
+    if (f->done) {
+      p = &f->next;
+    } else if (f->orphan) {
+      *p = f->next;
+      np_buf_release(f->buf);
+      free(f);
+    } else if (f->superseded) {
+      f->superseded = false;
+      f->status = (int)f->got;
+      f->done = true;
+      p = &f->next;
+    } else {
+      f->parked = true;
+      p = &f->next;
+    }
+  }
+  const int want = g_channels_max;
+  np_mutex_unlock(&g_shared_lock);
+
+  np_smb2_session_t *session = NULL;
+  struct smb2fh *fh = NULL;
+  np_channel_t *channels[NP_SHARED_MAX_CHANNELS - 1];
+  int nchannels = 0;
+  int bind_failures = 0;
+  uint64_t size = 0;
+  np_cache_key_t key;
+  char err[256];
+  int rc = -EIO;
+  for (int i = 0; i < NP_SHARED_RECONNECT_TRIES && rc != 0; i++) {
+    if (i > 0) {
+      np_sleep_ms(NP_SHARED_RECONNECT_BACKOFF_MS << (i - 1));
+    }
+    rc = np_open_file(file->host, file->port, file->username, file->password,
+                      file->domain, file->path, &file->durable, &session, &fh,
+                      &size, &key, err, (int)sizeof(err));
+  }
+  // Another version of the file must not be mixed into this one.
+  if (rc == 0 && (size != file->size || key.hi != file->key.hi ||
+                  key.lo != file->key.lo)) {
+    smb2_close(session->ctx, fh);
+    np_pool_release(session, NP_RELEASE_OK);
+    rc = -ESTALE;
+  }
+  if (rc == 0) {
+    nchannels =
+        np_channels_bind(file, session, fh, want, channels, &bind_failures);
+  }
+
+  np_mutex_lock(&g_shared_lock);
+  const uint64_t ms = np_now_ms() - start;
+  g_reconnect_total_ms += ms;
+  if (ms > g_reconnect_max_ms) {
+    g_reconnect_max_ms = ms;
+  }
+  g_channels_bound += (uint64_t)nchannels;
+  g_channel_bind_failures += (uint64_t)bind_failures;
+  if (rc == 0) {
+    file->session = session;
+    file->fh = fh;
+    memcpy(file->channels, channels, sizeof(channels[0]) * nchannels);
+    file->nchannels = nchannels;
+    file->failed = false;
+    np_lease_opened(file);
+    if (file->durable.reclaimed) {
+      g_reconnect_reclaims++;
+    }
+  } else {
+    g_reconnect_failures++;
+    file->broken = true;
+  }
+  file->reconnecting = false;
+  if (rc == 0) {
+    np_shared_unpark_locked(file);
+  }
+}
+
+// The connection was found lost by the holder servicing the socket: restore
+// it, unless nobody is left to read from a file being released or it keeps
+// being dropped.
+static void np_shared_lost_locked(np_shared_file_t *file) {
+  if (file->refs > 0 && file->reconnects++ < NP_SHARED_RECONNECT_LIMIT) {
+    np_shared_reconnect_locked(file);
+  } else {
+    file->broken = true;
+  }
+}
+
+// Service the connections once, polling them for up to `timeout_ms`. A lost
+// connection is restored before returning. Called and returns with
+// g_shared_lock held, by nobody else servicing it; the lock is released
+// around both the poll and the servicing.
+static void np_shared_service_locked(np_shared_file_t *file, int timeout_ms) {
+  file->pumping = true;
+  // Only this holder adds or drops channels, so they stay as polled.
+  const int n = file->nchannels + 1;
+  struct smb2_context *ctx[NP_SHARED_MAX_CHANNELS];
+  struct pollfd pfd[NP_SHARED_MAX_CHANNELS];
+  memset(pfd, 0, sizeof(pfd));
+  ctx[0] = file->session->ctx;
+  for (int i = 1; i < n; i++) {
+    ctx[i] = file->channels[i - 1]->ctx;
+  }
+  for (int i = 0; i < n; i++) {
+    pfd[i].fd = smb2_get_fd(ctx[i]);
+    pfd[i].events = (short)smb2_which_events(ctx[i]);
+    // Wake up for READs to hedge.
+    const int deadline = smb2_next_deadline(ctx[i]);
+    if (deadline >= 0 && deadline < timeout_ms) {
+      timeout_ms = deadline;
+    }
+  }
+  np_mutex_unlock(&g_shared_lock);
+
+  const int rc = poll(pfd, n, timeout_ms);
+  const int err = rc < 0 ? errno : 0;
+
+  // Nobody else is touching the file once the lock is back, and settling
+  // keeps them off it until the callbacks have run.
+  np_mutex_lock(&g_shared_lock);
+  file->servicing = true;
+  np_mutex_unlock(&g_shared_lock);
+  bool lost = false;
+  if (rc < 0 && err != EINTR) {
+    lost = true;
+  } else if (smb2_service(ctx[0], rc > 0 ? pfd[0].revents : 0) < 0) {
+    lost = true;
+  }
+  bool channel_lost[NP_SHARED_MAX_CHANNELS] = {false};
+  for (int i = 1; i < n && !lost; i++) {
+    channel_lost[i] = smb2_service(ctx[i], rc > 0 ? pfd[i].revents : 0) < 0;
+  }
+
+  np_mutex_lock(&g_shared_lock);
+  file->servicing = false;
+  np_hedge_count_locked(file);
+  // A failed channel only takes its own READs down; last first, so that
+  // dropping one does not move those still to be dropped.
+  for (int i = n - 1; i > 0 && !lost; i--) {
+    if (channel_lost[i]) {
+      g_channels_lost++;
+      np_channel_drop_locked(file, i - 1);
+    }
+  }
+  if (lost) {
+    np_shared_lost_locked(file);
+  } else {
+    np_shared_unpark_locked(file);
+  }
+  file->pumping = false;
+  np_cond_broadcast(&g_shared_cond);
+}
+
+// Service the socket once, or wait for the holder that does.
+static void np_shared_pump_locked(np_shared_file_t *file) {
+  if (file->pumping) {
+    np_cond_wait(&g_shared_cond, &g_shared_lock);
+    np_shared_settle_locked(file);
+    return;
+  }
+  np_shared_service_locked(file, NP_SHARED_POLL_MS);
+}
+
+// Take in what already arrived on an idle session, lease breaks above all:
+// nothing else does while readers are served from the cache. A holder
+// servicing it sees them anyway.
+static void np_shared_drain_locked(np_shared_file_t *file) {
+  if (file->pumping || file->reconnecting || file->broken ||
+      file->session == NULL) {
+    return;
+  }
+  np_shared_service_locked(file, 0);
+}
+
+static np_flight_t *np_flight_find_locked(np_shared_file_t *file,
+                                          uint64_t offset) {
+  bool read_lost;
+  np_lease_state(&file->lease, &read_lost);
+  for (np_flight_t *f = file->flights; f != NULL; f = f->next) {
+    // A failed block is fetched again rather than failing every joiner, and
+    // so is one that landed before the file may have changed.
+    if (f->whole && f->offset == offset && !f->orphan &&
+        !(f->done && (f->status < 0 || read_lost))) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+// Join the READ of the whole block at `offset` (with `whole`), or issue one.
+static int np_shared_issue(np_shared_file_t *file, uint64_t offset,
+                           uint32_t want, bool whole, bool wait,
+                           np_flight_t **out) {
+  const int needed = (int)((want - 1) / NP_SHARED_CREDIT_UNIT + 1);
+
+  np_channel_t *ch;
+
+  np_mutex_lock(&g_shared_lock);
+  for (;;) {
+    np_shared_settle_locked(file);
+    if (file->broken) {
+      np_mutex_unlock(&g_shared_lock);
+      return -EIO;
+    }
+    np_flight_t *f = whole ? np_flight_find_locked(file, offset) : NULL;
+    if (f != NULL) {
+      f->refs++;
+      g_shared_joins++;
+      np_mutex_unlock(&g_shared_lock);
+      *out = f;
+      return 0;
+    }
+    if (np_channel_pick_locked(file, needed, &ch)) {
+      break;
+    }
+    if (!wait) {
+      np_mutex_unlock(&g_shared_lock);
+      return -EAGAIN;
+    }
+    np_shared_pump_locked(file);
+  }
+
+  np_flight_t *flight = (np_flight_t *)calloc(1, sizeof(*flight));
+  uint8_t *buf = np_buf_acquire(want);
+  if (flight == NULL || buf == NULL) {
+    np_mutex_unlock(&g_shared_lock);
+    free(flight);
+    np_buf_release(buf);
+    return -ENOMEM;
+  }
+  flight->file = file;
+  flight->offset = offset;
+  flight->whole = whole;
+  flight->buf = buf;
+  flight->want = want;
+  flight->refs = 1;
+  const int rc = np_flight_issue_locked(flight, ch);
+  if (rc < 0) {
+    np_mutex_unlock(&g_shared_lock);
+    np_buf_release(buf);
+    free(flight);
+    return rc;
+  }
+  flight->next = file->flights;
+  file->flights = flight;
+  g_shared_reads++;
+  np_mutex_unlock(&g_shared_lock);
+  *out = flight;
+  return 0;
+}
+
+int np_shared_fetch(np_shared_file_t *file, uint64_t block, bool wait,
+                    np_flight_t **out) {
+  const uint64_t start = block * NP_CACHE_BLOCK_SIZE;
+  if (start >= file->size) {
+    return -EINVAL;
+  }
+  const uint32_t want = file->size - start < NP_CACHE_BLOCK_SIZE
+                            ? (uint32_t)(file->size - start)
+                            : NP_CACHE_BLOCK_SIZE;
+  return np_shared_issue(file, start, want, true, wait, out);
+}
+
+int np_shared_join(np_shared_file_t *file, uint64_t block,
+                   np_flight_t **out) {
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  np_flight_t *f =
+      np_flight_find_locked(file, block * NP_CACHE_BLOCK_SIZE);
+  if (f != NULL) {
+    f->refs++;
+    g_shared_joins++;
+  }
+  np_mutex_unlock(&g_shared_lock);
+  *out = f;
+  return f != NULL ? 0 : -ENOENT;
+}
+
+int np_shared_fetch_range(np_shared_file_t *file, uint64_t offset,
+                          uint32_t len, np_flight_t **out) {
+  if (offset >= file->size || len == 0) {
+    return -EINVAL;
+  }
+  if (file->size - offset < len) {
+    len = (uint32_t)(file->size - offset);
+  }
+  return np_shared_issue(file, offset, len, false, true, out);
+}
+
+// The block's outcome once it landed. The first holder to see a whole block
+// caches it, unless the file may have changed; the buffer no longer changes,
+// so that happens unlocked.
+static int np_flight_result_locked(np_flight_t *flight, bool *out_store) {
+  *out_store = false;
+  if (!flight->done) {
+    return flight->file->broken ? -EIO : -EAGAIN;
+  }
+  bool read_lost;
+  np_lease_state(&flight->file->lease, &read_lost);
+  if (flight->whole && !flight->stored && !read_lost &&
+      flight->status == (int)flight->want) {
+    flight->stored = true;
+    *out_store = true;
+  }
+  return flight->status;
+}
+
+static void np_flight_store(const np_flight_t *flight) {
+  const uint64_t block = flight->offset / NP_CACHE_BLOCK_SIZE;
+  np_cache_store(&flight->file->key, block, flight->buf, flight->got);
+  // A break that came in meanwhile already invalidated the file's blocks.
+  bool read_lost;
+  np_lease_state(&flight->file->lease, &read_lost);
+  if (read_lost) {
+    np_lease_invalidate(&flight->file->key, block, 1);
+  }
+}
+
+int np_shared_poll(np_shared_file_t *file, np_flight_t *flight) {
+  bool store;
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  const int rc = np_flight_result_locked(flight, &store);
+  np_mutex_unlock(&g_shared_lock);
+  if (store) {
+    np_flight_store(flight);
+  }
+  return rc;
+}
+
+int np_shared_wait(np_shared_file_t *file, np_flight_t *flight) {
+  bool store;
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  while (!flight->done && !file->broken) {
+    np_shared_pump_locked(file);
+  }
+  const int rc = np_flight_result_locked(flight, &store);
+  np_mutex_unlock(&g_shared_lock);
+  if (store) {
+    np_flight_store(flight);
+  }
+  return rc;
+}
+
+const uint8_t *np_flight_data(const np_flight_t *flight) { return flight->buf; }
+
+uint64_t np_flight_offset(const np_flight_t *flight) { return flight->offset; }
+
+void np_shared_put(np_shared_file_t *file, np_flight_t *flight) {
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  if (--flight->refs > 0) {
+    np_mutex_unlock(&g_shared_lock);
+    return;
+  }
+  if (flight->hedge != NULL) {
+    np_hedge_drop_locked(flight);
+  }
+  // A superseded READ was already cancelled.
+  if (!flight->done && !flight->parked && !flight->superseded &&
+      !file->broken &&
+      smb2_cancel_async(flight->channel != NULL ? flight->channel->ctx
+                                                : file->session->ctx,
+                        flight) < 0) {
+    file->broken = true;
+  }
+  if (flight->done || flight->parked) {
+    np_flight_unlink(flight);
+  } else {
+    // A sealed reply still being received, or the session is gone.
+    flight->orphan = true;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+void np_shared_cork(np_shared_file_t *file) {
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  // A failed reconnect leaves the file without a session.
+  if (file->session != NULL) {
+    smb2_cork(file->session->ctx);
+    for (int i = 0; i < file->nchannels; i++) {
+      smb2_cork(file->channels[i]->ctx);
+    }
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+void np_shared_uncork(np_shared_file_t *file) {
+  np_mutex_lock(&g_shared_lock);
+  // Uncorking a context replaced since does nothing.
+  np_shared_settle_locked(file);
+  if (file->session == NULL) {
+    np_mutex_unlock(&g_shared_lock);
+    return;
+  }
+  // Writing the batch can be what finds a connection lost. A holder
+  // servicing the socket finds that too, and is the only one to drop it.
+  const bool lost = smb2_uncork(file->session->ctx) < 0;
+  unsigned channels_lost = 0;
+  for (int i = 0; i < file->nchannels; i++) {
+    if (smb2_uncork(file->channels[i]->ctx) < 0) {
+      channels_lost |= 1u << i;
+    }
+  }
+  if ((lost || channels_lost != 0) && !file->pumping) {
+    file->pumping = true;
+    if (lost) {
+      np_shared_lost_locked(file);
+    } else {
+      for (int i = file->nchannels - 1; i >= 0; i--) {
+        if (channels_lost & (1u << i)) {
+          g_channels_lost++;
+          np_channel_drop_locked(file, i);
+        }
+      }
+      np_shared_unpark_locked(file);
+    }
+    file->pumping = false;
+    np_cond_broadcast(&g_shared_cond);
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+void np_shared_set_err(np_shared_file_t *file, char *err_buf, int err_len,
+                       const char *what) {
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  if (file->broken) {
+    np_set_err(err_buf, err_len, "%s: SMB connection lost", what);
+  } else {
+    np_set_err(err_buf, err_len, "%s: %s", what,
+               smb2_get_error(file->session->ctx));
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+// ---------------------------------------------------------------------------
+// Files
+// ---------------------------------------------------------------------------
+
+int np_shared_open(const char *host, int port, const char *username,
+                   const char *password, const char *domain, const char *path,
+                   np_shared_file_t **out, char *err_buf, int err_len) {
+  char *normalized = np_normalize_path(path);
+  if (normalized == NULL) {
+    np_set_err(err_buf, err_len, "Out of memory");
+    return -ENOMEM;
+  }
+  port = np_normalize_port(port);
+
+  // Set up before the lookup, so that the lookup and registering the file
+  // happen under one hold of the lock and concurrent openers of the same
+  // file always end up waiting for a single open. Dropped if it is found.
+  np_shared_file_t *file = (np_shared_file_t *)calloc(1, sizeof(*file));
+  if (file == NULL) {
+    free(normalized);
+    np_set_err(err_buf, err_len, "Out of memory");
+    return -ENOMEM;
+  }
+  file->host = np_strdup_or_empty(host);
+  file->port = port;
+  file->username = np_strdup_or_empty(username);
+  file->password = np_strdup_or_empty(password);
+  file->domain = np_strdup_or_empty(domain);
+  file->path = normalized;
+  file->refs = 1;
+  if (file->host == NULL || file->username == NULL ||
+      file->password == NULL || file->domain == NULL) {
+    np_shared_free(file);
+    np_set_err(err_buf, err_len, "Out of memory");
+    return -ENOMEM;
+  }
+  // Known before the open, which may already see a break.
+  np_lease_link(&file->lease);
+  file->durable.lease_want = NP_SHARED_LEASE;
+  memcpy(file->durable.lease_key, file->lease.key,
+         sizeof(file->durable.lease_key));
+
+  np_mutex_lock(&g_shared_lock);
+  for (np_shared_file_t *f = g_shared_files; f != NULL; f = f->next) {
+    if (!np_shared_matches(f, host, port, username, password, domain,
+                           file->path)) {
+      continue;
+    }
+    np_shared_free(file);
+    f->refs++;
+    while (f->opening) {
+      np_cond_wait(&g_shared_cond, &g_shared_lock);
+    }
+    const int rc = f->open_rc;
+    if (rc != 0) {
+      np_set_err(err_buf, err_len, "%s", f->open_err);
+      if (--f->refs == 0) {
+        np_shared_free(f);
+      }
+      np_mutex_unlock(&g_shared_lock);
+      return rc;
+    }
+    g_shared_reuses++;
+    np_mutex_unlock(&g_shared_lock);
+    *out = f;
+    return 0;
+  }
+  // Registered before opening so that concurrent openers wait for this one.
+  file->opening = true;
+  file->next = g_shared_files;
+  g_shared_files = file;
+  const int want = g_channels_max;
+  np_mutex_unlock(&g_shared_lock);
+
+  const int rc =
+      np_open_file(host, port, username, password, domain, path,
+                   &file->durable, &file->session, &file->fh, &file->size,
+                   &file->key, file->open_err, (int)sizeof(file->open_err));
+  int bind_failures = 0;
+  if (rc == 0) {
+    file->nchannels = np_channels_bind(file, file->session, file->fh, want,
+                                       file->channels, &bind_failures);
+  }
+
+  np_mutex_lock(&g_shared_lock);
+  g_channels_bound += (uint64_t)file->nchannels;
+  g_channel_bind_failures += (uint64_t)bind_failures;
+  file->opening = false;
+  file->open_rc = rc;
+  np_cond_broadcast(&g_shared_cond);
+  if (rc != 0) {
+    np_set_err(err_buf, err_len, "%s", file->open_err);
+    np_shared_unlink(file);
+    if (--file->refs == 0) {
+      np_shared_free(file);
+    }
+    np_mutex_unlock(&g_shared_lock);
+    return rc;
+  }
+  g_shared_opens++;
+  np_lease_opened(file);
+  np_mutex_unlock(&g_shared_lock);
+  *out = file;
+  return 0;
+}
+uint64_t np_shared_size(const np_shared_file_t *file) { return file->size; }
+
+const np_cache_key_t *np_shared_key(const np_shared_file_t *file) {
+  return &file->key;
+}
+
+bool np_shared_cacheable(np_shared_file_t *file) {
+  bool read_lost;
+  np_mutex_lock(&g_shared_lock);
+  // Without a lease no break ever comes.
+  if (np_lease_state(&file->lease, &read_lost) != 0 && !read_lost) {
+    np_shared_drain_locked(file);
+    np_lease_state(&file->lease, &read_lost);
+  }
+  np_mutex_unlock(&g_shared_lock);
+  return !read_lost;
+}
+
+bool np_shared_lease_stat(const char *host, int port, const char *username,
+                          const char *password, const char *domain,
+                          const char *path, uint64_t *out_size) {
+  char *normalized = np_normalize_path(path);
+  if (normalized == NULL) {
+    return false;
+  }
+  port = np_normalize_port(port);
+
+  np_mutex_lock(&g_shared_lock);
+  np_shared_file_t *file = NULL;
+  for (np_shared_file_t *f = g_shared_files; f != NULL; f = f->next) {
+    if (!f->opening && f->open_rc == 0 &&
+        np_shared_matches(f, host, port, username, password, domain,
+                          normalized)) {
+      file = f;
+      break;
+    }
+  }
+  free(normalized);
+  bool read_lost = true;
+  if (file != NULL && (np_lease_state(&file->lease, &read_lost) &
+                       SMB2_LEASE_READ_CACHING)) {
+    // Held so that it outlives the unlocked poll.
+    file->refs++;
+    np_shared_drain_locked(file);
+    const uint32_t state = np_lease_state(&file->lease, &read_lost);
+    read_lost = read_lost || !(state & SMB2_LEASE_READ_CACHING) ||
+                file->broken;
+    if (!read_lost) {
+      *out_size = file->size;
+    }
+    np_mutex_unlock(&g_shared_lock);
+    np_shared_release(file, NP_RELEASE_OK);
+  } else {
+    read_lost = true;
+    np_mutex_unlock(&g_shared_lock);
+  }
+  if (!read_lost) {
+    np_mutex_lock(&g_lease_lock);
+    g_lease_stat_hits++;
+    np_mutex_unlock(&g_lease_lock);
+  }
+  return !read_lost;
+}
+
+static void np_shared_close_cb(struct smb2_context *smb2, int status,
+                               void *command_data, void *cb_data) {
+  (void)smb2;
+  (void)status;
+  (void)command_data;
+  (void)cb_data;
+}
+
+void np_shared_release(np_shared_file_t *file, enum np_release_mode mode) {
+  np_mutex_lock(&g_shared_lock);
+  np_shared_settle_locked(file);
+  if (mode == NP_RELEASE_DISCARD) {
+    file->broken = true;
+  } else if (mode == NP_RELEASE_SUSPECT) {
+    file->failed = true;
+  }
+  if (--file->refs > 0) {
+    np_mutex_unlock(&g_shared_lock);
+    return;
+  }
+  np_shared_unlink(file);
+  // Only orphaned flights are left: replies that were already arriving when
+  // their READ was cancelled. Let them land.
+  while (file->inflight > 0 && !file->broken) {
+    np_shared_pump_locked(file);
+  }
+  np_hedge_count_locked(file);
+  np_mutex_unlock(&g_shared_lock);
+
+  // Nobody else can reach the file now. Destroying a channel fails the READs
+  // of orphans on it, which frees them.
+  for (int i = 0; i < file->nchannels; i++) {
+    np_channel_destroy(file->channels[i]);
+  }
+  if (file->session == NULL) {
+    // The reconnect failed; the lost session is already gone.
+  } else if (file->broken) {
+    // Destroying the context fails the orphans' READs, which frees them,
+    // and the queued CLOSE frees the file handle.
+    smb2_close_async(file->session->ctx, file->fh, np_shared_close_cb, NULL);
+    np_pool_release(file->session, NP_RELEASE_DISCARD);
+  } else {
+    smb2_close(file->session->ctx, file->fh);
+    np_pool_release(file->session,
+                    file->failed ? NP_RELEASE_SUSPECT : NP_RELEASE_OK);
+  }
+  while (file->flights != NULL) {
+    np_flight_unlink(file->flights);
+  }
+  np_shared_free(file);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_shared_stats(uint64_t *out_opens,
+                                            uint64_t *out_reused_opens,
+                                            uint64_t *out_reads,
+                                            uint64_t *out_joined_reads) {
+  np_mutex_lock(&g_shared_lock);
+  if (out_opens != NULL) {
+    *out_opens = g_shared_opens;
+  }
+  if (out_reused_opens != NULL) {
+    *out_reused_opens = g_shared_reuses;
+  }
+  if (out_reads != NULL) {
+    *out_reads = g_shared_reads;
+  }
+  if (out_joined_reads != NULL) {
+    *out_joined_reads = g_shared_joins;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_reconnect_stats(uint64_t *out_reconnects,
+                                               uint64_t *out_failed,
+                                               uint64_t *out_reclaimed,
+                                               uint64_t *out_replayed_reads,
+                                               uint64_t *out_total_ms,
+                                               uint64_t *out_max_ms) {
+  np_mutex_lock(&g_shared_lock);
+  if (out_reconnects != NULL) {
+    *out_reconnects = g_reconnects;
+  }
+  if (out_failed != NULL) {
+    *out_failed = g_reconnect_failures;
+  }
+  if (out_reclaimed != NULL) {
+    *out_reclaimed = g_reconnect_reclaims;
+  }
+  if (out_replayed_reads != NULL) {
+    *out_replayed_reads = g_reconnect_replays;
+  }
+  if (out_total_ms != NULL) {
+    *out_total_ms = g_reconnect_total_ms;
+  }
+  if (out_max_ms != NULL) {
+    *out_max_ms = g_reconnect_max_ms;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_lease_stats(uint64_t *out_grants,
+                                           uint64_t *out_breaks,
+                                           uint64_t *out_invalidated_blocks,
+                                           uint64_t *out_stat_hits) {
+  np_mutex_lock(&g_lease_lock);
+  if (out_grants != NULL) {
+    *out_grants = g_lease_grants;
+  }
+  if (out_breaks != NULL) {
+    *out_breaks = g_lease_breaks;
+  }
+  if (out_invalidated_blocks != NULL) {
+    *out_invalidated_blocks = g_lease_invalidated;
+  }
+  if (out_stat_hits != NULL) {
+    *out_stat_hits = g_lease_stat_hits;
+  }
+  np_mutex_unlock(&g_lease_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_multichannel_configure(int max_channels) {
+  np_mutex_lock(&g_shared_lock);
+  if (max_channels <= 0) {
+    g_channels_max = NP_SHARED_CHANNELS;
+  } else if (max_channels > NP_SHARED_MAX_CHANNELS) {
+    g_channels_max = NP_SHARED_MAX_CHANNELS;
+  } else {
+    g_channels_max = max_channels;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_hedge_configure(int percentile) {
+  np_mutex_lock(&g_shared_lock);
+  if (percentile <= 0) {
+    g_hedge_percentile = 0;
+  } else if (percentile < NP_HEDGE_MIN_PERCENTILE) {
+    g_hedge_percentile = NP_HEDGE_MIN_PERCENTILE;
+  } else if (percentile > NP_HEDGE_MAX_PERCENTILE) {
+    g_hedge_percentile = NP_HEDGE_MAX_PERCENTILE;
+  } else {
+    g_hedge_percentile = percentile;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_hedge_stats(uint64_t *out_hedged_reads,
+                                           uint64_t *out_won,
+                                           uint64_t *out_wasted,
+                                           uint64_t *out_delay_ms) {
+  np_mutex_lock(&g_shared_lock);
+  if (out_hedged_reads != NULL) {
+    *out_hedged_reads = g_hedges;
+  }
+  if (out_won != NULL) {
+    *out_won = g_hedge_wins;
+  }
+  if (out_wasted != NULL) {
+    *out_wasted = g_hedges_wasted;
+  }
+  if (out_delay_ms != NULL) {
+    *out_delay_ms = g_hedge_delay_ms;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_multichannel_stats(uint64_t *out_bound,
+                                                  uint64_t *out_failed_binds,
+                                                  uint64_t *out_striped_reads,
+                                                  uint64_t *out_lost) {
+  np_mutex_lock(&g_shared_lock);
+  if (out_bound != NULL) {
+    *out_bound = g_channels_bound;
+  }
+  if (out_failed_binds != NULL) {
+    *out_failed_binds = g_channel_bind_failures;
+  }
+  if (out_striped_reads != NULL) {
+    *out_striped_reads = g_channel_reads;
+  }
+  if (out_lost != NULL) {
+    *out_lost = g_channels_lost;
+  }
+  np_mutex_unlock(&g_shared_lock);
+}
@@ -0,0 +1,715 @@
+#include "nipaplay_smb2.h"
+#include "nipaplay_smb2_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+// Used when the caller passes 0 for chunk size / queue depth.
+#define NP_STREAM_DEFAULT_CHUNK (1024 * 1024)
+#define NP_STREAM_DEFAULT_DEPTH 8
+#define NP_STREAM_MAX_DEPTH 64
+// SMB2 charges one credit per 64 KiB of READ payload.
+#define NP_STREAM_CREDIT_UNIT 65536
+
+enum np_slot_state {
+  NP_SLOT_FREE = 0,
+  NP_SLOT_PENDING,
+  NP_SLOT_DONE,
+};
+
+typedef struct np_stream_slot {
+  struct np_smb2_stream *stream;
+  uint8_t *buf;
+  uint64_t offset;
+  uint32_t want;
+  int state;
+  volatile int done;
+  int status;
+  // Filled from the block cache rather than by a READ.
+  bool from_cache;
+  // The shared READ of the slot's block (shared streams only).
+  np_flight_t *flight;
+} np_stream_slot_t;
+
+struct np_smb2_stream {
+  // A shared stream reads through `file` and has no session of its own.
+  np_shared_file_t *file;
+  np_smb2_session_t *session;
+  struct smb2_context *ctx;
+  struct smb2fh *fh;
+  uint64_t size;
+
+  // Bytes in [next_offset, end) have not been requested yet; those before
+  // `pos` have been handed out.
+  uint64_t start;
+  uint64_t pos;
+  uint64_t next_offset;
+  uint64_t end;
+
+  uint32_t chunk;
+  int depth;
+  // Slots form a ring: `head` is the next to hand out, `tail` the next to fill.
+  int head;
+  int tail;
+  int inflight;
+  // The head slot was returned by the previous np_smb2_stream_next() call.
+  bool delivered;
+  // A READ failed with an NT status; the session itself is still usable.
+  bool failed;
+  // Servicing the socket failed; the session must be discarded.
+  bool broken;
+  // READs are aligned to cache blocks; cached ranges skip the network and
+  // fetched blocks are stored.
+  bool cached;
+  np_cache_key_t key;
+  // Grows the bytes requested ahead of `pos` while the consumer keeps up, so
+  // a short probe of the range costs one small READ rather than a full queue.
+  np_ra_t ra;
+
+  np_stream_slot_t slots[];
+};
+
+static void np_stream_set_err(np_smb2_stream_t *stream, char *err_buf,
+                              int err_len) {
+  if (stream->file != NULL) {
+    np_shared_set_err(stream->file, err_buf, err_len, "SMB read failed");
+  } else {
+    np_set_err(err_buf, err_len, "SMB read failed: %s",
+               smb2_get_error(stream->ctx));
+  }
+}
+
+static void np_stream_read_cb(struct smb2_context *smb2, int status,
+                              void *command_data, void *cb_data) {
+  (void)smb2;
+  (void)command_data;
+  np_stream_slot_t *slot = (np_stream_slot_t *)cb_data;
+  slot->status = status;
+  slot->done = 1;
+  slot->stream->inflight--;
+}
+
+static int np_stream_issue(np_smb2_stream_t *stream, np_stream_slot_t *slot,
+                           uint64_t offset, uint32_t want) {
+  slot->offset = offset;
+  slot->want = want;
+  slot->status = 0;
+  slot->done = 0;
+  slot->state = NP_SLOT_PENDING;
+  slot->from_cache = false;
+
+  const int rc = smb2_pread_async(stream->ctx, stream->fh, slot->buf, want,
+                                  offset, np_stream_read_cb, slot);
+  if (rc < 0) {
+    slot->state = NP_SLOT_FREE;
+    return rc;
+  }
+  stream->inflight++;
+  return 0;
+}
+
+// Fill the slot with the cached prefix of `[offset, offset + want)`, completed
+// right away. Returns the bytes filled; 0 if the first block is not cached.
+static uint32_t np_stream_from_cache(np_smb2_stream_t *stream,
+                                     np_stream_slot_t *slot, uint64_t offset,
+                                     uint32_t want) {
+  uint32_t got = 0;
+  while (got < want) {
+    const uint64_t pos = offset + got;
+    const int n = np_cache_read(&stream->key, pos / NP_CACHE_BLOCK_SIZE,
+                                (uint32_t)(pos % NP_CACHE_BLOCK_SIZE),
+                                slot->buf + got, want - got);
+    if (n <= 0) {
+      break;
+    }
+    got += (uint32_t)n;
+  }
+  if (got > 0) {
+    slot->offset = offset;
+    slot->want = got;
+    slot->status = (int)got;
+    slot->done = 1;
+    slot->state = NP_SLOT_PENDING;
+    slot->from_cache = true;
+  }
+  return got;
+}
+
+// Store the whole blocks a READ brought in.
+static void np_stream_to_cache(np_smb2_stream_t *stream,
+                               const np_stream_slot_t *slot) {
+  const uint64_t end = slot->offset + (uint64_t)slot->status;
+  uint64_t block = (slot->offset + NP_CACHE_BLOCK_SIZE - 1) / NP_CACHE_BLOCK_SIZE;
+  for (;; block++) {
+    const uint64_t start = block * NP_CACHE_BLOCK_SIZE;
+    uint64_t stop = start + NP_CACHE_BLOCK_SIZE;
+    if (stop > stream->size) {
+      stop = stream->size;
+    }
+    if (start >= stop || stop > end) {
+      return;
+    }
+    np_cache_store(&stream->key, block, slot->buf + (start - slot->offset),
+                   (uint32_t)(stop - start));
+  }
+}
+
+// Like np_stream_fill() for a shared stream: one slot per block, each joining
+// the file's READ of it. Stops short of credits; np_stream_next() waits.
+static int np_stream_fill_shared(np_smb2_stream_t *stream) {
+  int rc = 0;
+  const bool cached = stream->cached && np_shared_cacheable(stream->file);
+  np_shared_cork(stream->file);
+  while (stream->next_offset < stream->end) {
+    np_stream_slot_t *slot = &stream->slots[stream->tail];
+    if (slot->state != NP_SLOT_FREE ||
+        stream->next_offset - stream->pos >= stream->ra.window) {
+      break;
+    }
+    const uint32_t in_block =
+        (uint32_t)(stream->next_offset % NP_CACHE_BLOCK_SIZE);
+    const uint64_t remaining = stream->end - stream->next_offset;
+    const uint32_t want = remaining < NP_CACHE_BLOCK_SIZE - in_block
+                              ? (uint32_t)remaining
+                              : NP_CACHE_BLOCK_SIZE - in_block;
+
+    // Slot buffers hold cached data and unaligned heads only.
+    if ((cached || in_block != 0) && slot->buf == NULL) {
+      slot->buf = np_buf_acquire(NP_CACHE_BLOCK_SIZE);
+      if (slot->buf == NULL) {
+        rc = -ENOMEM;
+        break;
+      }
+    }
+    if (cached &&
+        np_stream_from_cache(stream, slot, stream->next_offset, want) > 0) {
+      stream->next_offset += slot->want;
+      stream->tail = (stream->tail + 1) % stream->depth;
+      continue;
+    }
+
+    rc = np_shared_fetch(stream->file,
+                         stream->next_offset / NP_CACHE_BLOCK_SIZE, false,
+                         &slot->flight);
+    if (rc < 0) {
+      if (rc == -EAGAIN) {
+        rc = 0;
+      }
+      break;
+    }
+    slot->offset = stream->next_offset;
+    slot->want = want;
+    slot->status = 0;
+    slot->done = 0;
+    slot->state = NP_SLOT_PENDING;
+    slot->from_cache = false;
+    stream->next_offset += want;
+    stream->tail = (stream->tail + 1) % stream->depth;
+  }
+  np_shared_uncork(stream->file);
+  return rc;
+}
+
+// Keep READs in flight up to the read-ahead window, bounded by free slots and
+// credits. The context is corked meanwhile so the whole batch goes out in one
+// writev().
+static int np_stream_fill(np_smb2_stream_t *stream) {
+  if (stream->file != NULL) {
+    return np_stream_fill_shared(stream);
+  }
+  int rc = 0;
+  smb2_cork(stream->ctx);
+  while (stream->next_offset < stream->end) {
+    np_stream_slot_t *slot = &stream->slots[stream->tail];
+    if (slot->state != NP_SLOT_FREE) {
+      break;
+    }
+    const uint64_t ahead = stream->next_offset - stream->pos;
+    if (ahead >= stream->ra.window) {
+      break;
+    }
+    if (slot->buf == NULL) {
+      slot->buf = np_buf_acquire(stream->chunk);
+      if (slot->buf == NULL) {
+        rc = -ENOMEM;
+        break;
+      }
+    }
+
+    // Requests grow with the window up to a full chunk.
+    uint32_t chunk = stream->chunk;
+    if (stream->ra.window - ahead < chunk) {
+      chunk = (uint32_t)(stream->ra.window - ahead);
+    }
+    if (stream->cached) {
+      // Whole blocks only; realign after an unaligned start.
+      chunk = (chunk + NP_CACHE_BLOCK_SIZE - 1) / NP_CACHE_BLOCK_SIZE *
+              NP_CACHE_BLOCK_SIZE;
+      if (chunk > stream->chunk) {
+        chunk = stream->chunk;
+      }
+      chunk -= (uint32_t)(stream->next_offset % NP_CACHE_BLOCK_SIZE);
+    }
+    const uint64_t remaining = stream->end - stream->next_offset;
+    const uint32_t want = remaining < chunk ? (uint32_t)remaining : chunk;
+
+    if (stream->cached) {
+      const uint32_t got =
+          np_stream_from_cache(stream, slot, stream->next_offset, want);
+      if (got > 0) {
+        stream->next_offset += got;
+        stream->tail = (stream->tail + 1) % stream->depth;
+        continue;
+      }
+    }
+
+    // Always allow one READ so a starved credit window still makes progress;
+    // libsmb2 shrinks it to whatever the server granted.
+    const int needed = (int)((want - 1) / NP_STREAM_CREDIT_UNIT + 1);
+    if (stream->inflight > 0 &&
+        smb2_get_available_credits(stream->ctx) < needed) {
+      break;
+    }
+
+    rc = np_stream_issue(stream, slot, stream->next_offset, want);
+    if (rc < 0) {
+      break;
+    }
+    stream->next_offset += want;
+    stream->tail = (stream->tail + 1) % stream->depth;
+  }
+  // A failed flush leaves the socket unusable, not just this stream.
+  if (smb2_uncork(stream->ctx) < 0) {
+    stream->broken = true;
+    if (rc == 0) {
+      rc = -EIO;
+    }
+  }
+  return rc;
+}
+
+// Complete a shared slot once its block landed. An unaligned head is copied
+// out so the flight can go; aligned slots hand out the flight's buffer.
+static void np_stream_land(np_smb2_stream_t *stream, np_stream_slot_t *slot) {
+  const int rc = np_shared_poll(stream->file, slot->flight);
+  if (rc == -EAGAIN) {
+    return;
+  }
+  const uint32_t in_block = (uint32_t)(slot->offset % NP_CACHE_BLOCK_SIZE);
+  if (rc < 0) {
+    slot->status = rc;
+  } else {
+    const uint32_t have = (uint32_t)rc > in_block ? (uint32_t)rc - in_block : 0;
+    slot->status = (int)(have < slot->want ? have : slot->want);
+    if (in_block != 0) {
+      memcpy(slot->buf, np_flight_data(slot->flight) + in_block,
+             (size_t)slot->status);
+      np_shared_put(stream->file, slot->flight);
+      slot->flight = NULL;
+    }
+    // The file ended early; a shared READ is not re-issued.
+    if ((uint32_t)slot->status < slot->want) {
+      stream->end = slot->offset + (uint64_t)slot->status;
+    }
+  }
+  slot->done = 1;
+}
+
+// Recycle the slot returned by the previous call. A short READ that stopped
+// before the end of the range is re-issued for its remainder in place so the
+// data stays in order.
+static int np_stream_advance(np_smb2_stream_t *stream) {
+  np_stream_slot_t *slot = &stream->slots[stream->head];
+  stream->delivered = false;
+
+  if (slot->flight != NULL) {
+    np_shared_put(stream->file, slot->flight);
+    slot->flight = NULL;
+    slot->state = NP_SLOT_FREE;
+    stream->head = (stream->head + 1) % stream->depth;
+    return 0;
+  }
+
+  // The caller kept the chunk (np_smb2_stream_next_buf); READ into a new one.
+  if (np_buf_is_shared(slot->buf)) {
+    uint8_t *fresh = np_buf_acquire(stream->chunk);
+    if (fresh == NULL) {
+      return -ENOMEM;
+    }
+    np_buf_release(slot->buf);
+    slot->buf = fresh;
+  }
+
+  const uint32_t got = (uint32_t)slot->status;
+  if (got < slot->want && slot->offset + got < stream->end) {
+    return np_stream_issue(stream, slot, slot->offset + got, slot->want - got);
+  }
+
+  slot->state = NP_SLOT_FREE;
+  stream->head = (stream->head + 1) % stream->depth;
+  return 0;
+}
+
+static np_smb2_stream_t *np_stream_alloc(uint64_t size, uint64_t start,
+                                         uint64_t end_exclusive,
+                                         uint32_t chunk, int depth,
+                                         const np_cache_key_t *cache_key) {
+  np_smb2_stream_t *stream = (np_smb2_stream_t *)calloc(
+      1, sizeof(*stream) + (size_t)depth * sizeof(np_stream_slot_t));
+  if (stream == NULL) {
+    return NULL;
+  }
+
+  stream->size = size;
+  stream->end =
+      (end_exclusive == 0 || end_exclusive > size) ? size : end_exclusive;
+  stream->next_offset = start < stream->end ? start : stream->end;
+  stream->start = stream->next_offset;
+  stream->pos = stream->next_offset;
+  stream->chunk = chunk;
+  stream->depth = depth;
+  if (cache_key != NULL) {
+    stream->cached = true;
+    stream->key = *cache_key;
+  }
+  np_ra_init(&stream->ra, stream->next_offset);
+  // Slot buffers are acquired as the window first reaches them.
+  for (int i = 0; i < depth; i++) {
+    stream->slots[i].stream = stream;
+  }
+  return stream;
+}
+
+np_smb2_stream_t *np_stream_create(np_smb2_session_t *session,
+                                   struct smb2fh *fh, uint64_t size,
+                                   uint64_t start, uint64_t end_exclusive,
+                                   uint32_t chunk_size, int queue_depth,
+                                   const np_cache_key_t *cache_key) {
+  int depth = queue_depth > 0 ? queue_depth : NP_STREAM_DEFAULT_DEPTH;
+  if (depth > NP_STREAM_MAX_DEPTH) {
+    depth = NP_STREAM_MAX_DEPTH;
+  }
+  uint32_t chunk = chunk_size > 0 ? chunk_size : NP_STREAM_DEFAULT_CHUNK;
+  const uint32_t max_read = smb2_get_max_read_size(session->ctx);
+  if (max_read > 0 && chunk > max_read) {
+    chunk = max_read;
+  }
+  // Chunks smaller than a block would never store one.
+  const bool cached = cache_key != NULL && chunk >= NP_CACHE_BLOCK_SIZE &&
+                      np_cache_enabled();
+  if (cached) {
+    chunk -= chunk % NP_CACHE_BLOCK_SIZE;
+  }
+
+  np_smb2_stream_t *stream = np_stream_alloc(
+      size, start, end_exclusive, chunk, depth, cached ? cache_key : NULL);
+  if (stream == NULL) {
+    return NULL;
+  }
+  stream->session = session;
+  stream->ctx = session->ctx;
+  stream->fh = fh;
+  return stream;
+}
+
+np_smb2_stream_t *np_stream_create_shared(np_shared_file_t *file,
+                                          uint64_t start,
+                                          uint64_t end_exclusive,
+                                          uint32_t chunk_size,
+                                          int queue_depth) {
+  // Same bytes ahead as a private stream, counted in blocks.
+  const uint32_t chunk = chunk_size > 0 ? chunk_size : NP_STREAM_DEFAULT_CHUNK;
+  int depth = queue_depth > 0 ? queue_depth : NP_STREAM_DEFAULT_DEPTH;
+  const uint32_t blocks =
+      (chunk + NP_CACHE_BLOCK_SIZE - 1) / NP_CACHE_BLOCK_SIZE;
+  depth = depth > NP_STREAM_MAX_DEPTH / (int)blocks ? NP_STREAM_MAX_DEPTH
+                                                    : depth * (int)blocks;
+
+  np_smb2_stream_t *stream = np_stream_alloc(
+      np_shared_size(file), start, end_exclusive, NP_CACHE_BLOCK_SIZE, depth,
+      np_cache_enabled() ? np_shared_key(file) : NULL);
+  if (stream == NULL) {
+    return NULL;
+  }
+  stream->file = file;
+  return stream;
+}
+
+np_smb2_stream_t *np_stream_attach(np_smb2_session_t *session,
+                                   struct smb2fh *fh, uint64_t size,
+                                   uint64_t start, uint64_t end_exclusive,
+                                   uint32_t chunk_size, int queue_depth,
+                                   const np_cache_key_t *cache_key,
+                                   char *err_buf, int err_len) {
+  np_smb2_stream_t *stream = np_stream_create(session, fh, size, start,
+                                              end_exclusive, chunk_size,
+                                              queue_depth, cache_key);
+  if (stream == NULL) {
+    np_set_err(err_buf, err_len, "Out of memory");
+    smb2_close(session->ctx, fh);
+    np_pool_release(session, NP_RELEASE_OK);
+    return NULL;
+  }
+
+  const int rc = np_stream_fill(stream);
+  if (rc < 0) {
+    np_set_err(err_buf, err_len, "SMB read failed: %s",
+               smb2_get_error(session->ctx));
+    stream->failed = true;
+    np_stream_close(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+np_smb2_stream_t *np_stream_attach_shared(np_shared_file_t *file,
+                                          uint64_t start,
+                                          uint64_t end_exclusive,
+                                          uint32_t chunk_size, int queue_depth,
+                                          char *err_buf, int err_len) {
+  np_smb2_stream_t *stream = np_stream_create_shared(
+      file, start, end_exclusive, chunk_size, queue_depth);
+  if (stream == NULL) {
+    np_set_err(err_buf, err_len, "Out of memory");
+    np_shared_release(file, NP_RELEASE_OK);
+    return NULL;
+  }
+
+  const int rc = np_stream_fill(stream);
+  if (rc < 0) {
+    np_stream_set_err(stream, err_buf, err_len);
+    stream->failed = true;
+    np_stream_close(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+int np_stream_poll(np_smb2_stream_t *stream, uint8_t **out_data,
+                   char *err_buf, int err_len) {
+  *out_data = NULL;
+  if (stream->failed || stream->broken) {
+    np_set_err(err_buf, err_len, "Stream failed");
+    return -EIO;
+  }
+
+  int rc = 0;
+  if (stream->delivered) {
+    rc = np_stream_advance(stream);
+  }
+  if (rc == 0) {
+    rc = np_stream_fill(stream);
+  }
+  if (rc < 0) {
+    np_stream_set_err(stream, err_buf, err_len);
+    stream->failed = true;
+    return rc;
+  }
+
+  np_stream_slot_t *slot = &stream->slots[stream->head];
+  if (slot->state == NP_SLOT_FREE) {
+    return 0;
+  }
+  if (slot->flight != NULL && !slot->done) {
+    np_stream_land(stream, slot);
+  }
+  if (!slot->done) {
+    return -EAGAIN;
+  }
+  slot->state = NP_SLOT_DONE;
+
+  if (slot->status < 0) {
+    np_stream_set_err(stream, err_buf, err_len);
+    stream->failed = true;
+    return slot->status;
+  }
+  if (slot->status == 0) {
+    // The server reported EOF early (e.g. the file was truncated).
+    stream->end = slot->offset;
+    return 0;
+  }
+
+  // Shared READs are cached by np_smb2_shared.c.
+  if (stream->cached && !slot->from_cache && stream->file == NULL) {
+    np_stream_to_cache(stream, slot);
+  }
+  stream->pos = slot->offset + (uint64_t)slot->status;
+  np_ra_observe(&stream->ra, slot->offset, (uint32_t)slot->status,
+                (uint64_t)stream->depth * stream->chunk);
+
+  // Credits granted with the replies serviced so far may allow more READs.
+  if (np_stream_fill(stream) < 0) {
+    stream->failed = true;
+  }
+
+  stream->delivered = true;
+  *out_data = slot->flight != NULL ? (uint8_t *)np_flight_data(slot->flight)
+                                   : slot->buf;
+  return slot->status;
+}
+
+int np_stream_next(np_smb2_stream_t *stream, uint8_t **out_data,
+                   char *err_buf, int err_len) {
+  for (;;) {
+    const int rc = np_stream_poll(stream, out_data, err_buf, err_len);
+    if (rc != -EAGAIN) {
+      return rc;
+    }
+    np_stream_slot_t *slot = &stream->slots[stream->head];
+    if (slot->flight != NULL) {
+      // Errors surface when the slot lands.
+      np_shared_wait(stream->file, slot->flight);
+      continue;
+    }
+    if (np_run_until_done(stream->ctx,
+                          &stream->slots[stream->head].done) < 0) {
+      np_set_err(err_buf, err_len, "SMB read failed: %s",
+                 smb2_get_error(stream->ctx));
+      stream->broken = true;
+      return -EIO;
+    }
+  }
+}
+
+bool np_stream_idle(const np_smb2_stream_t *stream) {
+  return stream->inflight == 0;
+}
+
+void np_stream_set_broken(np_smb2_stream_t *stream) { stream->broken = true; }
+
+enum np_release_mode np_stream_detach(np_smb2_stream_t *stream) {
+  const enum np_release_mode mode =
+      stream->broken ? NP_RELEASE_DISCARD
+                     : (stream->failed ? NP_RELEASE_SUSPECT : NP_RELEASE_OK);
+  np_ra_account(stream->next_offset - stream->start,
+                stream->pos - stream->start);
+  for (int i = 0; i < stream->depth; i++) {
+    if (stream->slots[i].flight != NULL) {
+      np_shared_put(stream->file, stream->slots[i].flight);
+    }
+    np_buf_release(stream->slots[i].buf);
+  }
+  free(stream);
+  return mode;
+}
+
+static void np_stream_close_cb(struct smb2_context *smb2, int status,
+                               void *command_data, void *cb_data) {
+  (void)smb2;
+  (void)status;
+  (void)command_data;
+  (void)cb_data;
+}
+
+void np_stream_settle(np_smb2_stream_t *stream) {
+  for (int i = 0; i < stream->depth && !stream->broken; i++) {
+    np_stream_slot_t *slot = &stream->slots[i];
+    if (slot->state == NP_SLOT_PENDING && !slot->done &&
+        slot->flight == NULL &&
+        np_run_until_done(stream->ctx, &slot->done) < 0) {
+      stream->broken = true;
+    }
+  }
+}
+
+void np_stream_cancel(np_smb2_stream_t *stream) {
+  if (stream->inflight == 0 || stream->broken) {
+    return;
+  }
+  // Each slot is the cb_data of its READ, and the callback runs right away
+  // for every READ cancelled.
+  for (int i = 0; i < stream->depth; i++) {
+    np_stream_slot_t *slot = &stream->slots[i];
+    if (slot->state == NP_SLOT_PENDING && !slot->done &&
+        smb2_cancel_async(stream->ctx, slot) < 0) {
+      stream->broken = true;
+      return;
+    }
+  }
+}
+
+void np_stream_close(np_smb2_stream_t *stream) {
+  if (stream->file != NULL) {
+    // Flights nobody else holds are cancelled as they are put.
+    np_shared_file_t *file = stream->file;
+    np_shared_release(file, np_stream_detach(stream));
+    return;
+  }
+  // Nothing more is consumed; whatever the server has not sent yet is not
+  // worth waiting for. The rest still targets our buffers; let it land.
+  np_stream_cancel(stream);
+  np_stream_settle(stream);
+
+  np_smb2_session_t *session = stream->session;
+  if (stream->broken) {
+    // Destroying the context fails the remaining READs before we free them,
+    // and the queued CLOSE frees the file handle.
+    smb2_close_async(stream->ctx, stream->fh, np_stream_close_cb, NULL);
+    np_pool_release(session, NP_RELEASE_DISCARD);
+    np_stream_detach(stream);
+    return;
+  }
+  smb2_close(stream->ctx, stream->fh);
+  np_pool_release(session, np_stream_detach(stream));
+}
+
+FFI_PLUGIN_EXPORT intptr_t np_smb2_stream_open(
+    const char *host, int port, const char *username, const char *password,
+    const char *domain, const char *path, uint64_t start,
+    uint64_t end_exclusive, uint32_t chunk_size, int queue_depth,
+    uint64_t *out_size, char *err_buf, int err_len) {
+  np_shared_file_t *file = NULL;
+  if (np_shared_open(host, port, username, password, domain, path, &file,
+                     err_buf, err_len) != 0) {
+    return (intptr_t)0;
+  }
+
+  const uint64_t size = np_shared_size(file);
+  np_smb2_stream_t *stream =
+      np_stream_attach_shared(file, start, end_exclusive, chunk_size,
+                              queue_depth, err_buf, err_len);
+  if (stream == NULL) {
+    return (intptr_t)0;
+  }
+
+  if (out_size != NULL) {
+    *out_size = size;
+  }
+  return (intptr_t)stream;
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_stream_next(intptr_t stream, uint8_t **out_data,
+                                          char *err_buf, int err_len) {
+  if (stream == 0 || out_data == NULL) {
+    np_set_err(err_buf, err_len, "Invalid arguments");
+    return -EINVAL;
+  }
+  return np_stream_next((np_smb2_stream_t *)stream, out_data, err_buf,
+                        err_len);
+}
+
+FFI_PLUGIN_EXPORT int np_smb2_stream_next_buf(intptr_t stream,
+                                              uint8_t **out_buf,
+                                              char *err_buf, int err_len) {
+  if (stream == 0 || out_buf == NULL) {
+    np_set_err(err_buf, err_len, "Invalid arguments");
+    return -EINVAL;
+  }
+  const int rc = np_stream_next((np_smb2_stream_t *)stream, out_buf, err_buf,
+                                err_len);
+  if (rc > 0) {
+    np_buf_retain(*out_buf);
+  }
+  return rc;
+}
+
+FFI_PLUGIN_EXPORT void np_smb2_stream_close(intptr_t stream) {
+  if (stream == 0) {
+    return;
+  }
+  np_stream_close((np_smb2_stream_t *)stream);
+}
@@ -28,6 +28,7 @@ check_include_file("sys/stat.h" HAVE_SYS_STAT_H)
 check_include_file("sys/types.h" HAVE_SYS_TYPES_H)
 check_include_file("sys/uio.h" HAVE_SYS_UIO_H)
 check_include_file("sys/_iovec.h" HAVE_SYS__IOVEC_H)
+check_include_file("linux/io_uring.h" HAVE_LINUX_IO_URING_H)
 check_include_file("sys/time.h" HAVE_SYS_TIME_H)
 check_include_file("sys/unistd.h" HAVE_SYS_UNISTD_H)
 if(NOT PS4)
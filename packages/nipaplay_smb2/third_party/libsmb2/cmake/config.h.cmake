@@ -78,6 +78,9 @@
 /* Define to 1 if you have the <sys/_iovec.h> header file. */
 #cmakedefine HAVE_SYS__IOVEC_H "@HAVE_SYS__IOVEC_H@"
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#cmakedefine HAVE_LINUX_IO_URING_H "@HAVE_LINUX_IO_URING_H@"
+
 /* Define to 1 if you have the <time.h> header file. */
 #cmakedefine HAVE_TIME_H  "@HAVE_TIME_H@"
 
@@ -0,0 +1,44 @@
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __smb2_aes_key_h__
+#define __smb2_aes_key_h__
+
+#define AES_MAX_ROUNDS 14
+
+/* An expanded AES encryption key, built by aes_key_setup() in lib/aes.c.
+ * The round keys are stored twice: as bytes in FIPS-197 order, which is
+ * what the AES-NI and ARMv8 instructions consume, and as big-endian words
+ * for the table based implementation.
+ */
+struct aes_key {
+        uint8_t rk[(AES_MAX_ROUNDS + 1) * 16];
+        uint32_t ek[(AES_MAX_ROUNDS + 1) * 4];
+        int rounds;
+};
+
+/* The GHASH key for GCM, H = E(K, 0^128), together with the 4-bit
+ * multiplication tables used when no carry-less multiply instruction is
+ * available. Built by ghash_key_setup() in lib/aes_gcm.c.
+ */
+struct ghash_key {
+        uint8_t h[16];
+        uint64_t hh[16];
+        uint64_t hl[16];
+};
+
+#endif /* __smb2_aes_key_h__ */
@@ -34,6 +34,8 @@ extern "C" {
 #endif /* __APPLE__ */
 #endif /* HAVE_LIBKRB5 */
 
+#include "aes-key.h"
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
 #ifndef discard_const
@@ -50,14 +52,28 @@ extern "C" {
 
 #define SMB2_SIGNATURE_SIZE 16
 #define SMB2_KEY_SIZE 16
+/* Encryption keys are 32 bytes for the AES-256 ciphers of SMB 3.1.1. */
+#define SMB2_CIPHER_KEY_SIZE_MAX 32
 
 #define SMB2_MAX_VECTORS 256
+/* Most requests and replies need no more than a handful of vectors, so
+ * that many are kept inside struct smb2_io_vectors. Larger compounds move
+ * the array to the heap, growing it up to SMB2_MAX_VECTORS.
+ */
+#define SMB2_INLINE_VECTORS 8
 
+/* iov points at inline_iov or at the heap array once it has spilled. It
+ * is only valid after the first smb2_add_iovector() and can move on any
+ * later one, so code holding a struct smb2_iovec pointer across adds must
+ * look it up again by index.
+ */
 struct smb2_io_vectors {
         size_t num_done;
         size_t total_size;
         int niov;
-        struct smb2_iovec iov[SMB2_MAX_VECTORS];
+        int max_iov;
+        struct smb2_iovec *iov;
+        struct smb2_iovec inline_iov[SMB2_INLINE_VECTORS];
 };
 
 struct smb2_async {
@@ -104,13 +120,20 @@ struct smb2_header {
  * 2: SMB2_RECV_HEADER     SMB3 Transform Header
  * 3: SMB2_RECV_TRFM       encrypted payload
  *
+ * A client peeks at the start of the encrypted payload first:
+ * 3: SMB2_RECV_TRFM_PEEK  SMB2 header and READ reply fixed part
+ * 4: SMB2_RECV_TRFM       the rest of the payload, with the READ data
+ *                         going straight to the application buffer
+ *
  * States for cancelled PDUs
  * This is used when we receive a reply for a PDU not in our waitlist.
  * This can for example happen if we have cancelled a pdu when it was
  * in-flight.
  * 1: SMB2_RECV_SPL        SPL
  * 2: SMB2_RECV_HEADER     SMB3 Transform Header
- * 3: SMB2_RECV_UNKNOWN    data for a PDU we are not waiting for
+ * 3: SMB2_RECV_UNKNOWN    data for a PDU we are not waiting for, read
+ *                         SMB2_RECV_DISCARD_SIZE bytes at a time into
+ *                         a scratch buffer
  */
 enum smb2_recv_state {
         SMB2_RECV_SPL = 0,
@@ -120,14 +143,76 @@ enum smb2_recv_state {
         SMB2_RECV_PAD,
         SMB2_RECV_TRFM,
         SMB2_RECV_UNKNOWN,
+        SMB2_RECV_TRFM_PEEK,
 };
 
+/* Encrypted SMB2 header plus the READ reply fixed part, which is what is
+ * peeked at, and room for the padding that may follow the READ data.
+ */
+#define SMB2_TRFM_PEEK_SIZE (SMB2_HEADER_SIZE + 16)
+#define SMB2_TRFM_BUF_SIZE (SMB2_TRFM_PEEK_SIZE + 64)
+
 /* current tree id stack, note: index 0 in the stack is not used
 */
 #define SMB2_MAX_TREE_NESTING 32
 #define smb2_tree_id(smb2) (((smb2)->tree_id_cur >= 0)?smb2->tree_id[(smb2)->tree_id_cur]:0xdeadbeef)
 
 #define MAX_CREDITS 1024
+
+/* Buckets in the message id index of the wait queue. Message ids are
+ * handed out sequentially and no more than MAX_CREDITS of them can be in
+ * flight, so masking the id spreads a full pipeline over distinct buckets.
+ */
+#define SMB2_WAIT_HASH_SIZE MAX_CREDITS
+
+/* Timer wheel of the request deadlines: a list of requests per tick of
+ * SMB2_TIMER_TICK_MS, SMB2_TIMER_SLOTS ticks around. A deadline further out
+ * than one revolution stays in its slot until a revolution reaches it.
+ */
+#define SMB2_TIMER_SLOTS 64
+#define SMB2_TIMER_TICK_MS 16
+
+/* Size classes of the per context block pool, 64 bytes to 16 kbytes.
+ * Larger blocks go straight to malloc. Each class keeps at most
+ * SMB2_POOL_MAX_FREE released blocks around for reuse.
+ */
+#define SMB2_POOL_CLASSES 9
+#define SMB2_POOL_MAX_FREE 64
+
+struct smb2_pool_block;
+
+struct smb2_pool {
+        struct smb2_pool_block *free[SMB2_POOL_CLASSES];
+        int nfree[SMB2_POOL_CLASSES];
+        /* Blocks handed out and not released yet. A destroyed context
+         * leaves the pool orphaned until this drops to zero.
+         */
+        int in_use;
+        int orphaned;
+        /* Blocks that had to be allocated from the heap and blocks served
+         * from a freelist, for tests and benchmarks.
+         */
+        uint64_t heap_allocs;
+        uint64_t reuses;
+};
+
+/* Bytes a single socket read may pull in past what the receive state
+ * machine asked for. Small replies that arrive back to back are decoded
+ * out of this staging buffer without another syscall. At a PDU boundary,
+ * or when the state machine asks for at least SMB2_RECV_DIRECT_MIN bytes,
+ * which is READ data going to the application buffer, only
+ * SMB2_RECV_PEEK_SIZE bytes are staged: enough for the next SPL, header
+ * and fixed part.
+ */
+#define SMB2_RECV_STAGING_SIZE 32768
+#define SMB2_RECV_DIRECT_MIN 16384
+#define SMB2_RECV_PEEK_SIZE 512
+
+/* Scratch space that replies nobody waits for any more, see
+ * smb2_cancel_async(), are read into and thrown away.
+ */
+#define SMB2_RECV_DISCARD_SIZE 65536
+
 #define SMB2_SALT_SIZE 32
 
 struct sync_cb_data {
@@ -189,11 +274,28 @@ struct smb2_context {
 
         uint8_t seal:1;
         uint8_t sign:1;
+        /* Binding to the session of another connection as a new channel:
+         * session_id and the keys are those of the session, the session
+         * setup requests are signed with them.
+         */
+        uint8_t binding:1;
         uint8_t signing_key[SMB2_KEY_SIZE];
-        uint8_t serverin_key[SMB2_KEY_SIZE];
-        uint8_t serverout_key[SMB2_KEY_SIZE];
+        uint8_t serverin_key[SMB2_CIPHER_KEY_SIZE_MAX];
+        uint8_t serverout_key[SMB2_CIPHER_KEY_SIZE_MAX];
+        /* Expanded schedules for the AES keys above, rebuilt each time
+         * the keys are derived so signing and sealing never re-expand.
+         */
+        struct aes_key signing_aes;
+        struct aes_key serverin_aes;
+        struct aes_key serverout_aes;
+        /* Only set up when a GCM cipher was negotiated. */
+        struct ghash_key serverin_ghash;
+        struct ghash_key serverout_ghash;
+        /* Only set up when AES-GMAC signing was negotiated. */
+        struct ghash_key signing_ghash;
         uint8_t salt[SMB2_SALT_SIZE];
         uint16_t cypher;
+        uint16_t signing_algo;
         uint8_t preauthhash[SMB2_PREAUTH_HASH_SIZE];
 
 
@@ -207,18 +309,83 @@ struct smb2_context {
         unsigned char *enc;
         size_t enc_len;
         int enc_pos;
+        /* For a sealed READ, enc_data_len bytes of the decrypted stream
+         * starting at enc_data_off live in the application buffer enc_data
+         * and are left out of enc.
+         */
+        uint8_t *enc_data;
+        size_t enc_data_off;
+        size_t enc_data_len;
+        uint8_t trfm_buf[SMB2_TRFM_BUF_SIZE];
 
         /*
          * For sending PDUs
          */
         struct smb2_pdu *outqueue;
+        /* PDUs are only queued, not written, while this is non-zero.
+         * See smb2_cork().
+         */
+        int cork;
+        /* writev() calls on the socket, (compound) PDUs they completed and
+         * bytes they wrote.
+         */
+        uint64_t send_syscalls;
+        uint64_t send_pdus;
+        uint64_t send_bytes;
+        /* Requests waiting for their reply, oldest first. Only change it
+         * through smb2_waitqueue_add() and smb2_waitqueue_remove() so the
+         * tail pointer and the message id index stay in sync.
+         */
         struct smb2_pdu *waitqueue;
+        struct smb2_pdu *waitqueue_tail;
+        struct smb2_pdu *wait_hash[SMB2_WAIT_HASH_SIZE];
+
+        /* Recycled pdus, fixed parts and reply structs, see lib/alloc.c */
+        struct smb2_pool *pool;
 
         /*
          * For receiving PDUs
          */
         struct smb2_io_vectors in;
         enum smb2_recv_state recv_state;
+        /* Bytes read from the socket but not consumed yet are
+         * stage[stage_pos .. stage_pos + stage_len). Allocated on first use.
+         */
+        uint8_t *stage;
+        size_t stage_pos;
+        size_t stage_len;
+        /* Completion based receive, see smb2_get_recv_iovecs(): bytes the
+         * vectors handed out ask for before the staging part, and the
+         * result of the read into them not consumed yet.
+         */
+        size_t recv_want;
+        int recv_done;
+        int recv_pending;
+        /* readv() calls on the socket, bytes they returned and bytes of
+         * those that were copied out of the staging buffer afterwards.
+         */
+        uint64_t recv_syscalls;
+        uint64_t recv_bytes;
+        uint64_t recv_staged_bytes;
+        /* Bytes of a reply nobody waits for that are left to read after
+         * the piece in progress, and the scratch buffer they go to.
+         * Allocated on first use.
+         */
+        size_t discard_left;
+        uint8_t *discard;
+        /* Requests smb2_cancel_async() completed and the bytes of replies
+         * that were thrown away because nobody waited for them.
+         */
+        uint64_t cancelled_pdus;
+        uint64_t discarded_bytes;
+        /* Requests with a deadline, in the slot of the tick it is due in,
+         * the first tick not expired yet and the requests that failed
+         * because their deadline passed.
+         */
+        struct smb2_pdu *timers[SMB2_TIMER_SLOTS];
+        uint64_t timer_tick;
+        int ntimers;
+        uint64_t expired_pdus;
         /* SPL for the (compound) command we are currently reading */
         uint32_t spl;
         /* buffer to avoid having to malloc the header */
@@ -289,6 +456,14 @@ typedef void (*smb2_free_payload)(struct smb2_context *smb2, void *payload);
 
 struct smb2_pdu {
         struct smb2_pdu *next;
+        /* While on the wait queue: the previous entry and the next pdu in
+         * the same wait_hash bucket.
+         */
+        struct smb2_pdu *wait_prev;
+        struct smb2_pdu *wait_hnext;
+        uint8_t waiting:1;
+        /* Completed by smb2_cancel_async(). Its reply is thrown away. */
+        uint8_t cancelled:1;
         struct smb2_header header;
 
         struct smb2_pdu *next_compound;
@@ -297,6 +472,15 @@ struct smb2_pdu {
         int caller_frees_pdu;
         smb2_command_cb cb;
         void *cb_data;
+        /* The cb_data the application passed, which smb2_cancel_async()
+         * matches. Wrappers like smb2_pread_async() pass their own state
+         * as cb_data.
+         */
+        void *owner;
+        /* From an interim reply that made the request async, 0 until then.
+         * A CANCEL has to name it instead of the message id.
+         */
+        uint64_t async_id;
         void (*free_cb)(void *);
 
         /* buffer to avoid having to malloc the headers */
@@ -309,6 +493,8 @@ struct smb2_pdu {
          * Or null if no additional memory needs to be freed.
          */
         smb2_free_payload free_payload;
+        /* payload came from smb2_pool_alloc() rather than malloc() */
+        uint8_t pooled_payload:1;
 
         /* For sending/receiving
          * out contains at least two vectors:
@@ -329,7 +515,20 @@ struct smb2_pdu {
         uint8_t seal:1;
         uint32_t crypt_len;
         unsigned char *crypt;
-        time_t timeout;
+
+        /* Deadlines in smb2_now_ms() time, 0 for none: when the request
+         * fails with SMB2_STATUS_IO_TIMEOUT, and when notify_cb is invoked
+         * while it keeps going.
+         */
+        uint64_t expires;
+        uint64_t notify_at;
+        smb2_deadline_cb notify_cb;
+        /* While on the timer wheel: the earlier of the two and the links
+         * of its slot.
+         */
+        uint64_t timer_at;
+        struct smb2_pdu *timer_next;
+        struct smb2_pdu **timer_pprev;
 };
 
 struct smb2_dirent_internal {
@@ -359,6 +558,11 @@ void smb2_close_connecting_fds(struct smb2_context *smb2);
 void *smb2_alloc_init(struct smb2_context *smb2, size_t size);
 void *smb2_alloc_data(struct smb2_context *smb2, void *memctx, size_t size);
 
+struct smb2_pool *smb2_pool_create(void);
+void smb2_pool_destroy(struct smb2_pool *pool);
+void *smb2_pool_alloc(struct smb2_context *smb2, size_t size);
+void smb2_pool_free(void *ptr);
+
 struct smb2_iovec *smb2_add_iovector(struct smb2_context *smb2,
                                      struct smb2_io_vectors *v,
                                      uint8_t *buf, size_t len,
@@ -379,7 +583,12 @@ int smb2_process_payload_variable(struct smb2_context *smb2,
 int smb2_get_fixed_size(struct smb2_context *smb2, struct smb2_pdu *pdu);
 
 struct smb2_pdu *smb2_find_pdu(struct smb2_context *smb2, uint64_t message_id);
+void smb2_waitqueue_add(struct smb2_context *smb2, struct smb2_pdu *pdu);
+void smb2_waitqueue_remove(struct smb2_context *smb2, struct smb2_pdu *pdu);
 void smb2_free_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v);
+int smb2_discard_recv(struct smb2_context *smb2, size_t len);
+int smb2_discard_current(struct smb2_context *smb2);
+void smb2_destroy_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v);
 
 void smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_data, void *cb_data);
 
@@ -646,6 +855,7 @@ int smb2_decode_reparse_data_buffer(struct smb2_context *smb2,
 int smb2_read_from_buf(struct smb2_context *smb2);
 void smb2_change_events(struct smb2_context *smb2, t_socket fd, int events);
 void smb2_timeout_pdus(struct smb2_context *smb2);
+uint64_t smb2_now_ms(void);
 
 struct dcerpc_context;
 int dcerpc_set_uint8(struct dcerpc_context *ctx, struct smb2_iovec *iov,
@@ -259,11 +259,69 @@ int smb2_service(struct smb2_context *smb2, int revents);
  */
 int smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents);
 
+/*
+ * COMPLETION BASED RECEIVE
+ * ========================
+ * Instead of waiting for POLLIN and letting smb2_service() read from the
+ * socket, an event loop built on completions (io_uring, IOCP) can do the
+ * read itself.
+ *
+ * smb2_get_recv_iovecs() fills iov with up to max vectors to read into
+ * from smb2_get_fd(). They are the unread part of the PDU that is being
+ * received, which for a READ reply is the application buffer, followed
+ * by room for whatever comes after it. max must be at least 2. Returns
+ * the number of vectors, or <0 on error.
+ *
+ * Read into the vectors in order, then pass the result to
+ * smb2_service_recv(): the number of bytes read, 0 if the server closed
+ * the connection or -errno on failure. It decodes and completes everything
+ * that arrived and returns like smb2_service(). The context must not be
+ * serviced in any other way in between, and smb2_get_recv_iovecs() must
+ * be called again before the next read.
+ *
+ * Writes are unaffected: queued PDUs are sent when they are queued or when
+ * smb2_service() is called with POLLOUT.
+ */
+struct iovec;
+int smb2_get_recv_iovecs(struct smb2_context *smb2, struct iovec *iov,
+                         int max);
+int smb2_service_recv(struct smb2_context *smb2, int count);
+
+/*
+ * IO_URING
+ * ========
+ * On Linux with io_uring, smb2_uring_service() waits for and receives on
+ * up to 64 contexts with one io_uring_enter(), replacing poll() plus
+ * one readv() per ready socket. It uses the completion based receive
+ * above, so READ payloads still land directly in the application buffer.
+ *
+ * smb2_uring_create() returns NULL if io_uring was not available at
+ * compile time or the running kernel does not support the features used
+ * (5.11 or later). Callers should fall back to smb2_get_fd() and poll().
+ *
+ * smb2_uring_service() waits up to timeout ms for any of the count
+ * connected contexts in smb2[] to become readable, or writable while they
+ * have PDUs to send, and services them. ret[i] receives the result for
+ * smb2[i] as smb2_service() would return it. Returns the number of
+ * contexts serviced, 0 on timeout, or -errno if the ring failed, in which
+ * case it should be destroyed and the caller fall back to poll(). Nothing
+ * is left in flight on return, so a context can be used with poll() or
+ * destroyed afterwards.
+ *
+ * A ring must only be used by one thread at a time.
+ */
+struct smb2_uring;
+struct smb2_uring *smb2_uring_create(void);
+void smb2_uring_destroy(struct smb2_uring *ring);
+int smb2_uring_service(struct smb2_uring *ring, struct smb2_context **smb2,
+                       int *ret, int count, int timeout);
+
 /*
  * Set the timeout in seconds after which a command will be aborted with
  * SMB2_STATUS_IO_TIMEOUT.
  * If you use timeouts with the async API you must make sure to call
- * smb2_service() at least once every second.
+ * smb2_service() at least once every second, or as smb2_next_deadline()
+ * tells. smb2_set_deadline_async() sets a deadline per request.
  *
  * Default is 0: No timeout.
  */
@@ -528,6 +586,43 @@ int smb2_connect_share(struct smb2_context *smb2,
                        const char *share,
                        const char *user);
 
+/*
+ * Async call to connect to a server and bind to the authenticated session
+ * of another context as a new channel of it (SMB 3.x multichannel).
+ * The context must be fresh. It takes the credentials, dialect, client
+ * guid, trees and keys of the session, so the file handles of the session
+ * can be used on it through smb2_fh_from_file_id(). It signs with a key
+ * of its own and seals with the keys of the session.
+ *
+ * Returns:
+ *  0 if the call was initiated and a connection will be attempted. Result of
+ * the binding will be reported through the callback function.
+ * -EOPNOTSUPP if the server of the session did not negotiate SMB 3.x with
+ *         SMB2_GLOBAL_CAP_MULTI_CHANNEL.
+ * -errno if there was an error. The callback function will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    0     : The channel was bound. Command_data is NULL.
+ *
+ *   -errno : Failed to bind the channel. Command_data is NULL.
+ */
+int smb2_connect_channel_async(struct smb2_context *smb2,
+                               struct smb2_context *session,
+                               const char *server,
+                               smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync call to bind to the session of another context as a new channel.
+ *
+ * Returns:
+ * 0      : The channel was bound.
+ * -errno : Failure.
+ */
+int smb2_connect_channel(struct smb2_context *smb2,
+                         struct smb2_context *session,
+                         const char *server);
+
 /*
  * Async call to disconnect from a share/
  *
@@ -791,6 +886,105 @@ int smb2_open_async(struct smb2_context *smb2, const char *path, int flags,
  */
 struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags);
 
+/*
+ * DURABLE OPEN
+ */
+/*
+ * Async open() asking for a durable handle v2. A durable handle outlives
+ * the loss of its connection for timeout milliseconds (0 lets the server
+ * choose) and is reclaimed from a new session of the same user with
+ * smb2_reopen_durable_async(). create_guid identifies the open: the
+ * caller makes up a fresh one for each open and keeps it to reclaim the
+ * handle. The handle is opened with a batch oplock, which the server
+ * needs to grant durability, unless lease_state is not 0: then it asks
+ * for a lease with that state under lease_key instead, which must cover
+ * handle caching for the handle to be durable. The state the server
+ * granted is told by smb2_fh_lease_state().
+ *
+ * Durable handles v2 need SMB 3.0 or later. On older dialects this is a
+ * plain open(), with the lease if any from SMB 2.1 on. Whether the server
+ * granted a durable handle is told by
+ * smb2_fh_is_durable().
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ *          Command_data is struct smb2fh.
+ *          This structure is freed using smb2_close().
+ * -errno : An error occurred.
+ *          Command_data is NULL.
+ */
+int smb2_open_durable_async(struct smb2_context *smb2, const char *path,
+                            int flags, const smb2_create_guid create_guid,
+                            uint32_t timeout, uint32_t lease_state,
+                            const smb2_lease_key lease_key,
+                            smb2_command_cb cb, void *cb_data);
+
+/*
+ * Async reclaim of a durable handle after its connection was lost.
+ * path, flags, create_guid and the lease are the ones it was opened with,
+ * file_id is what smb2_get_file_id() returned for it. The new handle has
+ * the same file id. Fails with -EINVAL below SMB 3.0 and with the error of
+ * the server if it no longer keeps the handle.
+ */
+int smb2_reopen_durable_async(struct smb2_context *smb2, const char *path,
+                              int flags, const smb2_create_guid create_guid,
+                              const smb2_file_id file_id,
+                              uint32_t lease_state,
+                              const smb2_lease_key lease_key,
+                              smb2_command_cb cb, void *cb_data);
+
+/*
+ * Like smb2_open_async_pdu(), for smb2_open_durable_async() when file_id
+ * is NULL and for smb2_reopen_durable_async() otherwise.
+ */
+struct smb2_pdu *
+smb2_open_durable_async_pdu(struct smb2_context *smb2, const char *path,
+                            int flags, const smb2_create_guid create_guid,
+                            uint32_t timeout, const smb2_file_id file_id,
+                            uint32_t lease_state,
+                            const smb2_lease_key lease_key,
+                            smb2_command_cb cb, void *cb_data,
+                            void (*free_cb)(void *));
+
+/*
+ * Sync durable open() and reclaim.
+ *
+ * Returns NULL on failure.
+ */
+struct smb2fh *smb2_open_durable(struct smb2_context *smb2, const char *path,
+                                 int flags, const smb2_create_guid create_guid,
+                                 uint32_t timeout, uint32_t lease_state,
+                                 const smb2_lease_key lease_key);
+struct smb2fh *smb2_reopen_durable(struct smb2_context *smb2,
+                                   const char *path, int flags,
+                                   const smb2_create_guid create_guid,
+                                   const smb2_file_id file_id,
+                                   uint32_t lease_state,
+                                   const smb2_lease_key lease_key);
+
+/*
+ * Returns 1 if the server granted a durable handle for fh.
+ */
+int smb2_fh_is_durable(struct smb2fh *fh);
+
+/*
+ * Returns the lease state the server granted when fh was opened, a mask
+ * of SMB2_LEASE_*_CACHING, or 0 if it was opened without a lease. Later
+ * breaks are reported to the oplock or lease break callback only.
+ */
+uint32_t smb2_fh_lease_state(struct smb2fh *fh);
+
+/*
+ * Frees fh without closing it on the server, e.g. a durable handle whose
+ * connection was lost and that is going to be reclaimed.
+ */
+void smb2_free_fh(struct smb2_context *smb2, struct smb2fh *fh);
+
 /*
  * CLOSE
  */
@@ -848,6 +1042,94 @@ int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh);
 uint32_t smb2_get_max_read_size(struct smb2_context *smb2);
 uint32_t smb2_get_max_write_size(struct smb2_context *smb2);
 
+/*
+ * Number of credits that are still free for new requests, i.e. the credits
+ * granted by the server minus the charge of requests that are queued but not
+ * yet sent. Applications that pipeline reads or writes can use this to bound
+ * the number of outstanding requests.
+ * Each read/write of up to 64kb is charged one credit.
+ */
+int smb2_get_available_credits(struct smb2_context *smb2);
+
+/*
+ * Hold back writes so that a burst of requests goes out together.
+ * Normally each queued request is written to the socket right away, one
+ * syscall and usually one TCP segment each. Between smb2_cork() and
+ * smb2_uncork() requests are only queued, and smb2_uncork() writes all of
+ * them that the credits allow with as few writev() calls as possible.
+ *
+ * Calls nest, the queue is flushed by the smb2_uncork() that matches the
+ * outermost smb2_cork(). Do not use the synchronous API while the context
+ * is corked, its requests would never be sent.
+ *
+ * smb2_uncork() returns 0 on success and <0 if writing to the socket
+ * failed, in which case the context must be treated as after a failing
+ * smb2_service().
+ */
+void smb2_cork(struct smb2_context *smb2);
+int smb2_uncork(struct smb2_context *smb2);
+
+/*
+ * Cancel the outstanding requests that were issued with cb_data, for
+ * example the READs a reader queued ahead of a position it has just
+ * seeked away from. For smb2_pread_async() and smb2_read_async() this is
+ * the cb_data passed to them.
+ *
+ * The callback of each cancelled request is invoked before this returns
+ * with status SMB2_STATUS_CANCELLED, which smb2_pread_async() passes on as
+ * -nterror_to_errno() like any other error, and is not invoked again.
+ * Buffers given to a cancelled READ are no longer touched and can be
+ * reused right away. The session stays usable:
+ *  - Requests not written to the socket yet still go out, as they already
+ *    hold their message ids, but READs among them ask for 0 bytes.
+ *  - Requests on the wire get an SMB2 CANCEL so the server can stop
+ *    working on them.
+ *  - Whatever reply still arrives is read into a scratch buffer and
+ *    thrown away.
+ * WRITEs that are not fully sent, requests whose pdu the caller frees and
+ * a sealed READ reply that is being received into its buffer are not
+ * cancelled and complete as usual.
+ *
+ * Do not call this between smb2_get_recv_iovecs() and the matching
+ * smb2_service_recv().
+ *
+ * Returns the number of requests cancelled, or <0 if the CANCELs could not
+ * be written to the socket, in which case the context must be treated as
+ * after a failing smb2_service().
+ */
+int smb2_cancel_async(struct smb2_context *smb2, void *cb_data);
+
+/*
+ * Give the outstanding requests that were issued with cb_data, matched as
+ * by smb2_cancel_async(), a deadline ms milliseconds from now.
+ *
+ * Without a callback, a request still outstanding at its deadline fails
+ * with SMB2_STATUS_IO_TIMEOUT, which smb2_pread_async() passes on as
+ * -ETIMEDOUT. It is failed the way smb2_cancel_async() cancels requests,
+ * so the session stays usable. This replaces the deadline smb2_set_timeout()
+ * gave it. A WRITE, a request in a compound and one whose pdu the caller
+ * frees are only failed once they are on the wire.
+ *
+ * With a callback, the request keeps going and cb is invoked once with
+ * cb_data if its deadline passes before it completed, for example to issue
+ * the same READ elsewhere. The callback may cancel the request but must not
+ * destroy the context.
+ *
+ * Deadlines are checked by smb2_service(), which has to be called by then;
+ * smb2_next_deadline() tells how long to poll() for at most.
+ *
+ * Returns the number of requests given the deadline.
+ */
+typedef void (*smb2_deadline_cb)(struct smb2_context *smb2, void *cb_data);
+int smb2_set_deadline_async(struct smb2_context *smb2, void *cb_data,
+                            uint32_t ms, smb2_deadline_cb cb);
+
+/*
+ * Milliseconds until the next deadline of a request of the context passes,
+ * 0 if one already has, or -1 if there is none.
+ */
+int smb2_next_deadline(struct smb2_context *smb2);
+
 struct smb2_read_cb_data {
         struct smb2fh *fh;
         uint8_t *buf;
@@ -1234,6 +1516,34 @@ int smb2_readlink_async(struct smb2_context *smb2, const char *path,
  */
 int smb2_readlink(struct smb2_context *smb2, const char *path, char *buf, uint32_t bufsiz);
 
+/*
+ * NETWORK INTERFACES
+ */
+/*
+ * Async query of the network interfaces of the server, through
+ * FSCTL_QUERY_NETWORK_INTERFACE_INFO on the current tree.
+ *
+ * Returns
+ *  0     : The query was initiated. The interfaces will be reported
+ *          through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success. Command_data is a struct smb2_network_interface_info
+ *          list, NULL if the server has no IPv4 or IPv6 address. It
+ *          must be freed with smb2_free_data().
+ * -errno : An error occurred.
+ */
+int smb2_query_network_interfaces_async(struct smb2_context *smb2,
+                                        smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync query of the network interfaces of the server. On success *info
+ * is the list, to be freed with smb2_free_data().
+ */
+int smb2_query_network_interfaces(struct smb2_context *smb2,
+                                  struct smb2_network_interface_info **info);
+
 /*
  * Async echo()
  *
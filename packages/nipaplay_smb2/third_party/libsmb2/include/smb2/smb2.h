@@ -106,6 +106,12 @@ enum smb2_command {
 
 #define SMB2_ENCRYPTION_AES_128_CCM        0x0001
 #define SMB2_ENCRYPTION_AES_128_GCM        0x0002
+#define SMB2_ENCRYPTION_AES_256_CCM        0x0003
+#define SMB2_ENCRYPTION_AES_256_GCM        0x0004
+
+#define SMB2_SIGNING_HMAC_SHA256           0x0000
+#define SMB2_SIGNING_AES_CMAC              0x0001
+#define SMB2_SIGNING_AES_GMAC              0x0002
 
 #define SMB2_NEGOTIATE_MAX_DIALECTS 10
 
@@ -130,6 +136,7 @@ struct smb2_negotiate_reply {
         uint16_t security_mode;
         uint16_t dialect_revision;
         uint16_t cypher;
+        uint16_t signing_algo;
         smb2_guid server_guid;
         uint32_t capabilities;
         uint32_t max_transact_size;
@@ -233,6 +240,12 @@ struct smb2_tree_connect_reply {
 
 #define SMB2_CREATE_REQUEST_LEASE_SIZE  32
 
+/* Durable handle v2 create contexts, SMB 3.x only */
+#define SMB2_CREATE_DURABLE_V2_REQUEST_SIZE   32
+#define SMB2_CREATE_DURABLE_V2_RECONNECT_SIZE 36
+#define SMB2_CREATE_GUID_SIZE 16
+typedef uint8_t smb2_create_guid[SMB2_CREATE_GUID_SIZE];
+
 #define SMB2_IMPERSONATION_ANONYMOUS      0x00000000
 #define SMB2_IMPERSONATION_IDENTIFICATION 0x00000001
 #define SMB2_IMPERSONATION_IMPERSONATION  0x00000002
@@ -1035,6 +1048,33 @@ struct  smb2_ioctl_validate_negotiate_info {
         uint16_t dialect;
 };
 
+#define SMB2_NETWORK_INTERFACE_INFO_SIZE 152
+
+#define SMB2_NETWORK_INTERFACE_CAP_RSS  0x00000001
+#define SMB2_NETWORK_INTERFACE_CAP_RDMA 0x00000002
+
+/* Address families of NETWORK_INTERFACE_INFO */
+#define SMB2_NETWORK_INTERFACE_INET     0x0002
+#define SMB2_NETWORK_INTERFACE_INET6    0x0017
+
+/*
+ * Output of FSCTL_QUERY_NETWORK_INTERFACE_INFO, one entry per address
+ * of each interface of the server.
+ */
+struct smb2_network_interface_info {
+        struct smb2_network_interface_info *next;
+        uint32_t if_index;
+        uint32_t capability;
+        /* In bits per second */
+        uint64_t link_speed;
+        uint16_t family;
+        /* The address in network byte order, 4 bytes of it for
+         * SMB2_NETWORK_INTERFACE_INET and 16 for INET6.
+         */
+        uint8_t address[16];
+        uint32_t scope_id;
+};
+
 #define SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_FILE_NAME    0x00000001
 #define SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_DIR_NAME     0x00000002
 #define SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_ATTRIBUTES   0x00000004
@@ -1119,6 +1159,9 @@ struct smb2_oplock_break_reply {
 #define SMB2_LEASE_HANDLE_CACHING       0x02
 #define SMB2_LEASE_WRITE_CACHING        0x04
 
+/* Flags of a lease break notification */
+#define SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED 0x01
+
 #define SMB2_BREAK_TYPE_OPLOCK_NOTIFICATION     0x01
 #define SMB2_BREAK_TYPE_OPLOCK_RESPONSE         0x02
 #define SMB2_BREAK_TYPE_OPLOCK_ACKNOWLEDGE      0x03
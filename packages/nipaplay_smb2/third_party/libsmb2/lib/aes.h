@@ -22,7 +22,45 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include <stddef.h>
+
 #include "compat.h"
+#include "aes-key.h"
+
+enum aes_impl {
+        AES_IMPL_AUTO = 0,
+        AES_IMPL_TABLE,
+        AES_IMPL_AESNI,
+        AES_IMPL_ARMV8,
+};
+
+/* Expand a 16 or 32 byte key. Returns 0 on success and -1 for any other
+ * key length. The schedule does not depend on the implementation in use,
+ * so it can be computed once per session key and reused for every block.
+ */
+int aes_key_setup(struct aes_key *key, const uint8_t *k, size_t len);
+
+/* Encrypt nblocks independent 16 byte blocks. in and out may be the same
+ * buffer. Hardware implementations keep several blocks in flight, so pass
+ * as many blocks per call as the mode of operation allows.
+ */
+void aes_encrypt_ecb(const struct aes_key *key, const uint8_t *in,
+                     uint8_t *out, size_t nblocks);
+
+void aes_encrypt_block(const struct aes_key *key, const uint8_t *in,
+                       uint8_t *out);
+
+/* By default the fastest implementation the CPU supports is picked on
+ * first use. Forcing one is meant for tests and benchmarks; returns -1 if
+ * it is not available on this CPU or was not compiled in.
+ */
+int aes_set_impl(enum aes_impl impl);
+enum aes_impl aes_get_impl(void);
+const char *aes_impl_name(void);
 
 void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
 
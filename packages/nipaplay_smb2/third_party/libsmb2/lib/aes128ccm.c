@@ -34,6 +34,7 @@
 
 #include "portable-endian.h"
 #include "aes.h"
+#include "aes128ccm.h"
 
 static void aes_ccm_generate_b0(unsigned char *nonce, size_t nlen,
                                 size_t alen, size_t plen, size_t mlen,
@@ -53,7 +54,7 @@ static void aes_ccm_generate_b0(unsigned char *nonce, size_t nlen,
         memcpy(&buf[1], nonce, nlen);
 }
 
-static inline void bxory(unsigned char *b, unsigned char *y, size_t num)
+static inline void bxory(unsigned char *b, const unsigned char *y, size_t num)
 {
         int i;
 
@@ -62,17 +63,18 @@ static inline void bxory(unsigned char *b, unsigned char *y, size_t num)
         }
 }
 
-static void ccm_generate_T(unsigned char *key,
-                           unsigned char *nonce, size_t nlen,
-                           unsigned char *aad, size_t alen,
-                           unsigned char *p, size_t plen,
-                           unsigned char *m, size_t mlen)
+/* CBC-MAC over B0 and the AAD, leaving y ready for the payload. */
+static void ccm_mac_start(const struct aes_key *key,
+                          unsigned char *nonce, size_t nlen,
+                          unsigned char *aad, size_t alen,
+                          size_t plen, size_t mlen,
+                          unsigned char *y)
 {
-        unsigned char b[16] _U_, y[16]_U_;
+        unsigned char b[16] _U_;
         uint16_t l;
 
         aes_ccm_generate_b0(nonce, nlen, alen, plen, mlen, &b[0]);
-        AES128_ECB_encrypt(b, key, y);
+        aes_encrypt_block(key, b, y);
 
         /* Create Aad */
         if (alen) {
@@ -87,7 +89,7 @@ static void ccm_generate_T(unsigned char *key,
                 alen -= l;
 
                 bxory(b, y, 16);
-                AES128_ECB_encrypt(b, key, y);
+                aes_encrypt_block(key, b, y);
 
                 while (alen) {
                         memset(b, 0, 16);
@@ -97,27 +99,40 @@ static void ccm_generate_T(unsigned char *key,
                         alen -= l;
 
                         bxory(b, y, 16);
-                        AES128_ECB_encrypt(b, key, y);
+                        aes_encrypt_block(key, b, y);
                 }
         }
+}
+
+static void ccm_generate_T(const struct aes_key *key,
+                           unsigned char *nonce, size_t nlen,
+                           unsigned char *aad, size_t alen,
+                           unsigned char *p, size_t plen,
+                           unsigned char *m, size_t mlen)
+{
+        unsigned char b[16] _U_, y[16]_U_;
+
+        ccm_mac_start(key, nonce, nlen, aad, alen, plen, mlen, y);
 
         /* Create Payload */
-        while (plen) {
+        while (plen >= 16) {
+                bxory(y, p, 16);
+                aes_encrypt_block(key, y, y);
+                p    += 16;
+                plen -= 16;
+        }
+        if (plen) {
                 memset(b, 0, 16);
-                l = (plen > 16) ? 16 : (uint16_t)plen;
-                memcpy(b, p, l);
-                p    += l;
-                plen -= l;
-
+                memcpy(b, p, plen);
                 bxory(b, y, 16);
-                AES128_ECB_encrypt(b, key, y);
+                aes_encrypt_block(key, b, y);
         }
 
         memcpy(m, y, mlen);
 }
 
-static void ccm_generate_s(unsigned char *key, unsigned char *nonce, size_t nlen,
-                           size_t plen, int i, unsigned char *s)
+static void ccm_generate_ctr(unsigned char *nonce, size_t nlen,
+                             uint32_t i, unsigned char *s)
 {
         uint32_t l;
 
@@ -128,58 +143,184 @@ static void ccm_generate_s(unsigned char *key, unsigned char *nonce, size_t nlen
         memcpy(&s[12], &l, 4);
 
         memcpy(&s[1], nonce, nlen);
+}
+
+/* Store counter i in the 15 - nlen bytes that follow the nonce in a counter
+ * block, leaving the nonce alone.
+ */
+static void ccm_set_ctr(unsigned char *a, size_t nlen, uint32_t i)
+{
+        size_t j;
 
-        AES128_ECB_encrypt(s, key, s);
+        for (j = 15; j > nlen; j--) {
+                a[j] = i & 0xff;
+                i >>= 8;
+        }
 }
 
-static void aes_ccm_crypt(unsigned char *key,
+/* Counter blocks are encrypted this many at a time so the hardware AES
+ * implementations can pipeline them.
+ */
+#define CCM_CTR_BATCH 16
+
+static void aes_ccm_crypt(const struct aes_key *key,
                           unsigned char *nonce, size_t nlen,
                           unsigned char *p, size_t plen)
 {
-        int j;
-        size_t l;
-        unsigned char s[16] _U_;
+        unsigned char a[16] _U_;
+        unsigned char s[CCM_CTR_BATCH * 16] _U_;
+        uint32_t ctr = 1;
+        size_t i, n, l;
 
-        j = 0;
+        ccm_generate_ctr(nonce, nlen, 0, &a[0]);
         while (plen) {
-                l = (plen > 16) ? 16 : plen;
-                ccm_generate_s(key, nonce, nlen, plen, j + 1, &s[0]);
-                bxory(&p[j * 16], &s[0], l);
+                n = (plen + 15) / 16;
+                if (n > CCM_CTR_BATCH) {
+                        n = CCM_CTR_BATCH;
+                }
+                for (i = 0; i < n; i++) {
+                        ccm_set_ctr(a, nlen, ctr++);
+                        memcpy(&s[i * 16], a, 16);
+                }
+                aes_encrypt_ecb(key, s, s, n);
 
-                j++;
+                l = (plen > n * 16) ? n * 16 : plen;
+                bxory(p, s, l);
+                p    += l;
                 plen -= l;
         }
 }
 
-void aes128ccm_encrypt(unsigned char *key,
-                       unsigned char *nonce, size_t nlen,
-                       unsigned char *aad, size_t alen,
-                       unsigned char *p, size_t plen,
-                       unsigned char *m, size_t mlen)
+void aes_ccm_encrypt(const struct aes_key *key,
+                     unsigned char *nonce, size_t nlen,
+                     unsigned char *aad, size_t alen,
+                     unsigned char *p, size_t plen,
+                     unsigned char *m, size_t mlen)
 {
         unsigned char s[16] _U_;
 
         ccm_generate_T(key, nonce, nlen, aad, alen, p, plen, m, mlen);
-        ccm_generate_s(key, nonce, nlen, plen, 0, &s[0]);
+        ccm_generate_ctr(nonce, nlen, 0, &s[0]);
+        aes_encrypt_block(key, s, s);
         bxory(m, &s[0], mlen);
 
         aes_ccm_crypt(key, nonce, nlen, p, plen);
 }
 
+int aes_ccm_decrypt(const struct aes_key *key,
+                    unsigned char *nonce, size_t nlen,
+                    unsigned char *aad, size_t alen,
+                    unsigned char *p, size_t plen,
+                    unsigned char *m, size_t mlen)
+{
+        struct aes_ccm_ctx ctx;
+
+        aes_ccm_decrypt_init(&ctx, key, nonce, nlen, aad, alen, plen, mlen);
+        aes_ccm_decrypt_update(&ctx, p, plen);
+        return aes_ccm_decrypt_final(&ctx, m);
+}
+
+void aes_ccm_decrypt_init(struct aes_ccm_ctx *ctx,
+                          const struct aes_key *key,
+                          unsigned char *nonce, size_t nlen,
+                          unsigned char *aad, size_t alen,
+                          size_t plen, size_t mlen)
+{
+        ctx->key = key;
+        ctx->ctr = 1;
+        ctx->pos = 0;
+        ctx->mlen = mlen;
+        ctx->nlen = nlen;
+        ccm_generate_ctr(nonce, nlen, 0, ctx->a);
+        ccm_mac_start(key, nonce, nlen, aad, alen, plen, mlen, ctx->y);
+}
+
+void aes_ccm_decrypt_update(struct aes_ccm_ctx *ctx,
+                            unsigned char *p, size_t len)
+{
+        unsigned char s[CCM_CTR_BATCH * 16] _U_;
+        size_t i, n, l;
+
+        while (len) {
+                if (ctx->pos == 0 && len >= 16) {
+                        n = len / 16;
+                        if (n > CCM_CTR_BATCH) {
+                                n = CCM_CTR_BATCH;
+                        }
+                        for (i = 0; i < n; i++) {
+                                ccm_set_ctr(ctx->a, ctx->nlen, ctx->ctr++);
+                                memcpy(&s[i * 16], ctx->a, 16);
+                        }
+                        aes_encrypt_ecb(ctx->key, s, s, n);
+                        bxory(p, s, n * 16);
+                        for (i = 0; i < n; i++) {
+                                bxory(ctx->y, &p[i * 16], 16);
+                                aes_encrypt_block(ctx->key, ctx->y, ctx->y);
+                        }
+                        p   += n * 16;
+                        len -= n * 16;
+                        continue;
+                }
+
+                /* A block split between two buffers */
+                if (ctx->pos == 0) {
+                        ccm_set_ctr(ctx->a, ctx->nlen, ctx->ctr++);
+                        aes_encrypt_block(ctx->key, ctx->a, ctx->ks);
+                }
+                l = 16 - ctx->pos;
+                if (l > len) {
+                        l = len;
+                }
+                bxory(p, &ctx->ks[ctx->pos], l);
+                memcpy(&ctx->b[ctx->pos], p, l);
+                ctx->pos += l;
+                p   += l;
+                len -= l;
+                if (ctx->pos == 16) {
+                        bxory(ctx->y, ctx->b, 16);
+                        aes_encrypt_block(ctx->key, ctx->y, ctx->y);
+                        ctx->pos = 0;
+                }
+        }
+}
+
+int aes_ccm_decrypt_final(struct aes_ccm_ctx *ctx, unsigned char *m)
+{
+        unsigned char s[16] _U_;
+
+        if (ctx->pos) {
+                memset(&ctx->b[ctx->pos], 0, 16 - ctx->pos);
+                bxory(ctx->y, ctx->b, 16);
+                aes_encrypt_block(ctx->key, ctx->y, ctx->y);
+        }
+
+        ccm_set_ctr(ctx->a, ctx->nlen, 0);
+        aes_encrypt_block(ctx->key, ctx->a, s);
+        bxory(ctx->y, s, ctx->mlen);
+
+        return memcmp(ctx->y, m, ctx->mlen);
+}
+
+void aes128ccm_encrypt(unsigned char *key,
+                       unsigned char *nonce, size_t nlen,
+                       unsigned char *aad, size_t alen,
+                       unsigned char *p, size_t plen,
+                       unsigned char *m, size_t mlen)
+{
+        struct aes_key k;
+
+        aes_key_setup(&k, key, 16);
+        aes_ccm_encrypt(&k, nonce, nlen, aad, alen, p, plen, m, mlen);
+}
+
 int aes128ccm_decrypt(unsigned char *key,
                       unsigned char *nonce, size_t nlen,
                       unsigned char *aad, size_t alen,
                       unsigned char *p, size_t plen,
                       unsigned char *m, size_t mlen)
 {
-        unsigned char s[16] _U_;
-        unsigned char tmp[16];
-
-        aes_ccm_crypt(key, nonce, nlen, p, plen);
-
-        ccm_generate_T(key, nonce, nlen, aad, alen, p, plen, tmp, mlen);
-        ccm_generate_s(key, nonce, nlen, plen, 0, &s[0]);
-        bxory(tmp, &s[0], mlen);
+        struct aes_key k;
 
-        return memcmp(tmp, m, mlen);
+        aes_key_setup(&k, key, 16);
+        return aes_ccm_decrypt(&k, nonce, nlen, aad, alen, p, plen, m, mlen);
 }
@@ -15,6 +15,52 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+#ifndef _AES128CCM_H_
+#define _AES128CCM_H_
+
+#include "aes.h"
+
+/* Variants that take a key expanded once with aes_key_setup(), for callers
+ * that seal or unseal many messages under the same key.
+ */
+void aes_ccm_encrypt(const struct aes_key *key,
+                     unsigned char *nonce, size_t nlen,
+                     unsigned char *aad, size_t alen,
+                     unsigned char *p, size_t plen,
+                     unsigned char *m, size_t mlen);
+
+int aes_ccm_decrypt(const struct aes_key *key,
+                    unsigned char *nonce, size_t nlen,
+                    unsigned char *aad, size_t alen,
+                    unsigned char *p, size_t plen,
+                    unsigned char *m, size_t mlen);
+
+/* Incremental decryption, for a payload that is spread over several
+ * buffers. plen is the total length, which CCM needs before it starts.
+ * Each piece is decrypted in place; final returns non-zero if the tag
+ * does not match, and the plaintext must then be discarded.
+ */
+struct aes_ccm_ctx {
+        const struct aes_key *key;
+        unsigned char a[16];
+        unsigned char ks[16];
+        unsigned char y[16];
+        unsigned char b[16];
+        uint32_t ctr;
+        size_t pos;
+        size_t mlen;
+        size_t nlen;
+};
+
+void aes_ccm_decrypt_init(struct aes_ccm_ctx *ctx,
+                          const struct aes_key *key,
+                          unsigned char *nonce, size_t nlen,
+                          unsigned char *aad, size_t alen,
+                          size_t plen, size_t mlen);
+void aes_ccm_decrypt_update(struct aes_ccm_ctx *ctx,
+                            unsigned char *p, size_t len);
+int aes_ccm_decrypt_final(struct aes_ccm_ctx *ctx, unsigned char *m);
+
 void aes128ccm_encrypt(unsigned char *key,
 		       unsigned char *nonce, size_t nlen,
 		       unsigned char *aad, size_t alen,
@@ -26,3 +72,5 @@ int aes128ccm_decrypt(unsigned char *key,
 		      unsigned char *aad, size_t alen,
 		      unsigned char *p, size_t plen,
 		      unsigned char *m, size_t mlen);
+
+#endif
@@ -0,0 +1,387 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include <string.h>
+
+#include "compat.h"
+
+#include "portable-endian.h"
+#include "aes_gcm.h"
+#include "aes_hw.h"
+
+/* Counter blocks are encrypted, and then hashed, this many at a time. */
+#define GCM_CTR_BATCH 16
+
+/* Reduction of the four bits shifted out of the 4-bit table multiply. */
+static const uint64_t ghash_last4[16] = {
+        0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+        0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static int ghash_clmul = -1;
+
+static inline void bxory(unsigned char *b, const unsigned char *y, size_t num)
+{
+        size_t i;
+
+        for (i = 0; i < num; i++) {
+                b[i] = b[i] ^ y[i];
+        }
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        return be64toh(v);
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+        v = htobe64(v);
+        memcpy(p, &v, 8);
+}
+
+void ghash_key_setup(struct ghash_key *gkey, const struct aes_key *key)
+{
+        static const uint8_t zero[16] = {0};
+        uint64_t vh, vl, t;
+        int i, j;
+
+        aes_encrypt_block(key, zero, gkey->h);
+
+        /* hh/hl[i] hold i * H, where the 4-bit index is read with its
+         * most significant bit as x^0, as GCM orders its bits.
+         */
+        vh = get_be64(&gkey->h[0]);
+        vl = get_be64(&gkey->h[8]);
+        gkey->hh[0] = 0;
+        gkey->hl[0] = 0;
+        gkey->hh[8] = vh;
+        gkey->hl[8] = vl;
+        for (i = 4; i > 0; i >>= 1) {
+                t = (vl & 1) * 0xe1000000U;
+                vl = (vh << 63) | (vl >> 1);
+                vh = (vh >> 1) ^ (t << 32);
+                gkey->hh[i] = vh;
+                gkey->hl[i] = vl;
+        }
+        for (i = 2; i <= 8; i *= 2) {
+                vh = gkey->hh[i];
+                vl = gkey->hl[i];
+                for (j = 1; j < i; j++) {
+                        gkey->hh[i + j] = vh ^ gkey->hh[j];
+                        gkey->hl[i + j] = vl ^ gkey->hl[j];
+                }
+        }
+}
+
+/* x = x * H, four bits at a time. */
+static void ghash_mult_table(const struct ghash_key *gkey, uint8_t *x)
+{
+        uint64_t zh, zl;
+        uint8_t lo, hi, rem;
+        int i;
+
+        lo = x[15] & 0x0f;
+        zh = gkey->hh[lo];
+        zl = gkey->hl[lo];
+
+        for (i = 15; i >= 0; i--) {
+                lo = x[i] & 0x0f;
+                hi = (x[i] >> 4) & 0x0f;
+
+                if (i != 15) {
+                        rem = (uint8_t)zl & 0x0f;
+                        zl = (zh << 60) | (zl >> 4);
+                        zh = (zh >> 4) ^ (ghash_last4[rem] << 48);
+                        zh ^= gkey->hh[lo];
+                        zl ^= gkey->hl[lo];
+                }
+
+                rem = (uint8_t)zl & 0x0f;
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ (ghash_last4[rem] << 48);
+                zh ^= gkey->hh[hi];
+                zl ^= gkey->hl[hi];
+        }
+
+        put_be64(&x[0], zh);
+        put_be64(&x[8], zl);
+}
+
+static void ghash_blocks(const struct ghash_key *gkey, uint8_t *y,
+                         const uint8_t *in, size_t nblocks)
+{
+        if (ghash_clmul < 0) {
+                ghash_clmul = aes_clmul_available();
+        }
+        /* Only pair PCLMULQDQ with AES-NI so that forcing the table
+         * implementation gives a fully portable baseline.
+         */
+        if (ghash_clmul && aes_get_impl() == AES_IMPL_AESNI) {
+                aes_ghash_clmul(gkey->h, y, in, nblocks);
+                return;
+        }
+
+        while (nblocks--) {
+                bxory(y, in, 16);
+                ghash_mult_table(gkey, y);
+                in += 16;
+        }
+}
+
+/* Hash len bytes, zero padding a final partial block. */
+static void ghash_update(const struct ghash_key *gkey, uint8_t *y,
+                         const uint8_t *in, size_t len)
+{
+        uint8_t b[16];
+
+        ghash_blocks(gkey, y, in, len / 16);
+        if (len % 16) {
+                memset(b, 0, 16);
+                memcpy(b, &in[len & ~(size_t)15], len % 16);
+                ghash_blocks(gkey, y, b, 1);
+        }
+}
+
+static void gcm_generate_ctr(const unsigned char *nonce, uint32_t i,
+                             unsigned char *s)
+{
+        uint32_t l;
+
+        memcpy(s, nonce, 12);
+        l = htobe32(i);
+        memcpy(&s[12], &l, 4);
+}
+
+/* CTR mode starting at counter 2, hashing the ciphertext as it goes. */
+static void aes_gcm_crypt(const struct aes_key *key,
+                          const struct ghash_key *gkey,
+                          unsigned char *nonce,
+                          unsigned char *p, size_t plen,
+                          uint8_t *y)
+{
+        unsigned char s[GCM_CTR_BATCH * 16] _U_;
+        uint32_t ctr = 2;
+        size_t i, n, l;
+
+        while (plen) {
+                n = (plen + 15) / 16;
+                if (n > GCM_CTR_BATCH) {
+                        n = GCM_CTR_BATCH;
+                }
+                for (i = 0; i < n; i++) {
+                        gcm_generate_ctr(nonce, ctr++, &s[i * 16]);
+                }
+                aes_encrypt_ecb(key, s, s, n);
+
+                l = (plen > n * 16) ? n * 16 : plen;
+                bxory(p, s, l);
+                ghash_update(gkey, y, p, l);
+                p    += l;
+                plen -= l;
+        }
+}
+
+static void aes_gcm_tag(const struct aes_key *key,
+                        const struct ghash_key *gkey,
+                        unsigned char *nonce, size_t alen, size_t plen,
+                        uint8_t *y)
+{
+        uint8_t b[16];
+
+        put_be64(&b[0], (uint64_t)alen * 8);
+        put_be64(&b[8], (uint64_t)plen * 8);
+        ghash_blocks(gkey, y, b, 1);
+
+        gcm_generate_ctr(nonce, 1, b);
+        aes_encrypt_block(key, b, b);
+        bxory(y, b, 16);
+}
+
+void aes_gcm_encrypt(const struct aes_key *key,
+                     const struct ghash_key *gkey,
+                     unsigned char *nonce,
+                     unsigned char *aad, size_t alen,
+                     unsigned char *p, size_t plen,
+                     unsigned char *m, size_t mlen)
+{
+        uint8_t y[16] = {0};
+
+        ghash_update(gkey, y, aad, alen);
+        aes_gcm_crypt(key, gkey, nonce, p, plen, y);
+        aes_gcm_tag(key, gkey, nonce, alen, plen, y);
+        memcpy(m, y, mlen);
+}
+
+int aes_gcm_decrypt(const struct aes_key *key,
+                    const struct ghash_key *gkey,
+                    unsigned char *nonce,
+                    unsigned char *aad, size_t alen,
+                    unsigned char *p, size_t plen,
+                    unsigned char *m, size_t mlen)
+{
+        struct aes_gcm_ctx ctx;
+
+        aes_gcm_decrypt_init(&ctx, key, gkey, nonce, aad, alen);
+        aes_gcm_decrypt_update(&ctx, p, plen);
+        return aes_gcm_decrypt_final(&ctx, m, mlen);
+}
+
+void aes_gcm_decrypt_init(struct aes_gcm_ctx *ctx,
+                          const struct aes_key *key,
+                          const struct ghash_key *gkey,
+                          unsigned char *nonce,
+                          unsigned char *aad, size_t alen)
+{
+        ctx->key = key;
+        ctx->gkey = gkey;
+        memcpy(ctx->nonce, nonce, 12);
+        memset(ctx->y, 0, 16);
+        ctx->ctr = 2;
+        ctx->pos = 0;
+        ctx->alen = alen;
+        ctx->clen = 0;
+        ghash_update(gkey, ctx->y, aad, alen);
+}
+
+void aes_gcm_decrypt_update(struct aes_gcm_ctx *ctx,
+                            unsigned char *p, size_t len)
+{
+        unsigned char s[GCM_CTR_BATCH * 16] _U_;
+        size_t i, n, l;
+
+        ctx->clen += len;
+        while (len) {
+                if (ctx->pos == 0 && len >= 16) {
+                        n = len / 16;
+                        if (n > GCM_CTR_BATCH) {
+                                n = GCM_CTR_BATCH;
+                        }
+                        for (i = 0; i < n; i++) {
+                                gcm_generate_ctr(ctx->nonce, ctx->ctr++,
+                                                 &s[i * 16]);
+                        }
+                        aes_encrypt_ecb(ctx->key, s, s, n);
+                        ghash_blocks(ctx->gkey, ctx->y, p, n);
+                        bxory(p, s, n * 16);
+                        p   += n * 16;
+                        len -= n * 16;
+                        continue;
+                }
+
+                /* A block split between two buffers */
+                if (ctx->pos == 0) {
+                        gcm_generate_ctr(ctx->nonce, ctx->ctr++, ctx->ks);
+                        aes_encrypt_block(ctx->key, ctx->ks, ctx->ks);
+                }
+                l = 16 - ctx->pos;
+                if (l > len) {
+                        l = len;
+                }
+                memcpy(&ctx->b[ctx->pos], p, l);
+                bxory(p, &ctx->ks[ctx->pos], l);
+                ctx->pos += l;
+                p   += l;
+                len -= l;
+                if (ctx->pos == 16) {
+                        ghash_blocks(ctx->gkey, ctx->y, ctx->b, 1);
+                        ctx->pos = 0;
+                }
+        }
+}
+
+int aes_gcm_decrypt_final(struct aes_gcm_ctx *ctx,
+                          unsigned char *m, size_t mlen)
+{
+        uint8_t diff = 0;
+        size_t i;
+
+        if (ctx->pos) {
+                memset(&ctx->b[ctx->pos], 0, 16 - ctx->pos);
+                ghash_blocks(ctx->gkey, ctx->y, ctx->b, 1);
+        }
+        aes_gcm_tag(ctx->key, ctx->gkey, ctx->nonce, (size_t)ctx->alen,
+                    (size_t)ctx->clen, ctx->y);
+
+        for (i = 0; i < mlen; i++) {
+                diff |= ctx->y[i] ^ m[i];
+        }
+        return diff;
+}
+
+void aes_gmac_init(struct aes_gmac_ctx *ctx, const struct aes_key *key,
+                   const struct ghash_key *gkey, const uint8_t *nonce)
+{
+        ctx->key = key;
+        ctx->gkey = gkey;
+        memcpy(ctx->nonce, nonce, 12);
+        memset(ctx->y, 0, 16);
+        ctx->buf_len = 0;
+        ctx->len = 0;
+}
+
+void aes_gmac_update(struct aes_gmac_ctx *ctx, const uint8_t *data,
+                     size_t len)
+{
+        size_t n;
+
+        ctx->len += len;
+        if (ctx->buf_len) {
+                n = 16 - ctx->buf_len;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(&ctx->buf[ctx->buf_len], data, n);
+                ctx->buf_len += n;
+                data += n;
+                len -= n;
+                if (ctx->buf_len < 16) {
+                        return;
+                }
+                ghash_blocks(ctx->gkey, ctx->y, ctx->buf, 1);
+                ctx->buf_len = 0;
+        }
+        ghash_blocks(ctx->gkey, ctx->y, data, len / 16);
+        ctx->buf_len = len % 16;
+        memcpy(ctx->buf, &data[len & ~(size_t)15], ctx->buf_len);
+}
+
+void aes_gmac_final(struct aes_gmac_ctx *ctx, uint8_t *mac)
+{
+        if (ctx->buf_len) {
+                memset(&ctx->buf[ctx->buf_len], 0, 16 - ctx->buf_len);
+                ghash_blocks(ctx->gkey, ctx->y, ctx->buf, 1);
+        }
+        aes_gcm_tag(ctx->key, ctx->gkey, ctx->nonce, (size_t)ctx->len, 0,
+                    ctx->y);
+        memcpy(mac, ctx->y, 16);
+}
@@ -0,0 +1,87 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "aes.h"
+
+/* Derive H from an expanded AES key. Do this once per key, next to
+ * aes_key_setup().
+ */
+void ghash_key_setup(struct ghash_key *gkey, const struct aes_key *key);
+
+/* AES-GCM with a 96 bit nonce, as used by SMB 3.1.1. p is encrypted or
+ * decrypted in place. aes_gcm_decrypt() returns non-zero if the tag does
+ * not match.
+ */
+void aes_gcm_encrypt(const struct aes_key *key,
+                     const struct ghash_key *gkey,
+                     unsigned char *nonce,
+                     unsigned char *aad, size_t alen,
+                     unsigned char *p, size_t plen,
+                     unsigned char *m, size_t mlen);
+
+int aes_gcm_decrypt(const struct aes_key *key,
+                    const struct ghash_key *gkey,
+                    unsigned char *nonce,
+                    unsigned char *aad, size_t alen,
+                    unsigned char *p, size_t plen,
+                    unsigned char *m, size_t mlen);
+
+/* Incremental decryption, for a payload that is spread over several
+ * buffers. Each piece is decrypted in place; final returns non-zero if
+ * the tag does not match, and the plaintext must then be discarded.
+ */
+struct aes_gcm_ctx {
+        const struct aes_key *key;
+        const struct ghash_key *gkey;
+        uint8_t nonce[12];
+        uint8_t y[16];
+        uint8_t ks[16];
+        uint8_t b[16];
+        uint32_t ctr;
+        size_t pos;
+        uint64_t alen;
+        uint64_t clen;
+};
+
+void aes_gcm_decrypt_init(struct aes_gcm_ctx *ctx,
+                          const struct aes_key *key,
+                          const struct ghash_key *gkey,
+                          unsigned char *nonce,
+                          unsigned char *aad, size_t alen);
+void aes_gcm_decrypt_update(struct aes_gcm_ctx *ctx,
+                            unsigned char *p, size_t len);
+int aes_gcm_decrypt_final(struct aes_gcm_ctx *ctx,
+                          unsigned char *m, size_t mlen);
+
+/* AES-GMAC, that is GCM with everything passed as AAD, fed in pieces.
+ * Used for SMB 3.1.1 signing so the message need not be contiguous.
+ */
+struct aes_gmac_ctx {
+        const struct aes_key *key;
+        const struct ghash_key *gkey;
+        uint8_t nonce[12];
+        uint8_t y[16];
+        uint8_t buf[16];
+        size_t buf_len;
+        uint64_t len;
+};
+
+void aes_gmac_init(struct aes_gmac_ctx *ctx, const struct aes_key *key,
+                   const struct ghash_key *gkey, const uint8_t *nonce);
+void aes_gmac_update(struct aes_gmac_ctx *ctx, const uint8_t *data,
+                     size_t len);
+void aes_gmac_final(struct aes_gmac_ctx *ctx, uint8_t *mac);
@@ -0,0 +1,357 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* AES block encryption using the AES-NI (x86) and ARMv8 Crypto Extension
+ * instructions, and GHASH using PCLMULQDQ. The functions are compiled with per-function target
+ * attributes so the rest of the library keeps its baseline ISA, and aes.c
+ * only calls them after the matching *_available() check succeeded.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "aes_hw.h"
+
+#if (defined(__x86_64__) || defined(_M_X64) || \
+     defined(__i386__) || defined(_M_IX86)) && !defined(_XBOX)
+#if defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1600) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || \
+                           (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define HAVE_AES_AESNI 1
+#endif
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#if defined(_MSC_VER) && !defined(__clang__)
+#define HAVE_AES_ARMV8 1
+#define AES_TARGET_ARMV8
+#elif defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)
+#define HAVE_AES_ARMV8 1
+#define AES_TARGET_ARMV8
+#elif defined(__clang__) && __clang_major__ >= 16
+/* Before clang 16 the crypto intrinsics are only declared when the whole
+ * file is built with +aes, so older releases use the table code.
+ */
+#define HAVE_AES_ARMV8 1
+#define AES_TARGET_ARMV8 __attribute__((target("aes")))
+#elif defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#define HAVE_AES_ARMV8 1
+#define AES_TARGET_ARMV8 __attribute__((target("+crypto")))
+#endif
+#endif
+
+#ifdef HAVE_AES_AESNI
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define AES_TARGET_AESNI
+#define AES_TARGET_CLMUL
+#else
+#include <cpuid.h>
+#define AES_TARGET_AESNI __attribute__((target("aes,sse2")))
+#define AES_TARGET_CLMUL __attribute__((target("pclmul,sse2,ssse3")))
+#endif
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+int aes_aesni_available(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        int regs[4];
+
+        __cpuid(regs, 1);
+        return (regs[2] & (1 << 25)) && (regs[3] & (1 << 26));
+#else
+        unsigned int eax, ebx, ecx, edx;
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                return 0;
+        }
+        /* AES and SSE2 */
+        return (ecx & (1u << 25)) && (edx & (1u << 26));
+#endif
+}
+
+AES_TARGET_AESNI
+void aes_encrypt_ecb_aesni(const struct aes_key *key, const uint8_t *in,
+                           uint8_t *out, size_t nblocks)
+{
+        __m128i rk[AES_MAX_ROUNDS + 1];
+        __m128i b0, b1, b2, b3;
+        int rounds = key->rounds;
+        int i;
+
+        for (i = 0; i <= rounds; i++) {
+                rk[i] = _mm_loadu_si128((const __m128i *)&key->rk[i * 16]);
+        }
+
+        /* Independent blocks are interleaved to hide the latency of
+         * AESENC.
+         */
+        while (nblocks >= 4) {
+                b0 = _mm_loadu_si128((const __m128i *)&in[0]);
+                b1 = _mm_loadu_si128((const __m128i *)&in[16]);
+                b2 = _mm_loadu_si128((const __m128i *)&in[32]);
+                b3 = _mm_loadu_si128((const __m128i *)&in[48]);
+                b0 = _mm_xor_si128(b0, rk[0]);
+                b1 = _mm_xor_si128(b1, rk[0]);
+                b2 = _mm_xor_si128(b2, rk[0]);
+                b3 = _mm_xor_si128(b3, rk[0]);
+                for (i = 1; i < rounds; i++) {
+                        b0 = _mm_aesenc_si128(b0, rk[i]);
+                        b1 = _mm_aesenc_si128(b1, rk[i]);
+                        b2 = _mm_aesenc_si128(b2, rk[i]);
+                        b3 = _mm_aesenc_si128(b3, rk[i]);
+                }
+                b0 = _mm_aesenclast_si128(b0, rk[rounds]);
+                b1 = _mm_aesenclast_si128(b1, rk[rounds]);
+                b2 = _mm_aesenclast_si128(b2, rk[rounds]);
+                b3 = _mm_aesenclast_si128(b3, rk[rounds]);
+                _mm_storeu_si128((__m128i *)&out[0], b0);
+                _mm_storeu_si128((__m128i *)&out[16], b1);
+                _mm_storeu_si128((__m128i *)&out[32], b2);
+                _mm_storeu_si128((__m128i *)&out[48], b3);
+                in += 64;
+                out += 64;
+                nblocks -= 4;
+        }
+
+        while (nblocks--) {
+                b0 = _mm_loadu_si128((const __m128i *)in);
+                b0 = _mm_xor_si128(b0, rk[0]);
+                for (i = 1; i < rounds; i++) {
+                        b0 = _mm_aesenc_si128(b0, rk[i]);
+                }
+                b0 = _mm_aesenclast_si128(b0, rk[rounds]);
+                _mm_storeu_si128((__m128i *)out, b0);
+                in += 16;
+                out += 16;
+        }
+}
+
+int aes_clmul_available(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+        int regs[4];
+
+        __cpuid(regs, 1);
+        return (regs[2] & (1 << 1)) && (regs[2] & (1 << 9));
+#else
+        unsigned int eax, ebx, ecx, edx;
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                return 0;
+        }
+        /* PCLMULQDQ and SSSE3 */
+        return (ecx & (1u << 1)) && (ecx & (1u << 9));
+#endif
+}
+
+/* Multiply in GF(2^128) with both operands byte reversed, following the
+ * Intel carry-less multiplication white paper: a 256 bit product from
+ * four PCLMULQDQ, a one bit left shift to undo the bit reflection and a
+ * reduction modulo x^128 + x^7 + x^2 + x + 1.
+ */
+AES_TARGET_CLMUL
+static __m128i aes_gfmul(__m128i a, __m128i b)
+{
+        __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+        t3 = _mm_clmulepi64_si128(a, b, 0x00);
+        t4 = _mm_clmulepi64_si128(a, b, 0x10);
+        t5 = _mm_clmulepi64_si128(a, b, 0x01);
+        t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+        t4 = _mm_xor_si128(t4, t5);
+        t5 = _mm_slli_si128(t4, 8);
+        t4 = _mm_srli_si128(t4, 8);
+        t3 = _mm_xor_si128(t3, t5);
+        t6 = _mm_xor_si128(t6, t4);
+
+        t7 = _mm_srli_epi32(t3, 31);
+        t8 = _mm_srli_epi32(t6, 31);
+        t3 = _mm_slli_epi32(t3, 1);
+        t6 = _mm_slli_epi32(t6, 1);
+        t9 = _mm_srli_si128(t7, 12);
+        t8 = _mm_slli_si128(t8, 4);
+        t7 = _mm_slli_si128(t7, 4);
+        t3 = _mm_or_si128(t3, t7);
+        t6 = _mm_or_si128(t6, t8);
+        t6 = _mm_or_si128(t6, t9);
+
+        t7 = _mm_slli_epi32(t3, 31);
+        t8 = _mm_slli_epi32(t3, 30);
+        t9 = _mm_slli_epi32(t3, 25);
+        t7 = _mm_xor_si128(t7, t8);
+        t7 = _mm_xor_si128(t7, t9);
+        t8 = _mm_srli_si128(t7, 4);
+        t7 = _mm_slli_si128(t7, 12);
+        t3 = _mm_xor_si128(t3, t7);
+
+        t2 = _mm_srli_epi32(t3, 1);
+        t4 = _mm_srli_epi32(t3, 2);
+        t5 = _mm_srli_epi32(t3, 7);
+        t2 = _mm_xor_si128(t2, t4);
+        t2 = _mm_xor_si128(t2, t5);
+        t2 = _mm_xor_si128(t2, t8);
+        t3 = _mm_xor_si128(t3, t2);
+
+        return _mm_xor_si128(t6, t3);
+}
+
+AES_TARGET_CLMUL
+void aes_ghash_clmul(const uint8_t *h, uint8_t *y, const uint8_t *in,
+                     size_t nblocks)
+{
+        const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                           8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i hv, yv, b;
+
+        hv = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)h), bswap);
+        yv = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), bswap);
+        while (nblocks--) {
+                b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in),
+                                     bswap);
+                yv = aes_gfmul(_mm_xor_si128(yv, b), hv);
+                in += 16;
+        }
+        _mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(yv, bswap));
+}
+
+#else /* HAVE_AES_AESNI */
+
+int aes_aesni_available(void)
+{
+        return 0;
+}
+
+int aes_clmul_available(void)
+{
+        return 0;
+}
+
+void aes_ghash_clmul(const uint8_t *h _U_, uint8_t *y _U_,
+                     const uint8_t *in _U_, size_t nblocks _U_)
+{
+}
+
+void aes_encrypt_ecb_aesni(const struct aes_key *key _U_,
+                           const uint8_t *in _U_,
+                           uint8_t *out _U_, size_t nblocks _U_)
+{
+}
+
+#endif /* HAVE_AES_AESNI */
+
+#ifdef HAVE_AES_ARMV8
+
+#include <arm_neon.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+
+int aes_armv8_available(void)
+{
+#if defined(__APPLE__)
+        /* Every arm64 Apple CPU has the crypto extension. */
+        return 1;
+#elif defined(_WIN32)
+        return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__linux__)
+        return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)
+        return 1;
+#else
+        return 0;
+#endif
+}
+
+AES_TARGET_ARMV8
+void aes_encrypt_ecb_armv8(const struct aes_key *key, const uint8_t *in,
+                           uint8_t *out, size_t nblocks)
+{
+        uint8x16_t rk[AES_MAX_ROUNDS + 1];
+        uint8x16_t b0, b1, b2, b3;
+        int rounds = key->rounds;
+        int i;
+
+        for (i = 0; i <= rounds; i++) {
+                rk[i] = vld1q_u8(&key->rk[i * 16]);
+        }
+
+        /* AESE folds the round key addition in front of SubBytes and
+         * ShiftRows, so the last round key is applied with a plain XOR.
+         */
+        while (nblocks >= 4) {
+                b0 = vld1q_u8(&in[0]);
+                b1 = vld1q_u8(&in[16]);
+                b2 = vld1q_u8(&in[32]);
+                b3 = vld1q_u8(&in[48]);
+                for (i = 0; i < rounds - 1; i++) {
+                        b0 = vaesmcq_u8(vaeseq_u8(b0, rk[i]));
+                        b1 = vaesmcq_u8(vaeseq_u8(b1, rk[i]));
+                        b2 = vaesmcq_u8(vaeseq_u8(b2, rk[i]));
+                        b3 = vaesmcq_u8(vaeseq_u8(b3, rk[i]));
+                }
+                b0 = veorq_u8(vaeseq_u8(b0, rk[rounds - 1]), rk[rounds]);
+                b1 = veorq_u8(vaeseq_u8(b1, rk[rounds - 1]), rk[rounds]);
+                b2 = veorq_u8(vaeseq_u8(b2, rk[rounds - 1]), rk[rounds]);
+                b3 = veorq_u8(vaeseq_u8(b3, rk[rounds - 1]), rk[rounds]);
+                vst1q_u8(&out[0], b0);
+                vst1q_u8(&out[16], b1);
+                vst1q_u8(&out[32], b2);
+                vst1q_u8(&out[48], b3);
+                in += 64;
+                out += 64;
+                nblocks -= 4;
+        }
+
+        while (nblocks--) {
+                b0 = vld1q_u8(in);
+                for (i = 0; i < rounds - 1; i++) {
+                        b0 = vaesmcq_u8(vaeseq_u8(b0, rk[i]));
+                }
+                b0 = veorq_u8(vaeseq_u8(b0, rk[rounds - 1]), rk[rounds]);
+                vst1q_u8(out, b0);
+                in += 16;
+                out += 16;
+        }
+}
+
+#else /* HAVE_AES_ARMV8 */
+
+int aes_armv8_available(void)
+{
+        return 0;
+}
+
+void aes_encrypt_ecb_armv8(const struct aes_key *key _U_,
+                           const uint8_t *in _U_,
+                           uint8_t *out _U_, size_t nblocks _U_)
+{
+}
+
+#endif /* HAVE_AES_ARMV8 */
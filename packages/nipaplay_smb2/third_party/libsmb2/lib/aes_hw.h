@@ -0,0 +1,42 @@
+#ifndef _AES_HW_H_
+#define _AES_HW_H_
+
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "aes.h"
+
+/* The *_available() functions return 0 when the instructions are missing
+ * from the CPU or when the backend was not compiled in for this target.
+ * The encrypt functions must only be called after a non-zero answer.
+ */
+int aes_aesni_available(void);
+void aes_encrypt_ecb_aesni(const struct aes_key *key, const uint8_t *in,
+                           uint8_t *out, size_t nblocks);
+
+int aes_armv8_available(void);
+void aes_encrypt_ecb_armv8(const struct aes_key *key, const uint8_t *in,
+                           uint8_t *out, size_t nblocks);
+
+/* GHASH over nblocks 16 byte blocks: y = (y ^ block) * H for each one,
+ * with h and y in the byte order of the GCM specification.
+ */
+int aes_clmul_available(void);
+void aes_ghash_clmul(const uint8_t *h, uint8_t *y, const uint8_t *in,
+                     size_t nblocks);
+
+#endif
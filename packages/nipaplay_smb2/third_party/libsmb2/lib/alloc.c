@@ -152,3 +152,147 @@ smb2_free_data(struct smb2_context *smb2, void *ptr)
         }
         free(hdr);
 }
+
+/* Freelist allocator for the small objects every request and reply goes
+ * through: pdus, fixed size command parts, reply structs and seal
+ * buffers. Blocks are grouped in power of two size classes and released
+ * blocks are kept on a per class freelist of the context for reuse.
+ * Every block points back at its pool, so smb2_pool_free() has the
+ * signature of free() and can be used as an iovector free callback.
+ */
+struct smb2_pool_block {
+        union {
+                struct smb2_pool *pool;
+                struct smb2_pool_block *next;
+        } u;
+        size_t cls;
+        char buf[0];
+};
+
+#define SMB2_POOL_MIN_SHIFT 6
+#define SMB2_POOL_NO_CLASS ((size_t)-1)
+
+static size_t
+smb2_pool_class(size_t size)
+{
+        size_t cls = 0;
+
+        while (cls < SMB2_POOL_CLASSES &&
+               size > ((size_t)1 << (SMB2_POOL_MIN_SHIFT + cls))) {
+                cls++;
+        }
+        return cls < SMB2_POOL_CLASSES ? cls : SMB2_POOL_NO_CLASS;
+}
+
+struct smb2_pool *
+smb2_pool_create(void)
+{
+        return calloc(1, sizeof(struct smb2_pool));
+}
+
+static void
+smb2_pool_drain(struct smb2_pool *pool)
+{
+        struct smb2_pool_block *blk;
+        int i;
+
+        for (i = 0; i < SMB2_POOL_CLASSES; i++) {
+                while ((blk = pool->free[i])) {
+                        pool->free[i] = blk->u.next;
+                        free(blk);
+                }
+                pool->nfree[i] = 0;
+        }
+}
+
+/* Called when the context is destroyed. Blocks that are still handed out
+ * keep the pool alive until they are released.
+ */
+void
+smb2_pool_destroy(struct smb2_pool *pool)
+{
+        if (pool == NULL) {
+                return;
+        }
+        smb2_pool_drain(pool);
+        pool->orphaned = 1;
+        if (pool->in_use == 0) {
+                free(pool);
+        }
+}
+
+/* Like calloc(): the first size bytes of the block are zeroed. */
+void *
+smb2_pool_alloc(struct smb2_context *smb2, size_t size)
+{
+        struct smb2_pool *pool = smb2->pool;
+        struct smb2_pool_block *blk;
+        size_t cls;
+
+        cls = smb2_pool_class(size);
+        if (cls != SMB2_POOL_NO_CLASS && pool->free[cls]) {
+                blk = pool->free[cls];
+                pool->free[cls] = blk->u.next;
+                pool->nfree[cls]--;
+                pool->reuses++;
+                memset(&blk->buf[0], 0, size);
+        } else {
+                size_t alloc = cls != SMB2_POOL_NO_CLASS ?
+                        (size_t)1 << (SMB2_POOL_MIN_SHIFT + cls) : size;
+
+                blk = calloc(1, offsetof(struct smb2_pool_block, buf) + alloc);
+                if (blk == NULL) {
+                        smb2_set_error(smb2, "Failed to alloc %zu bytes",
+                                       size);
+                        return NULL;
+                }
+                pool->heap_allocs++;
+        }
+
+        blk->u.pool = pool;
+        blk->cls = cls;
+        pool->in_use++;
+
+        return &blk->buf[0];
+}
+
+void
+smb2_pool_free(void *ptr)
+{
+        struct smb2_pool_block *blk;
+        struct smb2_pool *pool;
+
+        if (ptr == NULL) {
+                return;
+        }
+
+#ifndef _MSC_VER
+        blk = (struct smb2_pool_block *)(void *)container_of(ptr, struct smb2_pool_block, buf);
+#else
+        {
+          const char* __mptr = ptr;
+          blk = (struct smb2_pool_block*)((char *)__mptr - offsetof(struct smb2_pool_block, buf));
+        }
+#endif /* !_MSC_VER */
+
+        pool = blk->u.pool;
+        pool->in_use--;
+
+        if (pool->orphaned) {
+                free(blk);
+                if (pool->in_use == 0) {
+                        free(pool);
+                }
+                return;
+        }
+
+        if (blk->cls == SMB2_POOL_NO_CLASS ||
+            pool->nfree[blk->cls] >= SMB2_POOL_MAX_FREE) {
+                free(blk);
+                return;
+        }
+
+        blk->u.next = pool->free[blk->cls];
+        pool->free[blk->cls] = blk;
+        pool->nfree[blk->cls]++;
+}
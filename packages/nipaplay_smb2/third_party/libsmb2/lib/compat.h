@@ -821,6 +821,10 @@ int getlogin_r(char *buf, size_t size);
 #define EINVAL 22
 #endif
 
+#ifndef ENOTSUP
+#define ENOTSUP 95
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -279,6 +279,11 @@ struct smb2_context *smb2_init_context(void)
         if (smb2 == NULL) {
                 return NULL;
         }
+        smb2->pool = smb2_pool_create();
+        if (smb2->pool == NULL) {
+                free(smb2);
+                return NULL;
+        }
 
         ret = getlogin_r(buf, sizeof(buf));
         smb2_set_user(smb2, ret == 0 ? buf : "Guest");
@@ -344,7 +349,7 @@ void smb2_destroy_context(struct smb2_context *smb2)
         while (smb2->waitqueue) {
                 struct smb2_pdu *pdu = smb2->waitqueue;
 
-                smb2->waitqueue = pdu->next;
+                smb2_waitqueue_remove(smb2, pdu);
                 if (pdu->cb) {
                         pdu->cb(smb2, SMB2_STATUS_SHUTDOWN, NULL, pdu->cb_data);
                 }
@@ -353,7 +358,7 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 }
                 smb2_free_pdu(smb2, pdu);
         }
-        smb2_free_iovector(smb2, &smb2->in);
+        smb2_destroy_iovector(smb2, &smb2->in);
 
         if (smb2->connect_cb) {
            smb2->connect_cb(smb2, SMB2_STATUS_CANCELLED,
@@ -382,6 +387,9 @@ void smb2_destroy_context(struct smb2_context *smb2)
             free_c_data(smb2, smb2->connect_data);  /* sets smb2->connect_data to NULL */
         }
 
+        free(smb2->stage);
+        free(smb2->discard);
+        smb2_pool_destroy(smb2->pool);
         SMB2_LIST_REMOVE(&active_contexts, smb2);
         free(smb2);
 }
@@ -418,6 +426,44 @@ void smb2_free_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v)
         v->num_done = 0;
 }
 
+/* Like smb2_free_iovector() but also releases a spilled vector array.
+ * Used when the vectors themselves go away, not just their contents.
+ */
+void smb2_destroy_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v)
+{
+        smb2_free_iovector(smb2, v);
+        if (v->iov != v->inline_iov) {
+                free(v->iov);
+        }
+        v->iov = NULL;
+        v->max_iov = 0;
+}
+
+static int smb2_grow_iovector(struct smb2_io_vectors *v)
+{
+        struct smb2_iovec *iov;
+        int max_iov = v->max_iov * 2;
+
+        if (max_iov > SMB2_MAX_VECTORS) {
+                max_iov = SMB2_MAX_VECTORS;
+        }
+        if (v->iov == v->inline_iov) {
+                iov = malloc(max_iov * sizeof(struct smb2_iovec));
+                if (iov == NULL) {
+                        return -1;
+                }
+                memcpy(iov, v->inline_iov, v->niov * sizeof(struct smb2_iovec));
+        } else {
+                iov = realloc(v->iov, max_iov * sizeof(struct smb2_iovec));
+                if (iov == NULL) {
+                        return -1;
+                }
+        }
+        v->iov = iov;
+        v->max_iov = max_iov;
+        return 0;
+}
+
 struct smb2_iovec *smb2_add_iovector(struct smb2_context *smb2,
                                     struct smb2_io_vectors *v,
                                     uint8_t *buf, size_t len,
@@ -433,6 +479,17 @@ struct smb2_iovec *smb2_add_iovector(struct smb2_context *smb2,
                         }
                         return NULL;
                 }
+                if (v->iov == NULL) {
+                        v->iov = v->inline_iov;
+                        v->max_iov = SMB2_INLINE_VECTORS;
+                }
+                if (v->niov == v->max_iov && smb2_grow_iovector(v) < 0) {
+                        smb2_set_error(smb2, "Failed to grow I/O vectors");
+                        if (free_cb && buf) {
+                                free_cb(buf);
+                        }
+                        return NULL;
+                }
 
                 iov = &v->iov[v->niov];
                 v->iov[v->niov].buf = buf;
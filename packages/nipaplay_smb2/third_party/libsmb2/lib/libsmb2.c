@@ -96,6 +96,8 @@
 
 #include "sha.h"
 #include "sha-private.h"
+#include "aes.h"
+#include "aes_gcm.h"
 
 #include "slist.h"
 #include "smb2.h"
@@ -103,6 +105,7 @@
 #include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 #include "smb2-signing.h"
+#include "smb3-seal.h"
 #include "portable-endian.h"
 #include "ntlmssp.h"
 
@@ -165,6 +168,21 @@ struct smb2fh {
         smb2_file_id file_id;
         int64_t offset;
         int64_t end_of_file;
+
+        /* Durable handle context sent with the CREATE, 0 if none */
+        const char *durable_tag;
+        int durable;
+        /* Lease state the server granted */
+        uint32_t lease_state;
+};
+
+/* Durable handle v2 context for a CREATE. Without file_id it asks for a
+ * new durable handle, with file_id it reclaims the one it names.
+ */
+struct smb2_durable_open {
+        const uint8_t *create_guid;
+        uint32_t timeout;
+        const uint8_t *file_id;
 };
 
 void
@@ -181,13 +199,17 @@ smb2_close_context(struct smb2_context *smb2)
                 close(smb2->fd);
                 smb2->fd = SMB2_INVALID_SOCKET;
         }
+        smb2->stage_pos = 0;
+        smb2->stage_len = 0;
 
         smb2->message_id = 0;
         smb2->session_id = 0;
+        smb2->binding = 0;
         smb2->tree_id_top = 0;
         smb2->tree_id_cur = 0;
         smb2->tree_id[0] = 0xdeadbeef;
         memset(smb2->signing_key, 0, SMB2_KEY_SIZE);
+        memset(&smb2->signing_aes, 0, sizeof(smb2->signing_aes));
         if (smb2->session_key) {
                 free(smb2->session_key);
                 smb2->session_key = NULL;
@@ -578,26 +600,33 @@ void smb2_derive_key(
     uint32_t    label_len,
     const char  *context,
     uint32_t    context_len,
-    uint8_t     derived_key[SMB2_KEY_SIZE]
+    uint8_t     *derived_key,
+    uint32_t    derived_key_len
     )
 {
         unsigned char nul = 0;
         const uint32_t counter = htobe32(1);
-        const uint32_t keylen = htobe32(SMB2_KEY_SIZE * 8);
-        uint8_t input_key[SMB2_KEY_SIZE] = {0};
+        const uint32_t keylen = htobe32(derived_key_len * 8);
+        uint8_t input_key[SMB2_CIPHER_KEY_SIZE_MAX] = {0};
+        uint32_t input_key_len;
         HMACContext ctx;
         uint8_t digest[USHAMaxHashSize];
 
-        memcpy(input_key, derivation_key, MIN(sizeof(input_key),
+        /* The AES-256 ciphers are keyed from the full session key, all
+         * other keys from its first 16 bytes.
+         */
+        input_key_len = derived_key_len > SMB2_KEY_SIZE ?
+                SMB2_CIPHER_KEY_SIZE_MAX : SMB2_KEY_SIZE;
+        memcpy(input_key, derivation_key, MIN(input_key_len,
                                               derivation_key_len));
-        hmacReset(&ctx, SHA256, input_key, sizeof(input_key));
+        hmacReset(&ctx, SHA256, input_key, input_key_len);
         hmacInput(&ctx, (unsigned char *)&counter, sizeof(counter));
         hmacInput(&ctx, (unsigned char *)label, label_len);
         hmacInput(&ctx, &nul, 1);
         hmacInput(&ctx, (unsigned char *)context, context_len);
         hmacInput(&ctx, (unsigned char *)&keylen, sizeof(keylen));
         hmacResult(&ctx, digest);
-        memcpy(derived_key, digest, SMB2_KEY_SIZE);
+        memcpy(derived_key, digest, derived_key_len);
 }
 
 /* MS-SMB2 3.2.5.2 */
@@ -625,8 +654,32 @@ smb3_update_preauth_hash(struct smb2_context *smb2, int niov,
         return 0;
 }
 
+static void smb2_setup_key_schedules(struct smb2_context *smb2)
+{
+        uint32_t cipher_key_len;
+
+        cipher_key_len = smb3_cipher_key_size(smb2->cypher);
+        if (cipher_key_len == 0) {
+                cipher_key_len = SMB2_KEY_SIZE;
+        }
+
+        aes_key_setup(&smb2->signing_aes, smb2->signing_key, SMB2_KEY_SIZE);
+        ghash_key_setup(&smb2->signing_ghash, &smb2->signing_aes);
+        aes_key_setup(&smb2->serverin_aes, smb2->serverin_key, cipher_key_len);
+        aes_key_setup(&smb2->serverout_aes, smb2->serverout_key, cipher_key_len);
+        ghash_key_setup(&smb2->serverin_ghash, &smb2->serverin_aes);
+        ghash_key_setup(&smb2->serverout_ghash, &smb2->serverout_aes);
+}
+
 static void smb2_create_signing_key(struct smb2_context *smb2)
 {
+        uint32_t cipher_key_len;
+
+        cipher_key_len = smb3_cipher_key_size(smb2->cypher);
+        if (cipher_key_len == 0) {
+                cipher_key_len = SMB2_KEY_SIZE;
+        }
+
         /* Derive the signing key from session key
          * This is based on negotiated protocol
          */
@@ -643,44 +696,66 @@ static void smb2_create_signing_key(struct smb2_context *smb2)
                                 sizeof(SMB2AESCMAC),
                                 SmbSign,
                                 sizeof(SmbSign),
-                                smb2->signing_key);
+                                smb2->signing_key,
+                                SMB2_KEY_SIZE);
+        } else if (smb2->dialect > SMB2_VERSION_0302) {
+                smb2_derive_key(smb2->session_key,
+                                smb2->session_key_size,
+                                SMBSigningKey,
+                                sizeof(SMBSigningKey),
+                                (char *)smb2->preauthhash,
+                                SMB2_PREAUTH_HASH_SIZE,
+                                smb2->signing_key,
+                                SMB2_KEY_SIZE);
+        }
+
+        /* A channel signs with a key of its own, derived from the session
+         * key of the authentication that bound it, but seals with the keys
+         * of the session it was bound to. MS-SMB2 3.2.5.3.1
+         */
+        if (smb2->binding) {
+                smb2_setup_key_schedules(smb2);
+                return;
+        }
+
+        if (smb2->dialect == SMB2_VERSION_0300 ||
+            smb2->dialect == SMB2_VERSION_0302) {
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMB2AESCCM,
                                 sizeof(SMB2AESCCM),
                                 ServerIn,
                                 sizeof(ServerIn),
-                                smb2->serverin_key);
+                                smb2->serverin_key,
+                                cipher_key_len);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMB2AESCCM,
                                 sizeof(SMB2AESCCM),
                                 ServerOut,
                                 sizeof(ServerOut),
-                                smb2->serverout_key);
+                                smb2->serverout_key,
+                                cipher_key_len);
         } else if (smb2->dialect > SMB2_VERSION_0302) {
-                smb2_derive_key(smb2->session_key,
-                                smb2->session_key_size,
-                                SMBSigningKey,
-                                sizeof(SMBSigningKey),
-                                (char *)smb2->preauthhash,
-                                SMB2_PREAUTH_HASH_SIZE,
-                                smb2->signing_key);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMBC2SCipherKey,
                                 sizeof(SMBC2SCipherKey),
                                 (char *)smb2->preauthhash,
                                 SMB2_PREAUTH_HASH_SIZE,
-                                smb2->serverin_key);
+                                smb2->serverin_key,
+                                cipher_key_len);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMBS2CCipherKey,
                                 sizeof(SMBS2CCipherKey),
                                 (char *)smb2->preauthhash,
                                 SMB2_PREAUTH_HASH_SIZE,
-                                smb2->serverout_key);
+                                smb2->serverout_key,
+                                cipher_key_len);
         }
+
+        smb2_setup_key_schedules(smb2);
 }
 
 static void
@@ -738,7 +813,8 @@ session_setup_cb(struct smb2_context *smb2, int status,
 #endif
 
 
-        if (smb2->sign || smb2->seal || smb2->dialect == SMB2_VERSION_0311) {
+        if (smb2->sign || smb2->seal || smb2->binding ||
+            smb2->dialect == SMB2_VERSION_0311) {
                 uint8_t zero_key[SMB2_KEY_SIZE] = {0};
                 int have_valid_session_key = 1;
 
@@ -760,7 +836,8 @@ session_setup_cb(struct smb2_context *smb2, int status,
                 if (smb2->session_key == NULL || memcmp(smb2->session_key, zero_key, SMB2_KEY_SIZE) == 0) {
                         have_valid_session_key = 0;
                 }
-                if (smb2->sign && have_valid_session_key == 0) {
+                if ((smb2->sign || smb2->binding) &&
+                    have_valid_session_key == 0) {
                         smb2_close_context(smb2);
                         smb2_set_error(smb2, "Signing required by server. Session "
                                        "Key is not available %s",
@@ -793,6 +870,14 @@ session_setup_cb(struct smb2_context *smb2, int status,
                 }
         }
 
+        if (smb2->binding) {
+                /* The channel uses the trees of the session */
+                smb2->binding = 0;
+                c_data->cb(smb2, 0, NULL, c_data->cb_data);
+                free_c_data(smb2, c_data);
+                return;
+        }
+
         memset(&req, 0, sizeof(struct smb2_tree_connect_request));
         req.flags       = 0;
         req.path_length = 2 * c_data->utf16_unc->len;
@@ -829,6 +914,9 @@ send_session_setup_request(struct smb2_context *smb2,
         /* Session setup request. */
         memset(&req, 0, sizeof(struct smb2_session_setup_request));
         req.security_mode = (uint8_t)smb2->security_mode;
+        if (smb2->binding) {
+                req.flags = SMB2_SESSION_FLAG_BINDING;
+        }
 
         if (smb2->sec == SMB2_SEC_NTLMSSP) {
                 if (ntlmssp_generate_blob(NULL, smb2, time(NULL), c_data->auth_data,
@@ -900,6 +988,34 @@ negotiate_cb(struct smb2_context *smb2, int status,
         smb2->max_write_size    = rep->max_write_size;
         smb2->dialect           = rep->dialect_revision;
         smb2->cypher            = rep->cypher;
+        smb2->capabilities      = rep->capabilities;
+
+        /* Only 3.1.1 negotiates the signing algorithm. 2.x always uses
+         * HMAC-SHA256 and 3.x AES-CMAC unless the server picked GMAC.
+         */
+        if (smb2->dialect <= SMB2_VERSION_0210) {
+                smb2->signing_algo = SMB2_SIGNING_HMAC_SHA256;
+        } else if (smb2->dialect == SMB2_VERSION_0311 &&
+                   rep->signing_algo == SMB2_SIGNING_AES_GMAC) {
+                smb2->signing_algo = SMB2_SIGNING_AES_GMAC;
+        } else {
+                smb2->signing_algo = SMB2_SIGNING_AES_CMAC;
+        }
+
+        /* Only 3.1.1 negotiates a cipher, 3.0 and 3.0.2 always use
+         * AES-128-CCM.
+         */
+        if (smb2->dialect != SMB2_VERSION_0311) {
+                smb2->cypher = SMB2_ENCRYPTION_AES_128_CCM;
+        } else if (smb2->seal && !smb3_cipher_key_size(smb2->cypher)) {
+                smb2_set_error(smb2, "Encryption requested but server "
+                               "selected unsupported cipher 0x%04x.",
+                               smb2->cypher);
+                smb2_close_context(smb2);
+                c_data->cb(smb2, -ENOTSUP, NULL, c_data->cb_data);
+                free_c_data(smb2, c_data);
+                return;
+        }
 
         if (smb2->seal && (smb2->dialect == SMB2_VERSION_0300 ||
                            smb2->dialect == SMB2_VERSION_0302)) {
@@ -1006,13 +1122,14 @@ connect_cb(struct smb2_context *smb2, int status,
         }
 
         memset(&req, 0, sizeof(struct smb2_negotiate_request));
-        req.capabilities = SMB2_GLOBAL_CAP_LARGE_MTU;
+        req.capabilities = SMB2_GLOBAL_CAP_LARGE_MTU | SMB2_GLOBAL_CAP_LEASING;
         if (smb2->version == SMB2_VERSION_ANY  ||
             smb2->version == SMB2_VERSION_ANY3 ||
             smb2->version == SMB2_VERSION_0300 ||
             smb2->version == SMB2_VERSION_0302 ||
             smb2->version == SMB2_VERSION_0311) {
-                req.capabilities |= SMB2_GLOBAL_CAP_ENCRYPTION;
+                req.capabilities |= SMB2_GLOBAL_CAP_ENCRYPTION |
+                        SMB2_GLOBAL_CAP_MULTI_CHANNEL;
         }
         req.security_mode = smb2->security_mode;
         switch (smb2->version) {
@@ -1153,18 +1270,132 @@ smb2_connect_share_async(struct smb2_context *smb2,
         return 0;
 }
 
+int
+smb2_connect_channel_async(struct smb2_context *smb2,
+                           struct smb2_context *session,
+                           const char *server,
+                           smb2_command_cb cb, void *cb_data)
+{
+        int err;
+
+        if (smb2 == NULL || session == NULL || smb2 == session) {
+                return -EINVAL;
+        }
+        if (SMB2_VALID_SOCKET(smb2->fd)) {
+                smb2_set_error(smb2, "Context is already connected");
+                return -EINVAL;
+        }
+        /* Binding is signed with the key of the session, which a guest
+         * or anonymous session does not have.
+         */
+        if (session->session_id == 0 || session->session_key_size == 0 ||
+            session->tree_id_top == 0) {
+                smb2_set_error(smb2, "No authenticated session to bind to");
+                return -EINVAL;
+        }
+        if (session->dialect < SMB2_VERSION_0300 ||
+            !(session->capabilities & SMB2_GLOBAL_CAP_MULTI_CHANNEL)) {
+                smb2_set_error(smb2, "Server does not support multichannel");
+                return -EOPNOTSUPP;
+        }
+
+        smb2_set_user(smb2, session->user);
+        smb2_set_domain(smb2, session->domain);
+        smb2_set_password(smb2, session->password);
+        smb2_set_workstation(smb2, session->workstation);
+        if (session->user == NULL) {
+                smb2_set_error(smb2, "Session has no user");
+                return -EINVAL;
+        }
+        smb2->sec = session->sec;
+        smb2->security_mode = session->security_mode;
+        smb2->sign = session->sign;
+        smb2->seal = session->seal;
+        smb2->passthrough = session->passthrough;
+        /* The server binds only a connection of the same client that
+         * negotiated the same dialect. MS-SMB2 3.3.5.5.2
+         */
+        smb2->version = (enum smb2_negotiate_version)session->dialect;
+        memcpy(smb2->client_guid, session->client_guid,
+               sizeof(smb2->client_guid));
+
+        smb2->session_id = session->session_id;
+        memcpy(smb2->tree_id, session->tree_id, sizeof(smb2->tree_id));
+        smb2->tree_id_top = session->tree_id_top;
+        smb2->tree_id_cur = session->tree_id_cur;
+        memcpy(smb2->signing_key, session->signing_key, SMB2_KEY_SIZE);
+        memcpy(smb2->serverin_key, session->serverin_key,
+               SMB2_CIPHER_KEY_SIZE_MAX);
+        memcpy(smb2->serverout_key, session->serverout_key,
+               SMB2_CIPHER_KEY_SIZE_MAX);
+        smb2->cypher = session->cypher;
+        smb2_setup_key_schedules(smb2);
+        smb2->binding = 1;
+
+        err = smb2_connect_share_async(smb2, server,
+                                       session->share ? session->share :
+                                       "IPC$", session->user, cb, cb_data);
+        if (err != 0) {
+                smb2_close_context(smb2);
+        }
+        return err;
+}
+
 static void
 free_smb2fh(struct smb2_context *smb2, struct smb2fh *fh)
 {
         free(fh);
 }
 
+/* Find the create context named tag in a reply. Returns 0 and its data in
+ * data, or -1 if there is none.
+ */
+static int
+smb2_create_reply_find_context(struct smb2_create_reply *rep, const char *tag,
+                               struct smb2_iovec *data)
+{
+        struct smb2_iovec iov;
+        uint32_t pos = 0, next, data_length;
+        uint16_t name_offset, name_length, data_offset;
+
+        iov.buf = rep->create_context;
+        iov.len = rep->create_context_length;
+        if (iov.buf == NULL) {
+                return -1;
+        }
+        for (;;) {
+                if (smb2_get_uint32(&iov, pos, &next) ||
+                    smb2_get_uint16(&iov, pos + 4, &name_offset) ||
+                    smb2_get_uint16(&iov, pos + 6, &name_length) ||
+                    smb2_get_uint16(&iov, pos + 10, &data_offset) ||
+                    smb2_get_uint32(&iov, pos + 12, &data_length)) {
+                        return -1;
+                }
+                if (name_length == 4 &&
+                    (size_t)pos + name_offset + 4 <= iov.len &&
+                    !memcmp(iov.buf + pos + name_offset, tag, 4)) {
+                        if ((size_t)pos + data_offset + data_length >
+                            iov.len) {
+                                return -1;
+                        }
+                        data->buf = iov.buf + pos + data_offset;
+                        data->len = data_length;
+                        return 0;
+                }
+                if (next == 0 || next > iov.len - pos) {
+                        return -1;
+                }
+                pos += next;
+        }
+}
+
 static void
 open_cb(struct smb2_context *smb2, int status,
         void *command_data, void *private_data)
 {
         struct smb2fh *fh = private_data;
         struct smb2_create_reply *rep = command_data;
+        struct smb2_iovec data;
 
         if (status != SMB2_STATUS_SUCCESS) {
                 smb2_set_nterror(smb2, status, "Open failed with (0x%08x) %s.",
@@ -1176,12 +1407,26 @@ open_cb(struct smb2_context *smb2, int status,
 
         memcpy(fh->file_id, rep->file_id, SMB2_FD_SIZE);
         fh->end_of_file = rep->end_of_file;
+        /* A reclaimed handle stays durable, a new one only is if the
+         * server answered the request with a context of its own.
+         */
+        if (fh->durable_tag) {
+                fh->durable = !strcmp(fh->durable_tag, "DH2C") ||
+                        !smb2_create_reply_find_context(rep, fh->durable_tag,
+                                                        &data);
+        }
+        /* LeaseKey, then the LeaseState granted */
+        if (rep->oplock_level == SMB2_OPLOCK_LEVEL_LEASE &&
+            !smb2_create_reply_find_context(rep, "RqLs", &data)) {
+                smb2_get_uint32(&data, 16, &fh->lease_state);
+        }
         fh->cb(smb2, 0, fh, fh->cb_data);
 }
 
 static struct smb2_pdu *
 _smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *path, int flags,
                 uint8_t oplock_level, uint32_t lease_state, smb2_lease_key lease_key,
+                const struct smb2_durable_open *durable,
                 smb2_command_cb cb, void *cb_data, void (*free_cb)(void *),
                 int caller_frees_pdu)
 {
@@ -1189,6 +1434,7 @@ _smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *pat
         struct smb2_create_request req;
         struct smb2_pdu *pdu;
         struct smb2_iovec iov;
+        uint32_t lease_length = 0, durable_length = 0;
         uint32_t desired_access = 0;
         uint32_t create_disposition = 0;
         uint32_t create_options = 0;
@@ -1267,12 +1513,33 @@ _smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *pat
         req.create_options = create_options;
         req.name = path;
 
+        /* Create contexts: the lease, then the durable handle. The lease
+         * context is a multiple of 8 bytes, so the next one stays aligned.
+         */
         if (lease_state && lease_key) {
-                req.create_context_length = SMB2_CREATE_REQUEST_LEASE_SIZE + 24;
-                req.create_context = calloc(1, SMB2_CREATE_REQUEST_LEASE_SIZE + 24);
+                lease_length = SMB2_CREATE_REQUEST_LEASE_SIZE + 24;
+        }
+        if (durable) {
+                durable_length = 24 + (durable->file_id ?
+                        SMB2_CREATE_DURABLE_V2_RECONNECT_SIZE :
+                        SMB2_CREATE_DURABLE_V2_REQUEST_SIZE);
+        }
+        req.create_context_length = lease_length + durable_length;
+        if (req.create_context_length) {
+                req.create_context = calloc(1, req.create_context_length);
+                if (req.create_context == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate create "
+                                       "context");
+                        free_smb2fh(smb2, fh);
+                        return NULL;
+                }
+        }
+
+        if (lease_length) {
                 iov.buf = req.create_context;
-                iov.len = req.create_context_length;
-                smb2_set_uint32(&iov, 0, 0);    /* chain offset */
+                iov.len = lease_length;
+                /* chain offset */
+                smb2_set_uint32(&iov, 0, durable_length ? lease_length : 0);
                 smb2_set_uint16(&iov, 4, 16);   /* tag offset */
                 smb2_set_uint16(&iov, 6, 4);    /* tag length lo */
                 smb2_set_uint16(&iov, 8, 0);    /* tag length up */
@@ -1283,6 +1550,29 @@ _smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *pat
                 smb2_set_uint32(&iov, 40, lease_state);
         }
 
+        if (durable_length) {
+                iov.buf = req.create_context + lease_length;
+                iov.len = durable_length;
+                smb2_set_uint16(&iov, 4, 16);   /* tag offset */
+                smb2_set_uint16(&iov, 6, 4);    /* tag length */
+                smb2_set_uint16(&iov, 10, 24);  /* data offset */
+                smb2_set_uint32(&iov, 12, durable_length - 24);
+                if (durable->file_id) {
+                        /* FileId, CreateGuid, Flags 0: not persistent */
+                        fh->durable_tag = "DH2C";
+                        memcpy(iov.buf + 24, durable->file_id, SMB2_FD_SIZE);
+                        memcpy(iov.buf + 40, durable->create_guid,
+                               SMB2_CREATE_GUID_SIZE);
+                } else {
+                        /* Timeout, Flags 0, 8 reserved bytes, CreateGuid */
+                        fh->durable_tag = "DH2Q";
+                        smb2_set_uint32(&iov, 24, durable->timeout);
+                        memcpy(iov.buf + 40, durable->create_guid,
+                               SMB2_CREATE_GUID_SIZE);
+                }
+                memcpy(iov.buf + 16, fh->durable_tag, 4);
+        }
+
         pdu = smb2_cmd_create_async(smb2, &req, open_cb, fh);
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create create command");
@@ -1304,7 +1594,7 @@ smb2_open_async_pdu(struct smb2_context *smb2, const char *path, int flags,
                     smb2_command_cb cb, void *cb_data, void (*free_cb)(void *))
 {
         return _smb2_open_async_with_oplock_or_lease(smb2, path, flags,
-                SMB2_OPLOCK_LEVEL_NONE, 0, NULL,
+                SMB2_OPLOCK_LEVEL_NONE, 0, NULL, NULL,
                 cb, cb_data, free_cb, 1);
 }
         
@@ -1317,7 +1607,7 @@ smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *path
         struct smb2_pdu *pdu;
         
         pdu = _smb2_open_async_with_oplock_or_lease(smb2, path, flags,
-                oplock_level, lease_state, lease_key,
+                oplock_level, lease_state, lease_key, NULL,
                 cb, cb_data, NULL, 0);
         return pdu ? 0 : -1;
 }
@@ -1329,11 +1619,120 @@ smb2_open_async(struct smb2_context *smb2, const char *path, int flags,
         struct smb2_pdu *pdu;
         
         pdu = _smb2_open_async_with_oplock_or_lease(smb2, path, flags,
-                SMB2_OPLOCK_LEVEL_NONE, 0, NULL,
+                SMB2_OPLOCK_LEVEL_NONE, 0, NULL, NULL,
                 cb, cb_data, NULL, 0);
         return pdu ? 0 : -1;
 }
 
+/* Durable handles v2 need SMB 3.0. They also need a batch oplock (or a
+ * handle lease) to be granted, which is asked for again when reclaiming.
+ */
+static struct smb2_pdu *
+_smb2_open_durable_async(struct smb2_context *smb2, const char *path,
+                         int flags, const smb2_create_guid create_guid,
+                         uint32_t timeout, const smb2_file_id file_id,
+                         uint32_t lease_state, const uint8_t *lease_key,
+                         smb2_command_cb cb, void *cb_data,
+                         void (*free_cb)(void *), int caller_frees_pdu)
+{
+        struct smb2_durable_open durable;
+        uint8_t oplock_level = SMB2_OPLOCK_LEVEL_BATCH;
+
+        if (smb2 == NULL) {
+                return NULL;
+        }
+        if (lease_state && lease_key) {
+                oplock_level = SMB2_OPLOCK_LEVEL_LEASE;
+        } else {
+                lease_state = 0;
+        }
+        if (smb2->dialect < SMB2_VERSION_0300) {
+                if (file_id) {
+                        smb2_set_error(smb2, "Durable handles need SMB 3.0 "
+                                       "or later");
+                        return NULL;
+                }
+                /* Leases still work on SMB 2.1 */
+                if (smb2->dialect < SMB2_VERSION_0210) {
+                        lease_state = 0;
+                }
+                return _smb2_open_async_with_oplock_or_lease(smb2, path,
+                        flags, lease_state ? SMB2_OPLOCK_LEVEL_LEASE :
+                        SMB2_OPLOCK_LEVEL_NONE, lease_state,
+                        (uint8_t *)lease_key, NULL,
+                        cb, cb_data, free_cb, caller_frees_pdu);
+        }
+
+        durable.create_guid = create_guid;
+        durable.timeout = timeout;
+        durable.file_id = file_id;
+        return _smb2_open_async_with_oplock_or_lease(smb2, path, flags,
+                oplock_level, lease_state, (uint8_t *)lease_key, &durable,
+                cb, cb_data, free_cb, caller_frees_pdu);
+}
+
+struct smb2_pdu *
+smb2_open_durable_async_pdu(struct smb2_context *smb2, const char *path,
+                            int flags, const smb2_create_guid create_guid,
+                            uint32_t timeout, const smb2_file_id file_id,
+                            uint32_t lease_state,
+                            const smb2_lease_key lease_key,
+                            smb2_command_cb cb, void *cb_data,
+                            void (*free_cb)(void *))
+{
+        return _smb2_open_durable_async(smb2, path, flags, create_guid,
+                                        timeout, file_id, lease_state,
+                                        lease_key, cb, cb_data, free_cb, 1);
+}
+
+int
+smb2_open_durable_async(struct smb2_context *smb2, const char *path,
+                        int flags, const smb2_create_guid create_guid,
+                        uint32_t timeout, uint32_t lease_state,
+                        const smb2_lease_key lease_key,
+                        smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_pdu *pdu;
+
+        pdu = _smb2_open_durable_async(smb2, path, flags, create_guid,
+                                       timeout, NULL, lease_state, lease_key,
+                                       cb, cb_data, NULL, 0);
+        return pdu ? 0 : -1;
+}
+
+int
+smb2_reopen_durable_async(struct smb2_context *smb2, const char *path,
+                          int flags, const smb2_create_guid create_guid,
+                          const smb2_file_id file_id, uint32_t lease_state,
+                          const smb2_lease_key lease_key,
+                          smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_pdu *pdu;
+
+        pdu = _smb2_open_durable_async(smb2, path, flags, create_guid,
+                                       0, file_id, lease_state, lease_key,
+                                       cb, cb_data, NULL, 0);
+        return pdu ? 0 : -1;
+}
+
+int
+smb2_fh_is_durable(struct smb2fh *fh)
+{
+        return fh->durable;
+}
+
+uint32_t
+smb2_fh_lease_state(struct smb2fh *fh)
+{
+        return fh->lease_state;
+}
+
+void
+smb2_free_fh(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        free_smb2fh(smb2, fh);
+}
+
 static void
 close_cb(struct smb2_context *smb2, int status,
          void *command_data, void *private_data)
@@ -1449,7 +1848,7 @@ read_cb(struct smb2_context *smb2, int status,
                 smb2_set_nterror(smb2, status, "Read/Write failed with (0x%08x) %s",
                                status, nterror_to_str(status));
                 rd->cb(smb2, -nterror_to_errno(status), &rd->read_cb_data, rd->cb_data);
-                free(rd);
+                smb2_pool_free(rd);
                 return;
         }
 
@@ -1458,7 +1857,7 @@ read_cb(struct smb2_context *smb2, int status,
         }
 
         rd->cb(smb2, rep->data_length, &rd->read_cb_data, rd->cb_data);
-        free(rd);
+        smb2_pool_free(rd);
 }
 
 int
@@ -1479,7 +1878,7 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
                 return -EINVAL;
         }
 
-        rd = calloc(1, sizeof(struct read_data));
+        rd = smb2_pool_alloc(smb2, sizeof(struct read_data));
         if (rd == NULL) {
                 smb2_set_error(smb2, "Failed to allocate read_data");
                 return -ENOMEM;
@@ -1525,8 +1924,10 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
         pdu = smb2_cmd_read_async(smb2, &req, read_cb, rd);
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create read command");
+                smb2_pool_free(rd);
                 return -EINVAL;
         }
+        pdu->owner = cb_data;
 
         smb2_queue_pdu(smb2, pdu);
 
@@ -2637,6 +3038,67 @@ smb2_readlink_async(struct smb2_context *smb2, const char *path,
         return 0;
 }
 
+struct query_interfaces_data {
+        smb2_command_cb cb;
+        void *cb_data;
+};
+
+static void
+query_interfaces_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct query_interfaces_data *qi_data = private_data;
+        struct smb2_ioctl_reply *rep = command_data;
+
+        if (status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, status, "Query of network interfaces "
+                                 "failed with (0x%08x) %s",
+                                 status, nterror_to_str(status));
+                qi_data->cb(smb2, -nterror_to_errno(status), NULL,
+                            qi_data->cb_data);
+        } else {
+                qi_data->cb(smb2, 0, rep->output, qi_data->cb_data);
+        }
+        free(qi_data);
+}
+
+int
+smb2_query_network_interfaces_async(struct smb2_context *smb2,
+                                    smb2_command_cb cb, void *cb_data)
+{
+        struct query_interfaces_data *qi_data;
+        struct smb2_ioctl_request req;
+        struct smb2_pdu *pdu;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+
+        qi_data = calloc(1, sizeof(struct query_interfaces_data));
+        if (qi_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate "
+                               "query_interfaces_data");
+                return -ENOMEM;
+        }
+        qi_data->cb = cb;
+        qi_data->cb_data = cb_data;
+
+        /* Not about any file, so the file id is all ones. */
+        memset(&req, 0, sizeof(struct smb2_ioctl_request));
+        req.ctl_code = SMB2_FSCTL_QUERY_NETWORK_INTERFACE_INFO;
+        memcpy(req.file_id, compound_file_id, SMB2_FD_SIZE);
+        req.flags = SMB2_0_IOCTL_IS_FSCTL;
+
+        pdu = smb2_cmd_ioctl_async(smb2, &req, query_interfaces_cb, qi_data);
+        if (pdu == NULL) {
+                free(qi_data);
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
 struct disconnect_data {
         smb2_command_cb cb;
         void *cb_data;
@@ -2655,6 +3117,8 @@ disconnect_cb_2(struct smb2_context *smb2, int status,
         }
         close(smb2->fd);
         smb2->fd = SMB2_INVALID_SOCKET;
+        smb2->stage_pos = 0;
+        smb2->stage_len = 0;
 }
 
 static void
@@ -2801,6 +3265,13 @@ smb2_fd_event_callbacks(struct smb2_context *smb2,
         smb2->change_events = change_events;
 }
 
+/* The server answers acknowledgements; nothing to do with that. */
+static void
+oplock_break_ack_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+}
+
 void
 smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_data, void *cb_data)
 {
@@ -2813,6 +3284,17 @@ smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_da
 
         rep= command_data;
 
+        /* Without a callback, acknowledge the level the server broke to */
+        if (!status && rep->break_type == SMB2_BREAK_TYPE_OPLOCK_NOTIFICATION) {
+                new_oplock_level = rep->lock.oplock.oplock_level;
+        } else {
+                new_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+        }
+        if (!status && rep->break_type == SMB2_BREAK_TYPE_LEASE_NOTIFICATION) {
+                new_lease_state = rep->lock.lease.new_lease_state;
+        } else {
+                new_lease_state = 0;
+        }
 
         if (smb2->oplock_or_lease_break_cb) {
                 smb2->oplock_or_lease_break_cb(smb2,
@@ -2828,16 +3310,19 @@ smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_da
                                 memset(&rep_oplock, 0, sizeof(rep_oplock));
                                 rep_oplock.oplock_level = new_oplock_level;
                                 memcpy(rep_oplock.file_id, rep->lock.oplock.file_id, SMB2_FD_SIZE);
-                                pdu = smb2_cmd_oplock_break_reply_async(smb2, &rep_oplock, NULL, cb_data);
+                                pdu = smb2_cmd_oplock_break_reply_async(smb2, &rep_oplock, oplock_break_ack_cb, cb_data);
                                 break;
                         case SMB2_BREAK_TYPE_OPLOCK_RESPONSE:
                                 break;
                         case SMB2_BREAK_TYPE_LEASE_NOTIFICATION:
-                                memset(&rep_lease, 0, sizeof(rep_oplock));
-                                rep_lease.flags = rep->lock.lease.flags;
+                                /* a break from read caching only is not acknowledged */
+                                if (!(rep->lock.lease.flags & SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED)) {
+                                        break;
+                                }
+                                memset(&rep_lease, 0, sizeof(rep_lease));
                                 rep_lease.lease_state = new_lease_state;
                                 memcpy(rep_lease.lease_key, rep->lock.lease.lease_key, SMB2_LEASE_KEY_SIZE);
-                                pdu = smb2_cmd_lease_break_reply_async(smb2, &rep_lease, NULL, cb_data);
+                                pdu = smb2_cmd_lease_break_reply_async(smb2, &rep_lease, oplock_break_ack_cb, cb_data);
                                 break;
                         case SMB2_BREAK_TYPE_LEASE_RESPONSE:
                                 break;
@@ -3781,8 +4266,8 @@ smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *comma
                 return;
         }
 
-        if (smb2->sign)  {
-                /* Derive the signing key from session key
+        if (smb2->sign || smb2->seal)  {
+                /* Derive the signing and sealing keys from session key
                 * This is based on negotiated protocol
                 */
                 smb2_create_signing_key(smb2);
@@ -4005,8 +4490,25 @@ smb2_negotiate_request_cb(struct smb2_context *smb2, int status, void *command_d
         rep.max_read_size      = smb2->max_read_size;
         rep.max_write_size     = smb2->max_write_size;
         rep.dialect_revision   = smb2->dialect;
+        if (smb2->dialect != SMB2_VERSION_0311 ||
+            !smb3_cipher_key_size(smb2->cypher)) {
+                smb2->cypher = SMB2_ENCRYPTION_AES_128_CCM;
+        }
         rep.cypher             = smb2->cypher;
 
+        /* Echo the algorithm chosen from the client's signing context,
+         * then settle on what this dialect uses when there was none.
+         */
+        if (smb2->dialect == SMB2_VERSION_0311) {
+                rep.signing_algo = smb2->signing_algo;
+        }
+        if (smb2->dialect <= SMB2_VERSION_0210) {
+                smb2->signing_algo = SMB2_SIGNING_HMAC_SHA256;
+        } else if (smb2->dialect != SMB2_VERSION_0311 ||
+                   smb2->signing_algo != SMB2_SIGNING_AES_GMAC) {
+                smb2->signing_algo = SMB2_SIGNING_AES_CMAC;
+        }
+
         /* remember negotiated capabilites and security mode */
         smb2->capabilities = rep.capabilities;
         smb2->security_mode = rep.security_mode;
@@ -4195,9 +4697,7 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                                         smb2_set_error(smb2, "Timeout expired and no connection exists");
                                         smb2_close_context(smb2);
                                 }
-                                if (smb2->timeout) {
-                                        smb2_timeout_pdus(smb2);
-                                }
+                                smb2_timeout_pdus(smb2);
                         }
 
                         if (FD_ISSET(server->fd, &rfds)) {
@@ -49,6 +49,9 @@
 
 #include "compat.h"
 
+#include <errno.h>
+#include <limits.h>
+
 #include "portable-endian.h"
 
 #include "slist.h"
@@ -82,6 +85,79 @@ smb2_pad_to_64bit(struct smb2_context *smb2, struct smb2_io_vectors *v)
 
 #include <stdio.h>
 
+/* Milliseconds on a clock that does not jump with the time of day */
+uint64_t
+smb2_now_ms(void)
+{
+#if defined(_WIN32) || defined(_WINDOWS)
+        return (uint64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#else
+        return (uint64_t)time(NULL) * 1000;
+#endif
+}
+
+static void
+smb2_timer_disarm(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        if (pdu->timer_pprev == NULL) {
+                return;
+        }
+        *pdu->timer_pprev = pdu->timer_next;
+        if (pdu->timer_next) {
+                pdu->timer_next->timer_pprev = pdu->timer_pprev;
+        }
+        pdu->timer_next = NULL;
+        pdu->timer_pprev = NULL;
+        smb2->ntimers--;
+}
+
+/* Put a pdu on the timer wheel for the earlier of its deadlines. One that
+ * already passed goes to the tick being expired, to be seen right away.
+ */
+static void
+smb2_timer_arm(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **slot;
+        uint64_t at = pdu->expires;
+        uint64_t tick;
+
+        smb2_timer_disarm(smb2, pdu);
+        if (pdu->notify_at && (at == 0 || pdu->notify_at < at)) {
+                at = pdu->notify_at;
+        }
+        if (at == 0) {
+                return;
+        }
+        tick = at / SMB2_TIMER_TICK_MS;
+        if (tick < smb2->timer_tick) {
+                tick = smb2->timer_tick;
+        }
+        slot = &smb2->timers[tick % SMB2_TIMER_SLOTS];
+        pdu->timer_at = at;
+        pdu->timer_next = *slot;
+        if (*slot) {
+                (*slot)->timer_pprev = &pdu->timer_next;
+        }
+        *slot = pdu;
+        pdu->timer_pprev = slot;
+        smb2->ntimers++;
+}
+
+/* Deadlines do not apply to a request that completed */
+static void
+smb2_timer_clear(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        smb2_timer_disarm(smb2, pdu);
+        pdu->expires = 0;
+        pdu->notify_at = 0;
+        pdu->notify_cb = NULL;
+}
+
 struct smb2_pdu *
 smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
                   smb2_command_cb cb, void *cb_data)
@@ -90,7 +166,7 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
         struct smb2_header *hdr;
         char magic[4] = {0xFE, 'S', 'M', 'B'};
 
-        pdu = calloc(1, sizeof(struct smb2_pdu));
+        pdu = smb2_pool_alloc(smb2, sizeof(struct smb2_pdu));
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to allocate pdu");
                 return NULL;
@@ -153,10 +229,11 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
 
         pdu->cb = cb;
         pdu->cb_data = cb_data;
+        pdu->owner = cb_data;
         pdu->out.niov = 0;
 
         if (smb2_add_iovector(smb2, &pdu->out, pdu->hdr, SMB2_HEADER_SIZE, NULL) == NULL) {
-                free(pdu);
+                smb2_pool_free(pdu);
                 smb2_set_error(smb2, "Too many I/O vectors when adding SMB2 header");
                 return NULL;
         }
@@ -172,7 +249,8 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
         }
 
         if (smb2->timeout) {
-                pdu->timeout = time(NULL) + smb2->timeout;
+                pdu->expires = smb2_now_ms() + (uint64_t)smb2->timeout * 1000;
+                smb2_timer_arm(smb2, pdu);
         }
 
         return pdu;
@@ -344,14 +422,15 @@ void
 smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
         SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-        SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
+        smb2_waitqueue_remove(smb2, pdu);
 
         if (pdu->next_compound) {
                 smb2_free_pdu(smb2, pdu->next_compound);
         }
 
-        smb2_free_iovector(smb2, &pdu->out);
-        smb2_free_iovector(smb2, &pdu->in);
+        smb2_timer_disarm(smb2, pdu);
+        smb2_destroy_iovector(smb2, &pdu->out);
+        smb2_destroy_iovector(smb2, &pdu->in);
 
         if (pdu->free_cb != NULL) {
             pdu->free_cb(pdu->cb_data);
@@ -361,9 +440,13 @@ smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
             pdu->free_payload(smb2, pdu->payload);
         }
 
-        free(pdu->payload);
-        free(pdu->crypt);
-        free(pdu);
+        if (pdu->pooled_payload) {
+                smb2_pool_free(pdu->payload);
+        } else {
+                free(pdu->payload);
+        }
+        smb2_pool_free(pdu->crypt);
+        smb2_pool_free(pdu);
 }
 
 int
@@ -460,7 +543,8 @@ static void
 smb2_encode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
                    struct smb2_header *hdr)
 {
-        if (!smb2_is_server(smb2)) {
+        /* A CANCEL reuses the message id of the request it cancels */
+        if (!smb2_is_server(smb2) && hdr->command != SMB2_CANCEL) {
                 hdr->message_id = smb2->message_id++;
                 if (hdr->credit_charge > 1) {
                         smb2->message_id += (hdr->credit_charge - 1);
@@ -652,7 +736,7 @@ smb2_correlate_reply(struct smb2_context *smb2, struct smb2_pdu *pdu)
                                pdu->header.flags |= SMB2_FLAGS_ASYNC_COMMAND;
                                pdu->header.async.async_id = req_pdu->header.async.async_id;
                        }
-                       SMB2_LIST_REMOVE(&smb2->waitqueue, req_pdu);
+                       smb2_waitqueue_remove(smb2, req_pdu);
                        smb2_free_pdu(smb2, req_pdu);
                 }
         }
@@ -698,7 +782,7 @@ smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
                         prev_compound_mid = p->header.message_id;
                 }
 
-                if (smb2->sign ||
+                if (smb2->sign || smb2->binding ||
                     (p->header.command == SMB2_TREE_CONNECT && smb2->dialect == SMB2_VERSION_0311 && !smb2->seal)) {
                         if (smb2_pdu_add_signature(smb2, p) < 0) {
                                 smb2_set_error(smb2, "Failure to add "
@@ -763,12 +847,86 @@ smb2_get_last_reply_message_id(struct smb2_context *smb2)
         return 0;
 }
 
+static struct smb2_pdu **
+smb2_wait_bucket(struct smb2_context *smb2, uint64_t message_id)
+{
+        return &smb2->wait_hash[message_id & (SMB2_WAIT_HASH_SIZE - 1)];
+}
+
+/* Append a pdu to the wait queue. The pdu is also added to the end of its
+ * wait_hash bucket so smb2_find_pdu() still returns the oldest request
+ * when the same message id is queued more than once.
+ * The message id must not change while the pdu is queued.
+ */
+void
+smb2_waitqueue_add(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **b;
+
+        if (pdu->waiting) {
+                return;
+        }
+
+        pdu->next = NULL;
+        pdu->wait_prev = smb2->waitqueue_tail;
+        if (smb2->waitqueue_tail) {
+                smb2->waitqueue_tail->next = pdu;
+        } else {
+                smb2->waitqueue = pdu;
+        }
+        smb2->waitqueue_tail = pdu;
+
+        pdu->wait_hnext = NULL;
+        for (b = smb2_wait_bucket(smb2, pdu->header.message_id); *b;
+             b = &(*b)->wait_hnext) {
+                ;
+        }
+        *b = pdu;
+        pdu->waiting = 1;
+}
+
+/* Unlink a pdu from the wait queue. Does nothing if it is not queued. */
+void
+smb2_waitqueue_remove(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **b;
+
+        if (!pdu->waiting) {
+                return;
+        }
+
+        if (pdu->wait_prev) {
+                pdu->wait_prev->next = pdu->next;
+        } else {
+                smb2->waitqueue = pdu->next;
+        }
+        if (pdu->next) {
+                pdu->next->wait_prev = pdu->wait_prev;
+        } else {
+                smb2->waitqueue_tail = pdu->wait_prev;
+        }
+
+        for (b = smb2_wait_bucket(smb2, pdu->header.message_id); *b;
+             b = &(*b)->wait_hnext) {
+                if (*b == pdu) {
+                        *b = pdu->wait_hnext;
+                        break;
+                }
+        }
+
+        pdu->next = NULL;
+        pdu->wait_prev = NULL;
+        pdu->wait_hnext = NULL;
+        pdu->waiting = 0;
+}
+
 struct smb2_pdu *
 smb2_find_pdu(struct smb2_context *smb2,
               uint64_t message_id) {
         struct smb2_pdu *pdu;
 
-        for (pdu = smb2->waitqueue; pdu; pdu = pdu->next) {
+        for (pdu = *smb2_wait_bucket(smb2, message_id); pdu;
+             pdu = pdu->wait_hnext) {
                 if (pdu->header.message_id == message_id) {
                         break;
                 }
@@ -1127,33 +1285,385 @@ smb2_process_payload_variable(struct smb2_context *smb2, struct smb2_pdu *pdu)
         }
 }
 
-void smb2_timeout_pdus(struct smb2_context *smb2)
+/* Have the server stop working on a request that is on the wire. The
+ * CANCEL goes out ahead of requests that wait for credits: it is charged
+ * no credit, reuses the message id of the request and gets no reply.
+ */
+static int
+smb2_send_cancel(struct smb2_context *smb2, struct smb2_pdu *req)
 {
-        struct smb2_pdu *pdu, *next;
-        time_t t = time(NULL);
+        struct smb2_pdu *pdu;
+        struct smb2_iovec *iov;
+        uint8_t *buf;
+
+        pdu = smb2_allocate_pdu(smb2, SMB2_CANCEL, NULL, NULL);
+        if (pdu == NULL) {
+                return -1;
+        }
+        smb2_timer_clear(smb2, pdu);
+        buf = smb2_pool_alloc(smb2, SMB2_CANCEL_REQUEST_SIZE);
+        if (buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate cancel buffer");
+                smb2_free_pdu(smb2, pdu);
+                return -1;
+        }
+        iov = smb2_add_iovector(smb2, &pdu->out, buf,
+                                SMB2_CANCEL_REQUEST_SIZE, smb2_pool_free);
+        if (iov == NULL || smb2_pad_to_64bit(smb2, &pdu->out) != 0) {
+                smb2_free_pdu(smb2, pdu);
+                return -1;
+        }
+        smb2_set_uint16(iov, 0, SMB2_CANCEL_REQUEST_SIZE);
+
+        pdu->header.credit_charge = 0;
+        pdu->header.credit_request_response = 0;
+        pdu->header.message_id = req->header.message_id;
+        if (req->async_id) {
+                pdu->header.flags |= SMB2_FLAGS_ASYNC_COMMAND;
+                pdu->header.async.async_id = req->async_id;
+        } else {
+                pdu->header.sync.tree_id = req->header.sync.tree_id;
+        }
+        smb2_encode_header(smb2, &pdu->out.iov[0], &pdu->header);
+        if (smb2->sign && smb2_pdu_add_signature(smb2, pdu) < 0) {
+                smb2_free_pdu(smb2, pdu);
+                return -1;
+        }
+        smb3_encrypt_pdu(smb2, pdu);
 
-        pdu = smb2->outqueue;
-        while (pdu) {
+        /* Behind a PDU that is partly written, else first */
+        if (smb2->outqueue != NULL && smb2->outqueue->out.num_done) {
+                pdu->next = smb2->outqueue->next;
+                smb2->outqueue->next = pdu;
+        } else {
+                SMB2_LIST_ADD(&smb2->outqueue, pdu);
+        }
+        return 0;
+}
+
+/* A READ that has not been written yet already holds its message ids and
+ * its signature covers them, so it still goes out, asking for 0 bytes.
+ */
+static void
+smb2_shrink_read(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        if (pdu->header.command != SMB2_READ || pdu->out.num_done ||
+            pdu->next_compound != NULL || pdu->seal || pdu->out.niov < 2) {
+                return;
+        }
+        smb2_set_uint32(&pdu->out.iov[1], 4, 0);
+        smb2_set_uint32(&pdu->out.iov[1], 32, 0);
+        if (pdu->header.flags & SMB2_FLAGS_SIGNED) {
+                smb2_pdu_add_signature(smb2, pdu);
+        }
+}
+
+static int
+smb2_cancel_match(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                  void *cb_data)
+{
+        if (pdu->owner != cb_data || pdu->cancelled ||
+            pdu->caller_frees_pdu || pdu->header.command == SMB2_CANCEL) {
+                return 0;
+        }
+        /* A sealed READ reply being received into the application
+         * buffer can not be redirected. Let it complete.
+         */
+        if (smb2->enc_data != NULL && pdu->in.niov &&
+            smb2->enc_data == pdu->in.iov[0].buf) {
+                return 0;
+        }
+        return 1;
+}
+
+/* Invoke the callback of a cancelled request, or one whose deadline
+ * passed. It is never invoked again.
+ */
+static void
+smb2_cancel_complete(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                     uint32_t status)
+{
+        smb2_command_cb cb = pdu->cb;
+
+        pdu->cb = NULL;
+        smb2_timer_clear(smb2, pdu);
+        if (status == SMB2_STATUS_CANCELLED) {
+                smb2->cancelled_pdus++;
+        } else {
+                smb2->expired_pdus++;
+        }
+        if (cb) {
+                cb(smb2, status, NULL, pdu->cb_data);
+        }
+}
+
+int
+smb2_cancel_async(struct smb2_context *smb2, void *cb_data)
+{
+        struct smb2_pdu *pdu, *p, *next, *sent = NULL;
+        struct smb2_pdu *current = NULL;
+        int count = 0;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (smb2_is_server(smb2)) {
+                smb2_set_error(smb2, "Can not cancel requests of a server");
+                return -EINVAL;
+        }
+
+        /* Mark everything first. Callbacks may queue new requests with
+         * the same cb_data, those are not cancelled.
+         */
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                for (p = pdu; p; p = p->next_compound) {
+                        /* The data of a WRITE is still to be sent from
+                         * the application buffer.
+                         */
+                        if (p->header.command != SMB2_WRITE &&
+                            smb2_cancel_match(smb2, p, cb_data)) {
+                                p->cancelled = 1;
+                                if (p == pdu) {
+                                        smb2_shrink_read(smb2, p);
+                                }
+                        }
+                }
+        }
+        for (pdu = smb2->waitqueue; pdu; pdu = next) {
                 next = pdu->next;
-                if (pdu->timeout && pdu->timeout < t) {
-                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
-                        smb2_free_pdu(smb2, pdu);
+                if (!smb2_cancel_match(smb2, pdu, cb_data)) {
+                        continue;
+                }
+                smb2_waitqueue_remove(smb2, pdu);
+                pdu->cancelled = 1;
+                pdu->next = sent;
+                sent = pdu;
+                /* If this fails the reply is discarded all the same */
+                smb2_send_cancel(smb2, pdu);
+        }
+        if (smb2->pdu != NULL && smb2_cancel_match(smb2, smb2->pdu, cb_data) &&
+            smb2->pdu->cb != NULL && smb2_discard_current(smb2) == 0) {
+                current = smb2->pdu;
+                current->cancelled = 1;
+        }
+
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                for (p = pdu; p; p = p->next_compound) {
+                        if (p->cancelled && p->cb != NULL) {
+                                smb2_cancel_complete(smb2, p,
+                                                     SMB2_STATUS_CANCELLED);
+                                count++;
+                        }
                 }
-                pdu = next;
+        }
+        while (sent != NULL) {
+                pdu = sent;
+                sent = pdu->next;
+                pdu->next = NULL;
+                smb2_cancel_complete(smb2, pdu, SMB2_STATUS_CANCELLED);
+                smb2_free_pdu(smb2, pdu);
+                count++;
+        }
+        if (current != NULL) {
+                /* Still owned by the receive path, freed with the next
+                 * reply.
+                 */
+                smb2_cancel_complete(smb2, current,
+                                     SMB2_STATUS_CANCELLED);
+                count++;
         }
 
-        pdu = smb2->waitqueue;
-        while (pdu) {
-                next = pdu->next;
-                if (pdu->timeout && pdu->timeout < t) {
-                        SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
+        if (SMB2_VALID_SOCKET(smb2->fd) && smb2->outqueue != NULL &&
+            !smb2->cork && smb2_write_to_socket(smb2) < 0) {
+                return -1;
+        }
+        smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
+        return count;
+}
+
+/* The deadline of a request passed: fail it the way smb2_cancel_async()
+ * cancels requests. Returns -1 if it can not fail before it is on the wire,
+ * or its reply is being received into its buffer.
+ */
+static int
+smb2_expire_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *p;
+
+        if (pdu->cancelled || pdu->cb == NULL) {
+                return 0;
+        }
+        if (pdu->waiting) {
+                smb2_waitqueue_remove(smb2, pdu);
+                pdu->cancelled = 1;
+                /* If this fails the reply is discarded all the same */
+                smb2_send_cancel(smb2, pdu);
+                smb2_cancel_complete(smb2, pdu, SMB2_STATUS_IO_TIMEOUT);
+                if (!pdu->caller_frees_pdu) {
                         smb2_free_pdu(smb2, pdu);
                 }
-                pdu = next;
+                return 0;
         }
+        if (pdu->caller_frees_pdu) {
+                return -1;
+        }
+        if (pdu == smb2->pdu) {
+                if (smb2_discard_current(smb2) < 0) {
+                        return -1;
+                }
+                /* Still owned by the receive path */
+                pdu->cancelled = 1;
+                smb2_cancel_complete(smb2, pdu, SMB2_STATUS_IO_TIMEOUT);
+                return 0;
+        }
+        for (p = smb2->outqueue; p != NULL && p != pdu; p = p->next) {
+                ;
+        }
+        if (p == NULL || pdu->next_compound != NULL ||
+            pdu->header.command == SMB2_WRITE) {
+                return -1;
+        }
+        pdu->cancelled = 1;
+        smb2_shrink_read(smb2, pdu);
+        smb2_cancel_complete(smb2, pdu, SMB2_STATUS_IO_TIMEOUT);
+        return 0;
 }
 
+/* Expire the ticks of the timer wheel up to now. A callback may complete,
+ * cancel or give deadlines to any request, so each slot is walked again
+ * from its start after one was invoked.
+ */
+void
+smb2_timeout_pdus(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+        smb2_deadline_cb cb;
+        uint64_t now, tick, last;
+        int expired = 0;
+
+        now = smb2_now_ms();
+        last = now / SMB2_TIMER_TICK_MS;
+        if (smb2->ntimers == 0) {
+                smb2->timer_tick = last;
+                return;
+        }
+        tick = smb2->timer_tick;
+        if (last - tick >= SMB2_TIMER_SLOTS) {
+                tick = last - SMB2_TIMER_SLOTS + 1;
+        }
+        for (; tick <= last; tick++) {
+                smb2->timer_tick = tick;
+                pdu = smb2->timers[tick % SMB2_TIMER_SLOTS];
+                while (pdu != NULL) {
+                        if (pdu->timer_at > now) {
+                                pdu = pdu->timer_next;
+                                continue;
+                        }
+                        if (pdu->notify_at && pdu->notify_at <= now) {
+                                cb = pdu->notify_cb;
+                                pdu->notify_at = 0;
+                                pdu->notify_cb = NULL;
+                                smb2_timer_arm(smb2, pdu);
+                                cb(smb2, pdu->owner);
+                        } else if (smb2_expire_pdu(smb2, pdu) == 0) {
+                                expired = 1;
+                        } else {
+                                /* Look again on the next tick */
+                                pdu->expires = now + SMB2_TIMER_TICK_MS;
+                                smb2_timer_arm(smb2, pdu);
+                        }
+                        pdu = smb2->timers[tick % SMB2_TIMER_SLOTS];
+                }
+        }
+        if (expired && SMB2_VALID_SOCKET(smb2->fd)) {
+                /* For the CANCELs */
+                smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
+        }
+}
+
+static int
+smb2_deadline_match(struct smb2_pdu *pdu, void *cb_data)
+{
+        return pdu->owner == cb_data && !pdu->cancelled && pdu->cb != NULL &&
+                pdu->header.command != SMB2_CANCEL;
+}
+
+static void
+smb2_set_deadline(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                  uint64_t at, smb2_deadline_cb cb)
+{
+        if (cb) {
+                pdu->notify_at = at;
+                pdu->notify_cb = cb;
+        } else {
+                pdu->expires = at;
+        }
+        smb2_timer_arm(smb2, pdu);
+}
+
+int
+smb2_set_deadline_async(struct smb2_context *smb2, void *cb_data,
+                        uint32_t ms, smb2_deadline_cb cb)
+{
+        struct smb2_pdu *pdu, *p;
+        uint64_t at;
+        int count = 0;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (smb2_is_server(smb2)) {
+                smb2_set_error(smb2, "Can not set deadlines for requests "
+                               "of a server");
+                return -EINVAL;
+        }
+
+        at = smb2_now_ms() + ms;
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                for (p = pdu; p; p = p->next_compound) {
+                        if (smb2_deadline_match(p, cb_data)) {
+                                smb2_set_deadline(smb2, p, at, cb);
+                                count++;
+                        }
+                }
+        }
+        for (pdu = smb2->waitqueue; pdu; pdu = pdu->next) {
+                if (smb2_deadline_match(pdu, cb_data)) {
+                        smb2_set_deadline(smb2, pdu, at, cb);
+                        count++;
+                }
+        }
+        if (smb2->pdu != NULL && !smb2->pdu->waiting &&
+            smb2_deadline_match(smb2->pdu, cb_data)) {
+                smb2_set_deadline(smb2, smb2->pdu, at, cb);
+                count++;
+        }
+        return count;
+}
+
+int
+smb2_next_deadline(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+        uint64_t now, next = 0;
+        int i;
+
+        if (smb2 == NULL || smb2->ntimers == 0) {
+                return -1;
+        }
+        for (i = 0; i < SMB2_TIMER_SLOTS; i++) {
+                for (pdu = smb2->timers[i]; pdu; pdu = pdu->timer_next) {
+                        if (next == 0 || pdu->timer_at < next) {
+                                next = pdu->timer_at;
+                        }
+                }
+        }
+        now = smb2_now_ms();
+        if (next <= now) {
+                return 0;
+        }
+        if (next - now > INT_MAX) {
+                return INT_MAX;
+        }
+        return (int)(next - now);
+}
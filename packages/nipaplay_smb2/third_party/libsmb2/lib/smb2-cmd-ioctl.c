@@ -53,6 +53,7 @@
 
 #include "smb2.h"
 #include "libsmb2.h"
+#include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 
 static int
@@ -130,6 +131,7 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
         int len;
         uint8_t *buf;
         struct smb2_iovec *iov, *ioctlv;
+        int iov_idx;
 
         len = SMB2_IOCTL_REPLY_SIZE & 0xfffffffe;
         buf = calloc(len, sizeof(uint8_t));
@@ -142,6 +144,7 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
         if (iov == NULL) {
                 return -1;
         }
+        iov_idx = pdu->out.niov - 1;
 
         ioctlv = NULL;
         if (rep->output_count) {
@@ -201,6 +204,8 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
                 }
         }
 
+        /* Adding the output may have moved the vector array */
+        iov = &pdu->out.iov[iov_idx];
         smb2_set_uint16(iov, 0, SMB2_IOCTL_REPLY_SIZE);
         smb2_set_uint32(iov, 4, rep->ctl_code);
         memcpy(iov->buf + 8, rep->file_id, SMB2_FD_SIZE);
@@ -301,6 +306,75 @@ smb2_process_ioctl_fixed(struct smb2_context *smb2,
         return IOV_OFFSET + PAD_TO_64BIT(rep->input_count) + rep->output_count;
 }
 
+/* Decodes the NETWORK_INTERFACE_INFO entries of vec into a list whose
+ * head is allocated with smb2_alloc_init() and everything else with
+ * smb2_alloc_data() on it. Addresses of other families are skipped, so
+ * the list may be empty.
+ */
+static int
+smb2_decode_network_interface_info(struct smb2_context *smb2,
+                                   struct smb2_iovec *vec,
+                                   struct smb2_network_interface_info **out)
+{
+        struct smb2_network_interface_info *head = NULL, **tail = &head;
+        struct smb2_network_interface_info *info;
+        uint32_t pos = 0, next;
+        uint16_t family;
+
+        for (;;) {
+                if (pos + SMB2_NETWORK_INTERFACE_INFO_SIZE > vec->len) {
+                        smb2_set_error(smb2, "Network interface info "
+                                       "beyond end of ioctl output");
+                        goto err;
+                }
+                smb2_get_uint32(vec, pos, &next);
+                smb2_get_uint16(vec, pos + 24, &family);
+                if (family == SMB2_NETWORK_INTERFACE_INET ||
+                    family == SMB2_NETWORK_INTERFACE_INET6) {
+                        if (head == NULL) {
+                                info = smb2_alloc_init(smb2, sizeof(*info));
+                        } else {
+                                info = smb2_alloc_data(smb2, head,
+                                                       sizeof(*info));
+                        }
+                        if (info == NULL) {
+                                smb2_set_error(smb2, "Failed to allocate "
+                                               "network interface info");
+                                goto err;
+                        }
+                        smb2_get_uint32(vec, pos + 4, &info->if_index);
+                        smb2_get_uint32(vec, pos + 8, &info->capability);
+                        smb2_get_uint64(vec, pos + 16, &info->link_speed);
+                        info->family = family;
+                        if (family == SMB2_NETWORK_INTERFACE_INET) {
+                                memcpy(info->address, &vec->buf[pos + 28], 4);
+                        } else {
+                                memcpy(info->address, &vec->buf[pos + 32], 16);
+                                smb2_get_uint32(vec, pos + 48,
+                                                &info->scope_id);
+                        }
+                        *tail = info;
+                        tail = &info->next;
+                }
+                if (next == 0) {
+                        break;
+                }
+                if (next < SMB2_NETWORK_INTERFACE_INFO_SIZE ||
+                    next > vec->len - pos) {
+                        smb2_set_error(smb2, "Bad offset to next network "
+                                       "interface info");
+                        goto err;
+                }
+                pos += next;
+        }
+        *out = head;
+        return 0;
+
+ err:
+        smb2_free_data(smb2, head);
+        return -1;
+}
+
 int
 smb2_process_ioctl_variable(struct smb2_context *smb2,
                             struct smb2_pdu *pdu)
@@ -328,6 +402,17 @@ smb2_process_ioctl_variable(struct smb2_context *smb2,
                         return -1;
                 }
                 break;
+        case SMB2_FSCTL_QUERY_NETWORK_INTERFACE_INFO:
+        {
+                struct smb2_network_interface_info *info;
+
+                vec.len = rep->output_count;
+                if (smb2_decode_network_interface_info(smb2, &vec, &info)) {
+                        return -1;
+                }
+                ptr = info;
+                break;
+        }
         default:
                 ptr = smb2_alloc_init(smb2, rep->output_count);
                 if (ptr == NULL) {
@@ -56,6 +56,7 @@
 #include "smb2.h"
 #include "libsmb2.h"
 #include "libsmb2-private.h"
+#include "smb3-seal.h"
 
 static int
 smb2_encode_preauth_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
@@ -90,14 +91,73 @@ smb2_encode_preauth_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
         return 0;
 }
 
+/* Ciphers offered by the client, most preferred first. GCM needs no
+ * serial CBC-MAC pass and the 128 bit variants need four fewer rounds.
+ */
+static const uint16_t smb2_ciphers[] = {
+        SMB2_ENCRYPTION_AES_128_GCM,
+        SMB2_ENCRYPTION_AES_128_CCM,
+        SMB2_ENCRYPTION_AES_256_GCM,
+        SMB2_ENCRYPTION_AES_256_CCM,
+};
+
+/* Signing algorithms offered by the client, most preferred first. GMAC
+ * hashes with carry-less multiplies and needs no serial AES chain.
+ */
+static const uint16_t smb2_signing_algos[] = {
+        SMB2_SIGNING_AES_GMAC,
+        SMB2_SIGNING_AES_CMAC,
+};
+
+static int
+smb2_encode_signing_context(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                            uint16_t reply_algo)
+{
+        uint8_t *buf;
+        int i, len, data_len, count;
+        struct smb2_iovec *iov;
+
+        /* A reply carries only the algorithm the server selected. */
+        count = reply_algo ? 1 :
+                (int)(sizeof(smb2_signing_algos) / sizeof(smb2_signing_algos[0]));
+        data_len = 2 + count * 2;
+        len = 8 + data_len;
+        len = PAD_TO_64BIT(len);
+        buf = malloc(len);
+        if (buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate signing context");
+                return -1;
+        }
+        memset(buf, 0, len);
+
+        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                return -1;
+        }
+        smb2_set_uint16(iov, 0, SMB2_SIGNING_CAP);
+        smb2_set_uint16(iov, 2, data_len);
+        smb2_set_uint16(iov, 8, count);
+        if (reply_algo) {
+                smb2_set_uint16(iov, 10, reply_algo);
+        } else {
+                for (i = 0; i < count; i++) {
+                        smb2_set_uint16(iov, 10 + i * 2, smb2_signing_algos[i]);
+                }
+        }
+        return 0;
+}
+
 static int
-smb2_encode_encryption_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
+smb2_encode_encryption_context(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                               int is_reply)
 {
         uint8_t *buf;
-        int len, data_len;
+        int i, len, data_len, count;
         struct smb2_iovec *iov;
 
-        data_len = PAD_TO_64BIT(4);
+        /* A reply carries only the cipher the server selected. */
+        count = is_reply ? 1 : (int)(sizeof(smb2_ciphers) / sizeof(smb2_ciphers[0]));
+        data_len = 2 + count * 2;
         len = 8 + data_len;
         len = PAD_TO_64BIT(len);
         buf = malloc(len);
@@ -113,8 +173,14 @@ smb2_encode_encryption_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
         }
         smb2_set_uint16(iov, 0, SMB2_ENCRYPTION_CAP);
         smb2_set_uint16(iov, 2, data_len);
-        smb2_set_uint16(iov, 8, 1);
-        smb2_set_uint16(iov, 10, SMB2_ENCRYPTION_AES_128_CCM);
+        smb2_set_uint16(iov, 8, count);
+        if (is_reply) {
+                smb2_set_uint16(iov, 10, smb2->cypher);
+        } else {
+                for (i = 0; i < count; i++) {
+                        smb2_set_uint16(iov, 10 + i * 2, smb2_ciphers[i]);
+                }
+        }
 
         return 0;
 }
@@ -125,7 +191,7 @@ smb2_encode_negotiate_request(struct smb2_context *smb2,
                               struct smb2_negotiate_request *req)
 {
         uint8_t *buf;
-        int i, len;
+        int i, len, iov_idx;
         struct smb2_iovec *iov;
 
         len = SMB2_NEGOTIATE_REQUEST_SIZE +
@@ -150,6 +216,7 @@ smb2_encode_negotiate_request(struct smb2_context *smb2,
                 smb2_set_error(smb2, "Failed to add iovector for negotiate request");
                 return -1;
         }
+        iov_idx = pdu->out.niov - 1;
 
         if (smb2->version == SMB2_VERSION_ANY ||
             smb2->version == SMB2_VERSION_ANY3 ||
@@ -161,12 +228,19 @@ smb2_encode_negotiate_request(struct smb2_context *smb2,
                 }
                 req->negotiate_context_count++;
 
-                if (smb2_encode_encryption_context(smb2, pdu)) {
+                if (smb2_encode_encryption_context(smb2, pdu, 0)) {
+                        return -1;
+                }
+                req->negotiate_context_count++;
+
+                if (smb2_encode_signing_context(smb2, pdu, 0)) {
                         return -1;
                 }
                 req->negotiate_context_count++;
         }
 
+        /* Adding the contexts may have moved the vector array */
+        iov = &pdu->out.iov[iov_idx];
         smb2_set_uint16(iov, 0, SMB2_NEGOTIATE_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->dialect_count);
         smb2_set_uint16(iov, 4, req->security_mode);
@@ -213,7 +287,7 @@ smb2_encode_negotiate_reply(struct smb2_context *smb2,
                               struct smb2_negotiate_reply *rep)
 {
         uint8_t *buf;
-        int len, seclen;
+        int len, seclen, iov_idx;
         struct smb2_iovec *iov;
 
         len = SMB2_NEGOTIATE_REPLY_SIZE & 0xfffe;
@@ -237,6 +311,7 @@ smb2_encode_negotiate_reply(struct smb2_context *smb2,
                 smb2_set_error(smb2, "Failed to add iovector for negotiate reply");
                 return -1;
         }
+        iov_idx = pdu->out.niov - 1;
 
         if (rep->security_buffer_length) {
                 seclen = rep->security_buffer_length;
@@ -265,12 +340,23 @@ smb2_encode_negotiate_reply(struct smb2_context *smb2,
                 }
                 rep->negotiate_context_count++;
 
-                if (smb2_encode_encryption_context(smb2, pdu)) {
+                if (smb2_encode_encryption_context(smb2, pdu, 1)) {
                         return -1;
                 }
                 rep->negotiate_context_count++;
+
+                /* Only answer a signing context the client sent */
+                if (rep->signing_algo) {
+                        if (smb2_encode_signing_context(smb2, pdu,
+                                                        rep->signing_algo)) {
+                                return -1;
+                        }
+                        rep->negotiate_context_count++;
+                }
         }
 
+        /* Adding the contexts may have moved the vector array */
+        iov = &pdu->out.iov[iov_idx];
         smb2_set_uint16(iov, 0, SMB2_NEGOTIATE_REPLY_SIZE);
         smb2_set_uint16(iov, 2, rep->security_mode);
         smb2_set_uint16(iov, 4, rep->dialect_revision);
@@ -326,7 +412,37 @@ smb2_parse_encryption_context(struct smb2_context *smb2,
                               struct smb2_iovec *iov,
                               int offset)
 {
-        smb2_get_uint16(iov, offset, &rep->cypher);
+        uint16_t count;
+
+        if (offset + 4 > (int)iov->len) {
+                smb2_set_error(smb2, "Bad len in encryption context");
+                return -1;
+        }
+        /* CipherCount is always 1 in a reply, followed by the cipher */
+        smb2_get_uint16(iov, offset, &count);
+        rep->cypher = 0;
+        if (count >= 1) {
+                smb2_get_uint16(iov, offset + 2, &rep->cypher);
+        }
+        return 0;
+}
+
+static int
+smb2_parse_signing_context(struct smb2_context *smb2,
+                           struct smb2_negotiate_reply *rep,
+                           struct smb2_iovec *iov,
+                           int offset)
+{
+        uint16_t count;
+
+        if (offset + 4 > (int)iov->len) {
+                smb2_set_error(smb2, "Bad len in signing context");
+                return -1;
+        }
+        smb2_get_uint16(iov, offset, &count);
+        if (count >= 1) {
+                smb2_get_uint16(iov, offset + 2, &rep->signing_algo);
+        }
         return 0;
 }
 
@@ -356,6 +472,11 @@ smb2_parse_negotiate_contexts(struct smb2_context *smb2,
                         }
                         break;
                 case SMB2_SIGNING_CAP:
+                        if (smb2_parse_signing_context(smb2, rep,
+                                                       iov, offset + 8)) {
+                                return -1;
+                        }
+                        break;
                 case SMB2_COMPRESSION_CAP:
                 case SMB2_NETNAME_NEGOTIATE_CONTEXT_ID:
                 case SMB2_TRANSPORT_CAP:
@@ -398,6 +519,10 @@ smb2_process_negotiate_fixed(struct smb2_context *smb2,
 
         pdu->payload = rep;
 
+        /* Only filled in by negotiate contexts */
+        rep->cypher = 0;
+        rep->signing_algo = SMB2_SIGNING_HMAC_SHA256;
+
         smb2_get_uint16(iov, 2, &rep->security_mode);
         smb2_get_uint16(iov, 4, &rep->dialect_revision);
         memcpy(rep->server_guid, iov->buf + 8, SMB2_GUID_SIZE);
@@ -536,6 +661,49 @@ smb2_parse_encryption_request_context(struct smb2_context *smb2,
                               struct smb2_iovec *iov,
                               int offset, int len)
 {
+        uint16_t count, cypher;
+        int i;
+
+        /* Pick the first cipher in the client's order that we support */
+        smb2->cypher = 0;
+        if (len < 2 || offset + len > (int)iov->len) {
+                return 0;
+        }
+        smb2_get_uint16(iov, offset, &count);
+        for (i = 0; i < count && 2 + (i + 1) * 2 <= len; i++) {
+                smb2_get_uint16(iov, offset + 2 + i * 2, &cypher);
+                if (smb3_cipher_key_size(cypher)) {
+                        smb2->cypher = cypher;
+                        break;
+                }
+        }
+        return 0;
+}
+
+static int
+smb2_parse_signing_request_context(struct smb2_context *smb2,
+                              struct smb2_negotiate_request *req,
+                              struct smb2_iovec *iov,
+                              int offset, int len)
+{
+        uint16_t count, algo;
+        int i;
+
+        /* Pick the first algorithm in the client's order that we support.
+         * Left at 0 when there is none, and then no context is returned.
+         */
+        if (len < 2 || offset + len > (int)iov->len) {
+                return 0;
+        }
+        smb2_get_uint16(iov, offset, &count);
+        for (i = 0; i < count && 2 + (i + 1) * 2 <= len; i++) {
+                smb2_get_uint16(iov, offset + 2 + i * 2, &algo);
+                if (algo == SMB2_SIGNING_AES_GMAC ||
+                    algo == SMB2_SIGNING_AES_CMAC) {
+                        smb2->signing_algo = algo;
+                        break;
+                }
+        }
         return 0;
 }
 
@@ -560,6 +728,7 @@ smb2_parse_negotiate_request_contexts(struct smb2_context *smb2,
 {
         uint16_t type, len;
 
+        smb2->signing_algo = SMB2_SIGNING_HMAC_SHA256;
         while (count--) {
                 smb2_get_uint16(iov, offset, &type);
                 smb2_get_uint16(iov, offset + 2, &len);
@@ -584,6 +753,11 @@ smb2_parse_negotiate_request_contexts(struct smb2_context *smb2,
                         }
                         break;
                 case SMB2_SIGNING_CAP:
+                        if (smb2_parse_signing_request_context(smb2, req,
+                                                          iov, offset + 8, len)) {
+                                return -1;
+                        }
+                        break;
                 case SMB2_COMPRESSION_CAP:
                 case SMB2_TRANSPORT_CAP:
                 case SMB2_RDMA_TRANSFORM_CAP:
@@ -356,11 +356,11 @@ smb2_encode_lease_break_notification(struct smb2_context *smb2,
         smb2_set_uint16(iov, 2, req->new_epoch);
         smb2_set_uint32(iov, 4, req->flags);
         memcpy(iov->buf + 8, req->lease_key, SMB2_LEASE_KEY_SIZE);
-        smb2_set_uint32(iov, 4, req->current_lease_state);
-        smb2_set_uint32(iov, 4, req->new_lease_state);
-        smb2_set_uint32(iov, 4, req->break_reason);
-        smb2_set_uint32(iov, 4, req->access_mask_hint);
-        smb2_set_uint32(iov, 4, req->share_mask_hint);
+        smb2_set_uint32(iov, 24, req->current_lease_state);
+        smb2_set_uint32(iov, 28, req->new_lease_state);
+        smb2_set_uint32(iov, 32, req->break_reason);
+        smb2_set_uint32(iov, 36, req->access_mask_hint);
+        smb2_set_uint32(iov, 40, req->share_mask_hint);
 
         return 0;
 }
@@ -135,6 +135,7 @@ smb2_encode_query_info_reply(struct smb2_context *smb2,
         uint8_t *buf;
         struct smb2_iovec *iov, *cmdiov;
         uint32_t created_output_buffer_length;
+        int cmdiov_idx;
 
         len = SMB2_QUERY_INFO_REPLY_SIZE & 0xfffe;
         buf = calloc(len, sizeof(uint8_t));
@@ -153,6 +154,7 @@ smb2_encode_query_info_reply(struct smb2_context *smb2,
                 smb2_set_error(smb2, "Failed to add iovector for query-info reply header");
                 return -1;
         }
+        cmdiov_idx = pdu->out.niov - 1;
 
         smb2_set_uint16(cmdiov, 0, SMB2_QUERY_INFO_REPLY_SIZE);
         smb2_set_uint16(cmdiov, 2, rep->output_buffer_offset);
@@ -329,6 +331,8 @@ smb2_encode_query_info_reply(struct smb2_context *smb2,
                 }
         }
 
+        /* Adding the output may have moved the vector array */
+        cmdiov = &pdu->out.iov[cmdiov_idx];
         smb2_set_uint32(cmdiov, 4, rep->output_buffer_length);
         return 0;
 }
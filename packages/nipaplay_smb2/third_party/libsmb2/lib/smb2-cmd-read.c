@@ -65,13 +65,13 @@ smb2_encode_read_request(struct smb2_context *smb2,
         struct smb2_iovec *iov;
 
         len = SMB2_READ_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
+        buf = smb2_pool_alloc(smb2, len);
         if (buf == NULL) {
                 smb2_set_error(smb2, "Failed to allocate read buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, smb2_pool_free);
         if (iov == NULL) {
                 return -1;
         }
@@ -260,12 +260,13 @@ smb2_process_read_fixed(struct smb2_context *smb2,
                 return -1;
         }
 
-        rep = malloc(sizeof(*rep));
+        rep = smb2_pool_alloc(smb2, sizeof(*rep));
         if (rep == NULL) {
                 smb2_set_error(smb2, "Failed to allocate read reply");
                 return -1;
         }
         pdu->payload = rep;
+        pdu->pooled_payload = 1;
 
         smb2_get_uint8(iov, 2, &rep->data_offset);
         smb2_get_uint32(iov, 4, &rep->data_length);
@@ -281,7 +282,7 @@ smb2_process_read_fixed(struct smb2_context *smb2,
                                "Expected %d, got %d",
                                SMB2_HEADER_SIZE + 16, rep->data_offset);
                 pdu->payload = NULL;
-                free(rep);
+                smb2_pool_free(rep);
                 return -1;
         }
 
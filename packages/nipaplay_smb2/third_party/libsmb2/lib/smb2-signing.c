@@ -63,6 +63,7 @@
 #define CBC 1
 
 #include "aes.h"
+#include "aes_gcm.h"
 #include "sha.h"
 #include "sha-private.h"
 
@@ -100,7 +101,7 @@ void aes_cmac_xor(
 
 static
 void aes_cmac_sub_keys(
-    uint8_t key[AES128_KEY_LEN],
+    const struct aes_key *key,
     uint8_t sub_key1[AES128_KEY_LEN],
     uint8_t sub_key2[AES128_KEY_LEN]
     )
@@ -108,7 +109,7 @@ void aes_cmac_sub_keys(
         uint8_t zero[AES128_KEY_LEN] = {0};
         static const uint8_t rb[AES128_KEY_LEN] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x87};
 
-        AES128_ECB_encrypt(zero, key, sub_key1);
+        aes_encrypt_block(key, zero, sub_key1);
         if (aes_cmac_shift_left(sub_key1)) {
                 aes_cmac_xor(sub_key1, rb);
         }
@@ -120,85 +121,146 @@ void aes_cmac_sub_keys(
         }
 }
 
-void smb3_aes_cmac_128(uint8_t key[AES128_KEY_LEN],
+/* AES-CMAC over data that arrives in pieces. The last block is held
+ * back until final, since it is mixed with a subkey that depends on
+ * whether it is complete.
+ */
+struct aes_cmac_ctx {
+        const struct aes_key *key;
+        uint8_t mac[AES_BLOCK_SIZE];
+        uint8_t buf[AES_BLOCK_SIZE];
+        size_t buf_len;
+};
+
+static void
+aes_cmac_init(struct aes_cmac_ctx *ctx, const struct aes_key *key)
+{
+        ctx->key = key;
+        memset(ctx->mac, 0, AES_BLOCK_SIZE);
+        ctx->buf_len = 0;
+}
+
+static void
+aes_cmac_update(struct aes_cmac_ctx *ctx, const uint8_t *msg, size_t len)
+{
+        size_t n;
+
+        if (len == 0) {
+                return;
+        }
+        if (ctx->buf_len) {
+                n = MIN(AES_BLOCK_SIZE - ctx->buf_len, len);
+                memcpy(&ctx->buf[ctx->buf_len], msg, n);
+                ctx->buf_len += n;
+                msg += n;
+                len -= n;
+                if (len == 0) {
+                        return;
+                }
+                aes_cmac_xor(ctx->mac, ctx->buf);
+                aes_encrypt_block(ctx->key, ctx->mac, ctx->mac);
+                ctx->buf_len = 0;
+        }
+        /* Hash straight from the caller's buffer, keeping at least one
+         * byte back for final.
+         */
+        while (len > AES_BLOCK_SIZE) {
+                aes_cmac_xor(ctx->mac, msg);
+                aes_encrypt_block(ctx->key, ctx->mac, ctx->mac);
+                msg += AES_BLOCK_SIZE;
+                len -= AES_BLOCK_SIZE;
+        }
+        memcpy(ctx->buf, msg, len);
+        ctx->buf_len = len;
+}
+
+static void
+aes_cmac_final(struct aes_cmac_ctx *ctx, uint8_t mac[AES_BLOCK_SIZE])
+{
+        uint8_t sub_key1[AES128_KEY_LEN] = {0};
+        uint8_t sub_key2[AES128_KEY_LEN] = {0};
+
+        aes_cmac_sub_keys(ctx->key, sub_key1, sub_key2);
+
+        if (ctx->buf_len == AES_BLOCK_SIZE) {
+                aes_cmac_xor(ctx->buf, sub_key1);
+        } else {
+                ctx->buf[ctx->buf_len] = 0x80;
+                memset(&ctx->buf[ctx->buf_len + 1], 0,
+                       AES_BLOCK_SIZE - (ctx->buf_len + 1));
+                aes_cmac_xor(ctx->buf, sub_key2);
+        }
+
+        aes_cmac_xor(ctx->mac, ctx->buf);
+        aes_encrypt_block(ctx->key, ctx->mac, mac);
+}
+
+void smb3_aes_cmac_128(const struct aes_key *key,
                    uint8_t * msg,
                    uint64_t msg_len,
                    uint8_t mac[AES128_KEY_LEN]
                   )
 {
-        uint8_t sub_key1[AES128_KEY_LEN] = {0};
-        uint8_t sub_key2[AES128_KEY_LEN] = {0};
-        uint8_t scratch[AES128_KEY_LEN] = {0};
-        uint64_t n = (msg_len + AES128_KEY_LEN - 1) / AES128_KEY_LEN;
-        uint64_t rem = msg_len % AES128_KEY_LEN;
-        uint64_t i = 0;
-        int is_last_block_complete = n != 0 && rem == 0;
-
-        if (n == 0) {
-                n = 1;
-        }
+        struct aes_cmac_ctx ctx;
 
-        aes_cmac_sub_keys(key, sub_key1, sub_key2);
+        aes_cmac_init(&ctx, key);
+        aes_cmac_update(&ctx, msg, (size_t)msg_len);
+        aes_cmac_final(&ctx, mac);
+}
 
-        memset(mac, 0, AES128_KEY_LEN);
+/* MS-SMB2 3.1.4.1: the AES-GMAC nonce is the MessageId followed by a
+ * word whose bit 0 is set for server responses and bit 1 for CANCEL.
+ */
+static void
+smb3_gmac_nonce(const uint8_t *hdr, uint8_t nonce[12])
+{
+        uint16_t command = hdr[12] | (hdr[13] << 8);
 
-        for (i = 0; i < n - 1; i++) {
-                aes_cmac_xor(mac, &msg[i*AES128_KEY_LEN]);
-                AES128_ECB_encrypt(mac, key, scratch);
-                memcpy(mac, scratch, AES128_KEY_LEN);
+        memcpy(&nonce[0], &hdr[24], 8);
+        memset(&nonce[8], 0, 4);
+        if (hdr[16] & SMB2_FLAGS_SERVER_TO_REDIR) {
+                nonce[8] |= 0x01;
         }
-
-        if (is_last_block_complete) {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], AES128_KEY_LEN);
-                aes_cmac_xor(scratch, sub_key1);
-        } else {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], (size_t)rem);
-                scratch[rem] = 0x80;
-                memset(&scratch[rem + 1], 0, AES128_KEY_LEN - ((size_t)rem + 1));
-                aes_cmac_xor(scratch, sub_key2);
+        if (command == SMB2_CANCEL) {
+                nonce[8] |= 0x02;
         }
-
-        aes_cmac_xor(mac, scratch);
-        AES128_ECB_encrypt(mac, key, scratch);
-        memcpy(mac, scratch, AES128_KEY_LEN);
 }
 
+/* The iovecs are hashed where they are, so signing and verifying a
+ * multi-megabyte READ or WRITE never allocates or copies the payload.
+ */
 int
 smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
                     struct smb2_iovec *iov, size_t niov)
 
 {
+        size_t i;
+
         /* Clear the smb2 header signature field field */
         memset(iov[0].buf + 48, 0, 16);
 
-        if (smb2->dialect > SMB2_VERSION_0210) {
-                size_t i = 0;
-                size_t len = 0, offset = 0;
-                uint8_t aes_mac[AES_BLOCK_SIZE];
-                /* combine the buffers into one */
-                uint8_t *msg = NULL;
+        if (smb2->signing_algo == SMB2_SIGNING_AES_GMAC) {
+                struct aes_gmac_ctx ctx;
+                uint8_t nonce[12];
 
-                for (i=0; i < niov; i++) {
-                        len += iov[i].len;
-                }
-                msg = (uint8_t *) malloc(len);
-                if (msg == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate buffer for "
-                                       "signature calculation");
-                        return -1;
+                smb3_gmac_nonce(iov[0].buf, nonce);
+                aes_gmac_init(&ctx, &smb2->signing_aes,
+                              &smb2->signing_ghash, nonce);
+                for (i = 0; i < niov; i++) {
+                        aes_gmac_update(&ctx, iov[i].buf, iov[i].len);
                 }
+                aes_gmac_final(&ctx, signature);
+        } else if (smb2->signing_algo == SMB2_SIGNING_AES_CMAC) {
+                struct aes_cmac_ctx ctx;
 
-                for (i=0; i < niov; i++) {
-                        memcpy(msg + offset, iov[i].buf, iov[i].len);
-                        offset += iov[i].len;
+                aes_cmac_init(&ctx, &smb2->signing_aes);
+                for (i = 0; i < niov; i++) {
+                        aes_cmac_update(&ctx, iov[i].buf, iov[i].len);
                 }
-                smb3_aes_cmac_128(smb2->signing_key, msg, offset, aes_mac);
-                free(msg);
-                memcpy(&signature[0], aes_mac, SMB2_SIGNATURE_SIZE);
+                aes_cmac_final(&ctx, signature);
         } else {
                 HMACContext ctx;
                 uint8_t digest[USHAMaxHashSize];
-                size_t i;
 
                 hmacReset(&ctx, SHA256, &smb2->signing_key[0], SMB2_KEY_SIZE);
                 for (i=0; i < niov; i++) {
@@ -221,7 +283,11 @@ smb2_pdu_add_signature(struct smb2_context *smb2,
         struct smb2_iovec *iov = NULL;
         int niov;
 
-        if (pdu->header.command == SMB2_SESSION_SETUP) {
+        if (pdu->header.command == SMB2_NEGOTIATE) {
+                /* a channel being bound already has a session id */
+                return 0;
+        }
+        if (pdu->header.command == SMB2_SESSION_SETUP && !smb2->binding) {
                 /* the first session setup response with ok status
                  * is the first signed message
                  */
@@ -242,7 +308,8 @@ smb2_pdu_add_signature(struct smb2_context *smb2,
         if (smb2->session_id == 0) {
                 return 0; /* DO NOT sign the PDU if session id is 0 */
         }
-        if (smb2->session_key_size == 0) {
+        if (smb2->session_key_size == 0 && !smb2->binding) {
+                /* binding signs with the key of the session */
                 return -1;
         }
 
@@ -58,6 +58,7 @@
 #include "portable-endian.h"
 
 #include "aes128ccm.h"
+#include "aes_gcm.h"
 #include "slist.h"
 #include "smb2.h"
 #include "libsmb2.h"
@@ -67,13 +68,52 @@
 
 static const char xfer[4] = {0xFD, 'S', 'M', 'B'};
 
+int
+smb3_cipher_key_size(uint16_t cypher)
+{
+        switch (cypher) {
+        case SMB2_ENCRYPTION_AES_128_CCM:
+        case SMB2_ENCRYPTION_AES_128_GCM:
+                return 16;
+        case SMB2_ENCRYPTION_AES_256_CCM:
+        case SMB2_ENCRYPTION_AES_256_GCM:
+                return 32;
+        }
+        return 0;
+}
+
+static int
+smb3_cipher_is_gcm(uint16_t cypher)
+{
+        return cypher == SMB2_ENCRYPTION_AES_128_GCM ||
+                cypher == SMB2_ENCRYPTION_AES_256_GCM;
+}
+
+/* ServerIn protects client to server traffic and ServerOut the other
+ * direction, so a server swaps them.
+ */
+static void
+smb3_seal_keys(struct smb2_context *smb2, int out,
+               const struct aes_key **key, const struct ghash_key **gkey)
+{
+        if (out == !smb2_is_server(smb2)) {
+                *key = &smb2->serverin_aes;
+                *gkey = &smb2->serverin_ghash;
+        } else {
+                *key = &smb2->serverout_aes;
+                *gkey = &smb2->serverout_ghash;
+        }
+}
+
 int
 smb3_encrypt_pdu(struct smb2_context *smb2,
                  struct smb2_pdu *pdu)
 {
         struct smb2_pdu *tmp_pdu;
+        const struct aes_key *key;
+        const struct ghash_key *gkey;
         uint32_t spl, u32;
-        int i;
+        int i, nonce_len;
         uint16_t u16;
 
         if (!smb2->seal) {
@@ -89,14 +129,18 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
                         spl += (uint32_t)tmp_pdu->out.iov[i].len;
                 }
         }
-        pdu->crypt = calloc(spl, sizeof(uint8_t));
+        pdu->crypt = smb2_pool_alloc(smb2, spl);
         if (pdu->crypt == NULL) {
                 pdu->seal = 0;
                 return -1;
         }
 
+        /* GCM takes a 12 byte nonce, CCM 11. The rest of the 16 byte
+         * field stays zero.
+         */
+        nonce_len = smb3_cipher_is_gcm(smb2->cypher) ? 12 : 11;
         memcpy(&pdu->crypt[0], xfer, 4);
-        for (i = 20; i < 31; i++) {
+        for (i = 20; i < 20 + nonce_len; i++) {
                 pdu->crypt[i] = random()&0xff;
         }
         u32 = htole32(spl - 52);
@@ -114,31 +158,129 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
                 }
         }
 
-        aes128ccm_encrypt(smb2->serverin_key,
-                          &pdu->crypt[20], 11,
-                          &pdu->crypt[20], 32,
-                          &pdu->crypt[52], spl - 52,
-                          &pdu->crypt[4], 16);
+        smb3_seal_keys(smb2, 1, &key, &gkey);
+        if (nonce_len == 12) {
+                aes_gcm_encrypt(key, gkey,
+                                &pdu->crypt[20],
+                                &pdu->crypt[20], 32,
+                                &pdu->crypt[52], spl - 52,
+                                &pdu->crypt[4], 16);
+        } else {
+                aes_ccm_encrypt(key,
+                                &pdu->crypt[20], 11,
+                                &pdu->crypt[20], 32,
+                                &pdu->crypt[52], spl - 52,
+                                &pdu->crypt[4], 16);
+        }
         pdu->crypt_len = spl;
 
         return 0;
 }
 
+struct smb3_decrypt_ctx {
+        int gcm;
+        union {
+                struct aes_ccm_ctx ccm;
+                struct aes_gcm_ctx gcm;
+        } u;
+};
+
+static void
+smb3_decrypt_init(struct smb2_context *smb2, struct smb3_decrypt_ctx *ctx,
+                  uint8_t *trfm)
+{
+        const struct aes_key *key;
+        const struct ghash_key *gkey;
+        uint32_t plen;
+
+        smb3_seal_keys(smb2, 0, &key, &gkey);
+        ctx->gcm = smb3_cipher_is_gcm(smb2->cypher);
+        if (ctx->gcm) {
+                aes_gcm_decrypt_init(&ctx->u.gcm, key, gkey,
+                                     &trfm[20], &trfm[20], 32);
+        } else {
+                /* OriginalMessageSize, which CCM needs for B0 */
+                memcpy(&plen, &trfm[36], 4);
+                aes_ccm_decrypt_init(&ctx->u.ccm, key,
+                                     &trfm[20], 11, &trfm[20], 32,
+                                     le32toh(plen), 16);
+        }
+}
+
+static void
+smb3_decrypt_update(struct smb3_decrypt_ctx *ctx, uint8_t *p, size_t len)
+{
+        if (ctx->gcm) {
+                aes_gcm_decrypt_update(&ctx->u.gcm, p, len);
+        } else {
+                aes_ccm_decrypt_update(&ctx->u.ccm, p, len);
+        }
+}
+
+static int
+smb3_decrypt_final(struct smb3_decrypt_ctx *ctx, uint8_t *trfm)
+{
+        if (ctx->gcm) {
+                return aes_gcm_decrypt_final(&ctx->u.gcm, &trfm[4], 16);
+        }
+        return aes_ccm_decrypt_final(&ctx->u.ccm, &trfm[4]);
+}
+
+void
+smb3_decrypt_peek(struct smb2_context *smb2, uint8_t *trfm,
+                  uint8_t *buf, size_t len)
+{
+        struct smb3_decrypt_ctx ctx;
+
+        smb3_decrypt_init(smb2, &ctx, trfm);
+        smb3_decrypt_update(&ctx, buf, len);
+}
+
+/* smb2->in holds the SPL, the transform header and then the encrypted
+ * payload in one or more vectors. For a sealed READ the payload vectors
+ * include the application's buffer, see smb2_read_data().
+ */
 int
 smb3_decrypt_pdu(struct smb2_context *smb2)
 {
-        int rc;
-
-        if (aes128ccm_decrypt(smb2->serverout_key,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[20], 11,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[20], 32,
-                              &smb2->in.iov[smb2->in.niov - 1].buf[0],
-                              smb2->in.iov[smb2->in.niov - 1].len,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[4], 16)) {
+        struct smb3_decrypt_ctx ctx;
+        uint8_t *trfm = smb2->in.iov[1].buf;
+        int i, rc;
+
+        smb3_decrypt_init(smb2, &ctx, trfm);
+        for (i = 2; i < smb2->in.niov; i++) {
+                smb3_decrypt_update(&ctx, smb2->in.iov[i].buf,
+                                    smb2->in.iov[i].len);
+        }
+        if (smb3_decrypt_final(&ctx, trfm)) {
                 smb2_set_error(smb2, "Failed to decrypt PDU");
                 return -1;
         }
 
+        if (smb2->enc_data) {
+                /* Header and padding are in trfm_buf, the data is already
+                 * in place in the application buffer.
+                 */
+                smb2->enc = smb2->trfm_buf;
+                smb2->enc_len = smb2->in.total_size - SMB2_SPL_SIZE - 52;
+                smb2->enc_pos = 0;
+                smb2_free_iovector(smb2, &smb2->in);
+
+                smb2->spl = (uint32_t)smb2->enc_len;
+                smb2->recv_state = SMB2_RECV_HEADER;
+                if (smb2_add_iovector(smb2, &smb2->in, &smb2->header[0],
+                                       SMB2_HEADER_SIZE, NULL) == NULL) {
+                        smb2_set_error(smb2, "Failed to add iovector for decrypted header");
+                        smb2->enc = NULL;
+                        smb2->enc_data = NULL;
+                        return -1;
+                }
+                rc = smb2_read_from_buf(smb2);
+                smb2->enc = NULL;
+                smb2->enc_data = NULL;
+                return rc;
+        }
+
         if (smb2->in.num_done == 0) {
                 smb2->enc = smb2->in.iov[smb2->in.niov - 1].buf;
                 smb2->enc_len = smb2->in.iov[smb2->in.niov - 1].len;
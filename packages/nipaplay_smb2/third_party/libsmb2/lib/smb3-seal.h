@@ -30,12 +30,25 @@
 extern "C" {
 #endif
 
+/* Key length in bytes for a negotiated cipher, 0 if it is not supported. */
+int
+smb3_cipher_key_size(uint16_t cypher);
+
 int
 smb3_encrypt_pdu(struct smb2_context *smb2,
                  struct smb2_pdu *pdu);
 int
 smb3_decrypt_pdu(struct smb2_context *smb2);
 
+/* Decrypt a copy of the first len bytes of a sealed payload without
+ * checking the tag, to see what the message is before the rest arrives.
+ * trfm is the 52 byte transform header. The result must not be trusted
+ * beyond choosing where to receive the rest of the message.
+ */
+void
+smb3_decrypt_peek(struct smb2_context *smb2, uint8_t *trfm,
+                  uint8_t *buf, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -110,6 +110,7 @@
 #include "libsmb2-private.h"
 #include "portable-endian.h"
 #include <errno.h>
+#include <limits.h>
 
 #define MAX_URL_SIZE 1024
 
@@ -118,6 +119,19 @@
  * Since the smb is most likely used on local network, use an aggressive
  * timeout of 100ms. */
 #define HAPPY_EYEBALLS_TIMEOUT 100
+
+/* Most vectors passed to a single readv() */
+#define SMB2_SOCKET_VECTORS 64
+
+/* Most vectors passed to a single writev(). The send path gathers every
+ * sendable PDU in the outqueue into one call, a READ request takes three
+ * or four vectors, so this is larger than for reads.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define SMB2_SEND_VECTORS IOV_MAX
+#else
+#define SMB2_SEND_VECTORS 256
+#endif
 #if !defined(HAVE_LINGER)
 struct linger
 {
@@ -161,6 +175,10 @@ smb2_get_real_credit_charge_for_one_pdu(struct smb2_context *smb2, struct smb2_h
         int credits;
 
         credits = hdr->credit_charge;
+        if (hdr->command == SMB2_CANCEL) {
+                /* Rides on the credits of the request it cancels */
+                return 0;
+        }
         if (hdr->command == SMB2_NEGOTIATE) {
                 /* Mirror the special case in smb2_allocate_pdu. */
         } else if (smb2->dialect <= SMB2_VERSION_0202) {
@@ -188,7 +206,7 @@ smb2_which_events(struct smb2_context *smb2)
 {
         int events = SMB2_VALID_SOCKET(smb2->fd) ? POLLIN : POLLOUT;
 
-        if (smb2->outqueue != NULL &&
+        if (smb2->outqueue != NULL && !smb2->cork &&
             smb2_get_credit_charge(smb2, smb2->outqueue) <= smb2->credits) {
                 events |= POLLOUT;
         }
@@ -196,6 +214,42 @@ smb2_which_events(struct smb2_context *smb2)
         return events;
 }
 
+void
+smb2_cork(struct smb2_context *smb2)
+{
+        smb2->cork++;
+}
+
+int
+smb2_uncork(struct smb2_context *smb2)
+{
+        if (smb2->cork == 0 || --smb2->cork) {
+                return 0;
+        }
+        if (smb2->outqueue == NULL || !SMB2_VALID_SOCKET(smb2->fd)) {
+                return 0;
+        }
+        if (smb2_write_to_socket(smb2) != 0) {
+                return -1;
+        }
+        smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
+        return 0;
+}
+
+int
+smb2_get_available_credits(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+        int credits = smb2->credits;
+
+        /* PDUs still waiting in the outqueue have not been charged yet. */
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                credits -= smb2_get_credit_charge(smb2, pdu);
+        }
+
+        return credits > 0 ? credits : 0;
+}
+
 t_socket smb2_get_fd(struct smb2_context *smb2)
 {
         if (SMB2_VALID_SOCKET(smb2->fd)) {
@@ -221,75 +275,169 @@ smb2_get_fds(struct smb2_context *smb2, size_t *fd_count, int *timeout)
         }
 }
 
+/* Append the part of buf past *skip to iov. Returns -1 once all max
+ * entries are used.
+ */
+static int
+smb2_fill_iovec(struct iovec *iov, int *niov, int max, size_t *skip,
+                void *buf, size_t len)
+{
+        if (*skip >= len) {
+                *skip -= len;
+                return 0;
+        }
+        if (*niov == max) {
+                return -1;
+        }
+        iov[*niov].iov_base = (char *)buf + *skip;
+#if defined(_WIN32) || defined(_XBOX)
+        iov[*niov].iov_len = (unsigned long)(len - *skip);
+#else
+        iov[*niov].iov_len = len - *skip;
+#endif
+        *skip = 0;
+        (*niov)++;
+        return 0;
+}
+
+/* Length of pdu and all PDUs compounded with it, not counting the SPL */
+static uint32_t
+smb2_pdu_spl(struct smb2_pdu *pdu)
+{
+        uint32_t spl = 0;
+        int i;
+
+        if (pdu->seal) {
+                return (uint32_t)pdu->crypt_len;
+        }
+        for (; pdu; pdu = pdu->next_compound) {
+                for (i = 0; i < pdu->out.niov; i++) {
+                        spl += (uint32_t)pdu->out.iov[i].len;
+                }
+        }
+        return spl;
+}
+
+/* Gather the SPL and the unsent part of a (compound) PDU. spl_be must stay
+ * valid until the vectors are written. Returns -1 if the vectors ran out
+ * before all of it was added.
+ */
+static int
+smb2_gather_pdu(struct iovec *iov, int *niov, uint32_t *spl_be,
+                struct smb2_pdu *pdu)
+{
+        size_t num_done = pdu->out.num_done;
+        int i;
+
+        if (smb2_fill_iovec(iov, niov, SMB2_SEND_VECTORS, &num_done,
+                            spl_be, SMB2_SPL_SIZE)) {
+                return -1;
+        }
+        if (pdu->seal) {
+                return smb2_fill_iovec(iov, niov, SMB2_SEND_VECTORS,
+                                       &num_done, pdu->crypt,
+                                       pdu->crypt_len);
+        }
+        for (; pdu; pdu = pdu->next_compound) {
+                for (i = 0; i < pdu->out.niov; i++) {
+                        if (smb2_fill_iovec(iov, niov, SMB2_SEND_VECTORS,
+                                            &num_done, pdu->out.iov[i].buf,
+                                            pdu->out.iov[i].len)) {
+                                return -1;
+                        }
+                }
+        }
+        return 0;
+}
+
+/* A (compound) PDU has been written in full. Requests move to the wait
+ * queue, replies we served are done with.
+ */
+static void
+smb2_pdu_sent(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *tmp_pdu;
+
+        while (pdu) {
+                tmp_pdu = pdu->next_compound;
+
+                /* As we have now sent all the PDUs we
+                 * can remove the chaining.
+                 * On the receive side we will treat all
+                 * PDUs as individual PDUs.
+                 */
+                pdu->next_compound = NULL;
+
+                if (!smb2_is_server(smb2)) {
+                        smb2->credits -= smb2_get_real_credit_charge_for_one_pdu(smb2, &pdu->header);
+                        if (pdu->cancelled ||
+                            pdu->header.command == SMB2_CANCEL) {
+                                /* Nobody waits for a reply. Any that
+                                 * comes is discarded.
+                                 */
+                                smb2_free_pdu(smb2, pdu);
+                        } else {
+                                /* queue requests we send to correlate
+                                 * replies with
+                                 */
+                                smb2_waitqueue_add(smb2, pdu);
+                        }
+                }
+                else {
+                        /* alway allow writing replies */
+                        smb2->credits = 128;
+                        /* no longer need this reply we've sent */
+                        smb2_free_pdu(smb2, pdu);
+                }
+                pdu = tmp_pdu;
+        }
+}
+
 int
 smb2_write_to_socket(struct smb2_context *smb2)
 {
+        struct iovec iov[SMB2_SEND_VECTORS] _U_;
+        uint32_t spl_be[SMB2_SEND_VECTORS];
         struct smb2_pdu *pdu;
+        int credits, credit_charge, niov, npdus, i;
+        ssize_t count;
+        size_t left;
 
         if (!SMB2_VALID_SOCKET(smb2->fd)) {
                 smb2_set_error(smb2, "trying to write but not connected");
                 return -1;
         }
-        while ((pdu = smb2->outqueue) != NULL) {
-                struct iovec iov[SMB2_MAX_VECTORS] _U_;
-                struct iovec *tmpiov;
-                struct smb2_pdu *tmp_pdu;
-                size_t num_done = pdu->out.num_done;
-                int i, niov = 1;
-                ssize_t count;
-                uint32_t spl = 0, tmp_spl, credit_charge;
-
-                credit_charge = smb2_get_credit_charge(smb2, pdu);
-                if (credit_charge > (uint32_t)smb2->credits) {
-                        return 0;
-                }
-
-                if (pdu->seal) {
-                        niov = 2;
-                        spl = pdu->crypt_len;
-                        iov[1].iov_base = pdu->crypt;
-                        iov[1].iov_len  = pdu->crypt_len;
-                } else {
-                        /* Copy all the vectors from all PDUs in the
-                         * compound set.
-                         */
-                        for (tmp_pdu = pdu; tmp_pdu;
-                             tmp_pdu = tmp_pdu->next_compound) {
-                                for (i = 0; i < tmp_pdu->out.niov;
-                                     i++, niov++) {
-                                        iov[niov].iov_base = tmp_pdu->out.iov[i].buf;
-#if defined(_WIN32) || defined(_XBOX)
-                                        iov[niov].iov_len = (unsigned long)tmp_pdu->out.iov[i].len;
-#else
-                                        iov[niov].iov_len = (size_t)tmp_pdu->out.iov[i].len;
-#endif
-                                        spl += (uint32_t)tmp_pdu->out.iov[i].len;
+        while (smb2->outqueue != NULL && !smb2->cork) {
+                /* Gather every PDU the credits allow into one writev().
+                 * Whatever does not fit is picked up on the next pass.
+                 */
+                credits = smb2->credits;
+                niov = 0;
+                npdus = 0;
+                for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                        credit_charge = smb2_get_credit_charge(smb2, pdu);
+                        if (credit_charge > credits) {
+                                break;
+                        }
+                        if (!smb2_is_server(smb2)) {
+                                credits -= credit_charge;
+                        }
+                        spl_be[npdus] = htobe32(smb2_pdu_spl(pdu));
+                        i = niov;
+                        if (smb2_gather_pdu(iov, &niov, &spl_be[npdus], pdu)) {
+                                if (niov > i) {
+                                        npdus++;
                                 }
+                                break;
                         }
+                        npdus++;
                 }
-
-                /* Add the SPL vector as the first vector */
-                tmp_spl = htobe32(spl);
-                iov[0].iov_base = &tmp_spl;
-                iov[0].iov_len = SMB2_SPL_SIZE;
-
-                tmpiov = iov;
-
-                /* Skip the vectors we have already written */
-                while (num_done >= tmpiov->iov_len) {
-                        num_done -= tmpiov->iov_len;
-                        tmpiov++;
-                        niov--;
+                if (npdus == 0) {
+                        return 0;
                 }
 
-                /* Adjust the first vector to send */
-                tmpiov->iov_base = (char *)tmpiov->iov_base + num_done;
-#if defined(_WIN32) || defined(_XBOX)
-                tmpiov->iov_len -= (unsigned long)num_done;
-#else
-                tmpiov->iov_len -= (size_t)num_done;
-#endif
-                count = writev(smb2->fd, tmpiov, niov);
+                count = writev(smb2->fd, iov, niov);
+                smb2->send_syscalls++;
 
                 if (count == -1) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -300,36 +448,24 @@ smb2_write_to_socket(struct smb2_context *smb2)
                                        smb2_get_error(smb2));
                         return -1;
                 }
-
-                pdu->out.num_done += (size_t)count;
-
-                if (pdu->out.num_done == SMB2_SPL_SIZE + spl) {
-                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-                        smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
-                        while (pdu) {
-                                tmp_pdu = pdu->next_compound;
-
-                                /* As we have now sent all the PDUs we
-                                 * can remove the chaining.
-                                 * On the receive side we will treat all
-                                 * PDUs as individual PDUs.
-                                 */
-                                pdu->next_compound = NULL;
-
-                                if (!smb2_is_server(smb2)) {
-                                        smb2->credits -= smb2_get_real_credit_charge_for_one_pdu(smb2, &pdu->header);
-                                        /* queue requests we send to correlate replies with */
-                                        SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
-                                }
-                                else {
-                                        /* alway allow writing replies */
-                                        smb2->credits = 128;
-                                        /* no longer need this reply we've sent */
-                                        smb2_free_pdu(smb2, pdu);
-                                }
-                                pdu = tmp_pdu;
+                smb2->send_bytes += count;
+
+                /* Hand the written bytes to the PDUs in queue order */
+                for (i = 0; i < npdus && count > 0; i++) {
+                        pdu = smb2->outqueue;
+                        left = SMB2_SPL_SIZE + be32toh(spl_be[i]) -
+                                pdu->out.num_done;
+                        if ((size_t)count < left) {
+                                pdu->out.num_done += (size_t)count;
+                                break;
                         }
+                        pdu->out.num_done += left;
+                        count -= left;
+                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
+                        smb2->send_pdus++;
+                        smb2_pdu_sent(smb2, pdu);
                 }
+                smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
         }
         return 0;
 }
@@ -337,50 +473,88 @@ smb2_write_to_socket(struct smb2_context *smb2)
 typedef ssize_t (*read_func)(struct smb2_context *smb2,
                              const struct iovec *iov, int iovcnt);
 
+/* Look at a decrypted copy of the start of a sealed message. If it is a
+ * successful, uncompounded READ reply for a request with a single
+ * application buffer, return that buffer and the length of the data so
+ * that it can be received and decrypted in place. Otherwise return NULL.
+ */
+static uint8_t *
+smb2_sealed_read_buffer(struct smb2_context *smb2, uint32_t len,
+                        uint32_t *out_length)
+{
+        uint8_t buf[SMB2_TRFM_PEEK_SIZE];
+        struct smb2_iovec iov;
+        struct smb2_pdu *pdu;
+        uint64_t message_id;
+        uint32_t status, next_command, data_length;
+        uint16_t command, struct_size;
+        uint8_t data_offset;
+
+        memcpy(buf, smb2->trfm_buf, sizeof(buf));
+        smb3_decrypt_peek(smb2, smb2->in.iov[1].buf, buf, sizeof(buf));
+
+        iov.buf = buf;
+        iov.len = sizeof(buf);
+        iov.free = NULL;
+        if (buf[0] != 0xFE || buf[1] != 'S' || buf[2] != 'M' || buf[3] != 'B') {
+                return NULL;
+        }
+        smb2_get_uint32(&iov, 8, &status);
+        smb2_get_uint16(&iov, 12, &command);
+        smb2_get_uint32(&iov, 20, &next_command);
+        smb2_get_uint64(&iov, 24, &message_id);
+        if (command != SMB2_READ || status != SMB2_STATUS_SUCCESS ||
+            next_command != 0) {
+                return NULL;
+        }
+        smb2_get_uint16(&iov, SMB2_HEADER_SIZE, &struct_size);
+        smb2_get_uint8(&iov, SMB2_HEADER_SIZE + 2, &data_offset);
+        smb2_get_uint32(&iov, SMB2_HEADER_SIZE + 4, &data_length);
+        if (struct_size != SMB2_READ_REPLY_SIZE ||
+            data_offset != SMB2_TRFM_PEEK_SIZE || data_length == 0 ||
+            data_length > len - SMB2_TRFM_PEEK_SIZE ||
+            len - SMB2_TRFM_PEEK_SIZE - data_length >
+            SMB2_TRFM_BUF_SIZE - SMB2_TRFM_PEEK_SIZE) {
+                return NULL;
+        }
+
+        pdu = smb2_find_pdu(smb2, message_id);
+        if (pdu == NULL || pdu->header.command != SMB2_READ ||
+            pdu->in.niov != 1 || pdu->in.iov[0].len < data_length) {
+                return NULL;
+        }
+        *out_length = data_length;
+        return pdu->in.iov[0].buf;
+}
+
 static int smb2_read_data(struct smb2_context *smb2, read_func func,
                           int has_xfrmhdr)
 {
-        struct iovec iov[SMB2_MAX_VECTORS] _U_;
-        struct iovec *tmpiov;
+        struct iovec iov[SMB2_SOCKET_VECTORS] _U_;
         int i, niov, is_chained;
         size_t num_done;
         size_t iov_offset = 0;
         static char smb3tfrm[4] = {0xFD, 'S', 'M', 'B'};
         struct smb2_pdu *pdu = smb2->pdu;
         ssize_t count;
+        uint32_t data_length;
         int len;
 
 read_more_data:
         num_done = smb2->in.num_done;
 
-        /* Copy all the current vectors to our work vector */
-        niov = smb2->in.niov;
-        for (i = 0; i < niov; i++) {
-                iov[i].iov_base = smb2->in.iov[i].buf;
-#if defined(_WIN32) || defined(_XBOX)
-                iov[i].iov_len = (unsigned long)smb2->in.iov[i].len;
-#else
-                iov[i].iov_len = (size_t)smb2->in.iov[i].len;
-#endif
-        }
-        tmpiov = iov;
-
-        /* Skip the vectors we have already read */
-        while (num_done >= tmpiov->iov_len) {
-                num_done -= tmpiov->iov_len;
-                tmpiov++;
-                niov--;
+        /* Build the work vector from the part not read yet */
+        niov = 0;
+        for (i = 0; i < smb2->in.niov; i++) {
+                if (smb2_fill_iovec(iov, &niov, SMB2_SOCKET_VECTORS,
+                                    &num_done, smb2->in.iov[i].buf,
+                                    smb2->in.iov[i].len)) {
+                        break;
+                }
         }
 
-        /* Adjust the first vector to read */
-        tmpiov->iov_base = (char *)tmpiov->iov_base + num_done;
-#if defined(_WIN32) || defined(_XBOX)
-        tmpiov->iov_len -= (unsigned long)num_done;
-#else
-        tmpiov->iov_len -= (size_t)num_done;
-#endif
         /* Read into our trimmed iovectors */
-        count = func(smb2, tmpiov, niov);
+        count = func(smb2, iov, niov);
         if (count < 0) {
 #if defined(_WIN32) || defined(_XBOX)
                 int err = WSAGetLastError();
@@ -423,6 +597,24 @@ read_more_data:
                         smb2->in.iov[smb2->in.niov - 1].len = 52;
                         len = smb2->spl - 52;
                         smb2->in.total_size -= 12;
+                        smb2->enc_data = NULL;
+                        if (!smb2_is_server(smb2) &&
+                            len > SMB2_TRFM_PEEK_SIZE) {
+                                /* Only receive the start of the payload for
+                                 * now, to find out where the rest goes.
+                                 */
+                                if (smb2_add_iovector(smb2, &smb2->in,
+                                                      smb2->trfm_buf,
+                                                      SMB2_TRFM_PEEK_SIZE,
+                                                      NULL) == NULL) {
+                                        smb2_set_error(smb2, "Failed to add iovector for TRFM payload");
+                                        return -1;
+                                }
+                                memcpy(smb2->trfm_buf,
+                                       &smb2->in.iov[smb2->in.niov - 2].buf[52], 12);
+                                smb2->recv_state = SMB2_RECV_TRFM_PEEK;
+                                goto read_more_data;
+                        }
                         {
                                 uint8_t *tmp = malloc(len);
                                 if (tmp == NULL) {
@@ -469,7 +661,7 @@ read_more_data:
                         while (count > 0);
 
                         /* put on wait queue so queue_pdu doesn't complain */
-                        SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                        smb2_waitqueue_add(smb2, pdu);
 
                         smb2->in.num_done = 0;
                         pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
@@ -501,6 +693,15 @@ read_more_data:
                          * We will eventually receive a proper reply for this
                          * request sometime later.
                          */
+                        if (!smb2_is_server(smb2) &&
+                            (smb2->hdr.flags & SMB2_FLAGS_ASYNC_COMMAND)) {
+                                struct smb2_pdu *req;
+
+                                req = smb2_find_pdu(smb2, smb2->hdr.message_id);
+                                if (req != NULL) {
+                                        req->async_id = smb2->hdr.async.async_id;
+                                }
+                        }
 
                         len = smb2->spl - smb2->in.num_done;
                         /* If we don't have a transform header we are reading
@@ -564,16 +765,8 @@ read_more_data:
                                                 smb2_set_error(smb2, "no matching PDU found");
                                                 return -1;
                                         }
-                                        smb2->recv_state = SMB2_RECV_UNKNOWN;
-                                        {
-                                                uint8_t *tmp = malloc(len);
-                                                if (tmp == NULL) {
-                                                        smb2_set_error(smb2, "malloc failed while adding UNKNOWN padding");
-                                                        return -1;
-                                                }
-                                                if (smb2_add_iovector(smb2, &smb2->in, tmp, len, free) == NULL) {
-                                                        return -1;
-                                                }
+                                        if (smb2_discard_recv(smb2, len)) {
+                                                return -1;
                                         }
                                         goto read_more_data;
                                 }
@@ -587,7 +780,7 @@ read_more_data:
                                         return -1;
                                 }
 
-                                SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
+                                smb2_waitqueue_remove(smb2, pdu);
                         } else {
                                 /* oplock and lease break notifications won't have a pdu so make one
                                  * oplock replies (that are NOT notifications, i.e. have a valid message_id)
@@ -613,14 +806,14 @@ read_more_data:
                 smb2->recv_state = SMB2_RECV_FIXED;
                 {
                         size_t alen = len & 0xfffe;
-                        uint8_t *tmp = malloc(alen);
+                        uint8_t *tmp = smb2_pool_alloc(smb2, alen);
                         if (tmp == NULL) {
                                 smb2_set_error(smb2, "malloc failed while adding FIXED payload");
                                 return -1;
                         }
                         if (smb2_add_iovector(smb2, &smb2->in,
                                   tmp,
-                                  alen, free) == NULL) {
+                                  alen, smb2_pool_free) == NULL) {
                                 return -1;
                         }
                 }
@@ -766,6 +959,48 @@ read_more_data:
                  * PDU. Break out of the switch and invoke the callback.
                  */
                 break;
+        case SMB2_RECV_TRFM_PEEK:
+                len = smb2->spl - 52;
+                smb2->enc_data = smb2_sealed_read_buffer(smb2, len,
+                                                         &data_length);
+                if (smb2->enc_data) {
+                        /* Receive the READ data straight into the
+                         * application buffer and any padding after it
+                         * into trfm_buf. smb3_decrypt_pdu() decrypts
+                         * all of it in place.
+                         */
+                        smb2->enc_data_off = SMB2_TRFM_PEEK_SIZE;
+                        smb2->enc_data_len = data_length;
+                        if (smb2_add_iovector(smb2, &smb2->in, smb2->enc_data,
+                                              data_length, NULL) == NULL) {
+                                smb2->enc_data = NULL;
+                                return -1;
+                        }
+                        len -= SMB2_TRFM_PEEK_SIZE + data_length;
+                        if (len > 0 &&
+                            smb2_add_iovector(smb2, &smb2->in,
+                                              &smb2->trfm_buf[SMB2_TRFM_PEEK_SIZE],
+                                              len, NULL) == NULL) {
+                                smb2->enc_data = NULL;
+                                return -1;
+                        }
+                        smb2->recv_state = SMB2_RECV_TRFM;
+                        goto read_more_data;
+                }
+                {
+                        uint8_t *tmp = malloc(len);
+                        if (tmp == NULL) {
+                                smb2_set_error(smb2, "malloc failed while adding TRFM payload");
+                                return -1;
+                        }
+                        memcpy(tmp, smb2->trfm_buf, SMB2_TRFM_PEEK_SIZE);
+                        smb2->in.iov[smb2->in.niov - 1].buf = tmp;
+                        smb2->in.iov[smb2->in.niov - 1].len = len;
+                        smb2->in.iov[smb2->in.niov - 1].free = free;
+                        smb2->in.total_size += len - SMB2_TRFM_PEEK_SIZE;
+                }
+                smb2->recv_state = SMB2_RECV_TRFM;
+                goto read_more_data;
         case SMB2_RECV_TRFM:
                 /* We are finished reading the full payload for the
                  * encrypted packet.
@@ -780,6 +1015,24 @@ read_more_data:
                  */
                 return 0;
         case SMB2_RECV_UNKNOWN:
+                if (smb2->discard_left) {
+                        /* Read the next piece into the same scratch
+                         * buffer.
+                         */
+                        struct smb2_iovec *v = &smb2->in.iov[smb2->in.niov - 1];
+
+                        len = smb2->discard_left;
+                        if (len > SMB2_RECV_DISCARD_SIZE) {
+                                len = SMB2_RECV_DISCARD_SIZE;
+                        }
+                        smb2->in.total_size -= v->len;
+                        smb2->in.num_done = smb2->in.total_size;
+                        v->len = len;
+                        smb2->in.total_size += len;
+                        smb2->discard_left -= len;
+                        smb2->discarded_bytes += len;
+                        goto read_more_data;
+                }
                 /* We have finished reading the payload the the unknown reply we
                  * just received. As it is not matching anything we are waiting on
                  * there is no PDU associated with this and thus nothing else we need
@@ -843,7 +1096,7 @@ read_more_data:
 
         if (smb2_is_server(smb2)) {
                 /* queue requests to correlate our replies we send back later */
-                SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                smb2_waitqueue_add(smb2, pdu);
                 pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
                 smb2->pdu = smb2->next_pdu;
                 smb2->next_pdu = NULL;
@@ -875,43 +1128,360 @@ read_more_data:
         return 0;
 }
 
+/* Receive the next len bytes, the rest of a reply nobody waits for, into
+ * scratch space a piece at a time instead of allocating room for all of
+ * it.
+ */
+int
+smb2_discard_recv(struct smb2_context *smb2, size_t len)
+{
+        size_t n = len;
+
+        if (smb2->discard == NULL) {
+                smb2->discard = malloc(SMB2_RECV_DISCARD_SIZE);
+                if (smb2->discard == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate discard "
+                                       "buffer");
+                        return -1;
+                }
+        }
+        if (n > SMB2_RECV_DISCARD_SIZE) {
+                n = SMB2_RECV_DISCARD_SIZE;
+        }
+        if (smb2_add_iovector(smb2, &smb2->in, smb2->discard, n,
+                              NULL) == NULL) {
+                return -1;
+        }
+        smb2->discard_left = len - n;
+        smb2->discarded_bytes += n;
+        smb2->recv_state = SMB2_RECV_UNKNOWN;
+        return 0;
+}
+
+/* The reply being received belongs to a request that was just cancelled.
+ * Drop the vectors not filled yet, which may point into the application
+ * buffer, and read the rest of the reply into scratch space instead.
+ * Not possible for a decrypted reply, which is received in full before it
+ * is decoded, nor in the middle of a compound reply.
+ */
+int
+smb2_discard_current(struct smb2_context *smb2)
+{
+        struct smb2_io_vectors *v = &smb2->in;
+        size_t off = 0;
+        int i;
+
+        if (smb2->enc || smb2->hdr.next_command ||
+            v->num_done >= v->total_size ||
+            (smb2->recv_state != SMB2_RECV_FIXED &&
+             smb2->recv_state != SMB2_RECV_VARIABLE &&
+             smb2->recv_state != SMB2_RECV_PAD)) {
+                return -1;
+        }
+        for (i = 0; i < v->niov; i++) {
+                if (off + v->iov[i].len > v->num_done) {
+                        break;
+                }
+                off += v->iov[i].len;
+        }
+        /* Keep what was received of the vector in progress */
+        v->iov[i].len = v->num_done - off;
+        while (v->niov > i + 1) {
+                v->niov--;
+                if (v->iov[v->niov].free) {
+                        v->iov[v->niov].free(v->iov[v->niov].buf);
+                }
+        }
+        v->total_size = v->num_done;
+        return smb2_discard_recv(smb2,
+                                 smb2->spl + SMB2_SPL_SIZE - v->num_done);
+}
+
+/* Hand out bytes left in the staging buffer by an earlier read. */
+static size_t smb2_read_from_stage(struct smb2_context *smb2,
+                                   const struct iovec *iov, int iovcnt)
+{
+        size_t n, count = 0;
+        int i;
+
+        for (i = 0; i < iovcnt && smb2->stage_len; i++) {
+                n = iov[i].iov_len;
+                if (n > smb2->stage_len) {
+                        n = smb2->stage_len;
+                }
+                memcpy(iov[i].iov_base, &smb2->stage[smb2->stage_pos], n);
+                smb2->stage_pos += n;
+                smb2->stage_len -= n;
+                count += n;
+        }
+        smb2->recv_staged_bytes += count;
+        return count;
+}
+
+/* How much to stage behind a read of want bytes. At a PDU boundary we do
+ * not know yet whether READ data follows, so only peek. Once the peeked
+ * bytes are consumed the state machine asks for the rest and the staging
+ * buffer is used in full unless that rest is large.
+ */
+static size_t smb2_stage_window(struct smb2_context *smb2, size_t want)
+{
+        if (smb2->recv_state == SMB2_RECV_SPL ||
+            want >= SMB2_RECV_DIRECT_MIN) {
+                return SMB2_RECV_PEEK_SIZE;
+        }
+        return SMB2_RECV_STAGING_SIZE;
+}
+
+/* Read what the receive state machine asked for and, in the same readv(),
+ * whatever follows it on the socket into the staging buffer. A burst of
+ * small replies then costs one syscall instead of several per PDU. Large
+ * READ data still goes straight to the application buffer with only a
+ * short peek at the next PDU staged behind it.
+ */
 static ssize_t smb2_readv_from_socket(struct smb2_context *smb2,
                                       const struct iovec *iov, int iovcnt)
 {
-        ssize_t rc = readv(smb2->fd, (struct iovec*) iov, iovcnt);
+        struct iovec v[SMB2_SOCKET_VECTORS + 1];
+        size_t want = 0;
+        ssize_t rc;
+        int i;
+
+        if (smb2->stage_len) {
+                return (ssize_t)smb2_read_from_stage(smb2, iov, iovcnt);
+        }
+
+        for (i = 0; i < iovcnt; i++) {
+                v[i] = iov[i];
+                want += iov[i].iov_len;
+        }
+        smb2->stage_pos = 0;
+        v[iovcnt].iov_base = (char *)smb2->stage;
+        v[iovcnt].iov_len = smb2_stage_window(smb2, want);
+
+        rc = readv(smb2->fd, v, iovcnt + 1);
+        smb2->recv_syscalls++;
+        if (rc <= 0) {
+                return rc;
+        }
+        smb2->recv_bytes += rc;
+        if ((size_t)rc > want) {
+                smb2->stage_len = (size_t)rc - want;
+                rc = (ssize_t)want;
+        }
         return rc;
 }
 
+/* Hand out the bytes the application read for us, see
+ * smb2_service_recv(), then whatever was staged behind them.
+ */
+static ssize_t smb2_readv_completed(struct smb2_context *smb2,
+                                    const struct iovec *iov, int iovcnt)
+{
+        size_t want = 0;
+        int i;
+
+        if (!smb2->recv_pending) {
+                if (smb2->stage_len) {
+                        return (ssize_t)smb2_read_from_stage(smb2, iov,
+                                                             iovcnt);
+                }
+                errno = EAGAIN;
+                return -1;
+        }
+        if (smb2->recv_done <= 0) {
+                smb2->recv_pending = 0;
+                if (smb2->recv_done < 0) {
+                        errno = -smb2->recv_done;
+                        return -1;
+                }
+                return 0;
+        }
+
+        for (i = 0; i < iovcnt; i++) {
+                want += iov[i].iov_len;
+        }
+        if (want > (size_t)smb2->recv_done) {
+                want = (size_t)smb2->recv_done;
+        }
+        smb2->recv_done -= (int)want;
+        if (smb2->recv_done == 0) {
+                smb2->recv_pending = 0;
+        }
+        return (ssize_t)want;
+}
+
 static int
-smb2_read_from_socket(struct smb2_context *smb2)
+smb2_alloc_stage(struct smb2_context *smb2)
+{
+        if (smb2->stage == NULL) {
+                smb2->stage = malloc(SMB2_RECV_STAGING_SIZE);
+                if (smb2->stage == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate receive "
+                                       "staging buffer");
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/* initialize the input vectors to the spl and the header
+ * which are both static data in the smb2 context.
+ * additional vectors will be added when we can map this to
+ * the corresponding pdu.
+ */
+static int
+smb2_start_recv(struct smb2_context *smb2)
+{
+        smb2->recv_state = SMB2_RECV_SPL;
+        smb2->spl = 0;
+
+        smb2_free_iovector(smb2, &smb2->in);
+        if (smb2_add_iovector(smb2, &smb2->in, (uint8_t *)&smb2->spl,
+                              SMB2_SPL_SIZE, NULL) == NULL) {
+                smb2_set_error(smb2, "Too many I/O vectors when adding SPL");
+                return -1;
+        }
+        return 0;
+}
+
+/* Decode PDUs until func runs out of data. Staged bytes are invisible to
+ * poll(), so this keeps going until the socket itself runs dry: func only
+ * returns EAGAIN once the staging buffer is empty.
+ *
+ * The caller sets up the receive of the first PDU. The SPL may already
+ * have been read into by smb2_service_recv()'s caller.
+ */
+static int
+smb2_read_loop(struct smb2_context *smb2, read_func func)
 {
         int count;
 
         while(1) {
-                /* initialize the input vectors to the spl and the header
-                 * which are both static data in the smb2 context.
-                 * additional vectors will be added when we can map this to
-                 * the corresponding pdu.
-                 */
-                if (smb2->in.num_done == 0) {
-                        smb2->recv_state = SMB2_RECV_SPL;
-                        smb2->spl = 0;
-
-                        smb2_free_iovector(smb2, &smb2->in);
-                        if (smb2_add_iovector(smb2, &smb2->in, (uint8_t *)&smb2->spl,
-                                          SMB2_SPL_SIZE, NULL) == NULL) {
-                                smb2_set_error(smb2, "Too many I/O vectors when adding SPL");
-                                return -1;
-                        }
-                }
-
-                count = smb2_read_data(smb2, smb2_readv_from_socket, 0);
+                count = smb2_read_data(smb2, func, 0);
                 if (count == -EAGAIN) {
                         return 0;
                 }
                 if (count) {
                         return count;
                 }
+                if (smb2->in.num_done == 0 && smb2_start_recv(smb2)) {
+                        return -1;
+                }
+        }
+}
+
+static int
+smb2_read_from_socket(struct smb2_context *smb2)
+{
+        if (smb2_alloc_stage(smb2)) {
+                return -1;
+        }
+        if (smb2->in.num_done == 0 && smb2_start_recv(smb2)) {
+                return -1;
+        }
+        return smb2_read_loop(smb2, smb2_readv_from_socket);
+}
+
+int
+smb2_get_recv_iovecs(struct smb2_context *smb2, struct iovec *iov, int max)
+{
+        size_t num_done, want = 0;
+        int i, niov = 0;
+
+        if (!SMB2_VALID_SOCKET(smb2->fd)) {
+                smb2_set_error(smb2, "trying to read but not connected");
+                return -1;
+        }
+        if (max < 2) {
+                smb2_set_error(smb2, "Need at least two receive vectors");
+                return -1;
+        }
+        if (smb2_alloc_stage(smb2)) {
+                return -1;
+        }
+        if (smb2->in.num_done == 0 && smb2_start_recv(smb2)) {
+                return -1;
+        }
+
+        /* The unread part of what the state machine is waiting for, as in
+         * smb2_read_data(), then room to stage what follows it.
+         */
+        num_done = smb2->in.num_done;
+        for (i = 0; i < smb2->in.niov; i++) {
+                if (smb2_fill_iovec(iov, &niov, max - 1, &num_done,
+                                    smb2->in.iov[i].buf,
+                                    smb2->in.iov[i].len)) {
+                        break;
+                }
+        }
+        for (i = 0; i < niov; i++) {
+                want += iov[i].iov_len;
+        }
+        smb2->recv_want = want;
+        iov[niov].iov_base = (char *)smb2->stage;
+#if defined(_WIN32) || defined(_XBOX)
+        iov[niov].iov_len = (unsigned long)smb2_stage_window(smb2, want);
+#else
+        iov[niov].iov_len = smb2_stage_window(smb2, want);
+#endif
+        return niov + 1;
+}
+
+int
+smb2_service_recv(struct smb2_context *smb2, int count)
+{
+        int ret = 0;
+
+        if (count > 0) {
+                smb2->recv_bytes += count;
+                if ((size_t)count > smb2->recv_want) {
+                        smb2->stage_pos = 0;
+                        smb2->stage_len = (size_t)count - smb2->recv_want;
+                        count = (int)smb2->recv_want;
+                }
+        }
+        smb2->recv_done = count;
+        smb2->recv_pending = 1;
+        if (smb2_read_loop(smb2, smb2_readv_completed) != 0) {
+                ret = -1;
+        }
+        smb2->recv_pending = 0;
+
+        smb2_timeout_pdus(smb2);
+        return ret;
+}
+
+/* Copy len bytes of the decrypted stream from enc_pos. For a sealed READ
+ * the data range is read from the application buffer it was decrypted
+ * in, which is also where the READ reply wants it, so nothing is copied.
+ */
+static void smb2_copy_from_enc(struct smb2_context *smb2, uint8_t *dst,
+                               size_t len)
+{
+        size_t pos, n;
+        uint8_t *src;
+
+        while (len) {
+                pos = smb2->enc_pos;
+                if (smb2->enc_data == NULL || pos < smb2->enc_data_off) {
+                        n = smb2->enc_data ? smb2->enc_data_off - pos : len;
+                        src = &smb2->enc[pos];
+                } else if (pos < smb2->enc_data_off + smb2->enc_data_len) {
+                        n = smb2->enc_data_off + smb2->enc_data_len - pos;
+                        src = &smb2->enc_data[pos - smb2->enc_data_off];
+                } else {
+                        n = len;
+                        src = &smb2->enc[pos - smb2->enc_data_len];
+                }
+                if (n > len) {
+                        n = len;
+                }
+                if (src != dst) {
+                        memcpy(dst, src, n);
+                }
+                smb2->enc_pos += (int)n;
+                dst += n;
+                len -= n;
         }
 }
 
@@ -926,8 +1496,7 @@ static ssize_t smb2_readv_from_buf(struct smb2_context *smb2,
                 if (len > smb2->enc_len - smb2->enc_pos) {
                         len = smb2->enc_len - smb2->enc_pos;
                 }
-                memcpy(iov[i].iov_base, &smb2->enc[smb2->enc_pos], len);
-                smb2->enc_pos += (int)len;
+                smb2_copy_from_enc(smb2, iov[i].iov_base, len);
                 count += len;
         }
         return count;
@@ -944,13 +1513,17 @@ smb2_close_connecting_fd(struct smb2_context *smb2, t_socket fd)
 {
         size_t i;
 
+        if (smb2->change_fd) {
+                smb2->change_fd(smb2, fd, SMB2_DEL_FD);
+        }
         close(fd);
         /* Remove the fd from the connecting_fds array */
         for (i = 0; i < smb2->connecting_fds_count; ++i) {
                 if (fd == smb2->connecting_fds[i]) {
                         memmove(&smb2->connecting_fds[i],
                                 &smb2->connecting_fds[i + 1],
-                                smb2->connecting_fds_count - i - 1);
+                                (smb2->connecting_fds_count - i - 1) *
+                                sizeof(t_socket));
                         smb2->connecting_fds_count--;
                         return;
                 }
@@ -1060,6 +1633,8 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
                         goto out;
                 }
                 smb2->fd = fd;
+                smb2->stage_pos = 0;
+                smb2->stage_len = 0;
 
                 smb2_close_connecting_fds(smb2);
 
@@ -1086,9 +1661,7 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
         }
 
  out:
-        if (smb2->timeout) {
-                smb2_timeout_pdus(smb2);
-        }
+        smb2_timeout_pdus(smb2);
         return ret;
 }
 
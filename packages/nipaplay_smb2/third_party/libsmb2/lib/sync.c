@@ -62,25 +62,34 @@
 #include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 
+/* How long a connection may take to come up without a timeout set */
+#define SYNC_CONNECT_TIMEOUT_MS 1000
+
 static int wait_for_reply(struct smb2_context *smb2,
                           struct sync_cb_data *cb_data)
 {
-        time_t t = time(NULL);
+        uint64_t t = smb2_now_ms();
+        uint64_t limit = smb2->timeout ? (uint64_t)smb2->timeout * 1000 :
+                SYNC_CONNECT_TIMEOUT_MS;
 
         while (!cb_data->is_finished) {
 		struct pollfd pfd;
+                int timeout;
+
 		memset(&pfd, 0, sizeof(struct pollfd));
 		pfd.fd = smb2_get_fd(smb2);
 		pfd.events = smb2_which_events(smb2);
 
-		if (poll(&pfd, 1, 1000) < 0) {
+                timeout = smb2_next_deadline(smb2);
+                if (timeout < 0 || timeout > 1000) {
+                        timeout = 1000;
+                }
+		if (poll(&pfd, 1, timeout) < 0) {
 			smb2_set_error(smb2, "Poll failed");
 			return -1;
 		}
-                if (smb2->timeout) {
-                        smb2_timeout_pdus(smb2);
-                }
-		if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - t) > (smb2->timeout)))
+                smb2_timeout_pdus(smb2);
+		if (!SMB2_VALID_SOCKET(smb2->fd) && smb2_now_ms() - t > limit)
 		{
 			smb2_set_error(smb2, "Timeout expired and no connection exists\n");
 			return -1;
@@ -143,6 +152,35 @@ int smb2_connect_share(struct smb2_context *smb2,
 	return rc;
 }
 
+/*
+ * Connect to the server and bind to the session of another context.
+ */
+int smb2_connect_channel(struct smb2_context *smb2,
+                         struct smb2_context *session,
+                         const char *server)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = &smb2->connect_cb_data;
+	rc = smb2_connect_channel_async(smb2, session, server, connect_cb,
+                                        cb_data);
+        if (rc < 0) {
+                goto out;
+	}
+
+	rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+	}
+
+        rc = cb_data->status;
+ out:
+
+	return rc;
+}
+
 /*
  * Disconnect from share
  */
@@ -267,6 +305,67 @@ struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags)
         return ptr;
 }
 
+static struct smb2fh *open_durable(struct smb2_context *smb2,
+                                   const char *path, int flags,
+                                   const smb2_create_guid create_guid,
+                                   uint32_t timeout,
+                                   const smb2_file_id file_id,
+                                   uint32_t lease_state,
+                                   const smb2_lease_key lease_key)
+{
+        struct smb2_pdu *pdu;
+        struct sync_cb_data *cb_data;
+        void *ptr;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return NULL;
+        }
+
+        /* The create pdu does not free cb_data, so free it here once the
+         * pdu is gone and its callback can no longer run.
+         */
+        pdu = smb2_open_durable_async_pdu(smb2, path, flags, create_guid,
+                                          timeout, file_id, lease_state,
+                                          lease_key, open_cb, cb_data, NULL);
+        if (pdu == NULL) {
+                free(cb_data);
+                return NULL;
+        }
+
+        if (wait_for_reply(smb2, cb_data) < 0) {
+                smb2_free_pdu(smb2, pdu);
+                free(cb_data);
+                return NULL;
+        }
+
+        ptr = cb_data->ptr;
+        smb2_free_pdu(smb2, pdu);
+        free(cb_data);
+        return ptr;
+}
+
+struct smb2fh *smb2_open_durable(struct smb2_context *smb2, const char *path,
+                                 int flags, const smb2_create_guid create_guid,
+                                 uint32_t timeout, uint32_t lease_state,
+                                 const smb2_lease_key lease_key)
+{
+        return open_durable(smb2, path, flags, create_guid, timeout, NULL,
+                            lease_state, lease_key);
+}
+
+struct smb2fh *smb2_reopen_durable(struct smb2_context *smb2,
+                                   const char *path, int flags,
+                                   const smb2_create_guid create_guid,
+                                   const smb2_file_id file_id,
+                                   uint32_t lease_state,
+                                   const smb2_lease_key lease_key)
+{
+        return open_durable(smb2, path, flags, create_guid, 0, file_id,
+                            lease_state, lease_key);
+}
+
 /*
  * close()
  */
@@ -836,6 +935,54 @@ int smb2_readlink(struct smb2_context *smb2, const char *path,
 	return rc;
 }
 
+static void query_interfaces_cb(struct smb2_context *smb2, int status,
+                                void *command_data, void *private_data)
+{
+        struct sync_cb_data *cb_data = private_data;
+
+        if (cb_data->status == SMB2_STATUS_CANCELLED) {
+                smb2_free_data(smb2, command_data);
+                free(cb_data);
+                return;
+        }
+
+        cb_data->is_finished = 1;
+        cb_data->status = status;
+        cb_data->ptr = command_data;
+}
+
+int smb2_query_network_interfaces(struct smb2_context *smb2,
+                                  struct smb2_network_interface_info **info)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+	rc = smb2_query_network_interfaces_async(smb2, query_interfaces_cb,
+                                                 cb_data);
+        if (rc < 0) {
+                goto out;
+	}
+
+	rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+	}
+
+        rc = cb_data->status;
+        *info = cb_data->ptr;
+ out:
+        free(cb_data);
+
+	return rc;
+}
+
 static void echo_cb(struct smb2_context *smb2, int status,
                     void *command_data, void *private_data)
 {
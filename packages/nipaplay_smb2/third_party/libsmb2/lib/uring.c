@@ -0,0 +1,468 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Services many contexts from one io_uring. Every call submits one
+ * RECVMSG per context into the vectors from smb2_get_recv_iovecs(), plus
+ * a POLL_ADD for POLLOUT where PDUs are waiting to be sent, and waits for
+ * the first completions in the same io_uring_enter(). Receives that did
+ * not complete are cancelled before returning so that no buffer of a
+ * context is left with the kernel.
+ *
+ * The ring is driven with raw syscalls so that liburing is not needed.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef STDC_HEADERS
+#include <stddef.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_EXT_ARG)
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_EXT_ARG)
+
+/* Each context takes at most a RECVMSG, a POLL_ADD and a cancel for
+ * each of them.
+ */
+#define SMB2_URING_MAX_CONTEXTS 64
+#define SMB2_URING_ENTRIES (4 * SMB2_URING_MAX_CONTEXTS)
+#define SMB2_URING_VECTORS 65
+
+/* user_data of a submission: index of the context and what it is for */
+#define SMB2_URING_RECV    0
+#define SMB2_URING_POLLOUT 1
+#define SMB2_URING_CANCEL  2
+#define SMB2_URING_DATA(i, kind) (((uint64_t)(i) << 2) | (kind))
+
+struct smb2_uring_op {
+        struct msghdr msg;
+        struct iovec iov[SMB2_URING_VECTORS];
+        /* SMB2_URING_RECV and SMB2_URING_POLLOUT bits still in flight */
+        int inflight;
+        int serviced;
+};
+
+struct smb2_uring {
+        int fd;
+        void *sq_ring;
+        void *cq_ring;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_tail;
+        unsigned *sq_array;
+        unsigned sq_mask;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+
+        struct smb2_uring_op ops[SMB2_URING_MAX_CONTEXTS];
+};
+
+static void
+smb2_uring_unmap(struct smb2_uring *ring)
+{
+        if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+                munmap(ring->sqes, ring->sqes_size);
+        }
+        if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+            ring->cq_ring != ring->sq_ring) {
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+                munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+}
+
+struct smb2_uring *
+smb2_uring_create(void)
+{
+        struct io_uring_params p;
+        struct smb2_uring *ring;
+        char *sq, *cq;
+
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) {
+                return NULL;
+        }
+        memset(&p, 0, sizeof(p));
+        ring->fd = (int)syscall(__NR_io_uring_setup, SMB2_URING_ENTRIES, &p);
+        if (ring->fd < 0) {
+                free(ring);
+                return NULL;
+        }
+        /* FAST_POLL parks a receive on a non-blocking socket until data
+         * arrives instead of failing it with EAGAIN, EXT_ARG lets the wait
+         * time out without a timeout submission.
+         */
+        if (!(p.features & IORING_FEAT_FAST_POLL) ||
+            !(p.features & IORING_FEAT_EXT_ARG) ||
+            !(p.features & IORING_FEAT_NODROP)) {
+                goto fail;
+        }
+
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_size > ring->sq_ring_size) {
+                        ring->sq_ring_size = ring->cq_ring_size;
+                }
+                ring->cq_ring_size = ring->sq_ring_size;
+        }
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                goto fail;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd,
+                                     IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        goto fail;
+                }
+        }
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                goto fail;
+        }
+
+        sq = ring->sq_ring;
+        cq = ring->cq_ring;
+        ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+        ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        return ring;
+
+ fail:
+        smb2_uring_unmap(ring);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+}
+
+void
+smb2_uring_destroy(struct smb2_uring *ring)
+{
+        if (ring == NULL) {
+                return;
+        }
+        smb2_uring_unmap(ring);
+        close(ring->fd);
+        free(ring);
+}
+
+/* Queue a submission. Nothing reaches the kernel before
+ * smb2_uring_enter().
+ */
+static struct io_uring_sqe *
+smb2_uring_sqe(struct smb2_uring *ring, unsigned *tail, int i, int kind)
+{
+        unsigned idx = *tail & ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = SMB2_URING_DATA(i, kind);
+        ring->sq_array[idx] = idx;
+        (*tail)++;
+        return sqe;
+}
+
+static int
+smb2_uring_enter(struct smb2_uring *ring, unsigned tail, unsigned submit,
+                 unsigned wait, int timeout)
+{
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        int rc;
+
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        memset(&arg, 0, sizeof(arg));
+        if (timeout >= 0) {
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000000LL;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        /* The kernel only submits what is queued, so retrying with the
+         * same count after EINTR does not submit anything twice.
+         */
+        do {
+                rc = (int)syscall(__NR_io_uring_enter, ring->fd, submit,
+                                  wait, flags, &arg, sizeof(arg));
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0) {
+                return errno == ETIME ? 0 : -errno;
+        }
+        return 0;
+}
+
+/* Service the contexts whose submissions completed. Returns the number of
+ * completions for submissions other than cancels.
+ */
+static int
+smb2_uring_reap(struct smb2_uring *ring, struct smb2_context **smb2,
+                int *ret)
+{
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        struct io_uring_cqe *cqe;
+        struct smb2_uring_op *op;
+        int i, kind, res, count = 0;
+
+        for (; head != tail; head++) {
+                cqe = &ring->cqes[head & ring->cq_mask];
+                i = (int)(cqe->user_data >> 2);
+                kind = (int)(cqe->user_data & 3);
+                res = cqe->res;
+                if (kind == SMB2_URING_CANCEL) {
+                        continue;
+                }
+                op = &ring->ops[i];
+                op->inflight &= ~(1 << kind);
+                count++;
+                if (ret[i] < 0 || res == -ECANCELED) {
+                        continue;
+                }
+                op->serviced = 1;
+                if (kind == SMB2_URING_RECV) {
+                        ret[i] = smb2_service_recv(smb2[i], res);
+                } else {
+                        ret[i] = smb2_service(smb2[i],
+                                              res < 0 ? POLLERR : res);
+                }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        return count;
+}
+
+/* Queue a receive into the vectors the context wants filled next. */
+static int
+smb2_uring_recv(struct smb2_uring *ring, unsigned *tail,
+                struct smb2_context *smb2, int i)
+{
+        struct smb2_uring_op *op = &ring->ops[i];
+        struct io_uring_sqe *sqe;
+        int niov;
+
+        niov = smb2_get_recv_iovecs(smb2, op->iov, SMB2_URING_VECTORS);
+        if (niov < 0) {
+                return -1;
+        }
+        memset(&op->msg, 0, sizeof(op->msg));
+        op->msg.msg_iov = op->iov;
+        op->msg.msg_iovlen = niov;
+        sqe = smb2_uring_sqe(ring, tail, i, SMB2_URING_RECV);
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = smb2->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+        sqe->len = 1;
+        op->inflight |= 1 << SMB2_URING_RECV;
+        return 0;
+}
+
+int
+smb2_uring_service(struct smb2_uring *ring, struct smb2_context **smb2,
+                   int *ret, int count, int timeout)
+{
+        struct io_uring_sqe *sqe;
+        struct smb2_uring_op *op;
+        unsigned tail, submit = 0;
+        int i, rc, next, inflight = 0, cancels = 0, serviced = 0;
+
+        if (count > SMB2_URING_MAX_CONTEXTS) {
+                return -EINVAL;
+        }
+
+        tail = *ring->sq_tail;
+        for (i = 0; i < count; i++) {
+                op = &ring->ops[i];
+                op->inflight = 0;
+                op->serviced = 0;
+                ret[i] = 0;
+
+                /* Wake up for the next request deadline */
+                next = smb2_next_deadline(smb2[i]);
+                if (next >= 0 && (timeout < 0 || next < timeout)) {
+                        timeout = next;
+                }
+
+                if (smb2_uring_recv(ring, &tail, smb2[i], i)) {
+                        ret[i] = -1;
+                        continue;
+                }
+                submit++;
+
+                if (smb2_which_events(smb2[i]) & POLLOUT) {
+                        sqe = smb2_uring_sqe(ring, &tail, i,
+                                             SMB2_URING_POLLOUT);
+                        sqe->opcode = IORING_OP_POLL_ADD;
+                        sqe->fd = smb2[i]->fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                        sqe->poll32_events = (POLLOUT << 16) | (POLLOUT >> 16);
+#else
+                        sqe->poll32_events = POLLOUT;
+#endif
+                        op->inflight |= 1 << SMB2_URING_POLLOUT;
+                        submit++;
+                }
+        }
+        inflight = (int)submit;
+        if (inflight == 0) {
+                return 0;
+        }
+
+        rc = smb2_uring_enter(ring, tail, submit, 1, timeout);
+        if (rc < 0) {
+                return rc;
+        }
+        inflight -= smb2_uring_reap(ring, smb2, ret);
+
+        /* Take back what is still with the kernel. A receive may complete
+         * with data while it is being cancelled, it is serviced as usual.
+         */
+        if (inflight) {
+                tail = *ring->sq_tail;
+                for (i = 0; i < count; i++) {
+                        op = &ring->ops[i];
+                        if (op->inflight & (1 << SMB2_URING_RECV)) {
+                                sqe = smb2_uring_sqe(ring, &tail, i,
+                                                     SMB2_URING_CANCEL);
+                                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                                sqe->addr = SMB2_URING_DATA(i, SMB2_URING_RECV);
+                                cancels++;
+                        }
+                        if (op->inflight & (1 << SMB2_URING_POLLOUT)) {
+                                sqe = smb2_uring_sqe(ring, &tail, i,
+                                                     SMB2_URING_CANCEL);
+                                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                                sqe->addr = SMB2_URING_DATA(i, SMB2_URING_POLLOUT);
+                                cancels++;
+                        }
+                }
+                submit = cancels;
+                while (inflight > 0) {
+                        rc = smb2_uring_enter(ring, tail, submit, inflight,
+                                              -1);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        submit = 0;
+                        inflight -= smb2_uring_reap(ring, smb2, ret);
+                }
+        }
+
+        for (i = 0; i < count; i++) {
+                if (ring->ops[i].serviced) {
+                        serviced++;
+                } else if (ret[i] == 0 && smb2[i]->ntimers) {
+                        ret[i] = smb2_service(smb2[i], 0);
+                }
+        }
+        return serviced;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct smb2_uring *
+smb2_uring_create(void)
+{
+        return NULL;
+}
+
+void
+smb2_uring_destroy(struct smb2_uring *ring _U_)
+{
+}
+
+int
+smb2_uring_service(struct smb2_uring *ring _U_,
+                   struct smb2_context **smb2 _U_, int *ret _U_,
+                   int count _U_, int timeout _U_)
+{
+        return -ENOSYS;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
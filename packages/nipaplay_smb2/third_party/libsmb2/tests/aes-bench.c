@@ -0,0 +1,297 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Checks every AES implementation usable on this CPU against the FIPS-197
+ * and GCM specification vectors and measures it against the tiny-AES
+ * reference code.
+ *
+ * Build with "make aes-bench" in tests/ of an autotools build, or from the
+ * libsmb2 top directory:
+ *   cc -O2 -DHAVE_STDINT_H -DHAVE_STRING_H "-D_U_=__attribute__((unused))" \
+ *      -Iinclude -Ilib tests/aes-bench.c lib/aes.c lib/aes_hw.c \
+ *      lib/aes_gcm.c lib/aes_reference.c lib/aes128ccm.c -o aes-bench
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aes.h"
+#include "aes128ccm.h"
+#include "aes_gcm.h"
+#include "aes_reference.h"
+
+#define BENCH_BYTES (64 * 1024 * 1024)
+#define SEAL_BYTES (1024 * 1024)
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *impl, const char *what, size_t bytes,
+                   double secs)
+{
+        printf("%-10s %-28s %9.1f MB/s\n", impl, what,
+               bytes / secs / (1024 * 1024));
+}
+
+static int check_vectors(void)
+{
+        static const uint8_t pt[16] = {
+                0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+        };
+        static const uint8_t ct128[16] = {
+                0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+                0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+        };
+        static const uint8_t ct256[16] = {
+                0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+                0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89
+        };
+        uint8_t k[32], in[64], out[64], ref[16];
+        struct aes_key key;
+        int i;
+
+        for (i = 0; i < 32; i++) {
+                k[i] = i;
+        }
+        for (i = 0; i < 4; i++) {
+                memcpy(&in[i * 16], pt, 16);
+        }
+
+        /* Four blocks at once exercise the interleaved paths. */
+        aes_key_setup(&key, k, 16);
+        aes_encrypt_ecb(&key, in, out, 4);
+        for (i = 0; i < 4; i++) {
+                if (memcmp(&out[i * 16], ct128, 16)) {
+                        printf("%s: AES-128 mismatch in block %d\n",
+                               aes_impl_name(), i);
+                        return -1;
+                }
+        }
+        AES128_ECB_encrypt_reference((uint8_t *)pt, k, ref);
+        if (memcmp(ref, ct128, 16)) {
+                printf("reference: AES-128 mismatch\n");
+                return -1;
+        }
+
+        aes_key_setup(&key, k, 32);
+        aes_encrypt_ecb(&key, in, out, 4);
+        for (i = 0; i < 4; i++) {
+                if (memcmp(&out[i * 16], ct256, 16)) {
+                        printf("%s: AES-256 mismatch in block %d\n",
+                               aes_impl_name(), i);
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static size_t unhex(const char *s, uint8_t *out)
+{
+        size_t n = 0;
+        unsigned int v;
+
+        while (s[0] && s[1] && sscanf(s, "%2x", &v) == 1) {
+                out[n++] = (uint8_t)v;
+                s += 2;
+        }
+        return n;
+}
+
+/* Test cases 2, 4 and 16 of "The Galois/Counter Mode of Operation". */
+static int check_gcm(void)
+{
+        static const char *p4 =
+                "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d"
+                "8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657"
+                "ba637b39";
+        static const char *a4 = "feedfacedeadbeeffeedfacedeadbeefabaddad2";
+        static const struct {
+                const char *k, *p, *a, *iv, *c, *t;
+        } tc[] = {
+                { "00000000000000000000000000000000",
+                  "00000000000000000000000000000000", "",
+                  "000000000000000000000000",
+                  "0388dace60b6a392f328c2b971b2fe78",
+                  "ab6e47d42cec13bdf53a67b21257bddf" },
+                { "feffe9928665731c6d6a8f9467308308", NULL, NULL,
+                  "cafebabefacedbaddecaf888",
+                  "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e23"
+                  "29aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac97"
+                  "3d58e091",
+                  "5bc94fbc3221a5db94fae95ae7121a47" },
+                { "feffe9928665731c6d6a8f9467308308"
+                  "feffe9928665731c6d6a8f9467308308", NULL, NULL,
+                  "cafebabefacedbaddecaf888",
+                  "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd"
+                  "2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0a"
+                  "bcc9f662",
+                  "76fc6ece0f4e1768cddf8853bb2d551b" },
+        };
+        uint8_t k[32], p[64], a[32], iv[12], c[64], t[16], mac[16];
+        size_t i, klen, plen, alen;
+        struct aes_key key;
+        struct ghash_key gkey;
+
+        for (i = 0; i < sizeof(tc) / sizeof(tc[0]); i++) {
+                klen = unhex(tc[i].k, k);
+                plen = unhex(tc[i].p ? tc[i].p : p4, p);
+                alen = unhex(tc[i].a ? tc[i].a : a4, a);
+                unhex(tc[i].iv, iv);
+                unhex(tc[i].c, c);
+                unhex(tc[i].t, t);
+
+                aes_key_setup(&key, k, klen);
+                ghash_key_setup(&gkey, &key);
+                aes_gcm_encrypt(&key, &gkey, iv, a, alen, p, plen, mac, 16);
+                if (memcmp(p, c, plen) || memcmp(mac, t, 16)) {
+                        printf("%s: GCM mismatch in test %d\n",
+                               aes_impl_name(), (int)i);
+                        return -1;
+                }
+                if (aes_gcm_decrypt(&key, &gkey, iv, a, alen, p, plen,
+                                    mac, 16)) {
+                        printf("%s: GCM tag rejected in test %d\n",
+                               aes_impl_name(), (int)i);
+                        return -1;
+                }
+                mac[0] ^= 1;
+                if (!aes_gcm_decrypt(&key, &gkey, iv, a, alen, p, plen,
+                                     mac, 16)) {
+                        printf("%s: GCM bad tag accepted in test %d\n",
+                               aes_impl_name(), (int)i);
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static void bench_reference(uint8_t *buf)
+{
+        uint8_t k[16] = {0};
+        double t;
+        size_t i;
+
+        t = now();
+        for (i = 0; i < BENCH_BYTES / 16; i++) {
+                AES128_ECB_encrypt_reference(&buf[i * 16], k, &buf[i * 16]);
+        }
+        report("reference", "aes-128 block", BENCH_BYTES, now() - t);
+}
+
+static void bench_impl(uint8_t *buf)
+{
+        uint8_t k[32] = {0};
+        uint8_t nonce[12] = {0}, aad[32] = {0}, mac[16];
+        struct aes_key key;
+        struct ghash_key gkey;
+        double t;
+        size_t i;
+
+        aes_key_setup(&key, k, 16);
+
+        /* Chained single blocks, as CMAC and the CCM tag use them. */
+        t = now();
+        for (i = 0; i < BENCH_BYTES / 16; i++) {
+                aes_encrypt_block(&key, &buf[i * 16], &buf[i * 16]);
+        }
+        report(aes_impl_name(), "aes-128 block", BENCH_BYTES, now() - t);
+
+        t = now();
+        for (i = 0; i < BENCH_BYTES / 256; i++) {
+                aes_encrypt_ecb(&key, &buf[i * 256], &buf[i * 256], 16);
+        }
+        report(aes_impl_name(), "aes-128 ecb x16", BENCH_BYTES, now() - t);
+
+        t = now();
+        for (i = 0; i < BENCH_BYTES / SEAL_BYTES; i++) {
+                aes_ccm_encrypt(&key, nonce, 11, aad, sizeof(aad),
+                                &buf[i * SEAL_BYTES], SEAL_BYTES,
+                                mac, sizeof(mac));
+        }
+        report(aes_impl_name(), "aes-128-ccm seal 1 MiB", BENCH_BYTES,
+               now() - t);
+
+        ghash_key_setup(&gkey, &key);
+        t = now();
+        for (i = 0; i < BENCH_BYTES / SEAL_BYTES; i++) {
+                aes_gcm_encrypt(&key, &gkey, nonce, aad, sizeof(aad),
+                                &buf[i * SEAL_BYTES], SEAL_BYTES,
+                                mac, sizeof(mac));
+        }
+        report(aes_impl_name(), "aes-128-gcm seal 1 MiB", BENCH_BYTES,
+               now() - t);
+
+        aes_key_setup(&key, k, 32);
+        t = now();
+        for (i = 0; i < BENCH_BYTES / 256; i++) {
+                aes_encrypt_ecb(&key, &buf[i * 256], &buf[i * 256], 16);
+        }
+        report(aes_impl_name(), "aes-256 ecb x16", BENCH_BYTES, now() - t);
+
+        ghash_key_setup(&gkey, &key);
+        t = now();
+        for (i = 0; i < BENCH_BYTES / SEAL_BYTES; i++) {
+                aes_gcm_encrypt(&key, &gkey, nonce, aad, sizeof(aad),
+                                &buf[i * SEAL_BYTES], SEAL_BYTES,
+                                mac, sizeof(mac));
+        }
+        report(aes_impl_name(), "aes-256-gcm seal 1 MiB", BENCH_BYTES,
+               now() - t);
+}
+
+int main(void)
+{
+        static const enum aes_impl impls[] = {
+                AES_IMPL_TABLE, AES_IMPL_AESNI, AES_IMPL_ARMV8
+        };
+        uint8_t *buf;
+        size_t i;
+
+        buf = calloc(1, BENCH_BYTES);
+        if (buf == NULL) {
+                printf("Failed to allocate buffer\n");
+                return 1;
+        }
+
+        printf("default implementation: %s\n", aes_impl_name());
+        bench_reference(buf);
+        for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+                if (aes_set_impl(impls[i])) {
+                        continue;
+                }
+                if (check_vectors() || check_gcm()) {
+                        free(buf);
+                        return 1;
+                }
+                bench_impl(buf);
+        }
+
+        free(buf);
+        return 0;
+}
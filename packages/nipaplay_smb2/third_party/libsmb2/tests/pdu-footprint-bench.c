@@ -0,0 +1,137 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Reports how much memory a pdu costs: the size of the structures, the
+ * resident set growth with a deep pipeline of READs in flight, and the
+ * time to build and free one READ or ECHO request.
+ *
+ * Build with "make pdu-footprint-bench" in tests/ of an autotools build, or
+ * from the libsmb2 top directory after building the library with
+ * cmake -DBUILD_SHARED_LIBS=OFF into ./build:
+ *   cc -O2 -Ibuild -Iinclude -Iinclude/smb2 -Ilib \
+ *      "-D_U_=__attribute__((unused))" tests/pdu-footprint-bench.c \
+ *      build/lib/libsmb2.a -o pdu-footprint-bench
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+#define INFLIGHT 1024
+#define ITERATIONS (1000 * 1000)
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Resident set size in kbytes, or 0 where /proc is not available. */
+static long rss_kb(void)
+{
+        long pages = 0, resident = 0;
+        FILE *f;
+
+        f = fopen("/proc/self/statm", "r");
+        if (f == NULL) {
+                return 0;
+        }
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+                resident = 0;
+        }
+        fclose(f);
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static struct smb2_pdu *read_pdu(struct smb2_context *smb2, uint8_t *buf)
+{
+        struct smb2_read_request req;
+
+        memset(&req, 0, sizeof(req));
+        req.length = 65536;
+        req.buf = buf;
+        return smb2_cmd_read_async(smb2, &req, NULL, NULL);
+}
+
+int main(void)
+{
+        static struct smb2_pdu *pdus[INFLIGHT];
+        static uint8_t buf[65536];
+        struct smb2_context *smb2;
+        struct smb2_pdu *pdu;
+        long rss;
+        double t;
+        int i;
+
+        smb2 = smb2_init_context();
+        if (smb2 == NULL) {
+                printf("Failed to init context\n");
+                return 1;
+        }
+
+        printf("sizeof(struct smb2_pdu)        %8zu bytes\n",
+               sizeof(struct smb2_pdu));
+        printf("sizeof(struct smb2_io_vectors) %8zu bytes\n",
+               sizeof(struct smb2_io_vectors));
+        printf("sizeof(struct smb2_context)    %8zu bytes\n",
+               sizeof(struct smb2_context));
+
+        rss = rss_kb();
+        for (i = 0; i < INFLIGHT; i++) {
+                pdus[i] = read_pdu(smb2, buf);
+                if (pdus[i] == NULL) {
+                        printf("Failed to create READ\n");
+                        return 1;
+                }
+        }
+        printf("%d READs in flight             %8ld kbytes RSS growth\n",
+               INFLIGHT, rss_kb() - rss);
+        for (i = 0; i < INFLIGHT; i++) {
+                smb2_free_pdu(smb2, pdus[i]);
+        }
+
+        t = now();
+        for (i = 0; i < ITERATIONS; i++) {
+                pdu = read_pdu(smb2, buf);
+                smb2_free_pdu(smb2, pdu);
+        }
+        printf("build and free a READ          %8.1f ns\n",
+               (now() - t) * 1e9 / ITERATIONS);
+
+        t = now();
+        for (i = 0; i < ITERATIONS; i++) {
+                pdu = smb2_cmd_echo_async(smb2, NULL, NULL);
+                smb2_free_pdu(smb2, pdu);
+        }
+        printf("build and free an ECHO         %8.1f ns\n",
+               (now() - t) * 1e9 / ITERATIONS);
+
+        smb2_destroy_context(smb2);
+        return 0;
+}
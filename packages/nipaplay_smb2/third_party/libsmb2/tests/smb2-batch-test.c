@@ -0,0 +1,287 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Sends bursts of requests through a context connected to a minimal
+ * in-process server over a socketpair and counts the syscalls on the
+ * client side. Requests queued while the context is corked must go out
+ * in as few writev() calls as the vector limit allows. Replies are all
+ * queued on the socket before the context reads any of them: small ones
+ * must be decoded several to a readv() and large READ data must go to the
+ * application buffer, not through the staging buffer.
+ *
+ * The same replies are then decoded through smb2_get_recv_iovecs() and
+ * smb2_service_recv() with short reads, and through smb2_uring_service()
+ * if the kernel supports io_uring.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define MAX_READ 32768
+
+/* How replies are received, see receive_until() */
+#define RECV_POLL       0
+#define RECV_COMPLETION 1
+#define RECV_URING      2
+
+static int recv_mode;
+static struct smb2_uring *ring;
+
+/* Read at most 1000 bytes at a time into the vectors the context asks
+ * for, so that receives end in the middle of PDUs and of READ data.
+ */
+static int service_completion(void)
+{
+        struct iovec iov[8];
+        size_t left = 1000;
+        ssize_t count;
+        int i, niov;
+
+        niov = smb2_get_recv_iovecs(client, iov, 8);
+        if (niov < 2) {
+                printf("get_recv_iovecs failed: %s\n",
+                       smb2_get_error(client));
+                return -1;
+        }
+        for (i = 0; i < niov && left; i++) {
+                if (iov[i].iov_len > left) {
+                        iov[i].iov_len = left;
+                }
+                left -= iov[i].iov_len;
+        }
+        count = readv(client->fd, iov, i);
+        if (count < 0) {
+                count = -errno;
+        }
+        return smb2_service_recv(client, (int)count);
+}
+
+static int receive_until(int target)
+{
+        int ret = 0;
+
+        while (completed < target && !failed) {
+                switch (recv_mode) {
+                case RECV_COMPLETION:
+                        ret = service_completion();
+                        break;
+                case RECV_URING:
+                        if (smb2_uring_service(ring, &client, &ret, 1,
+                                               1000) < 0) {
+                                printf("uring_service failed\n");
+                                return -1;
+                        }
+                        break;
+                default:
+                        ret = smb2_service(client, POLLIN);
+                }
+                if (ret < 0) {
+                        return -1;
+                }
+        }
+        return failed ? -1 : 0;
+}
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+        struct smb2_read_cb_data *rd = command_data;
+        int i;
+
+        if (status != (int)(intptr_t)cb_data) {
+                printf("read failed: %d %s\n", status, smb2_get_error(smb2));
+                failed = 1;
+                return;
+        }
+        for (i = 0; i < status; i++) {
+                if (rd->buf[i] != pattern(rd->offset + i)) {
+                        printf("bad data at offset %llu\n",
+                               (unsigned long long)(rd->offset + i));
+                        failed = 1;
+                        return;
+                }
+        }
+        completed++;
+}
+
+/* Send count requests, corked or one by one, have all replies queued on
+ * the socket, then decode them. Returns the number of readv() calls the
+ * decode took and sets *writes to the number of writev() calls the
+ * requests took.
+ */
+static int burst(int count, uint32_t read_size, uint8_t *bufs, int corked,
+                 int *writes)
+{
+        uint64_t syscalls;
+        int i;
+
+        syscalls = client->send_syscalls;
+        if (corked) {
+                smb2_cork(client);
+        }
+        for (i = 0; i < count; i++) {
+                if (read_size == 0) {
+                        if (smb2_echo_async(client, echo_cb, NULL)) {
+                                printf("echo failed: %s\n",
+                                       smb2_get_error(client));
+                                return -1;
+                        }
+                        continue;
+                }
+                if (smb2_pread_async(client, fh, &bufs[i * read_size],
+                                     read_size, (uint64_t)i * read_size,
+                                     read_cb,
+                                     (void *)(intptr_t)read_size)) {
+                        printf("pread failed: %s\n", smb2_get_error(client));
+                        return -1;
+                }
+        }
+        if (corked) {
+                if (client->send_syscalls != syscalls) {
+                        printf("corked context wrote to the socket\n");
+                        return -1;
+                }
+                if (smb2_uncork(client)) {
+                        printf("uncork failed: %s\n",
+                               smb2_get_error(client));
+                        return -1;
+                }
+        }
+        if (client->outqueue != NULL) {
+                printf("requests left in the outqueue\n");
+                return -1;
+        }
+        *writes = (int)(client->send_syscalls - syscalls);
+
+        for (i = 0; i < count; i++) {
+                if (serve_one()) {
+                        return -1;
+                }
+        }
+        syscalls = client->recv_syscalls;
+        if (receive_until(completed + count)) {
+                return -1;
+        }
+        return (int)(client->recv_syscalls - syscalls);
+}
+
+int main(int argc, char *argv[])
+{
+        struct smb2_context *smb2;
+        static uint8_t bufs[32 * 4096];
+        uint64_t staged;
+        int echoes, small_reads, large_reads;
+        int echo_writes, uncorked_writes, corked_writes, many_writes;
+
+        smb2 = connect_client(SMB2_VERSION_0210);
+        if (smb2 == NULL) {
+                return 1;
+        }
+
+        if (smb2_open_async(smb2, "file", O_RDONLY, open_cb, NULL) ||
+            serve_one() || receive_until(1)) {
+                goto fail;
+        }
+
+        /* Each burst ends with one readv() that finds the socket empty. */
+        echoes = burst(64, 0, bufs, 1, &echo_writes);
+        if (burst(32, 4096, bufs, 0, &uncorked_writes) < 0) {
+                goto fail;
+        }
+        small_reads = burst(32, 4096, bufs, 1, &corked_writes);
+        staged = smb2->recv_staged_bytes;
+        large_reads = burst(4, MAX_READ, bufs, 1, &many_writes);
+        staged = smb2->recv_staged_bytes - staged;
+        if (echoes < 0 || small_reads < 0 || large_reads < 0) {
+                goto fail;
+        }
+        /* Three vectors per ECHO, more than one writev() may take */
+        if (burst(128, 0, bufs, 1, &many_writes) < 0) {
+                goto fail;
+        }
+
+        recv_mode = RECV_COMPLETION;
+        if (burst(64, 0, bufs, 1, &echo_writes) < 0 ||
+            burst(32, 4096, bufs, 1, &echo_writes) < 0 ||
+            burst(4, MAX_READ, bufs, 1, &echo_writes) < 0) {
+                printf("completion based receive failed\n");
+                goto fail;
+        }
+        ring = smb2_uring_create();
+        if (ring != NULL) {
+                recv_mode = RECV_URING;
+                if (burst(64, 0, bufs, 1, &echo_writes) < 0 ||
+                    burst(32, 4096, bufs, 1, &echo_writes) < 0 ||
+                    burst(4, MAX_READ, bufs, 1, &echo_writes) < 0) {
+                        printf("io_uring receive failed\n");
+                        goto fail;
+                }
+        }
+
+        printf("sent 32 READs in %d writev, %d corked, 64 ECHOs in %d, "
+               "128 ECHOs in %d\n", uncorked_writes, corked_writes,
+               echo_writes, many_writes);
+        printf("64 ECHO replies: %d readv, 32 4k READ replies: %d readv, "
+               "4 32k READ replies: %d readv, %llu bytes staged\n",
+               echoes, small_reads, large_reads,
+               (unsigned long long)staged);
+        printf("completion based receive ok, io_uring %s\n",
+               ring != NULL ? "ok" : "not available");
+        if (corked_writes != 1 || echo_writes != 1) {
+                printf("corked requests were not batched\n");
+                goto fail;
+        }
+        if (many_writes < 2 || many_writes > 4) {
+                printf("large batch was not split at the vector limit\n");
+                goto fail;
+        }
+        if (echoes > 3) {
+                printf("ECHO replies were not batched\n");
+                goto fail;
+        }
+        if (small_reads > 32 / 4) {
+                printf("small READ replies were not batched\n");
+                goto fail;
+        }
+        if (staged > 4 * SMB2_RECV_PEEK_SIZE) {
+                printf("large READ data went through the staging buffer\n");
+                goto fail;
+        }
+
+        smb2_uring_destroy(ring);
+        disconnect_client();
+        return 0;
+
+ fail:
+        smb2_uring_destroy(ring);
+        disconnect_client();
+        return 1;
+}
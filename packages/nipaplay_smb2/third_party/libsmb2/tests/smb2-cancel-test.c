@@ -0,0 +1,287 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Cancels READs through a context connected to a minimal in-process
+ * server over a socketpair:
+ *  - READs on the wire get a CANCEL each and their replies are thrown away
+ *    without allocating room for them.
+ *  - READs still waiting for credits go out asking for 0 bytes.
+ *  - A READ whose reply is half received stops writing to its buffer.
+ *  - A READ the server made async is cancelled by its async id.
+ * The session must keep working after each of these.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define MAX_READ 65536
+#define NREADS 8
+
+static int cancelled;
+
+/* Receive at most len bytes of what the context waits for. */
+static int service_some(size_t len)
+{
+        struct iovec iov[8];
+        ssize_t count;
+        int i, niov;
+
+        niov = smb2_get_recv_iovecs(client, iov, 8);
+        if (niov < 2) {
+                return -1;
+        }
+        for (i = 0; i < niov && len; i++) {
+                if (iov[i].iov_len > len) {
+                        iov[i].iov_len = len;
+                }
+                len -= iov[i].iov_len;
+        }
+        count = readv(client->fd, iov, i);
+        if (count < 0) {
+                count = -errno;
+        }
+        return smb2_service_recv(client, (int)count);
+}
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+        struct smb2_read_cb_data *rd = command_data;
+        int i;
+
+        if (status == -nterror_to_errno(SMB2_STATUS_CANCELLED)) {
+                cancelled++;
+                return;
+        }
+        if (status != (int)rd->count) {
+                printf("read failed: %d %s\n", status, smb2_get_error(smb2));
+                failed = 1;
+                return;
+        }
+        for (i = 0; i < status; i++) {
+                if (rd->buf[i] != pattern(rd->offset + i)) {
+                        printf("bad data at offset %llu\n",
+                               (unsigned long long)(rd->offset + i));
+                        failed = 1;
+                        return;
+                }
+        }
+        completed++;
+}
+
+static int issue_reads(uint8_t *bufs, void *owner)
+{
+        int i;
+
+        for (i = 0; i < NREADS; i++) {
+                if (smb2_pread_async(client, fh, &bufs[i * MAX_READ],
+                                     MAX_READ, (uint64_t)i * MAX_READ,
+                                     read_cb, owner)) {
+                        printf("pread failed: %s\n", smb2_get_error(client));
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/* All READs are on the wire. Each gets a CANCEL, their full replies
+ * arrive anyway and are thrown away.
+ */
+static int cancel_sent(uint8_t *bufs)
+{
+        uint64_t discarded = client->discarded_bytes;
+        int i, n, cancels = 0, empty = 0;
+
+        cancelled = 0;
+        if (issue_reads(bufs, bufs)) {
+                return -1;
+        }
+        n = smb2_cancel_async(client, bufs);
+        if (n != NREADS || cancelled != NREADS) {
+                printf("cancelled %d, %d callbacks\n", n, cancelled);
+                return -1;
+        }
+        if (client->waitqueue != NULL || client->outqueue != NULL) {
+                printf("cancelled READs are still queued\n");
+                return -1;
+        }
+        if (serve_all(&cancels, &empty)) {
+                return -1;
+        }
+        if (cancels != NREADS) {
+                printf("%d CANCELs sent for %d READs\n", cancels, NREADS);
+                return -1;
+        }
+        memset(bufs, 0xaa, NREADS * MAX_READ);
+        if (check_session(bufs + NREADS * MAX_READ, read_cb)) {
+                return -1;
+        }
+        for (i = 0; i < NREADS * MAX_READ; i++) {
+                if (bufs[i] != 0xaa) {
+                        printf("cancelled READ wrote to its buffer\n");
+                        return -1;
+                }
+        }
+        discarded = client->discarded_bytes - discarded;
+        if (discarded < (uint64_t)NREADS * MAX_READ) {
+                printf("only %llu bytes discarded\n",
+                       (unsigned long long)discarded);
+                return -1;
+        }
+        printf("%d READs on the wire cancelled, %llu bytes discarded\n",
+               NREADS, (unsigned long long)discarded);
+        return 0;
+}
+
+/* The READs are still queued behind a cork. They go out for 0 bytes and
+ * need no CANCEL.
+ */
+static int cancel_queued(uint8_t *bufs)
+{
+        int cancels = 0, empty = 0;
+
+        cancelled = 0;
+        smb2_cork(client);
+        if (issue_reads(bufs, bufs)) {
+                return -1;
+        }
+        if (smb2_cancel_async(client, bufs) != NREADS ||
+            cancelled != NREADS) {
+                printf("queued READs were not cancelled\n");
+                return -1;
+        }
+        if (smb2_uncork(client) || serve_all(&cancels, &empty)) {
+                return -1;
+        }
+        if (cancels != 0 || empty != NREADS) {
+                printf("%d CANCELs and %d empty READs\n", cancels, empty);
+                return -1;
+        }
+        if (check_session(bufs, read_cb)) {
+                return -1;
+        }
+        printf("%d queued READs went out for 0 bytes\n", empty);
+        return 0;
+}
+
+/* Cancel a READ in the middle of receiving its data. */
+static int cancel_receiving(uint8_t *bufs)
+{
+        uint8_t copy[1024];
+        int i;
+
+        cancelled = 0;
+        memset(bufs, 0xaa, MAX_READ);
+        if (smb2_pread_async(client, fh, bufs, MAX_READ, 0, read_cb, bufs) ||
+            serve_one()) {
+                return -1;
+        }
+        /* SPL, header, fixed part and the first bytes of the data */
+        while (client->in.num_done < 4 + SMB2_HEADER_SIZE + 16 + 500) {
+                if (service_some(4 + SMB2_HEADER_SIZE + 16 + 500 -
+                                 client->in.num_done) < 0) {
+                        return -1;
+                }
+        }
+        if (smb2_cancel_async(client, bufs) != 1 || cancelled != 1) {
+                printf("READ being received was not cancelled\n");
+                return -1;
+        }
+        memcpy(copy, bufs, sizeof(copy));
+        if (check_session(bufs + MAX_READ, read_cb)) {
+                return -1;
+        }
+        if (memcmp(copy, bufs, sizeof(copy))) {
+                printf("cancelled READ kept writing to its buffer\n");
+                return -1;
+        }
+        for (i = sizeof(copy); i < MAX_READ; i++) {
+                if (bufs[i] != 0xaa) {
+                        printf("cancelled READ kept writing to its buffer\n");
+                        return -1;
+                }
+        }
+        printf("READ cancelled after 500 of %d bytes\n", MAX_READ);
+        return 0;
+}
+
+/* The server made the READ async. Its CANCEL must name the async id. */
+static int cancel_async(uint8_t *bufs)
+{
+        cancelled = 0;
+        if (smb2_pread_async(client, fh, bufs, 4096, 0, read_cb, bufs) ||
+            serve_pending()) {
+                return -1;
+        }
+        while (client->waitqueue->async_id == 0) {
+                if (smb2_service(client, POLLIN) < 0) {
+                        return -1;
+                }
+        }
+        if (smb2_cancel_async(client, bufs) != 1 || serve_one()) {
+                return -1;
+        }
+        if (last_command != SMB2_CANCEL ||
+            !(last_flags & SMB2_FLAGS_ASYNC_COMMAND) ||
+            last_async_id != ASYNC_ID) {
+                printf("CANCEL did not name the async id\n");
+                return -1;
+        }
+        if (check_session(bufs, read_cb)) {
+                return -1;
+        }
+        printf("async READ cancelled by its async id\n");
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        static uint8_t bufs[(NREADS + 1) * MAX_READ];
+
+        if (connect_client(SMB2_VERSION_0210) == NULL) {
+                return 1;
+        }
+        if (smb2_open_async(client, "file", O_RDONLY, open_cb, NULL) ||
+            serve_one() || service_until(1)) {
+                goto fail;
+        }
+        if (cancel_sent(bufs) || cancel_queued(bufs) ||
+            cancel_receiving(bufs) || cancel_async(bufs)) {
+                goto fail;
+        }
+
+        disconnect_client();
+        return 0;
+
+ fail:
+        disconnect_client();
+        return 1;
+}
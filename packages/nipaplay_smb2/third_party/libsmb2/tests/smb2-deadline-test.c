@@ -0,0 +1,296 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Gives READs millisecond deadlines through a context connected to a
+ * minimal in-process server over a socketpair:
+ *  - A deadline with a callback invokes it once, on time, and the READ
+ *    still completes.
+ *  - A READ on the wire past its deadline fails with -ETIMEDOUT, gets a
+ *    CANCEL and its late reply is thrown away.
+ *  - A READ still queued past its deadline goes out for 0 bytes.
+ *  - A deadline further out than one revolution of the timer wheel does
+ *    not pass early, and a per request deadline overrides the timeout of
+ *    the context.
+ * The session must keep working after each of these.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define READ_SIZE 4096
+/* Slack for the scheduler when checking how late a deadline fired */
+#define LATE_MS 200
+
+static int timed_out;
+static int notified;
+
+static uint64_t now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Poll the context for as long as smb2_next_deadline() says, until *flag
+ * reaches target. Returns how long that took in ms, or -1.
+ */
+static int service_for(int *flag, int target)
+{
+        uint64_t start = now_ms();
+        struct pollfd pfd;
+        int timeout;
+
+        while (*flag < target && !failed) {
+                if (now_ms() - start > 5000) {
+                        printf("deadline did not pass\n");
+                        return -1;
+                }
+                timeout = smb2_next_deadline(client);
+                if (timeout < 0 || timeout > 100) {
+                        timeout = 100;
+                }
+                pfd.fd = client->fd;
+                pfd.events = smb2_which_events(client);
+                pfd.revents = 0;
+                if (poll(&pfd, 1, timeout) < 0 ||
+                    smb2_service(client, pfd.revents) < 0) {
+                        printf("service failed: %s\n",
+                               smb2_get_error(client));
+                        return -1;
+                }
+        }
+        return failed ? -1 : (int)(now_ms() - start);
+}
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+        struct smb2_read_cb_data *rd = command_data;
+        int i;
+
+        if (status == -ETIMEDOUT) {
+                timed_out++;
+                return;
+        }
+        if (status != (int)rd->count) {
+                printf("read failed: %d %s\n", status, smb2_get_error(smb2));
+                failed = 1;
+                return;
+        }
+        for (i = 0; i < status; i++) {
+                if (rd->buf[i] != pattern(rd->offset + i)) {
+                        printf("bad data at offset %llu\n",
+                               (unsigned long long)(rd->offset + i));
+                        failed = 1;
+                        return;
+                }
+        }
+        completed++;
+}
+
+static void deadline_cb(struct smb2_context *smb2, void *cb_data)
+{
+        if (smb2 != client || cb_data == NULL) {
+                printf("deadline callback with the wrong arguments\n");
+                failed = 1;
+        }
+        notified++;
+}
+
+/* The callback is invoked once, on time, and the READ keeps going. */
+static int notify(uint8_t *buf)
+{
+        int ms, next, target = completed + 1;
+
+        notified = 0;
+        if (smb2_pread_async(client, fh, buf, READ_SIZE, 0, read_cb, buf) ||
+            smb2_set_deadline_async(client, buf, 50, deadline_cb) != 1) {
+                printf("no READ given the deadline\n");
+                return -1;
+        }
+        next = smb2_next_deadline(client);
+        if (next < 0 || next > 50) {
+                printf("next deadline in %d ms\n", next);
+                return -1;
+        }
+        ms = service_for(&notified, 1);
+        if (ms < 0) {
+                return -1;
+        }
+        if (ms < 45 || ms > 50 + LATE_MS) {
+                printf("50 ms deadline passed after %d ms\n", ms);
+                return -1;
+        }
+        if (client->waitqueue == NULL || smb2_next_deadline(client) != -1) {
+                printf("READ did not keep going after its deadline\n");
+                return -1;
+        }
+        if (serve_one() || service_for(&completed, target) < 0) {
+                return -1;
+        }
+        if (notified != 1 || timed_out != 0) {
+                printf("%d callbacks, %d timeouts\n", notified, timed_out);
+                return -1;
+        }
+        printf("deadline callback after %d ms, READ completed\n", ms);
+        return 0;
+}
+
+/* The READ on the wire fails, gets a CANCEL and its reply is dropped. */
+static int expire_sent(uint8_t *buf)
+{
+        uint64_t discarded = client->discarded_bytes;
+        int ms, cancels = 0, empty = 0;
+
+        timed_out = 0;
+        memset(buf, 0xaa, READ_SIZE);
+        if (smb2_pread_async(client, fh, buf, READ_SIZE, 0, read_cb, buf) ||
+            smb2_set_deadline_async(client, buf, 30, NULL) != 1) {
+                return -1;
+        }
+        ms = service_for(&timed_out, 1);
+        if (ms < 0) {
+                return -1;
+        }
+        if (ms < 25 || ms > 30 + LATE_MS) {
+                printf("30 ms deadline passed after %d ms\n", ms);
+                return -1;
+        }
+        if (client->waitqueue != NULL || client->expired_pdus != 1) {
+                printf("expired READ is still waited for\n");
+                return -1;
+        }
+        /* The READ, then its CANCEL */
+        if (serve_all(&cancels, &empty) || cancels != 1) {
+                printf("%d CANCELs for the expired READ\n", cancels);
+                return -1;
+        }
+        if (check_session(buf + READ_SIZE, read_cb)) {
+                return -1;
+        }
+        if (buf[0] != 0xaa || client->discarded_bytes - discarded <
+            READ_SIZE) {
+                printf("reply of the expired READ was not thrown away\n");
+                return -1;
+        }
+        printf("READ on the wire timed out after %d ms\n", ms);
+        return 0;
+}
+
+/* The READ is still queued behind a cork. It goes out for 0 bytes. */
+static int expire_queued(uint8_t *buf)
+{
+        int cancels = 0, empty = 0;
+
+        timed_out = 0;
+        smb2_cork(client);
+        if (smb2_pread_async(client, fh, buf, READ_SIZE, 0, read_cb, buf) ||
+            smb2_set_deadline_async(client, buf, 20, NULL) != 1 ||
+            service_for(&timed_out, 1) < 0) {
+                return -1;
+        }
+        if (smb2_uncork(client) || serve_all(&cancels, &empty)) {
+                return -1;
+        }
+        if (cancels != 0 || empty != 1) {
+                printf("%d CANCELs and %d empty READs\n", cancels, empty);
+                return -1;
+        }
+        if (check_session(buf, read_cb)) {
+                return -1;
+        }
+        printf("queued READ timed out and went out for 0 bytes\n");
+        return 0;
+}
+
+/* One READ is due after more than a revolution of the wheel, the other one
+ * overrides the timeout of the context.
+ */
+static int expire_far(uint8_t *buf)
+{
+        const int far = SMB2_TIMER_SLOTS * SMB2_TIMER_TICK_MS + 100;
+        int ms, cancels = 0, empty = 0;
+
+        timed_out = 0;
+        smb2_set_timeout(client, 10);
+        if (smb2_pread_async(client, fh, buf, READ_SIZE, 0, read_cb, buf) ||
+            smb2_pread_async(client, fh, buf + READ_SIZE, READ_SIZE, 0,
+                             read_cb, buf + READ_SIZE)) {
+                return -1;
+        }
+        smb2_set_timeout(client, 0);
+        if (smb2_next_deadline(client) < 9000 ||
+            smb2_set_deadline_async(client, buf, far, NULL) != 1 ||
+            smb2_set_deadline_async(client, buf + READ_SIZE, 30, NULL) != 1) {
+                return -1;
+        }
+        ms = service_for(&timed_out, 2);
+        if (ms < 0) {
+                return -1;
+        }
+        if (ms < far - 5 || ms > far + LATE_MS) {
+                printf("%d ms deadline passed after %d ms\n", far, ms);
+                return -1;
+        }
+        if (serve_all(&cancels, &empty) || cancels != 2 ||
+            check_session(buf, read_cb)) {
+                return -1;
+        }
+        printf("%d ms deadline passed after %d ms\n", far, ms);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        static uint8_t bufs[2 * READ_SIZE];
+
+        if (connect_client(SMB2_VERSION_0210) == NULL) {
+                return 1;
+        }
+        client->max_read_size = READ_SIZE;
+
+        if (smb2_open_async(client, "file", O_RDONLY, open_cb, NULL) ||
+            serve_one() || service_for(&completed, 1) < 0) {
+                goto fail;
+        }
+        if (notify(bufs) || expire_sent(bufs) || expire_queued(bufs) ||
+            expire_far(bufs)) {
+                goto fail;
+        }
+
+        disconnect_client();
+        return 0;
+
+ fail:
+        disconnect_client();
+        return 1;
+}
@@ -0,0 +1,287 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Opens durable handles through a context connected to a minimal
+ * in-process server over a socketpair:
+ *  - On SMB 3.0 the CREATE carries a DH2Q context with the create guid and
+ *    asks for a batch oplock. The handle is durable only if the server
+ *    answers with a DH2Q context of its own.
+ *  - A reclaim from a new connection carries a DH2C context with the file
+ *    id and the create guid.
+ *  - On SMB 2.1 the open is a plain one and a reclaim fails.
+ *  - An oplock break without a callback is acknowledged at the level the
+ *    server broke to.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define TIMEOUT 60000
+
+static const smb2_create_guid guid = {
+        0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe,
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef
+};
+
+/* What the server saw last of a CREATE */
+static uint8_t last_oplock;
+static char last_tag[5];
+static uint8_t last_data[64];
+static uint32_t last_data_len;
+
+/* Read one request and remember what it was. Of a CREATE, remember the
+ * oplock it asked for and its first create context.
+ */
+static int read_one(void)
+{
+        static uint8_t req[1024];
+        uint32_t off, len;
+        uint16_t data_off;
+        int spl;
+
+        spl = read_request(req, sizeof(req));
+        if (spl < 0) {
+                return -1;
+        }
+        last_tag[0] = 0;
+        last_data_len = 0;
+        if (last_command != SMB2_CREATE) {
+                return 0;
+        }
+        last_oplock = req[SMB2_HEADER_SIZE + 3];
+        off = get32(req + SMB2_HEADER_SIZE + 48);
+        len = get32(req + SMB2_HEADER_SIZE + 52);
+        if (len == 0) {
+                return 0;
+        }
+        if (off + len > (uint32_t)spl || len < 24) {
+                printf("create context out of bounds\n");
+                return -1;
+        }
+        memcpy(last_tag, req + off + get16(req + off + 4), 4);
+        data_off = get16(req + off + 10);
+        last_data_len = get32(req + off + 12);
+        if (data_off + last_data_len > len ||
+            last_data_len > sizeof(last_data)) {
+                printf("create context data out of bounds\n");
+                return -1;
+        }
+        memcpy(last_data, req + off + data_off, last_data_len);
+        return 0;
+}
+
+/* Answer a CREATE with file id fill, granting the oplock it asked for.
+ * With durable set the reply carries a DH2Q context.
+ */
+static int serve_create(uint8_t fill, int durable)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 88 + 32];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE], *ctx = body + 88;
+        uint32_t len = 88;
+
+        if (read_one()) {
+                return -1;
+        }
+        if (last_command != SMB2_CREATE) {
+                printf("expected CREATE, got command %d\n", last_command);
+                return -1;
+        }
+        init_header(&rep[4], SMB2_CREATE, last_mid, 0);
+        memset(body, 0, 88 + 32);
+        put16(body, SMB2_CREATE_REPLY_SIZE);
+        body[2] = last_oplock;
+        put64(body + 48, 1024 * 1024);
+        memset(body + 64, fill, SMB2_FD_SIZE);
+        if (durable) {
+                put32(body + 80, SMB2_HEADER_SIZE + 88);
+                put32(body + 84, 32);
+                put16(ctx + 4, 16);
+                put16(ctx + 6, 4);
+                put16(ctx + 10, 24);
+                put32(ctx + 12, 8);
+                memcpy(ctx + 16, "DH2Q", 4);
+                put32(ctx + 24, TIMEOUT);
+                len += 32;
+        }
+        return write_reply(rep, len);
+}
+
+static int open_durable(int granted)
+{
+        if (smb2_open_durable_async(client, "file", O_RDONLY, guid,
+                                    TIMEOUT, 0, NULL, open_cb, NULL) ||
+            serve_create(0x42, granted) || service_until(completed + 1)) {
+                return -1;
+        }
+        if (strcmp(last_tag, "DH2Q") ||
+            last_data_len != SMB2_CREATE_DURABLE_V2_REQUEST_SIZE ||
+            get32(last_data) != TIMEOUT ||
+            memcmp(last_data + 16, guid, SMB2_CREATE_GUID_SIZE)) {
+                printf("CREATE did not carry a DH2Q context\n");
+                return -1;
+        }
+        if (last_oplock != SMB2_OPLOCK_LEVEL_BATCH) {
+                printf("durable CREATE asked for oplock %d\n", last_oplock);
+                return -1;
+        }
+        if (smb2_fh_is_durable(fh) != granted) {
+                printf("handle durable %d, server granted %d\n",
+                       smb2_fh_is_durable(fh), granted);
+                return -1;
+        }
+        return 0;
+}
+
+/* The server breaks the batch oplock to level II. The context answers on
+ * its own, at level II and for the same file id.
+ */
+static int oplock_break(void)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 24];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE];
+
+        init_header(&rep[4], SMB2_OPLOCK_BREAK, 0xffffffffffffffffULL, 0);
+        memset(body, 0, 24);
+        put16(body, SMB2_OPLOCK_BREAK_NOTIFICATION_SIZE);
+        body[2] = SMB2_OPLOCK_LEVEL_II;
+        memset(body + 8, 0x42, SMB2_FD_SIZE);
+        if (write_reply(rep, 24) || service_until_sent(1000) != 1 ||
+            read_one()) {
+                printf("oplock break was not acknowledged\n");
+                return -1;
+        }
+        if (last_command != SMB2_OPLOCK_BREAK ||
+            last_body[2] != SMB2_OPLOCK_LEVEL_II ||
+            memcmp(last_body + 8, smb2_get_file_id(fh), SMB2_FD_SIZE)) {
+                printf("oplock break acknowledged wrongly\n");
+                return -1;
+        }
+        return 0;
+}
+
+/* The connection is gone. Reclaim the handle from a new one. */
+static int reclaim(void)
+{
+        smb2_file_id file_id;
+
+        memcpy(file_id, smb2_get_file_id(fh), SMB2_FD_SIZE);
+        smb2_free_fh(client, fh);
+        disconnect_client();
+        if (connect_client(SMB2_VERSION_0300) == NULL) {
+                return -1;
+        }
+        if (smb2_reopen_durable_async(client, "file", O_RDONLY, guid,
+                                      file_id, 0, NULL, open_cb, NULL) ||
+            serve_create(0x42, 0) || service_until(completed + 1)) {
+                return -1;
+        }
+        if (strcmp(last_tag, "DH2C") ||
+            last_data_len != SMB2_CREATE_DURABLE_V2_RECONNECT_SIZE ||
+            memcmp(last_data, file_id, SMB2_FD_SIZE) ||
+            memcmp(last_data + 16, guid, SMB2_CREATE_GUID_SIZE) ||
+            get32(last_data + 32) != 0) {
+                printf("CREATE did not carry a DH2C context\n");
+                return -1;
+        }
+        if (!smb2_fh_is_durable(fh) ||
+            memcmp(smb2_get_file_id(fh), file_id, SMB2_FD_SIZE)) {
+                printf("reclaimed handle is not the durable one\n");
+                return -1;
+        }
+        return 0;
+}
+
+/* Below SMB 3.0 there are no durable handles v2. */
+static int old_dialect(void)
+{
+        smb2_file_id file_id;
+
+        disconnect_client();
+        if (connect_client(SMB2_VERSION_0210) == NULL) {
+                return -1;
+        }
+        if (smb2_open_durable_async(client, "file", O_RDONLY, guid,
+                                    TIMEOUT, 0, NULL, open_cb, NULL) ||
+            serve_create(0x43, 0) || service_until(completed + 1)) {
+                return -1;
+        }
+        if (last_tag[0] || last_oplock != SMB2_OPLOCK_LEVEL_NONE ||
+            smb2_fh_is_durable(fh)) {
+                printf("durable open on SMB 2.1 was not a plain one\n");
+                return -1;
+        }
+        memcpy(file_id, smb2_get_file_id(fh), SMB2_FD_SIZE);
+        if (smb2_reopen_durable_async(client, "file", O_RDONLY, guid,
+                                      file_id, 0, NULL, open_cb, NULL) == 0) {
+                printf("reclaim on SMB 2.1 did not fail\n");
+                return -1;
+        }
+        smb2_free_fh(client, fh);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        if (connect_client(SMB2_VERSION_0300) == NULL) {
+                return 1;
+        }
+        if (open_durable(0)) {
+                goto fail;
+        }
+        smb2_free_fh(client, fh);
+        printf("DH2Q sent, handle not durable without a DH2Q reply\n");
+
+        if (open_durable(1)) {
+                goto fail;
+        }
+        printf("DH2Q sent with a batch oplock, handle durable\n");
+
+        if (oplock_break()) {
+                goto fail;
+        }
+        printf("oplock break acknowledged at level II\n");
+
+        if (reclaim()) {
+                goto fail;
+        }
+        smb2_free_fh(client, fh);
+        printf("durable handle reclaimed with DH2C\n");
+
+        if (old_dialect()) {
+                goto fail;
+        }
+        printf("plain open and no reclaim on SMB 2.1\n");
+
+        disconnect_client();
+        return 0;
+
+ fail:
+        disconnect_client();
+        return 1;
+}
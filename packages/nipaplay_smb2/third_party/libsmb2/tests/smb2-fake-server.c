@@ -0,0 +1,404 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+struct smb2_context *client;
+int srv_fd = -1;
+struct smb2fh *fh;
+int completed;
+int failed;
+
+uint16_t last_command;
+uint32_t last_flags;
+uint64_t last_mid;
+uint64_t last_async_id;
+uint32_t last_tree_id;
+uint64_t last_session_id;
+uint32_t last_count;
+uint8_t last_body[128];
+
+int read_full(int fd, uint8_t *buf, size_t len)
+{
+        ssize_t count;
+
+        while (len) {
+                count = read(fd, buf, len);
+                if (count <= 0) {
+                        return -1;
+                }
+                buf += count;
+                len -= count;
+        }
+        return 0;
+}
+
+int write_full(int fd, const uint8_t *buf, size_t len)
+{
+        ssize_t count;
+
+        while (len) {
+                count = write(fd, buf, len);
+                if (count <= 0) {
+                        return -1;
+                }
+                buf += count;
+                len -= count;
+        }
+        return 0;
+}
+
+void put16(uint8_t *p, uint16_t v)
+{
+        p[0] = v; p[1] = v >> 8;
+}
+
+void put32(uint8_t *p, uint32_t v)
+{
+        put16(p, v); put16(p + 2, v >> 16);
+}
+
+void put64(uint8_t *p, uint64_t v)
+{
+        put32(p, v); put32(p + 4, v >> 32);
+}
+
+uint16_t get16(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8);
+}
+
+uint32_t get32(const uint8_t *p)
+{
+        return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+uint64_t get64(const uint8_t *p)
+{
+        return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+uint8_t pattern(uint64_t offset)
+{
+        return (uint8_t)(offset * 7 + (offset >> 12));
+}
+
+struct smb2_context *connect_client(uint16_t dialect)
+{
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+                printf("socketpair failed\n");
+                return NULL;
+        }
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+        srv_fd = sv[1];
+
+        client = smb2_init_context();
+        if (client == NULL) {
+                printf("Failed to init context\n");
+                close(sv[0]);
+                close(sv[1]);
+                srv_fd = -1;
+                return NULL;
+        }
+        client->fd = sv[0];
+        client->dialect = dialect;
+        client->supports_multi_credit = 1;
+        client->max_read_size = FAKE_MAX_READ;
+        client->credits = 256;
+        return client;
+}
+
+void disconnect_client(void)
+{
+        smb2_destroy_context(client);
+        client = NULL;
+        if (srv_fd >= 0) {
+                close(srv_fd);
+                srv_fd = -1;
+        }
+        fh = NULL;
+}
+
+int read_request(uint8_t *req, uint32_t size)
+{
+        uint32_t spl;
+
+        if (read_full(srv_fd, req, 4)) {
+                return -1;
+        }
+        spl = (req[1] << 16) | (req[2] << 8) | req[3];
+        if (spl > size || spl < SMB2_HEADER_SIZE ||
+            read_full(srv_fd, req, spl)) {
+                return -1;
+        }
+        last_command = get16(req + 12);
+        last_flags = get32(req + 16);
+        last_mid = get64(req + 24);
+        last_async_id = get64(req + 32);
+        last_tree_id = get32(req + 36);
+        last_session_id = get64(req + 40);
+        memset(last_body, 0, sizeof(last_body));
+        memcpy(last_body, req + SMB2_HEADER_SIZE,
+               spl - SMB2_HEADER_SIZE < sizeof(last_body) ?
+               spl - SMB2_HEADER_SIZE : sizeof(last_body));
+        last_count = 0;
+        if (last_command == SMB2_READ) {
+                last_count = get32(last_body + 4);
+        }
+        return spl;
+}
+
+void init_header(uint8_t *hdr, uint16_t command, uint64_t mid,
+                 uint32_t status)
+{
+        memset(hdr, 0, SMB2_HEADER_SIZE);
+        memcpy(hdr, "\xfeSMB", 4);
+        put16(hdr + 4, SMB2_HEADER_SIZE);
+        put32(hdr + 8, status);
+        put16(hdr + 12, command);
+        put16(hdr + 14, 1);
+        put32(hdr + 16, SMB2_FLAGS_SERVER_TO_REDIR);
+        put64(hdr + 24, mid);
+        put64(hdr + 40, last_session_id);
+}
+
+int write_reply(uint8_t *rep, uint32_t len)
+{
+        uint32_t spl = SMB2_HEADER_SIZE + len;
+
+        rep[0] = 0;
+        rep[1] = spl >> 16; rep[2] = spl >> 8; rep[3] = spl;
+        return write_full(srv_fd, rep, 4 + spl);
+}
+
+static int serve(int pending)
+{
+        static uint8_t req[1024];
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 88 + FAKE_MAX_READ];
+        uint8_t *hdr = &rep[4], *body = &rep[4 + SMB2_HEADER_SIZE];
+        uint32_t len = 0, count, i;
+        uint64_t offset;
+
+        if (read_request(req, sizeof(req)) < 0) {
+                return -1;
+        }
+
+        init_header(hdr, last_command, last_mid, 0);
+        memset(body, 0, 88);
+
+        switch (last_command) {
+        case SMB2_CANCEL:
+                return 0;
+        case SMB2_CREATE:
+                put16(body, SMB2_CREATE_REPLY_SIZE);
+                put64(body + 48, 16 * 1024 * 1024);
+                memset(body + 64, 0x42, SMB2_FD_SIZE);
+                len = 88;
+                break;
+        case SMB2_ECHO:
+                put16(body, SMB2_ECHO_REPLY_SIZE);
+                len = 4;
+                break;
+        case SMB2_READ:
+                if (pending) {
+                        put32(hdr + 8, SMB2_STATUS_PENDING);
+                        put32(hdr + 16, SMB2_FLAGS_SERVER_TO_REDIR |
+                              SMB2_FLAGS_ASYNC_COMMAND);
+                        put64(hdr + 32, ASYNC_ID);
+                        put16(body, SMB2_ERROR_REPLY_SIZE);
+                        len = 9;
+                        break;
+                }
+                count = last_count;
+                offset = get64(req + SMB2_HEADER_SIZE + 8);
+                if (count > FAKE_MAX_READ) {
+                        count = FAKE_MAX_READ;
+                }
+                put16(body, SMB2_READ_REPLY_SIZE);
+                body[2] = SMB2_HEADER_SIZE + 16;
+                put32(body + 4, count);
+                for (i = 0; i < count; i++) {
+                        body[16 + i] = pattern(offset + i);
+                }
+                len = 16 + count;
+                break;
+        default:
+                printf("unexpected command %d\n", last_command);
+                return -1;
+        }
+
+        return write_reply(rep, len);
+}
+
+int serve_one(void)
+{
+        return serve(0);
+}
+
+int serve_pending(void)
+{
+        return serve(1);
+}
+
+int service_until(int target)
+{
+        while (completed < target && !failed) {
+                if (smb2_service(client, POLLIN) < 0) {
+                        printf("service failed: %s\n",
+                               smb2_get_error(client));
+                        return -1;
+                }
+        }
+        return failed ? -1 : 0;
+}
+
+int service_until_sent(int wait_ms)
+{
+        struct pollfd pfd[2];
+        int done = completed;
+
+        pfd[1].fd = srv_fd;
+        pfd[1].events = POLLIN;
+        do {
+                pfd[0].fd = smb2_get_fd(client);
+                pfd[0].events = smb2_which_events(client);
+                pfd[0].revents = pfd[1].revents = 0;
+                if (poll(pfd, 2, 10) < 0) {
+                        return -1;
+                }
+                if (pfd[0].revents &&
+                    smb2_service(client, pfd[0].revents) < 0) {
+                        /* A request that failed may have closed the
+                         * connection on its way out.
+                         */
+                        if (completed != done) {
+                                return 0;
+                        }
+                        printf("service failed: %s\n",
+                               smb2_get_error(client));
+                        return -1;
+                }
+                if (pfd[1].revents) {
+                        return 1;
+                }
+                wait_ms -= 10;
+        } while (wait_ms > 0);
+        return 0;
+}
+
+int pump(void)
+{
+        struct pollfd pfd;
+
+        for (;;) {
+                pfd.fd = client->fd;
+                pfd.events = smb2_which_events(client);
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 0) <= 0) {
+                        return 0;
+                }
+                if (smb2_service(client, pfd.revents) < 0) {
+                        printf("service failed: %s\n",
+                               smb2_get_error(client));
+                        return -1;
+                }
+        }
+}
+
+int serve_all(int *cancels, int *empty)
+{
+        struct pollfd pfd;
+
+        for (;;) {
+                pfd.fd = srv_fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 100) <= 0) {
+                        return 0;
+                }
+                if (serve_one()) {
+                        return -1;
+                }
+                if (last_command == SMB2_CANCEL) {
+                        (*cancels)++;
+                        if (last_flags & SMB2_FLAGS_ASYNC_COMMAND) {
+                                printf("CANCEL of a sync READ is async\n");
+                                return -1;
+                        }
+                } else if (last_command == SMB2_READ && last_count == 0) {
+                        (*empty)++;
+                }
+                if (pump()) {
+                        return -1;
+                }
+        }
+}
+
+int check_session(uint8_t *buf, smb2_command_cb read_cb)
+{
+        int target = completed + 2;
+
+        if (smb2_echo_async(client, echo_cb, NULL) ||
+            smb2_pread_async(client, fh, buf, 4096, 12345, read_cb, NULL)) {
+                printf("requests failed: %s\n", smb2_get_error(client));
+                return -1;
+        }
+        if (serve_one() || serve_one() || service_until(target)) {
+                printf("session broken\n");
+                return -1;
+        }
+        return 0;
+}
+
+void open_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *cb_data)
+{
+        if (status) {
+                printf("open failed: %s\n", smb2_get_error(smb2));
+                failed = 1;
+                return;
+        }
+        fh = command_data;
+        completed++;
+}
+
+void echo_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *cb_data)
+{
+        if (status) {
+                printf("echo failed: %s\n", smb2_get_error(smb2));
+                failed = 1;
+                return;
+        }
+        completed++;
+}
@@ -0,0 +1,120 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _SMB2_FAKE_SERVER_H_
+#define _SMB2_FAKE_SERVER_H_
+
+/*
+ * A minimal in-process server for the tests. The context under test is
+ * connected to it over a socketpair as if a dialect had been negotiated,
+ * and the test answers its requests by hand.
+ */
+
+/* Largest READ serve_one() answers in full */
+#define FAKE_MAX_READ 65536
+
+/* The context under test and the server end of its socket */
+extern struct smb2_context *client;
+extern int srv_fd;
+
+/* Set by open_cb() */
+extern struct smb2fh *fh;
+/* Bumped by the callbacks of the tests as their requests complete */
+extern int completed;
+extern int failed;
+
+/* What the server saw last */
+extern uint16_t last_command;
+extern uint32_t last_flags;
+extern uint64_t last_mid;
+extern uint64_t last_async_id;
+extern uint32_t last_tree_id;
+extern uint64_t last_session_id;
+/* Bytes asked for, if it was a READ */
+extern uint32_t last_count;
+/* The start of its body, zero padded */
+extern uint8_t last_body[128];
+
+int read_full(int fd, uint8_t *buf, size_t len);
+int write_full(int fd, const uint8_t *buf, size_t len);
+
+void put16(uint8_t *p, uint16_t v);
+void put32(uint8_t *p, uint32_t v);
+void put64(uint8_t *p, uint64_t v);
+uint16_t get16(const uint8_t *p);
+uint32_t get32(const uint8_t *p);
+uint64_t get64(const uint8_t *p);
+
+/* The content of the file served, at offset */
+uint8_t pattern(uint64_t offset);
+
+/* Pretend the given dialect was negotiated on a fresh socketpair. */
+struct smb2_context *connect_client(uint16_t dialect);
+void disconnect_client(void);
+
+/* Read one request of at most size bytes into req and remember what it
+ * was. Returns its length without the SPL, or -1.
+ */
+int read_request(uint8_t *req, uint32_t size);
+
+/* Fill in the header of a reply in the session of the last request. */
+void init_header(uint8_t *hdr, uint16_t command, uint64_t mid,
+                 uint32_t status);
+
+/* Send the reply in rep, a header at rep + 4 and len bytes of body after
+ * it, with its SPL.
+ */
+int write_reply(uint8_t *rep, uint32_t len);
+
+/* Answer one request: CREATE gets a file id, ECHO an empty reply and READ
+ * the requested number of bytes of the pattern at the requested offset.
+ * A CANCEL gets no reply.
+ */
+int serve_one(void);
+
+/* Like serve_one(), but a READ only gets an interim reply that makes it
+ * async with ASYNC_ID.
+ */
+#define ASYNC_ID 0x1234
+int serve_pending(void);
+
+/* Service the client until completed reaches target. */
+int service_until(int target);
+
+/* Service the client until it sends something, for at most wait_ms.
+ * Returns 1 if it did.
+ */
+int service_until_sent(int wait_ms);
+
+/* Let the context read what the server wrote so far and send what it
+ * has queued. Replies are served one at a time and drained right away so
+ * that the server never blocks on a full socket.
+ */
+int pump(void);
+
+/* Serve what the client sent until it has been quiet for a while,
+ * counting the CANCELs and the READs for 0 bytes.
+ */
+int serve_all(int *cancels, int *empty);
+
+/* The session still works: an ECHO and a READ of 4096 bytes into buf
+ * complete. The READ completes through read_cb.
+ */
+int check_session(uint8_t *buf, smb2_command_cb read_cb);
+
+void open_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *cb_data);
+void echo_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *cb_data);
+
+#endif /* !_SMB2_FAKE_SERVER_H_ */
@@ -0,0 +1,360 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Opens files with leases through a context connected to a minimal
+ * in-process server over a socketpair:
+ *  - A durable open with a lease chains a RqLs context before the DH2Q
+ *    one and asks for a lease instead of an oplock. The state the server
+ *    granted is the one smb2_fh_lease_state() reports.
+ *  - A lease break that requires an acknowledgement is answered with the
+ *    state the break callback chose, and the answer of the server to
+ *    that acknowledgement is swallowed.
+ *  - A break that requires none is reported but not answered.
+ *  - On SMB 2.1 the lease is asked for without a DH2Q context.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define TIMEOUT 60000
+#define LEASE_RH (SMB2_LEASE_READ_CACHING | SMB2_LEASE_HANDLE_CACHING)
+
+static const smb2_create_guid guid = {
+        0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe,
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef
+};
+
+static const smb2_lease_key key = {
+        0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf
+};
+
+/* What the break callback saw last */
+static int breaks;
+static uint32_t break_current;
+static uint32_t break_new;
+
+/* What the server saw last of a CREATE */
+static uint8_t last_oplock;
+static int last_ntags;
+static char last_tag[2][5];
+static uint8_t last_data[2][64];
+static uint32_t last_data_len[2];
+
+/* Read one request and remember what it was. Of a CREATE, remember the
+ * oplock it asked for and its first two create contexts.
+ */
+static int read_one(void)
+{
+        static uint8_t req[1024];
+        uint32_t off, len, next;
+        uint16_t data_off;
+        int spl;
+
+        spl = read_request(req, sizeof(req));
+        if (spl < 0) {
+                return -1;
+        }
+        last_ntags = 0;
+        if (last_command != SMB2_CREATE) {
+                return 0;
+        }
+        last_oplock = req[SMB2_HEADER_SIZE + 3];
+        off = get32(req + SMB2_HEADER_SIZE + 48);
+        len = get32(req + SMB2_HEADER_SIZE + 52);
+        if (len == 0) {
+                return 0;
+        }
+        if (off + len > (uint32_t)spl) {
+                printf("create contexts out of bounds\n");
+                return -1;
+        }
+        while (last_ntags < 2) {
+                if (len < 24) {
+                        printf("create context out of bounds\n");
+                        return -1;
+                }
+                memcpy(last_tag[last_ntags],
+                       req + off + get16(req + off + 4), 4);
+                last_tag[last_ntags][4] = 0;
+                data_off = get16(req + off + 10);
+                last_data_len[last_ntags] = get32(req + off + 12);
+                if (data_off + last_data_len[last_ntags] > len ||
+                    last_data_len[last_ntags] > sizeof(last_data[0])) {
+                        printf("create context data out of bounds\n");
+                        return -1;
+                }
+                memcpy(last_data[last_ntags], req + off + data_off,
+                       last_data_len[last_ntags]);
+                last_ntags++;
+                next = get32(req + off);
+                if (next == 0) {
+                        break;
+                }
+                if (next > len) {
+                        printf("next create context out of bounds\n");
+                        return -1;
+                }
+                off += next;
+                len -= next;
+        }
+        return 0;
+}
+
+/* Answer a CREATE with file id fill. If it asked for a lease, grant the
+ * given state of it in a RqLs context.
+ */
+static int serve_create(uint8_t fill, uint32_t granted)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 88 + 56];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE], *ctx = body + 88;
+        uint32_t len = 88;
+
+        if (read_one()) {
+                return -1;
+        }
+        if (last_command != SMB2_CREATE) {
+                printf("expected CREATE, got command %d\n", last_command);
+                return -1;
+        }
+        init_header(&rep[4], SMB2_CREATE, last_mid, 0);
+        memset(body, 0, 88 + 56);
+        put16(body, SMB2_CREATE_REPLY_SIZE);
+        body[2] = last_oplock;
+        put64(body + 48, 1024 * 1024);
+        memset(body + 64, fill, SMB2_FD_SIZE);
+        if (last_oplock == SMB2_OPLOCK_LEVEL_LEASE) {
+                put32(body + 80, SMB2_HEADER_SIZE + 88);
+                put32(body + 84, 56);
+                put16(ctx + 4, 16);
+                put16(ctx + 6, 4);
+                put16(ctx + 10, 24);
+                put32(ctx + 12, 32);
+                memcpy(ctx + 16, "RqLs", 4);
+                memcpy(ctx + 24, key, SMB2_LEASE_KEY_SIZE);
+                put32(ctx + 40, granted);
+                len += 56;
+        }
+        return write_reply(rep, len);
+}
+
+/* Give up handle caching only */
+static void break_cb(struct smb2_context *smb2, int status,
+                     struct smb2_oplock_or_lease_break_reply *rep,
+                     uint8_t *new_oplock_level, uint32_t *new_lease_state)
+{
+        if (status ||
+            rep->break_type != SMB2_BREAK_TYPE_LEASE_NOTIFICATION ||
+            memcmp(rep->lock.lease.lease_key, key, SMB2_LEASE_KEY_SIZE)) {
+                return;
+        }
+        breaks++;
+        break_current = rep->lock.lease.current_lease_state;
+        break_new = rep->lock.lease.new_lease_state;
+        *new_lease_state = break_current & ~SMB2_LEASE_HANDLE_CACHING;
+}
+
+/* Pretend the given dialect was negotiated and take lease breaks. */
+static struct smb2_context *connect_leased(uint16_t dialect)
+{
+        if (connect_client(dialect) == NULL) {
+                return NULL;
+        }
+        smb2_set_oplock_or_lease_break_callback(client, break_cb);
+        return client;
+}
+
+/* Ask for RH, the server grants R only */
+static int open_leased(void)
+{
+        if (smb2_open_durable_async(client, "file", O_RDONLY, guid,
+                                    TIMEOUT, LEASE_RH, key, open_cb, NULL) ||
+            serve_create(0x42, SMB2_LEASE_READ_CACHING) ||
+            service_until(completed + 1)) {
+                return -1;
+        }
+        if (last_oplock != SMB2_OPLOCK_LEVEL_LEASE) {
+                printf("leased CREATE asked for oplock %d\n", last_oplock);
+                return -1;
+        }
+        if (last_ntags != 2 ||
+            strcmp(last_tag[0], "RqLs") ||
+            last_data_len[0] != SMB2_CREATE_REQUEST_LEASE_SIZE ||
+            memcmp(last_data[0], key, SMB2_LEASE_KEY_SIZE) ||
+            get32(last_data[0] + 16) != LEASE_RH) {
+                printf("CREATE did not carry a RqLs context first\n");
+                return -1;
+        }
+        if (strcmp(last_tag[1], "DH2Q") ||
+            memcmp(last_data[1] + 16, guid, SMB2_CREATE_GUID_SIZE)) {
+                printf("CREATE did not carry a DH2Q context second\n");
+                return -1;
+        }
+        if (smb2_fh_lease_state(fh) != SMB2_LEASE_READ_CACHING) {
+                printf("lease state %x, server granted R\n",
+                       smb2_fh_lease_state(fh));
+                return -1;
+        }
+        return 0;
+}
+
+static int send_lease_break(uint32_t flags, uint32_t current,
+                            uint32_t new_state)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 44];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE];
+
+        init_header(&rep[4], SMB2_OPLOCK_BREAK, 0xffffffffffffffffULL, 0);
+        memset(body, 0, 44);
+        put16(body, SMB2_LEASE_BREAK_NOTIFICATION_SIZE);
+        put32(body + 4, flags);
+        memcpy(body + 8, key, SMB2_LEASE_KEY_SIZE);
+        put32(body + 24, current);
+        put32(body + 28, new_state);
+        return write_reply(rep, 44);
+}
+
+/* The server breaks RH to R and wants to hear about it. The callback
+ * keeps R and the acknowledgement says so. The server answers it.
+ */
+static int acked_break(void)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 36];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE];
+
+        if (send_lease_break(SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED,
+                             LEASE_RH, SMB2_LEASE_READ_CACHING) ||
+            service_until_sent(1000) != 1 || read_one()) {
+                printf("lease break was not acknowledged\n");
+                return -1;
+        }
+        if (breaks != 1 || break_current != LEASE_RH ||
+            break_new != SMB2_LEASE_READ_CACHING) {
+                printf("break callback saw %d breaks, %x to %x\n",
+                       breaks, break_current, break_new);
+                return -1;
+        }
+        if (last_command != SMB2_OPLOCK_BREAK ||
+            get16(last_body) != SMB2_LEASE_BREAK_ACKNOWLEDGE_SIZE ||
+            get32(last_body + 4) != 0 ||
+            memcmp(last_body + 8, key, SMB2_LEASE_KEY_SIZE) ||
+            get32(last_body + 24) != SMB2_LEASE_READ_CACHING) {
+                printf("lease break acknowledged wrongly\n");
+                return -1;
+        }
+
+        init_header(&rep[4], SMB2_OPLOCK_BREAK, last_mid, 0);
+        memset(body, 0, 36);
+        put16(body, SMB2_LEASE_BREAK_REPLY_SIZE);
+        memcpy(body + 8, key, SMB2_LEASE_KEY_SIZE);
+        put32(body + 24, SMB2_LEASE_READ_CACHING);
+        if (write_reply(rep, 36) || service_until_sent(50) != 0) {
+                printf("answer to the acknowledgement went wrong\n");
+                return -1;
+        }
+        if (breaks != 1) {
+                printf("answer to the acknowledgement taken for a break\n");
+                return -1;
+        }
+        return 0;
+}
+
+/* Breaking R to none needs no acknowledgement, and gets none. */
+static int unacked_break(void)
+{
+        if (send_lease_break(0, SMB2_LEASE_READ_CACHING,
+                             SMB2_LEASE_NONE) ||
+            service_until_sent(50) != 0) {
+                printf("break without ACK_REQUIRED was answered\n");
+                return -1;
+        }
+        if (breaks != 2 || break_current != SMB2_LEASE_READ_CACHING ||
+            break_new != SMB2_LEASE_NONE) {
+                printf("break callback saw %d breaks, %x to %x\n",
+                       breaks, break_current, break_new);
+                return -1;
+        }
+        return 0;
+}
+
+/* SMB 2.1 has leases but no durable handles v2 */
+static int old_dialect(void)
+{
+        disconnect_client();
+        if (connect_leased(SMB2_VERSION_0210) == NULL) {
+                return -1;
+        }
+        if (smb2_open_durable_async(client, "file", O_RDONLY, guid,
+                                    TIMEOUT, LEASE_RH, key, open_cb, NULL) ||
+            serve_create(0x43, LEASE_RH) || service_until(completed + 1)) {
+                return -1;
+        }
+        if (last_oplock != SMB2_OPLOCK_LEVEL_LEASE || last_ntags != 1 ||
+            strcmp(last_tag[0], "RqLs") || smb2_fh_is_durable(fh) ||
+            smb2_fh_lease_state(fh) != LEASE_RH) {
+                printf("leased open on SMB 2.1 went wrong\n");
+                return -1;
+        }
+        smb2_free_fh(client, fh);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        if (connect_leased(SMB2_VERSION_0300) == NULL) {
+                return 1;
+        }
+        if (open_leased()) {
+                goto fail;
+        }
+        printf("RqLs chained before DH2Q, granted state reported\n");
+
+        if (acked_break()) {
+                goto fail;
+        }
+        printf("lease break acknowledged with the state chosen\n");
+
+        if (unacked_break()) {
+                goto fail;
+        }
+        smb2_free_fh(client, fh);
+        printf("lease break without ACK_REQUIRED not answered\n");
+
+        if (old_dialect()) {
+                goto fail;
+        }
+        printf("lease without DH2Q on SMB 2.1\n");
+
+        disconnect_client();
+        return 0;
+
+ fail:
+        disconnect_client();
+        return 1;
+}
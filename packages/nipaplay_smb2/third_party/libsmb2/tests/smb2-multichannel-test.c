@@ -0,0 +1,481 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Multichannel against a minimal in-process server:
+ *  - FSCTL_QUERY_NETWORK_INTERFACE_INFO is sent on the file id of all
+ *    ones and its IPv4 and IPv6 entries are decoded, other families are
+ *    skipped.
+ *  - A channel is not bound to a session without one, or to a session
+ *    of a server that did not offer multichannel.
+ *  - A channel negotiates the dialect of the session with the client
+ *    guid of it, authenticates with signed SESSION_SETUP requests that
+ *    carry the BINDING flag and the id of the session, and then uses the
+ *    trees of the session without connecting any.
+ *  - A binding the server refuses fails the callback.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define SESSION_ID 0x1122334455667788ULL
+#define TREE_ID 0x77
+
+static int last_status;
+static struct smb2_network_interface_info *interfaces;
+
+/* Read one request and remember its header and the start of its body. */
+static int read_one(void)
+{
+        static uint8_t req[2048];
+
+        return read_request(req, sizeof(req)) < 0 ? -1 : 0;
+}
+
+static int wait_completed(int target)
+{
+        int i;
+
+        for (i = 0; i < 100 && completed < target; i++) {
+                if (service_until_sent(10) < 0) {
+                        return -1;
+                }
+        }
+        return completed < target ? -1 : 0;
+}
+
+static void command_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *cb_data)
+{
+        last_status = status;
+        interfaces = command_data;
+        completed++;
+}
+
+static void put_interface(uint8_t *p, uint32_t next, uint32_t if_index,
+                          uint32_t capability, uint64_t speed,
+                          uint16_t family)
+{
+        memset(p, 0, SMB2_NETWORK_INTERFACE_INFO_SIZE);
+        put32(p, next);
+        put32(p + 4, if_index);
+        put32(p + 8, capability);
+        put64(p + 16, speed);
+        put16(p + 24, family);
+}
+
+/* Three entries: an RSS capable IPv4 address, one of a family nobody
+ * knows, and a link local IPv6 address.
+ */
+static int query_interfaces(void)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 48 +
+                           3 * SMB2_NETWORK_INTERFACE_INFO_SIZE];
+        static const uint8_t v6[16] = {
+                0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01
+        };
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE], *out = body + 48;
+        const uint32_t size = SMB2_NETWORK_INTERFACE_INFO_SIZE;
+        struct smb2_network_interface_info *info;
+
+        if (connect_client(SMB2_VERSION_0300) == NULL ||
+            smb2_connect_tree_id(client, TREE_ID) ||
+            smb2_query_network_interfaces_async(client, command_cb, NULL) ||
+            service_until_sent(1000) != 1 || read_one()) {
+                return -1;
+        }
+        if (last_command != SMB2_IOCTL ||
+            get32(last_body + 4) != SMB2_FSCTL_QUERY_NETWORK_INTERFACE_INFO ||
+            get64(last_body + 8) != 0xffffffffffffffffULL ||
+            get64(last_body + 16) != 0xffffffffffffffffULL ||
+            get32(last_body + 48) != SMB2_0_IOCTL_IS_FSCTL ||
+            last_tree_id != TREE_ID) {
+                printf("interface query sent wrongly\n");
+                return -1;
+        }
+
+        init_header(&rep[4], SMB2_IOCTL, last_mid, 0);
+        memset(body, 0, 48);
+        put16(body, SMB2_IOCTL_REPLY_SIZE);
+        put32(body + 4, SMB2_FSCTL_QUERY_NETWORK_INTERFACE_INFO);
+        memset(body + 8, 0xff, SMB2_FD_SIZE);
+        put32(body + 32, SMB2_HEADER_SIZE + 48);
+        put32(body + 36, 3 * size);
+        put_interface(out, size, 3, SMB2_NETWORK_INTERFACE_CAP_RSS,
+                      10000000000ULL, SMB2_NETWORK_INTERFACE_INET);
+        memcpy(out + 28, "\xc0\xa8\x01\x02", 4);
+        put_interface(out + size, size, 4, 0, 1, 0x1234);
+        put_interface(out + 2 * size, 0, 5, 0, 1000000000ULL,
+                      SMB2_NETWORK_INTERFACE_INET6);
+        memcpy(out + 2 * size + 32, v6, 16);
+        put32(out + 2 * size + 48, 7);
+        if (write_reply(rep, 48 + 3 * size) || wait_completed(1)) {
+                return -1;
+        }
+        if (last_status) {
+                printf("interface query failed: %s\n",
+                       smb2_get_error(client));
+                return -1;
+        }
+
+        info = interfaces;
+        if (info == NULL || info->if_index != 3 ||
+            info->family != SMB2_NETWORK_INTERFACE_INET ||
+            info->capability != SMB2_NETWORK_INTERFACE_CAP_RSS ||
+            info->link_speed != 10000000000ULL ||
+            memcmp(info->address, "\xc0\xa8\x01\x02", 4)) {
+                printf("IPv4 interface decoded wrongly\n");
+                return -1;
+        }
+        info = info->next;
+        if (info == NULL || info->if_index != 5 ||
+            info->family != SMB2_NETWORK_INTERFACE_INET6 ||
+            info->link_speed != 1000000000ULL ||
+            memcmp(info->address, v6, 16) || info->scope_id != 7 ||
+            info->next != NULL) {
+                printf("IPv6 interface decoded wrongly\n");
+                return -1;
+        }
+        smb2_free_data(client, interfaces);
+        interfaces = NULL;
+        disconnect_client();
+        return 0;
+}
+
+/* A session to bind to, that was never connected. */
+static struct smb2_context *fake_session(uint32_t capabilities)
+{
+        struct smb2_context *session;
+
+        session = smb2_init_context();
+        if (session == NULL) {
+                return NULL;
+        }
+        smb2_set_user(session, "user");
+        smb2_set_password(session, "password");
+        session->sec = SMB2_SEC_NTLMSSP;
+        session->dialect = SMB2_VERSION_0300;
+        session->capabilities = capabilities;
+        session->session_id = SESSION_ID;
+        session->session_key = malloc(SMB2_KEY_SIZE);
+        if (session->session_key == NULL) {
+                smb2_destroy_context(session);
+                return NULL;
+        }
+        memset(session->session_key, 0x5a, SMB2_KEY_SIZE);
+        session->session_key_size = SMB2_KEY_SIZE;
+        memset(session->signing_key, 0x6b, SMB2_KEY_SIZE);
+        session->share = strdup("share");
+        smb2_connect_tree_id(session, TREE_ID);
+        return session;
+}
+
+static int refusals(void)
+{
+        struct smb2_context *session, *channel;
+        int ret = -1;
+
+        channel = smb2_init_context();
+        session = fake_session(0);
+        if (channel == NULL || session == NULL) {
+                goto out;
+        }
+        if (smb2_connect_channel_async(channel, session, "127.0.0.1",
+                                       command_cb, NULL) != -EOPNOTSUPP) {
+                printf("bound without multichannel\n");
+                goto out;
+        }
+        session->capabilities = SMB2_GLOBAL_CAP_MULTI_CHANNEL;
+        session->session_id = 0;
+        if (smb2_connect_channel_async(channel, session, "127.0.0.1",
+                                       command_cb, NULL) != -EINVAL) {
+                printf("bound without a session\n");
+                goto out;
+        }
+        ret = 0;
+ out:
+        if (session) {
+                smb2_destroy_context(session);
+        }
+        if (channel) {
+                smb2_destroy_context(channel);
+        }
+        return ret;
+}
+
+static int listen_loopback(int *port)
+{
+        struct sockaddr_in sin;
+        socklen_t len = sizeof(sin);
+        int fd;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+                return -1;
+        }
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) ||
+            listen(fd, 1) ||
+            getsockname(fd, (struct sockaddr *)&sin, &len)) {
+                close(fd);
+                return -1;
+        }
+        *port = ntohs(sin.sin_port);
+        return fd;
+}
+
+static int serve_negotiate(struct smb2_context *session)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 64];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE];
+
+        if (service_until_sent(1000) != 1 || read_one()) {
+                printf("channel did not negotiate\n");
+                return -1;
+        }
+        if (last_command != SMB2_NEGOTIATE ||
+            get16(last_body + 2) != 1 ||
+            get16(last_body + 36) != SMB2_VERSION_0300 ||
+            !(get32(last_body + 8) & SMB2_GLOBAL_CAP_MULTI_CHANNEL) ||
+            memcmp(last_body + 12, session->client_guid,
+                   SMB2_GUID_SIZE)) {
+                printf("channel negotiated wrongly\n");
+                return -1;
+        }
+
+        init_header(&rep[4], SMB2_NEGOTIATE, last_mid, 0);
+        memset(body, 0, 64);
+        put16(body, SMB2_NEGOTIATE_REPLY_SIZE);
+        put16(body + 2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+        put16(body + 4, SMB2_VERSION_0300);
+        put32(body + 24, SMB2_GLOBAL_CAP_LARGE_MTU |
+              SMB2_GLOBAL_CAP_MULTI_CHANNEL);
+        put32(body + 28, 65536);
+        put32(body + 32, 65536);
+        put32(body + 36, 65536);
+        return write_reply(rep, 64);
+}
+
+/* Read a SESSION_SETUP that must be a signed binding of the session. */
+static int read_binding(void)
+{
+        if (service_until_sent(1000) != 1 || read_one()) {
+                printf("channel did not authenticate\n");
+                return -1;
+        }
+        if (last_command != SMB2_SESSION_SETUP ||
+            last_body[2] != SMB2_SESSION_FLAG_BINDING ||
+            last_session_id != SESSION_ID ||
+            !(last_flags & SMB2_FLAGS_SIGNED)) {
+                printf("SESSION_SETUP is not a signed binding\n");
+                return -1;
+        }
+        return 0;
+}
+
+/* An NTLM CHALLENGE_MESSAGE with no target name and a target info of
+ * just the end of the list.
+ */
+static int serve_challenge(void)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 8 + 60];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE], *ntlm = body + 8;
+
+        init_header(&rep[4], SMB2_SESSION_SETUP, last_mid,
+                    SMB2_STATUS_MORE_PROCESSING_REQUIRED);
+        memset(body, 0, 8 + 60);
+        put16(body, SMB2_SESSION_SETUP_REPLY_SIZE);
+        put16(body + 4, SMB2_HEADER_SIZE + 8);
+        put16(body + 6, 60);
+        memcpy(ntlm, "NTLMSSP", 8);
+        put32(ntlm + 8, 2);
+        put32(ntlm + 16, 56);
+        put32(ntlm + 20, 0xe2888215);
+        memcpy(ntlm + 24, "\x01\x23\x45\x67\x89\xab\xcd\xef", 8);
+        put16(ntlm + 40, 4);
+        put16(ntlm + 42, 4);
+        put32(ntlm + 44, 56);
+        return write_reply(rep, 8 + 60);
+}
+
+static int serve_error(uint16_t command, uint32_t status)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 9];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE];
+
+        init_header(&rep[4], command, last_mid, status);
+        memset(body, 0, 9);
+        put16(body, SMB2_ERROR_REPLY_SIZE);
+        return write_reply(rep, 9);
+}
+
+static int serve_session_setup(uint32_t status)
+{
+        static uint8_t rep[4 + SMB2_HEADER_SIZE + 8];
+        uint8_t *body = &rep[4 + SMB2_HEADER_SIZE];
+
+        if (status) {
+                return serve_error(SMB2_SESSION_SETUP, status);
+        }
+        init_header(&rep[4], SMB2_SESSION_SETUP, last_mid, 0);
+        memset(body, 0, 8);
+        put16(body, SMB2_SESSION_SETUP_REPLY_SIZE);
+        return write_reply(rep, 8);
+}
+
+/* Binds a channel and answers the second SESSION_SETUP with status. */
+static int bind_channel(uint32_t status)
+{
+        struct smb2_context *session;
+        smb2_file_id file_id;
+        static uint8_t buf[16];
+        char server[32];
+        int lfd, port, ret = -1;
+
+        completed = 0;
+        session = fake_session(SMB2_GLOBAL_CAP_MULTI_CHANNEL);
+        client = smb2_init_context();
+        lfd = listen_loopback(&port);
+        if (session == NULL || client == NULL || lfd < 0) {
+                goto out;
+        }
+        snprintf(server, sizeof(server), "127.0.0.1:%d", port);
+        if (smb2_connect_channel_async(client, session, server,
+                                       command_cb, NULL)) {
+                printf("binding failed to start: %s\n",
+                       smb2_get_error(client));
+                goto out;
+        }
+        srv_fd = accept(lfd, NULL, NULL);
+        if (srv_fd < 0) {
+                goto out;
+        }
+
+        last_session_id = 0;
+        if (serve_negotiate(session) || read_binding()) {
+                goto out;
+        }
+        if (get64(last_body + 16) != 0) {
+                printf("binding asked to replace a session\n");
+                goto out;
+        }
+        if (serve_challenge() || read_binding() ||
+            serve_session_setup(status) || wait_completed(1)) {
+                goto out;
+        }
+
+        if (status) {
+                if (last_status != -EACCES) {
+                        printf("refused binding reported %d\n",
+                               last_status);
+                        goto out;
+                }
+                ret = 0;
+                goto out;
+        }
+        if (last_status) {
+                printf("binding failed: %s\n", smb2_get_error(client));
+                goto out;
+        }
+        if (client->session_id != SESSION_ID ||
+            client->tree_id_top != 1 || client->tree_id[1] != TREE_ID ||
+            client->binding) {
+                printf("bound channel has the wrong ids\n");
+                goto out;
+        }
+
+        /* No TREE_CONNECT, the first request uses the tree of the
+         * session.
+         */
+        memset(file_id, 0x42, SMB2_FD_SIZE);
+        fh = smb2_fh_from_file_id(client, &file_id);
+        if (fh == NULL ||
+            smb2_pread_async(client, fh, buf, sizeof(buf), 0,
+                             command_cb, NULL) ||
+            service_until_sent(1000) != 1 || read_one()) {
+                goto out;
+        }
+        if (last_command != SMB2_READ || last_session_id != SESSION_ID ||
+            last_tree_id != TREE_ID) {
+                printf("channel sent command %d to tree %x of session "
+                       "%llx\n", last_command, last_tree_id,
+                       (unsigned long long)last_session_id);
+                goto out;
+        }
+        if (serve_error(SMB2_READ, SMB2_STATUS_END_OF_FILE) ||
+            wait_completed(2)) {
+                goto out;
+        }
+        smb2_free_fh(client, fh);
+        ret = 0;
+ out:
+        if (lfd >= 0) {
+                close(lfd);
+        }
+        if (session) {
+                smb2_destroy_context(session);
+        }
+        disconnect_client();
+        return ret;
+}
+
+int main(int argc, char *argv[])
+{
+        if (query_interfaces()) {
+                goto fail;
+        }
+        printf("network interfaces decoded\n");
+
+        if (refusals()) {
+                goto fail;
+        }
+        printf("no binding without a session or multichannel\n");
+
+        if (bind_channel(0)) {
+                goto fail;
+        }
+        printf("channel bound and using the trees of the session\n");
+
+        if (bind_channel(SMB2_STATUS_ACCESS_DENIED)) {
+                goto fail;
+        }
+        printf("refused binding reported\n");
+
+        return 0;
+
+ fail:
+        if (client) {
+                disconnect_client();
+        }
+        return 1;
+}
@@ -0,0 +1,131 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Streams READs through a context connected to a minimal in-process
+ * server over a socketpair and checks that once the pipeline is warm the
+ * read path is served entirely from the context's block pool.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "smb2-fake-server.h"
+
+#define DEPTH 16
+#define WARMUP_ROUNDS 4
+#define ROUNDS 256
+#define READ_SIZE 4096
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+        struct smb2_read_cb_data *rd = command_data;
+        int i;
+
+        if (status != READ_SIZE) {
+                printf("read failed: %d %s\n", status, smb2_get_error(smb2));
+                failed = 1;
+                return;
+        }
+        for (i = 0; i < READ_SIZE; i++) {
+                if (rd->buf[i] != pattern(rd->offset + i)) {
+                        printf("bad data at offset %llu\n",
+                               (unsigned long long)(rd->offset + i));
+                        failed = 1;
+                        return;
+                }
+        }
+        completed++;
+}
+
+static int stream(uint8_t *bufs, int rounds, uint64_t *offset)
+{
+        int r, i;
+
+        for (r = 0; r < rounds; r++) {
+                for (i = 0; i < DEPTH; i++) {
+                        if (smb2_pread_async(client, fh,
+                                             &bufs[i * READ_SIZE], READ_SIZE,
+                                             *offset, read_cb, NULL)) {
+                                printf("pread failed: %s\n",
+                                       smb2_get_error(client));
+                                return -1;
+                        }
+                        *offset += READ_SIZE;
+                }
+                for (i = 0; i < DEPTH; i++) {
+                        if (serve_one()) {
+                                return -1;
+                        }
+                }
+                if (service_until(completed + DEPTH)) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        struct smb2_context *smb2;
+        static uint8_t bufs[DEPTH * READ_SIZE];
+        uint64_t offset = 0, heap_allocs;
+
+        smb2 = connect_client(SMB2_VERSION_0210);
+        if (smb2 == NULL) {
+                return 1;
+        }
+        smb2->credits = DEPTH * 2;
+
+        if (smb2_open_async(smb2, "file", O_RDONLY, open_cb, NULL) ||
+            serve_one() || service_until(1)) {
+                goto fail;
+        }
+
+        if (stream(bufs, WARMUP_ROUNDS, &offset)) {
+                goto fail;
+        }
+        heap_allocs = smb2->pool->heap_allocs;
+        if (stream(bufs, ROUNDS, &offset)) {
+                goto fail;
+        }
+
+        printf("%d READs, %llu heap allocations, %llu pool reuses\n",
+               ROUNDS * DEPTH,
+               (unsigned long long)(smb2->pool->heap_allocs - heap_allocs),
+               (unsigned long long)smb2->pool->reuses);
+        if (smb2->pool->heap_allocs != heap_allocs) {
+                printf("steady state READs allocated from the heap\n");
+                goto fail;
+        }
+
+        disconnect_client();
+        return 0;
+
+ fail:
+        disconnect_client();
+        return 1;
+}
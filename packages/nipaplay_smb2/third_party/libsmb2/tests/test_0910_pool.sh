@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "PDU pool steady state allocation test"
+
+./smb2-pool-test || failure
+success
+
+exit 0
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Batched socket send and receive test"
+
+./smb2-batch-test || failure
+success
+
+exit 0
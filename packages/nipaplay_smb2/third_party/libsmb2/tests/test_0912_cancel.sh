@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Cancel in-flight requests test"
+
+./smb2-cancel-test || failure
+success
+
+exit 0
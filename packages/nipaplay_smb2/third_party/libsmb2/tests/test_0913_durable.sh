@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Durable handles test"
+
+./smb2-durable-test || failure
+success
+
+exit 0
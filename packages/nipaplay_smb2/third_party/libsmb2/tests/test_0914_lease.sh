@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Leases test"
+
+./smb2-lease-test || failure
+success
+
+exit 0
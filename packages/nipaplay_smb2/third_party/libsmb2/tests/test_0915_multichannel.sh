@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Multichannel test"
+
+./smb2-multichannel-test || failure
+success
+
+exit 0
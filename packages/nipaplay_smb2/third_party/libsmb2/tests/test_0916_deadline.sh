@@ -0,0 +1,10 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Deadline test"
+
+./smb2-deadline-test || failure
+success
+
+exit 0
@@ -0,0 +1,451 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Streams 64k READs over socketpairs from forked minimal servers into one
+ * or more contexts and compares driving them with poll() and
+ * smb2_service() against smb2_uring_service(). Reports throughput and the
+ * syscalls the client made per MiB.
+ *
+ * Build with "make uring-bench" in tests/ of an autotools build, or from
+ * the libsmb2 top directory after building the library with
+ * cmake -DBUILD_SHARED_LIBS=OFF into ./build:
+ *   cc -O2 -Ibuild -Iinclude -Iinclude/smb2 -Ilib \
+ *      "-D_U_=__attribute__((unused))" \
+ *      -Wl,--wrap=poll,--wrap=readv,--wrap=writev,--wrap=syscall \
+ *      tests/uring-bench.c build/lib/libsmb2.a -o uring-bench
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#define MAX_CONTEXTS 16
+#define READ_SIZE 65536
+#define DEPTH 8
+#define TOTAL_BYTES (1024ULL * 1024 * 1024)
+
+static uint64_t syscalls;
+
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+ssize_t __real_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+long __real_syscall(long number, ...);
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+        syscalls++;
+        return __real_poll(fds, nfds, timeout);
+}
+
+ssize_t __wrap_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+        syscalls++;
+        return __real_readv(fd, iov, iovcnt);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+        syscalls++;
+        return __real_writev(fd, iov, iovcnt);
+}
+
+/* The ring is driven through syscall(2), at most six arguments */
+long __wrap_syscall(long number, ...)
+{
+        long a[6];
+        va_list ap;
+        int i;
+
+        va_start(ap, number);
+        for (i = 0; i < 6; i++) {
+                a[i] = va_arg(ap, long);
+        }
+        va_end(ap);
+        syscalls++;
+        return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+struct stream {
+        struct smb2_context *smb2;
+        struct smb2fh *fh;
+        pid_t pid;
+        uint8_t *bufs;
+        uint64_t issued;
+        uint64_t target;
+        uint64_t received;
+        int inflight;
+        int failed;
+};
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_full(int fd, uint8_t *buf, size_t len)
+{
+        ssize_t count;
+
+        while (len) {
+                count = read(fd, buf, len);
+                if (count <= 0) {
+                        return -1;
+                }
+                buf += count;
+                len -= count;
+        }
+        return 0;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+        p[0] = v; p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+        put16(p, v); put16(p + 2, v >> 16);
+}
+
+/* Answer CREATE with a file id and READ with the requested number of
+ * bytes until the client goes away.
+ */
+static void serve(int fd)
+{
+        static uint8_t req[1024], hdr[4 + SMB2_HEADER_SIZE + 88];
+        static uint8_t data[READ_SIZE];
+        uint8_t *body = &hdr[4 + SMB2_HEADER_SIZE];
+        struct iovec iov[2];
+        uint32_t spl, len, count;
+        uint16_t command;
+        ssize_t rc;
+
+        while (read_full(fd, req, 4) == 0) {
+                spl = (req[1] << 16) | (req[2] << 8) | req[3];
+                if (spl > sizeof(req) || read_full(fd, req, spl)) {
+                        break;
+                }
+                command = req[12] | (req[13] << 8);
+
+                memset(hdr, 0, sizeof(hdr));
+                memcpy(&hdr[4], "\xfeSMB", 4);
+                put16(&hdr[4 + 4], SMB2_HEADER_SIZE);
+                put16(&hdr[4 + 12], command);
+                put16(&hdr[4 + 14], 1);
+                put32(&hdr[4 + 16], SMB2_FLAGS_SERVER_TO_REDIR);
+                memcpy(&hdr[4 + 24], &req[24], 8);
+
+                count = 0;
+                if (command == SMB2_CREATE) {
+                        put16(body, SMB2_CREATE_REPLY_SIZE);
+                        memset(body + 64, 0x42, SMB2_FD_SIZE);
+                        len = 88;
+                } else if (command == SMB2_READ) {
+                        memcpy(&count, &req[SMB2_HEADER_SIZE + 4], 4);
+                        if (count > READ_SIZE) {
+                                count = READ_SIZE;
+                        }
+                        put16(body, SMB2_READ_REPLY_SIZE);
+                        body[2] = SMB2_HEADER_SIZE + 16;
+                        put32(body + 4, count);
+                        len = 16;
+                } else {
+                        break;
+                }
+                spl = SMB2_HEADER_SIZE + len + count;
+                hdr[1] = spl >> 16; hdr[2] = spl >> 8; hdr[3] = spl;
+
+                iov[0].iov_base = hdr;
+                iov[0].iov_len = 4 + SMB2_HEADER_SIZE + len;
+                iov[1].iov_base = data;
+                iov[1].iov_len = count;
+                while (iov[0].iov_len + iov[1].iov_len) {
+                        rc = __real_writev(fd, iov[0].iov_len ? iov : &iov[1],
+                                           iov[0].iov_len ? 2 : 1);
+                        if (rc <= 0) {
+                                _exit(0);
+                        }
+                        if ((size_t)rc >= iov[0].iov_len) {
+                                rc -= iov[0].iov_len;
+                                iov[0].iov_len = 0;
+                                iov[1].iov_base =
+                                        (uint8_t *)iov[1].iov_base + rc;
+                                iov[1].iov_len -= rc;
+                        } else {
+                                iov[0].iov_base =
+                                        (uint8_t *)iov[0].iov_base + rc;
+                                iov[0].iov_len -= rc;
+                        }
+                }
+        }
+        _exit(0);
+}
+
+static void open_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+        struct stream *s = cb_data;
+
+        if (status) {
+                s->failed = 1;
+                return;
+        }
+        s->fh = command_data;
+}
+
+static int issue(struct stream *s);
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+        struct stream *s = cb_data;
+
+        s->inflight--;
+        if (status != READ_SIZE) {
+                printf("read failed: %d %s\n", status, smb2_get_error(smb2));
+                s->failed = 1;
+                return;
+        }
+        s->received += status;
+        issue(s);
+}
+
+/* Keep DEPTH READs in flight until the target has been requested. The
+ * replies come back in order so the buffers are used round robin.
+ */
+static int issue(struct stream *s)
+{
+        uint64_t slot;
+
+        while (s->inflight < DEPTH && s->issued < s->target && !s->failed) {
+                slot = s->issued / READ_SIZE % DEPTH;
+                if (smb2_pread_async(s->smb2, s->fh,
+                                     &s->bufs[slot * READ_SIZE],
+                                     READ_SIZE, s->issued, read_cb, s)) {
+                        s->failed = 1;
+                        return -1;
+                }
+                s->issued += READ_SIZE;
+                s->inflight++;
+        }
+        return 0;
+}
+
+static int start(struct stream *s, uint64_t target)
+{
+        struct pollfd pfd;
+        int sv[2];
+
+        memset(s, 0, sizeof(*s));
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+                return -1;
+        }
+        s->pid = fork();
+        if (s->pid == 0) {
+                close(sv[0]);
+                serve(sv[1]);
+        }
+        close(sv[1]);
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+
+        s->smb2 = smb2_init_context();
+        s->bufs = malloc(DEPTH * READ_SIZE);
+        if (s->smb2 == NULL || s->bufs == NULL) {
+                return -1;
+        }
+        /* Pretend SMB 2.1 was negotiated on this socket. */
+        s->smb2->fd = sv[0];
+        s->smb2->dialect = SMB2_VERSION_0210;
+        s->smb2->max_read_size = READ_SIZE;
+        s->smb2->credits = 256;
+        s->target = target;
+
+        if (smb2_open_async(s->smb2, "file", O_RDONLY, open_cb, s)) {
+                return -1;
+        }
+        while (s->fh == NULL && !s->failed) {
+                pfd.fd = sv[0];
+                pfd.events = smb2_which_events(s->smb2);
+                if (__real_poll(&pfd, 1, 1000) < 0 ||
+                    smb2_service(s->smb2, pfd.revents) < 0) {
+                        return -1;
+                }
+        }
+        return s->failed ? -1 : 0;
+}
+
+static void stop(struct stream *s)
+{
+        if (s->smb2 != NULL) {
+                smb2_destroy_context(s->smb2);
+        }
+        if (s->pid > 0) {
+                waitpid(s->pid, NULL, 0);
+        }
+        free(s->bufs);
+}
+
+static int busy(struct stream *s, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++) {
+                if (s[i].failed) {
+                        return -1;
+                }
+                if (s[i].inflight) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+static int run_poll(struct stream *s, int n)
+{
+        struct pollfd pfd[MAX_CONTEXTS];
+        int i, rc;
+
+        while ((rc = busy(s, n)) > 0) {
+                for (i = 0; i < n; i++) {
+                        pfd[i].fd = s[i].smb2->fd;
+                        pfd[i].events = smb2_which_events(s[i].smb2);
+                        pfd[i].revents = 0;
+                }
+                if (poll(pfd, n, 1000) < 0) {
+                        return -1;
+                }
+                for (i = 0; i < n; i++) {
+                        if (pfd[i].revents &&
+                            smb2_service(s[i].smb2, pfd[i].revents) < 0) {
+                                return -1;
+                        }
+                }
+        }
+        return rc;
+}
+
+static int run_uring(struct smb2_uring *ring, struct stream *s, int n)
+{
+        struct smb2_context *smb2[MAX_CONTEXTS];
+        int ret[MAX_CONTEXTS];
+        int i, rc;
+
+        for (i = 0; i < n; i++) {
+                smb2[i] = s[i].smb2;
+        }
+        while ((rc = busy(s, n)) > 0) {
+                if (smb2_uring_service(ring, smb2, ret, n, 1000) < 0) {
+                        return -1;
+                }
+                for (i = 0; i < n; i++) {
+                        if (ret[i] < 0) {
+                                return -1;
+                        }
+                }
+        }
+        return rc;
+}
+
+static int run(struct smb2_uring *ring, int n, double *mib_s,
+               double *calls_per_mib)
+{
+        struct stream s[MAX_CONTEXTS];
+        uint64_t calls;
+        double t;
+        int i, rc = -1;
+
+        memset(s, 0, sizeof(s));
+        for (i = 0; i < n; i++) {
+                if (start(&s[i], TOTAL_BYTES / n)) {
+                        goto out;
+                }
+        }
+
+        calls = syscalls;
+        t = now();
+        for (i = 0; i < n; i++) {
+                if (issue(&s[i])) {
+                        goto out;
+                }
+        }
+        if ((ring ? run_uring(ring, s, n) : run_poll(s, n)) < 0) {
+                printf("servicing failed\n");
+                goto out;
+        }
+        t = now() - t;
+        calls = syscalls - calls;
+
+        *mib_s = TOTAL_BYTES / (1024.0 * 1024) / t;
+        *calls_per_mib = calls / (TOTAL_BYTES / (1024.0 * 1024));
+        rc = 0;
+ out:
+        /* Later servers hold the sockets of earlier ones, stop them first */
+        for (i = n - 1; i >= 0; i--) {
+                stop(&s[i]);
+        }
+        return rc;
+}
+
+int main(void)
+{
+        static const int counts[] = { 1, 4, 16 };
+        struct smb2_uring *ring;
+        double poll_mib, poll_calls, uring_mib, uring_calls;
+        size_t i;
+
+        signal(SIGPIPE, SIG_IGN);
+        ring = smb2_uring_create();
+        if (ring == NULL) {
+                printf("io_uring is not available\n");
+                return 1;
+        }
+
+        printf("%-9s %10s %12s %10s %12s\n", "contexts", "poll MiB/s",
+               "calls/MiB", "uring MiB/s", "calls/MiB");
+        for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+                if (run(NULL, counts[i], &poll_mib, &poll_calls) ||
+                    run(ring, counts[i], &uring_mib, &uring_calls)) {
+                        smb2_uring_destroy(ring);
+                        return 1;
+                }
+                printf("%-9d %10.0f %12.1f %10.0f %12.1f\n", counts[i],
+                       poll_mib, poll_calls, uring_mib, uring_calls);
+        }
+
+        smb2_uring_destroy(ring);
+        return 0;
+}
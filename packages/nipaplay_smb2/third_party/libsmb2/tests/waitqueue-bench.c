@@ -0,0 +1,196 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the NipaPlay authors
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Simulates a client with hundreds of READs in flight whose replies come
+ * back slightly out of order, and times reply correlation through the
+ * wait queue against the plain linked list scan it replaced.
+ *
+ * Build with "make waitqueue-bench" in tests/ of an autotools build, or
+ * from the libsmb2 top directory after building the library with
+ * cmake -DBUILD_SHARED_LIBS=OFF into ./build:
+ *   cc -O2 -Ibuild -Iinclude -Iinclude/smb2 -Ilib \
+ *      "-D_U_=__attribute__((unused))" tests/waitqueue-bench.c \
+ *      build/lib/libsmb2.a -o waitqueue-bench
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compat.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+#include "slist.h"
+
+#define REPLIES (2 * 1000 * 1000)
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *cb_data)
+{
+}
+
+/* Replies arrive within a window of the oldest request, so pick one of
+ * the first few ids still outstanding rather than strictly the oldest.
+ * outstanding is a ring of depth ids starting at *head.
+ */
+static uint64_t next_reply(uint64_t *outstanding, int depth, int *head,
+                           unsigned *seed)
+{
+        int window = depth < 8 ? depth : 8;
+        int i;
+        uint64_t mid;
+
+        *seed = *seed * 1103515245 + 12345;
+        i = (*head + (*seed >> 16) % window) % depth;
+        mid = outstanding[i];
+        outstanding[i] = outstanding[*head];
+        outstanding[*head] = mid;
+        *head = (*head + 1) % depth;
+        return mid;
+}
+
+static struct smb2_pdu *list_find(struct smb2_pdu *list, uint64_t mid)
+{
+        struct smb2_pdu *pdu;
+
+        for (pdu = list; pdu; pdu = pdu->next) {
+                if (pdu->header.message_id == mid) {
+                        break;
+                }
+        }
+        return pdu;
+}
+
+static int run(struct smb2_context *smb2, int depth, int indexed,
+               double *secs)
+{
+        struct smb2_pdu **pdus, *pdu, *list = NULL;
+        uint64_t *outstanding, mid, next_mid = 1;
+        unsigned seed = 1;
+        double t;
+        int i, oldest = 0;
+
+        pdus = calloc(depth, sizeof(*pdus));
+        outstanding = calloc(depth, sizeof(*outstanding));
+        if (pdus == NULL || outstanding == NULL) {
+                free(pdus);
+                free(outstanding);
+                return -1;
+        }
+        for (i = 0; i < depth; i++) {
+                pdus[i] = smb2_allocate_pdu(smb2, SMB2_READ, read_cb, NULL);
+                if (pdus[i] == NULL) {
+                        return -1;
+                }
+        }
+
+        /* Fill the pipeline. 64 KiB reads charge one credit per id. */
+        for (i = 0; i < depth; i++) {
+                pdu = pdus[i];
+                pdu->header.message_id = next_mid;
+                outstanding[i] = next_mid++;
+                if (indexed) {
+                        smb2_waitqueue_add(smb2, pdu);
+                } else {
+                        SMB2_LIST_ADD_END(&list, pdu);
+                }
+        }
+
+        t = now();
+        for (i = 0; i < REPLIES; i++) {
+                mid = next_reply(outstanding, depth, &oldest, &seed);
+                if (indexed) {
+                        pdu = smb2_find_pdu(smb2, mid);
+                } else {
+                        pdu = list_find(list, mid);
+                }
+                if (pdu == NULL || pdu->header.message_id != mid) {
+                        printf("reply %llu not found\n",
+                               (unsigned long long)mid);
+                        return -1;
+                }
+                /* Complete it and reuse the pdu for the next request. */
+                if (indexed) {
+                        smb2_waitqueue_remove(smb2, pdu);
+                } else {
+                        SMB2_LIST_REMOVE(&list, pdu);
+                }
+                pdu->header.message_id = next_mid;
+                outstanding[(oldest + depth - 1) % depth] = next_mid++;
+                if (indexed) {
+                        smb2_waitqueue_add(smb2, pdu);
+                } else {
+                        SMB2_LIST_ADD_END(&list, pdu);
+                }
+        }
+        *secs = now() - t;
+
+        for (i = 0; i < depth; i++) {
+                if (indexed) {
+                        smb2_waitqueue_remove(smb2, pdus[i]);
+                }
+                pdus[i]->next = NULL;
+                smb2_free_pdu(smb2, pdus[i]);
+        }
+        if (smb2->waitqueue != NULL || smb2->waitqueue_tail != NULL) {
+                printf("wait queue not empty after the run\n");
+                return -1;
+        }
+        free(pdus);
+        free(outstanding);
+        return 0;
+}
+
+int main(void)
+{
+        static const int depths[] = { 1, 16, 64, 256, 512, 1024 };
+        struct smb2_context *smb2;
+        double list_secs, hash_secs;
+        size_t i;
+
+        smb2 = smb2_init_context();
+        if (smb2 == NULL) {
+                printf("Failed to init context\n");
+                return 1;
+        }
+
+        printf("%-8s %14s %14s\n", "depth", "list ns/reply", "hash ns/reply");
+        for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+                if (run(smb2, depths[i], 0, &list_secs) ||
+                    run(smb2, depths[i], 1, &hash_secs)) {
+                        smb2_destroy_context(smb2);
+                        return 1;
+                }
+                printf("%-8d %14.1f %14.1f\n", depths[i],
+                       list_secs * 1e9 / REPLIES, hash_secs * 1e9 / REPLIES);
+        }
+
+        smb2_destroy_context(smb2);
+        return 0;
+}